@@ -0,0 +1,614 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <dm_aot.h>
+#include <dm_compiler.h>
+#include <dm_vm.h>
+
+// The chunks of a program: the main function and the functions among the
+// constants that dm_chunk_verify checked, depth first. Every chunk is taken
+// once.
+typedef struct {
+	int size;
+	int capacity;
+	dm_function **funcs;
+} chunks;
+
+static void collect(chunks *list, dm_function *func) {
+	// the code never loads the others, inlined functions for example
+	if (!((dm_chunk*) func->chunk)->verified) {
+		return;
+	}
+	for (int i = 0; i < list->size; i++) {
+		if (list->funcs[i]->chunk == func->chunk) {
+			return;
+		}
+	}
+	if (list->size >= list->capacity) {
+		list->capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+		list->funcs = realloc(list->funcs, list->capacity * sizeof(dm_function*));
+	}
+	list->funcs[list->size++] = func;
+
+	dm_chunk *chunk = func->chunk;
+	for (int i = 0; i < chunk->constsize; i++) {
+		if (dm_value_type(chunk->consts[i]) == DM_TYPE_FUNCTION) {
+			collect(list, dm_value_as_function(chunk->consts[i]));
+		}
+	}
+}
+
+// FNV-1a over the code words
+static uint32_t code_hash(dm_chunk *chunk) {
+	uint32_t hash = 2166136261u;
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		for (int i = 0; i < 4; i++) {
+			hash ^= (chunk->code[addr] >> (8 * i)) & 0xff;
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+// The translation of one chunk. The stack code keeps the same depth at an
+// address on every path, the value at depth i is the local s<i>.
+typedef struct {
+	FILE *out;
+	dm_function *func;
+	dm_chunk *chunk;
+	int *depth;                 // in front of every address, -1 where it isn't reached
+	bool *label;                // jumped to or entered
+	bool *entry;                // where the vm enters the code again
+	bool *captured;             // variables that stay in the frame
+	bool *exits;                // the stack depths the code stops at
+} emitter;
+
+static const char *opassign_names[] = {
+	[DM_OPASSIGN_PLUS]  = "DM_OPASSIGN_PLUS",
+	[DM_OPASSIGN_MINUS] = "DM_OPASSIGN_MINUS",
+	[DM_OPASSIGN_MUL]   = "DM_OPASSIGN_MUL",
+	[DM_OPASSIGN_DIV]   = "DM_OPASSIGN_DIV",
+	[DM_OPASSIGN_MOD]   = "DM_OPASSIGN_MOD",
+};
+
+// the inline arithmetic of dm_aot.h for the op-assigns of variables
+static const char *opassign_funcs[] = {
+	[DM_OPASSIGN_PLUS]  = "dm_aot_plus",
+	[DM_OPASSIGN_MINUS] = "dm_aot_minus",
+	[DM_OPASSIGN_MUL]   = "dm_aot_mul",
+	[DM_OPASSIGN_DIV]   = "dm_aot_div",
+	[DM_OPASSIGN_MOD]   = "dm_aot_mod",
+};
+
+static const char *type_names[] = {
+	[DM_TYPE_NIL]      = "DM_TYPE_NIL",
+	[DM_TYPE_BOOL]     = "DM_TYPE_BOOL",
+	[DM_TYPE_INT]      = "DM_TYPE_INT",
+	[DM_TYPE_FLOAT]    = "DM_TYPE_FLOAT",
+	[DM_TYPE_STRING]   = "DM_TYPE_STRING",
+	[DM_TYPE_ARRAY]    = "DM_TYPE_ARRAY",
+	[DM_TYPE_TABLE]    = "DM_TYPE_TABLE",
+	[DM_TYPE_FUNCTION] = "DM_TYPE_FUNCTION",
+};
+
+// the C operator of a comparison
+static const char *compare_op(dm_opcode op) {
+	switch (dm_opcode_generic(op)) {
+		case DM_OP_LESS:      return "<";
+		case DM_OP_LESSEQUAL: return "<=";
+		case DM_OP_GREATER:   return ">";
+		default:              return ">=";
+	}
+}
+
+// the halves of the instruction at addr, returns how many
+static int halves(dm_chunk *chunk, int addr, dm_instr *in) {
+	if (dm_superinstr_split(chunk->code[addr], &in[0], &in[1])) {
+		return 2;
+	}
+	in[0] = chunk->code[addr];
+	return 1;
+}
+
+static bool is_exit(dm_opcode op) {
+	return op == DM_OP_CALL || op == DM_OP_CALL_WITHPARENT || op == DM_OP_TAILCALL
+		|| op == DM_OP_RETURN || op == DM_OP_CLOSURE || op == DM_OP_IMPORT;
+}
+
+// Follows the paths through the code like the verifier, which already
+// checked that the depths are consistent.
+static void analyze(emitter *e) {
+	dm_chunk *chunk = e->chunk;
+	int *work = malloc((chunk->codesize + 1) * sizeof(int));
+	int nwork = 0;
+	e->depth[0] = 0;
+	e->label[0] = e->entry[0] = true;
+	work[nwork++] = 0;
+	while (nwork > 0) {
+		int addr = work[--nwork];
+		for (; addr < chunk->codesize; addr++) {
+			dm_instr in[2];
+			int n = halves(chunk, addr, in);
+			int d = e->depth[addr];
+			dm_opcode op = DM_OP_NUM_OPS;
+			for (int i = 0; i < n; i++) {
+				int pops, pushes;
+				op = dm_opcode_generic(dm_instr_op(in[i]));
+				dm_instr_stack_effect(in[i], &pops, &pushes);
+				if (dm_opcode_is_jump(op)) {
+					int target = dm_instr_b(in[i]);
+					e->label[target] = true;
+					// the vm enters a loop where it jumps back
+					if (target <= addr) {
+						e->entry[target] = true;
+					}
+					if (e->depth[target] == -1) {
+						bool keep = op == DM_OP_JUMP_IF_TRUE_OR_POP || op == DM_OP_JUMP_IF_FALSE_OR_POP;
+						e->depth[target] = keep ? d : d - pops + pushes;
+						work[nwork++] = target;
+					}
+				}
+				if (is_exit(op)) {
+					e->exits[d] = true;
+				}
+				d = d - pops + pushes;
+			}
+
+			if (op == DM_OP_CALL || op == DM_OP_CALL_WITHPARENT || op == DM_OP_CLOSURE || op == DM_OP_IMPORT) {
+				e->label[addr + 1] = e->entry[addr + 1] = true;
+			}
+			// the vm doesn't come back after a tail call
+			if (op == DM_OP_JUMP || op == DM_OP_RETURN || op == DM_OP_TAILCALL || e->depth[addr + 1] != -1) {
+				break;
+			}
+			e->depth[addr + 1] = d;
+		}
+	}
+	free(work);
+
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		if (e->depth[addr] == -1 || dm_instr_op(chunk->code[addr]) != DM_OP_CLOSURE) {
+			continue;
+		}
+		dm_value proto = chunk->consts[dm_instr_b(chunk->code[addr])];
+		dm_chunk *inner = dm_value_as_function(proto)->chunk;
+		for (int i = 0; i < inner->upvalsize; i++) {
+			if (inner->upvals[i].local) {
+				e->captured[inner->upvals[i].index] = true;
+			}
+		}
+	}
+}
+
+// the C lvalue of a variable, a few at a time can be used
+static const char *var(emitter *e, int index) {
+	static char names[4][32];
+	static int next;
+	char *name = names[next++ % 4];
+	if (e->captured[index]) {
+		snprintf(name, sizeof(names[0]), "f->vars[%d]", index);
+	} else {
+		snprintf(name, sizeof(names[0]), "v%d", index);
+	}
+	return name;
+}
+
+static const char *for_limit(emitter *e, dm_forloop *loop) {
+	static char limit[32];
+	if (loop->limit_is_var) {
+		return var(e, loop->limit);
+	}
+	snprintf(limit, sizeof(limit), "dm_aot_int(%d)", loop->limit);
+	return limit;
+}
+
+// numbers and the like are literals, everything else is loaded from the chunk
+static void emit_constant(emitter *e, int index, int slot) {
+	dm_value v = e->chunk->consts[index];
+	FILE *out = e->out;
+	if (dm_value_type(v) == DM_TYPE_INT && dm_value_as_int(v) != INT64_MIN) {
+		fprintf(out, "\ts%d = dm_aot_int(INT64_C(%lld));\n", slot, (long long) dm_value_as_int(v));
+	} else if (dm_value_type(v) == DM_TYPE_FLOAT && isfinite(dm_value_as_float(v))) {
+		fprintf(out, "\ts%d = dm_aot_float(%a);\n", slot, dm_value_as_float(v));
+	} else if (dm_value_type(v) == DM_TYPE_BOOL) {
+		fprintf(out, "\ts%d = dm_aot_bool(%s);\n", slot, dm_value_as_bool(v) ? "true" : "false");
+	} else if (dm_value_type(v) == DM_TYPE_NIL) {
+		fprintf(out, "\ts%d = dm_aot_nil();\n", slot);
+	} else {
+		fprintf(out, "\ts%d = dm_aot_const(f, %d);\n", slot, index);
+	}
+}
+
+// the values from s<first> on as an array for the literals
+static void emit_elements(emitter *e, int first, int n) {
+	if (n == 0) {
+		fprintf(e->out, "NULL");
+		return;
+	}
+	fprintf(e->out, "(dm_value[]){");
+	for (int i = 0; i < n; i++) {
+		fprintf(e->out, i == 0 ? "s%d" : ", s%d", first + i);
+	}
+	fprintf(e->out, "}");
+}
+
+// Emits one instruction (or half of a superinstruction) at depth d. ip is
+// what the frame has while it runs.
+static void emit_instr(emitter *e, int addr, dm_instr in, int d) {
+	FILE *out = e->out;
+	int ip = addr + 1;
+	int a = dm_instr_a(in);
+	int b = dm_instr_b(in);
+	int top = d - 1;
+	dm_opcode op = dm_instr_op(in);
+	if (is_exit(op)) {
+		fprintf(out, "\tf->ip = %d;\n\tf->top = &f->vars[%d];\n\tgoto exit%d;\n", addr, e->chunk->varsize + d, d);
+		return;
+	}
+
+	switch (op) {
+		case DM_OP_VARSET:
+			fprintf(out, "\t%s = s%d;\n", var(e, b), top);
+			break;
+		case DM_OP_VARGETOPSET:
+			fprintf(out, "\ts%d = %s = %s(f, %d, %s, s%d);\n",
+				top, var(e, b), opassign_funcs[a], ip, var(e, b), top);
+			break;
+		case DM_OP_VARSET_UP:
+			fprintf(out, "\t*f->upvals[%d]->v = s%d;\n", b, top);
+			break;
+		case DM_OP_VARGETOPSET_UP:
+			fprintf(out, "\ts%d = *f->upvals[%d]->v = %s(f, %d, *f->upvals[%d]->v, s%d);\n",
+				top, b, opassign_funcs[a], ip, b, top);
+			break;
+		case DM_OP_VARGET:
+			fprintf(out, "\ts%d = %s;\n", d, var(e, b));
+			break;
+		case DM_OP_VARGET_UP:
+			fprintf(out, "\ts%d = *f->upvals[%d]->v;\n", d, b);
+			break;
+		case DM_OP_FIELDSET:
+		case DM_OP_FIELDSET_ARRAY_INT:
+		case DM_OP_FIELDSET_ARRAY_INT_UNCHECKED:
+			fprintf(out, "\tdm_op_fieldset(dm_aot_at(f, %d), s%d, s%d, s%d);\n\ts%d = s%d;\n", ip, d - 3, d - 2, d - 1, d - 3, d - 1);
+			break;
+		case DM_OP_FIELDSET_S:
+			fprintf(out, "\tdm_op_fieldset_s(dm_aot_at(f, %d), s%d, s%d, s%d);\n\ts%d = s%d;\n", ip, d - 3, d - 2, d - 1, d - 3, d - 1);
+			break;
+		case DM_OP_FIELDGETOPSET:
+		case DM_OP_FIELDGETOPSET_S:
+			fprintf(out, "\ts%d = dm_op_fieldgetopset%s(dm_aot_at(f, %d), %s, s%d, s%d, s%d);\n", d - 3,
+				op == DM_OP_FIELDGETOPSET_S ? "_s" : "", ip, opassign_names[a], d - 3, d - 2, d - 1);
+			break;
+		case DM_OP_FIELDGET:
+		case DM_OP_FIELDGET_ARRAY_INT:
+		case DM_OP_FIELDGET_ARRAY_INT_UNCHECKED:
+			fprintf(out, "\ts%d = dm_op_fieldget(dm_aot_at(f, %d), s%d, s%d);\n", d - 2, ip, d - 2, d - 1);
+			break;
+		case DM_OP_FIELDGET_S:
+			fprintf(out, "\ts%d = dm_op_fieldget_s(dm_aot_at(f, %d), s%d, s%d);\n", d - 2, ip, d - 2, d - 1);
+			break;
+		case DM_OP_FIELDGET_PUSHPARENT:
+			fprintf(out, "\ts%d = dm_op_fieldget(dm_aot_at(f, %d), s%d, s%d);\n", d - 1, ip, d - 2, d - 1);
+			break;
+		case DM_OP_FIELDGET_S_PUSHPARENT:
+			fprintf(out, "\ts%d = dm_op_fieldget_s(dm_aot_at(f, %d), s%d, s%d);\n", d - 1, ip, d - 2, d - 1);
+			break;
+		case DM_OP_CONSTANT:
+			emit_constant(e, b, d);
+			break;
+		case DM_OP_CONSTANT_SMALLINT:
+			fprintf(out, "\ts%d = dm_aot_int(%d);\n", d, b);
+			break;
+		case DM_OP_ARRAYLIT:
+			fprintf(out, "\ts%d = dm_op_arraylit(dm_aot_at(f, %d), %d, ", d - b, ip, b);
+			emit_elements(e, d - b, b);
+			fprintf(out, ");\n");
+			break;
+		case DM_OP_TABLELIT:
+			fprintf(out, "\ts%d = dm_op_tablelit(dm_aot_at(f, %d), %d, ", d - 2 * b, ip, b);
+			emit_elements(e, d - 2 * b, 2 * b);
+			fprintf(out, ");\n");
+			break;
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+			fprintf(out, "\ts%d = dm_aot_bool(%s);\n", d, op == DM_OP_TRUE ? "true" : "false");
+			break;
+		case DM_OP_NIL:
+			fprintf(out, "\ts%d = dm_aot_nil();\n", d);
+			break;
+		case DM_OP_SELF:
+			if (e->func->takes_self && e->func->nargs > 0) {
+				fprintf(out, "\ts%d = %s;\n", d, var(e, 0));
+			} else {
+				fprintf(out, "\ts%d = dm_aot_nil();\n", d);
+			}
+			break;
+		case DM_OP_CHECKTYPE:
+			fprintf(out, "\tif (dm_value_type(s%d) != %s) {\n\t\tdm_runtime_type_mismatch(dm_aot_at(f, %d), %s, s%d);\n\t}\n",
+				top, type_names[a], ip, type_names[a], top);
+			break;
+		case DM_OP_NEGATE:
+			fprintf(out, "\ts%d = dm_op_negate(dm_aot_at(f, %d), s%d);\n", top, ip, top);
+			break;
+		case DM_OP_NOT:
+			fprintf(out, "\ts%d = dm_op_not(dm_aot_at(f, %d), s%d);\n", top, ip, top);
+			break;
+		case DM_OP_PLUS:
+		case DM_OP_PLUS_INT:
+		case DM_OP_PLUS_FLOAT:
+		case DM_OP_MINUS:
+		case DM_OP_MINUS_INT:
+		case DM_OP_MINUS_FLOAT:
+		case DM_OP_MUL:
+		case DM_OP_MUL_INT:
+		case DM_OP_MUL_FLOAT:
+		case DM_OP_DIV:
+		case DM_OP_DIV_INT:
+		case DM_OP_DIV_FLOAT:
+		case DM_OP_MOD: {
+			const char *name = dm_opcode_generic(op) == DM_OP_PLUS ? "plus"
+				: dm_opcode_generic(op) == DM_OP_MINUS ? "minus"
+				: dm_opcode_generic(op) == DM_OP_MUL ? "mul"
+				: dm_opcode_generic(op) == DM_OP_DIV ? "div" : "mod";
+			fprintf(out, "\ts%d = dm_aot_%s(f, %d, s%d, s%d);\n", d - 2, name, ip, d - 2, d - 1);
+			break;
+		}
+		case DM_OP_PLUS_INT_UNCHECKED:
+		case DM_OP_MINUS_INT_UNCHECKED:
+		case DM_OP_MUL_INT_UNCHECKED: {
+			char c = op == DM_OP_PLUS_INT_UNCHECKED ? '+' : op == DM_OP_MINUS_INT_UNCHECKED ? '-' : '*';
+			fprintf(out, "\ts%d = dm_aot_int(dm_value_as_int(s%d) %c dm_value_as_int(s%d));\n", d - 2, d - 2, c, d - 1);
+			break;
+		}
+		case DM_OP_PLUS_FLOAT_UNCHECKED:
+		case DM_OP_MINUS_FLOAT_UNCHECKED:
+		case DM_OP_MUL_FLOAT_UNCHECKED: {
+			char c = op == DM_OP_PLUS_FLOAT_UNCHECKED ? '+' : op == DM_OP_MINUS_FLOAT_UNCHECKED ? '-' : '*';
+			fprintf(out, "\ts%d = dm_aot_float(dm_op_as_float(s%d) %c dm_op_as_float(s%d));\n", d - 2, d - 2, c, d - 1);
+			break;
+		}
+		case DM_OP_DIV_INT_UNCHECKED:
+		case DM_OP_DIV_FLOAT_UNCHECKED:
+			fprintf(out, "\ts%d = dm_aot_div_%s(f, %d, s%d, s%d);\n", d - 2,
+				op == DM_OP_DIV_INT_UNCHECKED ? "int" : "float", ip, d - 2, d - 1);
+			break;
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL:
+			fprintf(out, "\ts%d = dm_aot_bool(%sdm_aot_equals(f, %d, s%d, s%d));\n", d - 2,
+				op == DM_OP_NOTEQUAL ? "!" : "", ip, d - 2, d - 1);
+			break;
+		case DM_OP_LESS:
+		case DM_OP_LESS_INT:
+		case DM_OP_LESS_FLOAT:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_LESSEQUAL_INT:
+		case DM_OP_LESSEQUAL_FLOAT:
+		case DM_OP_GREATER:
+		case DM_OP_GREATER_INT:
+		case DM_OP_GREATER_FLOAT:
+		case DM_OP_GREATEREQUAL:
+		case DM_OP_GREATEREQUAL_INT:
+		case DM_OP_GREATEREQUAL_FLOAT:
+			fprintf(out, "\ts%d = dm_aot_bool(dm_aot_compare(f, %d, s%d, s%d) %s 0);\n", d - 2, ip, d - 2, d - 1, compare_op(op));
+			break;
+		case DM_OP_LESS_INT_UNCHECKED:
+		case DM_OP_LESSEQUAL_INT_UNCHECKED:
+		case DM_OP_GREATER_INT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_INT_UNCHECKED:
+			fprintf(out, "\ts%d = dm_aot_bool(dm_value_as_int(s%d) %s dm_value_as_int(s%d));\n", d - 2, d - 2, compare_op(op), d - 1);
+			break;
+		case DM_OP_LESS_FLOAT_UNCHECKED:
+		case DM_OP_LESSEQUAL_FLOAT_UNCHECKED:
+		case DM_OP_GREATER_FLOAT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_FLOAT_UNCHECKED:
+			fprintf(out, "\ts%d = dm_aot_bool(dm_op_compare_numbers(s%d, s%d) %s 0);\n", d - 2, d - 2, d - 1, compare_op(op));
+			break;
+		case DM_OP_JUMP_IF_TRUE_OR_POP:
+			fprintf(out, "\tif (!dm_op_falsey(s%d)) {\n\t\tgoto L%d;\n\t}\n", top, b);
+			break;
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+		case DM_OP_JUMP_IF_FALSE:
+			fprintf(out, "\tif (dm_op_falsey(s%d)) {\n\t\tgoto L%d;\n\t}\n", top, b);
+			break;
+		case DM_OP_JUMP:
+			fprintf(out, "\tgoto L%d;\n", b);
+			break;
+		case DM_OP_FORPREP: {
+			dm_forloop *loop = &e->chunk->loops[a];
+			fprintf(out, "\tif (!dm_op_for_compare(dm_aot_at(f, %d), DM_OP_%s, %s, %s)) {\n\t\tgoto L%d;\n\t}\n",
+				ip, dm_opcode_name(loop->compare), var(e, loop->var), for_limit(e, loop), b);
+			break;
+		}
+		case DM_OP_FORLOOP: {
+			dm_forloop *loop = &e->chunk->loops[a];
+			fprintf(out, "\tif (dm_aot_for_loop(f, %d, DM_OP_%s, %d, &%s, %s)) {\n\t\tgoto L%d;\n\t}\n",
+				ip, dm_opcode_name(loop->compare), loop->step, var(e, loop->var), for_limit(e, loop), b);
+			break;
+		}
+		default:
+			// POP, the value is left behind in its local
+			break;
+	}
+}
+
+static void emit_chunk(FILE *out, dm_function *func, int index) {
+	dm_chunk *chunk = func->chunk;
+	int size = chunk->codesize + 1;
+	emitter e = {out, func, chunk, malloc(size * sizeof(int)), calloc(size, sizeof(bool)),
+		calloc(size, sizeof(bool)), calloc(chunk->varsize + 1, sizeof(bool)), calloc(chunk->maxstack + 1, sizeof(bool))};
+	for (int i = 0; i < size; i++) {
+		e.depth[i] = -1;
+	}
+	analyze(&e);
+
+	fprintf(out, "// line %d\nstatic void chunk%d(dm_jit_frame *f) {\n", dm_chunk_line_at(chunk, 0), index);
+	for (int i = 0; i < chunk->varsize; i++) {
+		if (!e.captured[i]) {
+			fprintf(out, "\tdm_value v%d = f->vars[%d];\n", i, i);
+		}
+	}
+	for (int i = 0; i < chunk->maxstack; i++) {
+		fprintf(out, "\tdm_value s%d;\n", i);
+	}
+
+	fprintf(out, "\tswitch (f->ip) {\n");
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		if (!e.entry[addr] || e.depth[addr] == -1) {
+			continue;
+		}
+		fprintf(out, "\t\tcase %d:", addr);
+		for (int i = 0; i < e.depth[addr]; i++) {
+			fprintf(out, " s%d = f->vars[%d];", i, chunk->varsize + i);
+		}
+		fprintf(out, " goto L%d;\n", addr);
+	}
+	fprintf(out, "\t\tdefault: return;\n\t}\n");
+
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		if (e.depth[addr] == -1) {
+			continue;
+		}
+		if (e.label[addr]) {
+			fprintf(out, "L%d:\n", addr);
+		}
+		dm_instr in[2];
+		int n = halves(chunk, addr, in);
+		int d = e.depth[addr];
+		for (int i = 0; i < n; i++) {
+			int pops, pushes;
+			emit_instr(&e, addr, in[i], d);
+			dm_instr_stack_effect(in[i], &pops, &pushes);
+			d = d - pops + pushes;
+		}
+	}
+
+	// the frame gets the stack and the variables back where the code stops
+	for (int d = chunk->maxstack; d >= 0; d--) {
+		if (e.exits[d]) {
+			fprintf(out, "exit%d:\n", d);
+		}
+		if (d > 0) {
+			fprintf(out, "\tf->vars[%d] = s%d;\n", chunk->varsize + d - 1, d - 1);
+		}
+	}
+	for (int i = 0; i < chunk->varsize; i++) {
+		if (!e.captured[i]) {
+			fprintf(out, "\tf->vars[%d] = v%d;\n", i, i);
+		}
+	}
+	fprintf(out, "\treturn;\n}\n\n");
+
+	free(e.depth);
+	free(e.label);
+	free(e.entry);
+	free(e.captured);
+	free(e.exits);
+}
+
+// the source as a string literal, a line at a time
+static void emit_source(FILE *out, const char *source) {
+	fprintf(out, "static const char source[] =\n\t\"");
+	for (const char *c = source; *c != '\0'; c++) {
+		if (*c == '\n') {
+			fprintf(out, c[1] != '\0' ? "\\n\"\n\t\"" : "\\n");
+		} else if (*c == '"' || *c == '\\') {
+			fprintf(out, "\\%c", *c);
+		} else if (*c >= ' ' && *c <= '~') {
+			fputc(*c, out);
+		} else {
+			fprintf(out, "\\%03o", (unsigned char) *c);
+		}
+	}
+	fprintf(out, "\";\n\n");
+}
+
+int dm_aot_emit(dm_state *dm, char *source, FILE *out) {
+	dm_value main = dm_value_nil();
+	if (dm_compile(dm, &main, source) != 0) {
+		return 1;
+	}
+	if (dm_chunk_verify(dm_value_as_function(main)->chunk) != 0) {
+		return 1;
+	}
+
+	chunks list = {0};
+	collect(&list, dm_value_as_function(main));
+
+	fprintf(out, "// Generated by diamond --emit-c, see src/dm_aot.h.\n\n#include <dm_aot.h>\n\n");
+	for (int i = 0; i < list.size; i++) {
+		emit_chunk(out, list.funcs[i], i);
+	}
+	emit_source(out, source);
+
+	fprintf(out, "static const dm_aot_func funcs[] = {");
+	for (int i = 0; i < list.size; i++) {
+		fprintf(out, i == 0 ? "chunk%d" : ", chunk%d", i);
+	}
+	fprintf(out, "};\n\nstatic const dm_aot_check checks[] = {\n");
+	for (int i = 0; i < list.size; i++) {
+		dm_chunk *chunk = list.funcs[i]->chunk;
+		fprintf(out, "\t{%d, 0x%08x},\n", chunk->codesize, code_hash(chunk));
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "static const dm_aot_program program = {source, %d, %s, %s, %s, %d, funcs, checks};\n\n",
+		dm_opt_level(dm), dm_fold_enabled(dm) ? "true" : "false", dm_peephole_enabled(dm) ? "true" : "false",
+		dm_inline_enabled(dm) ? "true" : "false", list.size);
+	fprintf(out, "int main(void) {\n\treturn dm_aot_main(&program);\n}\n");
+
+	free(list.funcs);
+	return 0;
+}
+
+int dm_aot_bind(dm_function *main, const dm_aot_program *program) {
+	chunks list = {0};
+	collect(&list, main);
+	bool same = list.size == program->nchunks;
+	for (int i = 0; i < list.size && same; i++) {
+		dm_chunk *chunk = list.funcs[i]->chunk;
+		same = chunk->codesize == program->checks[i].codesize && code_hash(chunk) == program->checks[i].hash;
+	}
+	for (int i = 0; i < list.size && same; i++) {
+		((dm_chunk*) list.funcs[i]->chunk)->aot = program->funcs[i];
+	}
+	free(list.funcs);
+
+	if (!same) {
+		fprintf(stderr, "The script compiles to different code than it was emitted from, emit it again with --emit-c\n");
+		return 1;
+	}
+	return 0;
+}
+
+int dm_aot_main(const dm_aot_program *program) {
+	dm_state *dm = dm_open();
+	if (dm == NULL) {
+		return 1;
+	}
+
+	dm_set_opt_level(dm, program->optlevel);
+	if (!program->fold) {
+		dm_disable_fold(dm);
+	}
+	if (!program->peephole) {
+		dm_disable_peephole(dm);
+	}
+	if (!program->inline_calls) {
+		dm_disable_inline(dm);
+	}
+	dm_enable_aot(dm, program);
+
+	char *source = strdup(program->source);
+	dm_value result;
+	if (dm_vm_exec(dm, source, &result, false) == 0) {
+		dm_value_inspect(dm, result);
+		printf("\n");
+	}
+
+	free(source);
+	dm_close(dm);
+	return 0;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <dm.h>
+#include <dm_state.h>
+#include <dm_chunk.h>
+#include <dm_jit.h>
+#include <dm_ops.h>
+
+// Ahead-of-time compilation: --emit-c translates every chunk of a script into
+// a C function, see dm_aot_emit. The file includes this header and is built
+// together with the runtime (everything in src/ but dm_main.c), make
+// bin/aot/<script> does both.
+//
+// The functions run on the frame of the jit and take the same way in and out
+// of the vm: they start at f->ip and stop in front of the next call, return,
+// closure or import, which the vm executes before it enters the code again
+// after it. The values on the stack and the variables no closure captures are
+// locals of the function, they go to the frame when it stops. Jumps are gotos
+// and the number cases of the instructions are inline below, gcc optimizes
+// across instructions. Imported scripts are interpreted.
+//
+// The program keeps the source of the script and compiles it again at startup
+// with the options it was emitted with, the chunks get their function in the
+// order of dm_aot_emit. The size and a hash of their code make sure they are
+// the same chunks.
+
+typedef void (*dm_aot_func)(dm_jit_frame *f);
+
+typedef struct {
+	int codesize;
+	uint32_t hash;
+} dm_aot_check;
+
+typedef struct dm_aot_program {
+	const char *source;
+	int optlevel;
+	bool fold;
+	bool peephole;
+	bool inline_calls;
+	int nchunks;
+	const dm_aot_func *funcs;
+	const dm_aot_check *checks;
+} dm_aot_program;
+
+// Writes the program for the script to out, returns 1 if it doesn't compile.
+int dm_aot_emit(dm_state *dm, char *source, FILE *out);
+// Gives the chunks of the main function their code, returns 1 if they aren't
+// the ones the program was emitted from.
+int dm_aot_bind(dm_function *main, const dm_aot_program *program);
+// Runs the script of the program and prints its result like the interpreter.
+int dm_aot_main(const dm_aot_program *program);
+
+// Everything the generated code doesn't do inline goes through dm_ops.h, like
+// in the vms. The frame gets the ip of the instruction first, the address plus
+// one, for the backtrace of an error.
+static inline dm_state *dm_aot_at(dm_jit_frame *f, int ip) {
+	*f->frame_ip = ip;
+	return f->dm;
+}
+
+// dm_value_int etc. live in dm_value.c, these are inlined without lto
+static inline dm_value dm_aot_nil(void) {
+	return dm_value_make(DM_TYPE_NIL, 0);
+}
+
+static inline dm_value dm_aot_bool(dm_bool b) {
+#ifdef DM_NAN_BOXING
+	return dm_value_make(DM_TYPE_BOOL, b);
+#else
+	return (dm_value){DM_TYPE_BOOL, {.bool_val = b}};
+#endif
+}
+
+static inline dm_value dm_aot_int(dm_int i) {
+	return dm_value_make(DM_TYPE_INT, i);
+}
+
+static inline dm_value dm_aot_float(dm_float x) {
+#ifdef DM_NAN_BOXING
+	return dm_value_float(x);
+#else
+	return (dm_value){DM_TYPE_FLOAT, {.float_val = x}};
+#endif
+}
+
+static inline dm_value dm_aot_const(dm_jit_frame *f, int index) {
+	return ((dm_chunk*) dm_value_as_function(f->func)->chunk)->consts[index];
+}
+
+#define DM_AOT_ARITH(name, opcode, op)                                         \
+static inline dm_value dm_aot_##name(dm_jit_frame *f, int ip, dm_value a, dm_value b) { \
+	if (dm_op_is_int_pair(a, b)) {                                             \
+		return dm_aot_int(dm_value_as_int(a) op dm_value_as_int(b));           \
+	} else if (dm_op_is_number(a) && dm_op_is_number(b)) {                     \
+		return dm_aot_float(dm_op_as_float(a) op dm_op_as_float(b));           \
+	}                                                                          \
+	return dm_op_arith(dm_aot_at(f, ip), opcode, a, b);                        \
+}
+
+DM_AOT_ARITH(plus, DM_OP_PLUS, +)
+DM_AOT_ARITH(minus, DM_OP_MINUS, -)
+DM_AOT_ARITH(mul, DM_OP_MUL, *)
+#undef DM_AOT_ARITH
+
+// division by 0 is reported by the module
+static inline dm_value dm_aot_div(dm_jit_frame *f, int ip, dm_value a, dm_value b) {
+	if (dm_op_is_int_pair(a, b) && dm_value_as_int(b) != 0) {
+		return dm_aot_int(dm_value_as_int(a) / dm_value_as_int(b));
+	} else if (dm_op_is_number(a) && dm_op_is_number(b) && dm_op_as_float(b) != 0) {
+		return dm_aot_float(dm_op_as_float(a) / dm_op_as_float(b));
+	}
+	return dm_op_arith(dm_aot_at(f, ip), DM_OP_DIV, a, b);
+}
+
+static inline dm_value dm_aot_mod(dm_jit_frame *f, int ip, dm_value a, dm_value b) {
+	if (dm_op_is_int_pair(a, b) && dm_value_as_int(b) != 0) {
+		return dm_aot_int(dm_value_as_int(a) % dm_value_as_int(b));
+	}
+	return dm_op_arith(dm_aot_at(f, ip), DM_OP_MOD, a, b);
+}
+
+static inline int dm_aot_compare(dm_jit_frame *f, int ip, dm_value a, dm_value b) {
+	if (dm_op_is_number(a) && dm_op_is_number(b)) {
+		return dm_op_compare_numbers(a, b);
+	}
+	return dm_op_compare(dm_aot_at(f, ip), a, b);
+}
+
+static inline bool dm_aot_equals(dm_jit_frame *f, int ip, dm_value a, dm_value b) {
+	if (dm_op_is_number(a) && dm_op_is_number(b)) {
+		return dm_op_numbers_equal(a, b);
+	}
+	return dm_op_equals(dm_aot_at(f, ip), a, b);
+}
+
+// the operand types were proven by the optimizer, only 0 is checked
+static inline dm_value dm_aot_div_int(dm_jit_frame *f, int ip, dm_value a, dm_value b) {
+	if (dm_value_as_int(b) != 0) {
+		return dm_aot_int(dm_value_as_int(a) / dm_value_as_int(b));
+	}
+	return dm_op_arith(dm_aot_at(f, ip), DM_OP_DIV, a, b);
+}
+
+static inline dm_value dm_aot_div_float(dm_jit_frame *f, int ip, dm_value a, dm_value b) {
+	if (dm_op_as_float(b) != 0) {
+		return dm_aot_float(dm_op_as_float(a) / dm_op_as_float(b));
+	}
+	return dm_op_arith(dm_aot_at(f, ip), DM_OP_DIV, a, b);
+}
+
+// The step of a counting loop, the operands of the loop are constants of the
+// generated code.
+static inline bool dm_aot_for_loop(dm_jit_frame *f, int ip, dm_opcode compare, int step, dm_value *i, dm_value limit) {
+	if (dm_op_is_int_pair(*i, limit)) {
+		dm_int v = dm_value_as_int(*i) + step;
+		*i = dm_aot_int(v);
+		switch (compare) {
+			case DM_OP_LESS:      return v < dm_value_as_int(limit);
+			case DM_OP_LESSEQUAL: return v <= dm_value_as_int(limit);
+			case DM_OP_GREATER:   return v > dm_value_as_int(limit);
+			default:              return v >= dm_value_as_int(limit);
+		}
+	}
+	return dm_op_for_step(dm_aot_at(f, ip), compare, step, i, limit);
+}
@@ -15,7 +15,7 @@ static void array_mark(dm_state *dm, struct dm_gc_obj *obj) {
 	dm_value *data = (dm_value*) arr->values;
 	for (int i = 0; i < arr->size; i++) {
 		if (dm_value_is_gc_obj(data[i])) {
-			dm_gc_mark(dm, data[i].gc_obj);
+			dm_gc_mark(dm, dm_value_as_gc_obj(data[i]));
 		}
 	}
 }
@@ -25,7 +25,7 @@ static void array_free(dm_state *dm, struct dm_gc_obj *obj) {
 	dm_value *data = (dm_value*) arr->values;
 	for (int i = 0; i < arr->size; i++) {
 		if (dm_value_is_gc_obj(data[i])) {
-			dm_gc_mark(dm, data[i].gc_obj);
+			dm_gc_mark(dm, dm_value_as_gc_obj(data[i]));
 		}
 	}
 	free(arr->values);
@@ -36,12 +36,15 @@ dm_value dm_value_array(dm_state *dm, int capacity) {
 	arr->capacity = capacity < 16 ? 16 : capacity;
 	arr->size = capacity;
 	arr->values = malloc(sizeof(dm_value) * arr->capacity);
-	memset(arr->values, 0, sizeof(dm_value) * arr->capacity);
-	return (dm_value){DM_TYPE_ARRAY, {.arr_val = arr}};
+	dm_value *values = arr->values;
+	for (int i = 0; i < arr->capacity; i++) {
+		values[i] = dm_value_nil();
+	}
+	return dm_value_object(DM_TYPE_ARRAY, arr);
 }
 
 static void dm_array_inspect(dm_state *dm, dm_value self) {
-	dm_array *a = self.arr_val;
+	dm_array *a = dm_value_as_array(self);
 	dm_value *values = a->values;
 
 	printf("[");
@@ -58,13 +61,13 @@ static void dm_array_inspect(dm_state *dm, dm_value self) {
 }
 
 void dm_value_array_set(dm_state *dm, dm_value a, dm_value index, dm_value v) {
-	if (index.type != DM_TYPE_INT) {
+	if (dm_value_type(index) != DM_TYPE_INT) {
 		dm_runtime_type_mismatch(dm, DM_TYPE_INT, index);
 		return;
 	}
 
-	int _index = index.int_val;
-	dm_array *arr = a.arr_val;
+	int _index = dm_value_as_int(index);
+	dm_array *arr = dm_value_as_array(a);
 	if (_index < 0 || _index >= arr->size) {
 		dm_runtime_error(dm, "index %d out of bounds for array of length %d", _index, arr->size);
 		return;
@@ -75,12 +78,12 @@ void dm_value_array_set(dm_state *dm, dm_value a, dm_value index, dm_value v) {
 }
 
 dm_value dm_value_array_get(dm_state *dm, dm_value a, dm_value index) {
-	if (index.type != DM_TYPE_INT) {
+	if (dm_value_type(index) != DM_TYPE_INT) {
 		dm_runtime_type_mismatch(dm, DM_TYPE_INT, index);
 	}
 
-	int _index = index.int_val;
-	dm_array *arr = a.arr_val;
+	int _index = dm_value_as_int(index);
+	dm_array *arr = dm_value_as_array(a);
 	if (_index < 0 || _index >= arr->size) {
 		dm_runtime_error(dm, "index %d out of bounds for array of length %d", _index, arr->size);
 	}
@@ -90,12 +93,12 @@ dm_value dm_value_array_get(dm_state *dm, dm_value a, dm_value index) {
 }
 
 static bool dm_array_equals(dm_state *dm, dm_value self, dm_value other) {
-	if (self.type != other.type) {
+	if (dm_value_type(self) != dm_value_type(other)) {
 		return false;
 	}
 
-	dm_array *a1 = self.arr_val;
-	dm_array *a2 = other.arr_val;
+	dm_array *a1 = dm_value_as_array(self);
+	dm_array *a2 = dm_value_as_array(other);
 	if (a1->size != a2->size) {
 		return false;
 	}
@@ -122,13 +125,13 @@ static bool dm_array_fieldget(dm_state *dm, dm_value self, const char *field, dm
 }
 
 static dm_value dm_array_add(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_ARRAY) {
+	if (dm_value_type(other) != DM_TYPE_ARRAY) {
 		dm_runtime_type_mismatch(dm, DM_TYPE_ARRAY, other);
 	}
 
-	dm_array *a = self.arr_val;
+	dm_array *a = dm_value_as_array(self);
 	dm_value *a_v = a->values;
-	dm_array *b = other.arr_val;
+	dm_array *b = dm_value_as_array(other);
 	dm_value *b_v = b->values;
 	dm_value arr = dm_value_array(dm, a->size + b->size);
 	int i = 0;
@@ -144,13 +147,13 @@ static dm_value dm_array_add(dm_state *dm, dm_value self, dm_value other) {
 }
 
 static dm_value dm_array_sub(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_ARRAY) {
+	if (dm_value_type(other) != DM_TYPE_ARRAY) {
 		dm_runtime_type_mismatch(dm, DM_TYPE_ARRAY, other);
 	}
 
-	dm_array *a = self.arr_val;
+	dm_array *a = dm_value_as_array(self);
 	dm_value *a_v = a->values;
-	dm_array *b = other.arr_val;
+	dm_array *b = dm_value_as_array(other);
 	dm_value *b_v = b->values;
 	int items_to_delete = 0;
 	for (int i = 0; i < a->size; i++) {
@@ -183,15 +186,15 @@ static dm_value dm_array_sub(dm_state *dm, dm_value self, dm_value other) {
 }
 
 static dm_value dm_array_mul(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_INT) {
+	if (dm_value_type(other) != DM_TYPE_INT) {
 		dm_runtime_type_mismatch(dm, DM_TYPE_INT, other);
 	}
 
-	dm_array *a = self.arr_val;
+	dm_array *a = dm_value_as_array(self);
 	dm_value *a_v = a->values;
-	dm_value new = dm_value_array(dm, a->size * other.int_val);
+	dm_value new = dm_value_array(dm, a->size * dm_value_as_int(other));
 	int new_i = 0;
-	for (int i = 0; i < (int) other.int_val; i++) {
+	for (int i = 0; i < (int) dm_value_as_int(other); i++) {
 		for (int n = 0; n < a->size; n++, new_i++) {
 			dm_value_array_set(dm, new, dm_value_int(new_i), a_v[n]);
 		}
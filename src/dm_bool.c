@@ -3,12 +3,12 @@
 
 static void dm_bool_inspect(dm_state *dm, dm_value self) {
 	(void) dm;
-	printf(self.bool_val ? "true" : "false");
+	printf(dm_value_as_bool(self) ? "true" : "false");
 }
 
 static bool dm_bool_equals(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
-	return other.type == DM_TYPE_BOOL && self.bool_val == other.bool_val;
+	return dm_value_type(other) == DM_TYPE_BOOL && dm_value_as_bool(self) == dm_value_as_bool(other);
 }
 
 static bool dm_bool_fieldset(dm_state *dm, dm_value self, const char *field, dm_value v) {
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <dm_chunk.h>
+#include <dm_regcode.h>
+#include <dm_jit.h>
 #include <dm.h>
 
 void dm_chunk_init(dm_chunk *chunk) {
@@ -10,7 +12,6 @@ void dm_chunk_init(dm_chunk *chunk) {
 		.codesize = 0,
 		.codecapacity = 0,
 		.code = NULL,
-		.ip = 0,
 		.constsize = 0,
 		.constcapacity = 0,
 		.consts = NULL,
@@ -18,10 +19,27 @@ void dm_chunk_init(dm_chunk *chunk) {
 		.varcapacity = 0,
 		.vars = NULL,
 		.lines = NULL,
-		.current_line = 1
+		.current_line = 1,
+		.inlinesize = 0,
+		.inlinecapacity = 0,
+		.inlines = NULL,
+		.loopsize = 0,
+		.loopcapacity = 0,
+		.loops = NULL,
+		.upvalsize = 0,
+		.upvalcapacity = 0,
+		.upvals = NULL,
+		.maxstack = 0,
+		.verified = false,
+		.regcode = NULL,
+		.hotness = 0,
+		.jit = NULL,
+		.traces = NULL,
+		.tracesize = 0,
+		.aot = NULL
 	};
 	chunk->codecapacity = 128;
-	chunk->code = malloc(chunk->codecapacity);
+	chunk->code = malloc(chunk->codecapacity * sizeof(dm_instr));
 	chunk->lines = malloc(chunk->codecapacity * sizeof(int));
 	chunk->constcapacity = 4;
 	chunk->consts = malloc(chunk->constcapacity * sizeof(dm_value));
@@ -49,7 +67,29 @@ void dm_chunk_free(dm_chunk *chunk) {
 	chunk->vars = NULL;
 	chunk->varsize = 0;
 	chunk->varcapacity = 0;
-	chunk->ip = 0;
+
+	free(chunk->loops);
+	chunk->loops = NULL;
+	chunk->loopsize = 0;
+	chunk->loopcapacity = 0;
+
+	free(chunk->upvals);
+	chunk->upvals = NULL;
+	chunk->upvalsize = 0;
+	chunk->upvalcapacity = 0;
+
+	free(chunk->inlines);
+	chunk->inlines = NULL;
+	chunk->inlinesize = 0;
+	chunk->inlinecapacity = 0;
+
+	dm_regcode_free(chunk->regcode);
+	chunk->regcode = NULL;
+	dm_jit_free(chunk->jit);
+	chunk->jit = NULL;
+	chunk->hotness = 0;
+	dm_trace_free(chunk);
+	chunk->aot = NULL;
 }
 
 void dm_chunk_set_parent(dm_chunk *chunk, dm_chunk *parent) {
@@ -57,17 +97,61 @@ void dm_chunk_set_parent(dm_chunk *chunk, dm_chunk *parent) {
 }
 
 void dm_chunk_reset_code(dm_chunk *chunk) {
-	memset(chunk->code, 0, chunk->codecapacity);
+	memset(chunk->code, 0, chunk->codecapacity * sizeof(dm_instr));
 	memset(chunk->lines, 0, chunk->codecapacity * sizeof(int));
 	chunk->codesize = 0;
+	chunk->loopsize = 0;
+	chunk->maxstack = 0;
+	chunk->verified = false;
+	dm_regcode_free(chunk->regcode);
+	chunk->regcode = NULL;
+	dm_jit_free(chunk->jit);
+	chunk->jit = NULL;
+	chunk->hotness = 0;
+	dm_trace_free(chunk);
+}
+
+// drops the code from addr on, the compiler uses it to replace code it emitted
+void dm_chunk_truncate_code(dm_chunk *chunk, int addr) {
+	if (addr < 0 || addr > chunk->codesize) {
+		return;
+	}
+	chunk->codesize = addr;
 }
 
 int dm_chunk_current_address(dm_chunk *chunk) {
 	return chunk->codesize;
 }
 
-int dm_chunk_current_line(dm_chunk *chunk) {
-	return chunk->lines[chunk->ip-2];
+int dm_chunk_line_at(dm_chunk *chunk, int addr) {
+	if (addr < 0 || addr >= chunk->codesize) {
+		return chunk->current_line;
+	}
+	dm_inline_site *site = dm_chunk_inline_site_at(chunk, addr);
+	return site != NULL ? site->call_line : chunk->lines[addr];
+}
+
+dm_inline_site *dm_chunk_inline_site_at(dm_chunk *chunk, int addr) {
+	if (addr < 0 || addr >= chunk->codesize || chunk->lines[addr] >= 0) {
+		return NULL;
+	}
+	return &chunk->inlines[-chunk->lines[addr] - 1];
+}
+
+int dm_chunk_add_inline_site(dm_chunk *chunk, dm_value func, int line, int call_line, bool tail) {
+	int index = 0;
+	for (; index < chunk->inlinesize; index++) {
+		dm_inline_site *site = &chunk->inlines[index];
+		if (dm_value_as_function(site->func) == dm_value_as_function(func) && site->line == line && site->call_line == call_line && site->tail == tail) {
+			return -(index + 1);
+		}
+	}
+	if (chunk->inlinesize >= chunk->inlinecapacity) {
+		chunk->inlinecapacity = chunk->inlinecapacity == 0 ? 8 : chunk->inlinecapacity * 2;
+		chunk->inlines = realloc(chunk->inlines, chunk->inlinecapacity * sizeof(dm_inline_site));
+	}
+	chunk->inlines[chunk->inlinesize++] = (dm_inline_site){func, line, call_line, tail};
+	return -chunk->inlinesize;
 }
 
 void dm_chunk_set_line(dm_chunk *chunk, int line) {
@@ -77,8 +161,8 @@ void dm_chunk_set_line(dm_chunk *chunk, int line) {
 int dm_chunk_index_of_string_constant(dm_chunk *chunk, const char *s, size_t len) {
 	for (int i = 0; i < chunk->constsize; i++) {
 		dm_value c = chunk->consts[i];
-		if (c.type == DM_TYPE_STRING) {
-			if (dm_string_size(c.str_val) == len && strncmp(dm_string_c_str(c.str_val), s, len) == 0) {
+		if (dm_value_type(c) == DM_TYPE_STRING) {
+			if (dm_string_size(dm_value_as_string(c)) == len && strncmp(dm_string_c_str(dm_value_as_string(c)), s, len) == 0) {
 				return i;
 			}
 		}
@@ -86,7 +170,7 @@ int dm_chunk_index_of_string_constant(dm_chunk *chunk, const char *s, size_t len
 	return -1;
 }
 
-void dm_chunk_emit_constant(dm_state *dm, dm_chunk *chunk, dm_value value) {
+int dm_chunk_add_constant(dm_state *dm, dm_chunk *chunk, dm_value value) {
 	int index = 0;
 	for (; index < chunk->constsize; index++) {
 		if (dm_value_equals(dm, chunk->consts[index], value)) {
@@ -101,7 +185,11 @@ void dm_chunk_emit_constant(dm_state *dm, dm_chunk *chunk, dm_value value) {
 		chunk->constsize++;
 	}
 	chunk->consts[index] = value;
-	dm_chunk_emit_arg16(chunk, DM_OP_CONSTANT, index);
+	return index;
+}
+
+void dm_chunk_emit_constant(dm_state *dm, dm_chunk *chunk, dm_value value) {
+	dm_chunk_emit_arg16(chunk, DM_OP_CONSTANT, dm_chunk_add_constant(dm, chunk, value));
 }
 
 void dm_chunk_emit_constant_i(dm_chunk *chunk, int index) {
@@ -111,18 +199,18 @@ void dm_chunk_emit_constant_i(dm_chunk *chunk, int index) {
 	dm_chunk_emit_arg16(chunk, DM_OP_CONSTANT, index);
 }
 
-static void emit_byte(dm_chunk *chunk, uint8_t byte) {
+static void emit_instr(dm_chunk *chunk, dm_instr instr) {
 	if (chunk->codesize >= chunk->codecapacity) {
 		chunk->codecapacity *= 2;
-		chunk->code = realloc(chunk->code, chunk->codecapacity);
+		chunk->code = realloc(chunk->code, chunk->codecapacity * sizeof(dm_instr));
 		chunk->lines = realloc(chunk->lines, chunk->codecapacity * sizeof(int));
 	}
 	chunk->lines[chunk->codesize] = chunk->current_line;
-	chunk->code[chunk->codesize++] = byte;
+	chunk->code[chunk->codesize++] = instr;
 }
 
 void dm_chunk_emit(dm_chunk *chunk, dm_opcode opcode) {
-	emit_byte(chunk, (uint8_t) opcode);
+	emit_instr(chunk, dm_instr_make(opcode, 0, 0));
 }
 
 void dm_chunk_emit_arg8(dm_chunk *chunk, dm_opcode opcode, int arg8) {
@@ -130,8 +218,7 @@ void dm_chunk_emit_arg8(dm_chunk *chunk, dm_opcode opcode, int arg8) {
 		return;
 	}
 
-	emit_byte(chunk, (uint8_t) opcode);
-	emit_byte(chunk, (uint8_t) arg8);
+	emit_instr(chunk, dm_instr_make(opcode, arg8, 0));
 }
 
 void dm_chunk_emit_arg16(dm_chunk *chunk, dm_opcode opcode, int arg16) {
@@ -139,10 +226,7 @@ void dm_chunk_emit_arg16(dm_chunk *chunk, dm_opcode opcode, int arg16) {
 		return;
 	}
 
-	uint16_t arg = (uint16_t) arg16;
-	emit_byte(chunk, (uint8_t) opcode);
-	emit_byte(chunk, arg >> 8);
-	emit_byte(chunk, arg & 0xff);
+	emit_instr(chunk, dm_instr_make(opcode, 0, arg16));
 }
 
 void dm_chunk_emit_arg8_arg16(dm_chunk *chunk, dm_opcode opcode, int arg8, int arg16) {
@@ -150,45 +234,55 @@ void dm_chunk_emit_arg8_arg16(dm_chunk *chunk, dm_opcode opcode, int arg8, int a
 		return;
 	}
 
-	emit_byte(chunk, (uint8_t) opcode);
-	emit_byte(chunk, (uint8_t) arg8);
-	emit_byte(chunk, (uint16_t) arg16 >> 8);
-	emit_byte(chunk, (uint16_t) arg16 & 0xff);
-}
-
-void dm_chunk_emit_arg8_arg8_arg16(dm_chunk *chunk, dm_opcode opcode, int arg8_1, int arg8_2, int arg16) {
-	if (arg8_1 >= 1 << 8 || arg8_2 >= 1 << 8 || arg16 >= 1 << 16) {
-		return;
-	}
-
-	emit_byte(chunk, (uint8_t) opcode);
-	emit_byte(chunk, (uint8_t) arg8_1);
-	emit_byte(chunk, (uint8_t) arg8_2);
-	emit_byte(chunk, (uint16_t) arg16 >> 8);
-	emit_byte(chunk, (uint16_t) arg16 & 0xff);
+	emit_instr(chunk, dm_instr_make(opcode, arg8, arg16));
 }
 
+// returns the address of the jump for dm_chunk_patch_jump
 int dm_chunk_emit_jump(dm_chunk *chunk, dm_opcode opcode, int dest) {
 	if (dest >= 1 << 16) {
 		return 0;
 	}
 
-	uint16_t addr = (uint16_t) dest;
-	emit_byte(chunk, (uint8_t) opcode);
-	int addr_location = dm_chunk_current_address(chunk);
-	emit_byte(chunk, (uint8_t) (addr >> 8));
-	emit_byte(chunk, (uint8_t) (addr & 0xff));
-	return addr_location;
+	int addr = dm_chunk_current_address(chunk);
+	emit_instr(chunk, dm_instr_make(opcode, 0, dest));
+	return addr;
 }
 
-void dm_chunk_patch_jump(dm_chunk *chunk, int addr_location) {
+void dm_chunk_patch_jump(dm_chunk *chunk, int jump_addr) {
 	if (dm_chunk_current_address(chunk) >= 1 << 16) {
 		return;
 	}
 
-	uint16_t addr = dm_chunk_current_address(chunk);
-	chunk->code[addr_location] = (uint8_t) (addr >> 8);
-	chunk->code[addr_location+1] = (uint8_t) (addr & 0xff);
+	dm_instr jump = chunk->code[jump_addr];
+	chunk->code[jump_addr] = dm_instr_make(dm_instr_op(jump), dm_instr_a(jump), dm_chunk_current_address(chunk));
+}
+
+// returns -1 if the loop can't be addressed by the 8 bit operand
+int dm_chunk_add_forloop(dm_chunk *chunk, dm_forloop loop) {
+	if (chunk->loopsize >= 1 << 8) {
+		return -1;
+	}
+	if (chunk->loopsize >= chunk->loopcapacity) {
+		chunk->loopcapacity = chunk->loopcapacity == 0 ? 4 : chunk->loopcapacity * 2;
+		chunk->loops = realloc(chunk->loops, chunk->loopcapacity * sizeof(dm_forloop));
+	}
+	chunk->loops[chunk->loopsize++] = loop;
+	return chunk->loopsize - 1;
+}
+
+// returns the index of the upvalue, an upvalue is only added once
+int dm_chunk_add_upval(dm_chunk *chunk, bool local, int index) {
+	for (int i = 0; i < chunk->upvalsize; i++) {
+		if (chunk->upvals[i].local == local && chunk->upvals[i].index == index) {
+			return i;
+		}
+	}
+	if (chunk->upvalsize >= chunk->upvalcapacity) {
+		chunk->upvalcapacity = chunk->upvalcapacity == 0 ? 4 : chunk->upvalcapacity * 2;
+		chunk->upvals = realloc(chunk->upvals, chunk->upvalcapacity * sizeof(dm_upvaldesc));
+	}
+	chunk->upvals[chunk->upvalsize++] = (dm_upvaldesc){local, index};
+	return chunk->upvalsize - 1;
 }
 
 int dm_chunk_add_var(dm_chunk *chunk, const char *name, int size) {
@@ -204,9 +298,9 @@ int dm_chunk_add_var(dm_chunk *chunk, const char *name, int size) {
 	new_name[size] = '\0';
 	if (chunk->varsize >= chunk->varcapacity) {
 		chunk->varcapacity *= 2;
-		chunk->vars = realloc(chunk->vars, chunk->varcapacity * sizeof(dm_value));
+		chunk->vars = realloc(chunk->vars, chunk->varcapacity * sizeof(struct variable));
 	}
-	chunk->vars[chunk->varsize++] = (struct variable){new_name, dm_value_nil()};
+	chunk->vars[chunk->varsize++] = (struct variable){new_name, dm_value_nil(), NULL};
 	return chunk->varsize - 1;
 }
 
@@ -220,85 +314,583 @@ int dm_chunk_find_var(dm_chunk *chunk, const char *name, int size) {
 	return -1;
 }
 
+// index comes from verified code
 void dm_chunk_set_var(dm_chunk *chunk, int index, dm_value v) {
-	if (index < 0 || index >= chunk->varsize) {
-		return;
-	}
 	chunk->vars[index].value = v;
 }
 
 dm_value dm_chunk_get_var(dm_chunk *chunk, int index) {
-	if (index < 0 || index >= chunk->varsize) {
-		return dm_value_nil();
-	}
 	return chunk->vars[index].value;
 }
 
 
-static int decompile_op(uint8_t *code) {
-	dm_opcode opcode = code[0];
+// the opcode the compiler emitted for a quickened one
+dm_opcode dm_opcode_generic(dm_opcode opcode) {
 	switch (opcode) {
-		case DM_OP_IMPORT:				printf("IMPORT\n"); return 1;
-		case DM_OP_VARSET:				printf("VARSET %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_VARGETOPSET:			printf("VARGETOPSET %d %d\n", code[1], code[2] << 8 | code[3]); return 4;
-		case DM_OP_VARSET_UP:			printf("VARSET_UP (%d) %d\n", code[1], code[2] << 8 | code[3]); return 4;
-		case DM_OP_VARGETOPSET_UP:		printf("VARGETOPSET_UP %d (%d) %d\n", code[1], code[2], code[3] << 8 | code[4]); return 5;
-		case DM_OP_VARGET:				printf("VARGET %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_VARGET_UP:			printf("VARGET_UP (%d) %d\n", code[1], code[2] << 8 | code[3]); return 4;
-		case DM_OP_FIELDSET:			printf("FIELDSET\n"); return 1;
-		case DM_OP_FIELDGETOPSET:		printf("FIELDGETOPSET %d\n", code[1]); return 2;
-		case DM_OP_FIELDSET_S:			printf("FIELDSET_S\n"); return 1;
-		case DM_OP_FIELDGETOPSET_S:		printf("FIELDGETOPSET_S %d\n", code[1]); return 2;
-		case DM_OP_FIELDGET:			printf("FIELDGET\n"); return 1;
-		case DM_OP_FIELDGET_S:			printf("FIELDGET_S\n"); return 1;
-		case DM_OP_FIELDGET_PUSHPARENT:	printf("FIELDGET_PUSHPARENT\n"); return 1;
-		case DM_OP_FIELDGET_S_PUSHPARENT: printf("FIELDGET_S_PUSHPARENT\n"); return 1;
-
-		case DM_OP_CONSTANT:			printf("CONSTANT %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_CONSTANT_SMALLINT:	printf("CONSTANT_SMALLINT <%d>\n", code[1] << 8 | code[2]); return 3;
-
-		case DM_OP_ARRAYLIT:			printf("ARRAYLIT %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_TABLELIT:			printf("TABLELIT %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_TRUE:				printf("TRUE\n"); return 1;
-		case DM_OP_FALSE:				printf("FALSE\n"); return 1;
-		case DM_OP_NIL:					printf("NIL\n"); return 1;
-		case DM_OP_SELF:                printf("SELF\n"); return 1;
-
-		case DM_OP_CALL:				printf("CALL %d\n", code[1]); return 2;
-		case DM_OP_CALL_WITHPARENT:		printf("CALL_WITHPARENT %d\n", code[1]); return 2;
-
-		case DM_OP_NEGATE:				printf("NEGATE\n"); return 1;
-		case DM_OP_NOT:					printf("NOT\n"); return 1;
-		case DM_OP_PLUS:				printf("PLUS\n"); return 1;
-		case DM_OP_MINUS:				printf("MINUS\n"); return 1;
-		case DM_OP_MUL:					printf("MUL\n"); return 1;
-		case DM_OP_DIV:					printf("DIV\n"); return 1;
-		case DM_OP_MOD:					printf("MOD\n"); return 1;
-		case DM_OP_NOTEQUAL:			printf("NOTEQUAL\n"); return 1;
-		case DM_OP_EQUAL:				printf("EQUAL\n"); return 1;
-		case DM_OP_LESS:				printf("LESS\n"); return 1;
-		case DM_OP_LESSEQUAL:			printf("LESSEQUAL\n"); return 1;
-		case DM_OP_GREATER:				printf("GREATER\n"); return 1;
-		case DM_OP_GREATEREQUAL:		printf("GREATEREQUAL\n"); return 1;
-
-		case DM_OP_JUMP_IF_TRUE_OR_POP:	printf("JUMP_IF_TRUE_OR_POP %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_JUMP_IF_FALSE_OR_POP:printf("JUMP_IF_FALSE_OR_POP %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_JUMP_IF_FALSE:		printf("JUMP_IF_FALSE %d\n", code[1] << 8 | code[2]); return 3;
-		case DM_OP_JUMP:				printf("JUMP %d\n", code[1] << 8 | code[2]); return 3;
-
-		case DM_OP_POP:					printf("POP\n"); return 1;
-		case DM_OP_RETURN:				printf("RETURN\n"); return 1;
+		case DM_OP_PLUS_INT_UNCHECKED:
+		case DM_OP_PLUS_FLOAT_UNCHECKED:
+		case DM_OP_PLUS_INT:
+		case DM_OP_PLUS_FLOAT:          return DM_OP_PLUS;
+		case DM_OP_MINUS_INT_UNCHECKED:
+		case DM_OP_MINUS_FLOAT_UNCHECKED:
+		case DM_OP_MINUS_INT:
+		case DM_OP_MINUS_FLOAT:         return DM_OP_MINUS;
+		case DM_OP_MUL_INT_UNCHECKED:
+		case DM_OP_MUL_FLOAT_UNCHECKED:
+		case DM_OP_MUL_INT:
+		case DM_OP_MUL_FLOAT:           return DM_OP_MUL;
+		case DM_OP_DIV_INT_UNCHECKED:
+		case DM_OP_DIV_FLOAT_UNCHECKED:
+		case DM_OP_DIV_INT:
+		case DM_OP_DIV_FLOAT:           return DM_OP_DIV;
+		case DM_OP_LESS_INT_UNCHECKED:
+		case DM_OP_LESS_FLOAT_UNCHECKED:
+		case DM_OP_LESS_INT:
+		case DM_OP_LESS_FLOAT:          return DM_OP_LESS;
+		case DM_OP_LESSEQUAL_INT_UNCHECKED:
+		case DM_OP_LESSEQUAL_FLOAT_UNCHECKED:
+		case DM_OP_LESSEQUAL_INT:
+		case DM_OP_LESSEQUAL_FLOAT:     return DM_OP_LESSEQUAL;
+		case DM_OP_GREATER_INT_UNCHECKED:
+		case DM_OP_GREATER_FLOAT_UNCHECKED:
+		case DM_OP_GREATER_INT:
+		case DM_OP_GREATER_FLOAT:       return DM_OP_GREATER;
+		case DM_OP_GREATEREQUAL_INT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_FLOAT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_INT:
+		case DM_OP_GREATEREQUAL_FLOAT:  return DM_OP_GREATEREQUAL;
+		case DM_OP_FIELDGET_ARRAY_INT_UNCHECKED:
+		case DM_OP_FIELDGET_ARRAY_INT:  return DM_OP_FIELDGET;
+		case DM_OP_FIELDSET_ARRAY_INT_UNCHECKED:
+		case DM_OP_FIELDSET_ARRAY_INT:  return DM_OP_FIELDSET;
+		default:                        return opcode;
 	}
+}
 
-	printf("UNKNOWN_OPCODE\n");
+bool dm_opcode_is_jump(dm_opcode op) {
+	return op == DM_OP_JUMP || op == DM_OP_JUMP_IF_FALSE || op == DM_OP_JUMP_IF_TRUE_OR_POP
+		|| op == DM_OP_JUMP_IF_FALSE_OR_POP || op == DM_OP_FORPREP || op == DM_OP_FORLOOP;
+}
+
+static const char *opcode_names[] = {
+	[DM_OP_IMPORT]                 = "IMPORT",
+	[DM_OP_VARSET]                 = "VARSET",
+	[DM_OP_VARGETOPSET]            = "VARGETOPSET",
+	[DM_OP_VARSET_UP]              = "VARSET_UP",
+	[DM_OP_VARGETOPSET_UP]         = "VARGETOPSET_UP",
+	[DM_OP_VARGET]                 = "VARGET",
+	[DM_OP_VARGET_UP]              = "VARGET_UP",
+	[DM_OP_FIELDSET]               = "FIELDSET",
+	[DM_OP_FIELDGETOPSET]          = "FIELDGETOPSET",
+	[DM_OP_FIELDSET_S]             = "FIELDSET_S",
+	[DM_OP_FIELDGETOPSET_S]        = "FIELDGETOPSET_S",
+	[DM_OP_FIELDGET]               = "FIELDGET",
+	[DM_OP_FIELDGET_S]             = "FIELDGET_S",
+	[DM_OP_FIELDGET_PUSHPARENT]    = "FIELDGET_PUSHPARENT",
+	[DM_OP_FIELDGET_S_PUSHPARENT]  = "FIELDGET_S_PUSHPARENT",
+	[DM_OP_CONSTANT]               = "CONSTANT",
+	[DM_OP_CONSTANT_SMALLINT]      = "CONSTANT_SMALLINT",
+	[DM_OP_CLOSURE]                = "CLOSURE",
+	[DM_OP_ARRAYLIT]               = "ARRAYLIT",
+	[DM_OP_TABLELIT]               = "TABLELIT",
+	[DM_OP_TRUE]                   = "TRUE",
+	[DM_OP_FALSE]                  = "FALSE",
+	[DM_OP_NIL]                    = "NIL",
+	[DM_OP_SELF]                   = "SELF",
+	[DM_OP_CALL]                   = "CALL",
+	[DM_OP_CALL_WITHPARENT]        = "CALL_WITHPARENT",
+	[DM_OP_TAILCALL]               = "TAILCALL",
+	[DM_OP_CHECKTYPE]              = "CHECKTYPE",
+	[DM_OP_NEGATE]                 = "NEGATE",
+	[DM_OP_NOT]                    = "NOT",
+	[DM_OP_PLUS]                   = "PLUS",
+	[DM_OP_MINUS]                  = "MINUS",
+	[DM_OP_MUL]                    = "MUL",
+	[DM_OP_DIV]                    = "DIV",
+	[DM_OP_MOD]                    = "MOD",
+	[DM_OP_NOTEQUAL]               = "NOTEQUAL",
+	[DM_OP_EQUAL]                  = "EQUAL",
+	[DM_OP_LESS]                   = "LESS",
+	[DM_OP_LESSEQUAL]              = "LESSEQUAL",
+	[DM_OP_GREATER]                = "GREATER",
+	[DM_OP_GREATEREQUAL]           = "GREATEREQUAL",
+	[DM_OP_JUMP_IF_TRUE_OR_POP]    = "JUMP_IF_TRUE_OR_POP",
+	[DM_OP_JUMP_IF_FALSE_OR_POP]   = "JUMP_IF_FALSE_OR_POP",
+	[DM_OP_JUMP_IF_FALSE]          = "JUMP_IF_FALSE",
+	[DM_OP_JUMP]                   = "JUMP",
+	[DM_OP_POP]                    = "POP",
+	[DM_OP_RETURN]                 = "RETURN",
+	[DM_OP_FORPREP]                = "FORPREP",
+	[DM_OP_FORLOOP]                = "FORLOOP",
+	[DM_OP_PLUS_INT]               = "PLUS_INT",
+	[DM_OP_PLUS_FLOAT]             = "PLUS_FLOAT",
+	[DM_OP_MINUS_INT]              = "MINUS_INT",
+	[DM_OP_MINUS_FLOAT]            = "MINUS_FLOAT",
+	[DM_OP_MUL_INT]                = "MUL_INT",
+	[DM_OP_MUL_FLOAT]              = "MUL_FLOAT",
+	[DM_OP_DIV_INT]                = "DIV_INT",
+	[DM_OP_DIV_FLOAT]              = "DIV_FLOAT",
+	[DM_OP_LESS_INT]               = "LESS_INT",
+	[DM_OP_LESS_FLOAT]             = "LESS_FLOAT",
+	[DM_OP_LESSEQUAL_INT]          = "LESSEQUAL_INT",
+	[DM_OP_LESSEQUAL_FLOAT]        = "LESSEQUAL_FLOAT",
+	[DM_OP_GREATER_INT]            = "GREATER_INT",
+	[DM_OP_GREATER_FLOAT]          = "GREATER_FLOAT",
+	[DM_OP_GREATEREQUAL_INT]       = "GREATEREQUAL_INT",
+	[DM_OP_GREATEREQUAL_FLOAT]     = "GREATEREQUAL_FLOAT",
+	[DM_OP_FIELDGET_ARRAY_INT]     = "FIELDGET_ARRAY_INT",
+	[DM_OP_FIELDSET_ARRAY_INT]     = "FIELDSET_ARRAY_INT",
+	[DM_OP_PLUS_INT_UNCHECKED]            = "PLUS_INT_UNCHECKED",
+	[DM_OP_PLUS_FLOAT_UNCHECKED]          = "PLUS_FLOAT_UNCHECKED",
+	[DM_OP_MINUS_INT_UNCHECKED]           = "MINUS_INT_UNCHECKED",
+	[DM_OP_MINUS_FLOAT_UNCHECKED]         = "MINUS_FLOAT_UNCHECKED",
+	[DM_OP_MUL_INT_UNCHECKED]             = "MUL_INT_UNCHECKED",
+	[DM_OP_MUL_FLOAT_UNCHECKED]           = "MUL_FLOAT_UNCHECKED",
+	[DM_OP_DIV_INT_UNCHECKED]             = "DIV_INT_UNCHECKED",
+	[DM_OP_DIV_FLOAT_UNCHECKED]           = "DIV_FLOAT_UNCHECKED",
+	[DM_OP_LESS_INT_UNCHECKED]            = "LESS_INT_UNCHECKED",
+	[DM_OP_LESS_FLOAT_UNCHECKED]          = "LESS_FLOAT_UNCHECKED",
+	[DM_OP_LESSEQUAL_INT_UNCHECKED]       = "LESSEQUAL_INT_UNCHECKED",
+	[DM_OP_LESSEQUAL_FLOAT_UNCHECKED]     = "LESSEQUAL_FLOAT_UNCHECKED",
+	[DM_OP_GREATER_INT_UNCHECKED]         = "GREATER_INT_UNCHECKED",
+	[DM_OP_GREATER_FLOAT_UNCHECKED]       = "GREATER_FLOAT_UNCHECKED",
+	[DM_OP_GREATEREQUAL_INT_UNCHECKED]    = "GREATEREQUAL_INT_UNCHECKED",
+	[DM_OP_GREATEREQUAL_FLOAT_UNCHECKED]  = "GREATEREQUAL_FLOAT_UNCHECKED",
+	[DM_OP_FIELDGET_ARRAY_INT_UNCHECKED]  = "FIELDGET_ARRAY_INT_UNCHECKED",
+	[DM_OP_FIELDSET_ARRAY_INT_UNCHECKED]  = "FIELDSET_ARRAY_INT_UNCHECKED",
+#define X(name, first, second) [DM_OP_##name] = #name,
+	DM_SUPERINSTRUCTIONS(X)
+#undef X
+};
+
+const char *dm_opcode_name(dm_opcode opcode) {
+	return opcode_names[opcode];
+}
+
+bool dm_superinstr_split(dm_instr in, dm_instr *first, dm_instr *second) {
+	switch (dm_instr_op(in)) {
+#define X(name, f, s)                                                          \
+		case DM_OP_##name:                                                     \
+			*first = dm_superinstr_first(DM_OP_##f, DM_OP_##s, in);           \
+			*second = dm_superinstr_second(DM_OP_##f, DM_OP_##s, in);         \
+			return true;
+		DM_SUPERINSTRUCTIONS(X)
+#undef X
+		default:
+			return false;
+	}
+}
+
+bool dm_superinstr_fuse(dm_instr first, dm_instr second, dm_instr *fused) {
+	dm_opcode f = dm_instr_op(first);
+	// the dispatch a pair saves is worth more than the checks an unchecked
+	// opcode skips, the pair runs the generic handler
+	dm_opcode s = dm_opcode_generic(dm_instr_op(second));
+	dm_opcode op = DM_OP_NUM_OPS;
+#define X(name, fop, sop) if (f == DM_OP_##fop && s == DM_OP_##sop) op = DM_OP_##name;
+	DM_SUPERINSTRUCTIONS(X)
+#undef X
+	// the vm runs the first half inline and jumps to the handler of the second
+	if (op == DM_OP_NUM_OPS || dm_opcode_is_jump(f) || f == DM_OP_RETURN
+			|| dm_opcode_operands(f) == DM_OPERANDS_OTHER || dm_opcode_operands(s) == DM_OPERANDS_OTHER) {
+		return false;
+	}
+
+	if (dm_opcode_operands(s) == DM_OPERANDS_NONE) {
+		*fused = dm_instr_make(op, dm_instr_a(first), dm_instr_b(first));
+	} else if (dm_opcode_operands(f) == DM_OPERANDS_NONE) {
+		*fused = dm_instr_make(op, dm_instr_a(second), dm_instr_b(second));
+	} else if (dm_instr_b(first) <= UINT8_MAX) {
+		*fused = dm_instr_make(op, dm_instr_b(first), dm_instr_b(second));
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// values an instruction takes from the stack and leaves on it, for the
+// *_OR_POP jumps on the path that falls through. Superinstructions have to be
+// split first.
+void dm_instr_stack_effect(dm_instr instr, int *pops, int *pushes) {
+	int a = dm_instr_a(instr);
+	int b = dm_instr_b(instr);
+	*pops = 0;
+	*pushes = 1;
+	switch (dm_opcode_generic(dm_instr_op(instr))) {
+		case DM_OP_VARGET:
+		case DM_OP_VARGET_UP:
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_CLOSURE:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL:
+		case DM_OP_SELF:                return;
+		case DM_OP_IMPORT:
+		case DM_OP_VARSET:
+		case DM_OP_VARGETOPSET:
+		case DM_OP_VARSET_UP:
+		case DM_OP_VARGETOPSET_UP:
+		case DM_OP_CHECKTYPE:
+		case DM_OP_NEGATE:
+		case DM_OP_NOT:                 *pops = 1; return;
+		case DM_OP_FIELDSET:
+		case DM_OP_FIELDGETOPSET:
+		case DM_OP_FIELDSET_S:
+		case DM_OP_FIELDGETOPSET_S:     *pops = 3; return;
+		case DM_OP_FIELDGET_PUSHPARENT:
+		case DM_OP_FIELDGET_S_PUSHPARENT: *pops = 2; *pushes = 2; return;
+		case DM_OP_ARRAYLIT:            *pops = b; return;
+		case DM_OP_TABLELIT:            *pops = 2 * b; return;
+		case DM_OP_CALL:
+		case DM_OP_TAILCALL:            *pops = a + 1; return;
+		case DM_OP_CALL_WITHPARENT:     *pops = a + 2; return;
+		case DM_OP_JUMP_IF_TRUE_OR_POP:
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+		case DM_OP_JUMP_IF_FALSE:
+		case DM_OP_POP:
+		case DM_OP_RETURN:              *pops = 1; *pushes = 0; return;
+		case DM_OP_JUMP:
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:             *pushes = 0; return;
+		default:                        *pops = 2; return;
+	}
+}
+
+static int verify_error(dm_chunk *chunk, int addr, const char *message) {
+	fprintf(stderr, "[line %d] Invalid bytecode at %d: %s\n", dm_chunk_line_at(chunk, addr), addr, message);
 	return 1;
 }
 
-void dm_chunk_decompile(dm_state *dm, dm_chunk *chunk) {
-	for (int i = 0; i < chunk->codesize;) {
+// checks the operands of one instruction against the tables of the chunk
+static int verify_operands(dm_chunk *chunk, int addr, dm_instr instr) {
+	dm_opcode op = dm_opcode_generic(dm_instr_op(instr));
+	int a = dm_instr_a(instr);
+	int b = dm_instr_b(instr);
+	if (dm_instr_op(instr) >= DM_OP_NUM_OPS) {
+		return verify_error(chunk, addr, "unknown opcode");
+	}
+
+	dm_instr first, second;
+	if (dm_superinstr_split(instr, &first, &second)) {
+		return verify_operands(chunk, addr, first) || verify_operands(chunk, addr, second);
+	}
+
+	switch (op) {
+		case DM_OP_VARGETOPSET:
+		case DM_OP_VARGETOPSET_UP:
+		case DM_OP_FIELDGETOPSET:
+		case DM_OP_FIELDGETOPSET_S:
+			if (a > DM_OPASSIGN_MOD) {
+				return verify_error(chunk, addr, "unknown op-assign");
+			}
+			break;
+		case DM_OP_CHECKTYPE:
+			if (a >= DM_TYPE_NUM_TYPES) {
+				return verify_error(chunk, addr, "unknown type");
+			}
+			break;
+		default:
+			break;
+	}
+
+	switch (op) {
+		case DM_OP_VARSET:
+		case DM_OP_VARGETOPSET:
+		case DM_OP_VARGET:
+			if (b >= chunk->varsize) {
+				return verify_error(chunk, addr, "variable index out of range");
+			}
+			break;
+		case DM_OP_VARSET_UP:
+		case DM_OP_VARGETOPSET_UP:
+		case DM_OP_VARGET_UP:
+			if (b >= chunk->upvalsize) {
+				return verify_error(chunk, addr, "upvalue index out of range");
+			}
+			break;
+		case DM_OP_CONSTANT:
+		case DM_OP_CLOSURE: {
+			if (b >= chunk->constsize) {
+				return verify_error(chunk, addr, "constant index out of range");
+			}
+			dm_value c = chunk->consts[b];
+			dm_chunk *fchunk = dm_value_type(c) == DM_TYPE_FUNCTION ? dm_value_as_function(c)->chunk : NULL;
+			if (op == DM_OP_CLOSURE && fchunk == NULL) {
+				return verify_error(chunk, addr, "closure of a constant that is not a function");
+			}
+			if (op == DM_OP_CONSTANT && fchunk != NULL && fchunk->upvalsize > 0) {
+				return verify_error(chunk, addr, "function with upvalues loaded without closure");
+			}
+			for (int i = 0; fchunk != NULL && i < fchunk->upvalsize; i++) {
+				dm_upvaldesc desc = fchunk->upvals[i];
+				if (desc.index < 0 || desc.index >= (desc.local ? chunk->varsize : chunk->upvalsize)) {
+					return verify_error(chunk, addr, "closure captures an upvalue out of range");
+				}
+			}
+			// only the functions the code loads, the constants of a REPL line
+			// that didn't compile stay in the chunk
+			if (fchunk != NULL && dm_chunk_verify(fchunk) != 0) {
+				return 1;
+			}
+			break;
+		}
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP: {
+			if (a >= chunk->loopsize) {
+				return verify_error(chunk, addr, "loop index out of range");
+			}
+			dm_forloop *loop = &chunk->loops[a];
+			if (loop->var >= chunk->varsize || (loop->limit_is_var && loop->limit >= chunk->varsize)) {
+				return verify_error(chunk, addr, "loop variable out of range");
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+	if (dm_opcode_is_jump(op) && b >= chunk->codesize) {
+		return verify_error(chunk, addr, "jump target out of range");
+	}
+	return 0;
+}
+
+// Follows every path through the code and sets chunk->maxstack. Every path
+// has to reach an instruction with the same stack depth, must not pop more
+// than it pushed and has to end in a jump or return.
+static int verify_stack(dm_chunk *chunk) {
+	int *depth = malloc((chunk->codesize + 1) * sizeof(int));
+	int *work = malloc((chunk->codesize + 1) * sizeof(int));
+	for (int i = 0; i <= chunk->codesize; i++) {
+		depth[i] = -1;
+	}
+
+	int max = 0;
+	int nwork = 0;
+	int err = 0;
+	depth[0] = 0;
+	work[nwork++] = 0;
+	while (nwork > 0 && !err) {
+		int addr = work[--nwork];
+		for (;; addr++) {
+			if (addr >= chunk->codesize) {
+				err = verify_error(chunk, addr, "code runs past the end");
+				break;
+			}
+
+			dm_instr instr = chunk->code[addr];
+			int d = depth[addr];
+			int pops, pushes;
+			// the first half of a superinstruction never jumps
+			dm_instr first;
+			if (dm_superinstr_split(instr, &first, &instr)) {
+				dm_instr_stack_effect(first, &pops, &pushes);
+				if (d < pops) {
+					err = verify_error(chunk, addr, "pops from an empty stack");
+					break;
+				}
+				d = d - pops + pushes;
+				if (d > max) {
+					max = d;
+				}
+			}
+
+			dm_opcode op = dm_opcode_generic(dm_instr_op(instr));
+			dm_instr_stack_effect(instr, &pops, &pushes);
+			if (d < pops) {
+				err = verify_error(chunk, addr, "pops from an empty stack");
+				break;
+			}
+			int next = d - pops + pushes;
+			if (next > max) {
+				max = next;
+			}
+
+			if (dm_opcode_is_jump(op)) {
+				int target = dm_instr_b(instr);
+				// the *_OR_POP jumps keep the condition
+				int target_depth = op == DM_OP_JUMP_IF_TRUE_OR_POP || op == DM_OP_JUMP_IF_FALSE_OR_POP ? d : next;
+				if (depth[target] != -1 && depth[target] != target_depth) {
+					err = verify_error(chunk, addr, "jump target reached with different stack depths");
+					break;
+				}
+				if (depth[target] == -1) {
+					depth[target] = target_depth;
+					work[nwork++] = target;
+				}
+			}
+			if (op == DM_OP_JUMP || op == DM_OP_RETURN) {
+				break;
+			}
+
+			if (depth[addr + 1] != -1) {
+				if (depth[addr + 1] != next) {
+					err = verify_error(chunk, addr + 1, "instruction reached with different stack depths");
+				}
+				break;
+			}
+			depth[addr + 1] = next;
+		}
+	}
+
+	free(work);
+	free(depth);
+	chunk->maxstack = max;
+	return err;
+}
+
+// Checks the code of the chunk and of the functions it loads once before it
+// runs, the vm trusts the operands and the stack depth afterwards. Prints what
+// is wrong and returns 1 for malformed code.
+int dm_chunk_verify(dm_chunk *chunk) {
+	if (chunk->verified) {
+		return 0;
+	}
+
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		if (verify_operands(chunk, addr, chunk->code[addr]) != 0) {
+			return 1;
+		}
+	}
+	if (verify_stack(chunk) != 0) {
+		return 1;
+	}
+	chunk->verified = true;
+	return 0;
+}
+
+static void decompile_op(dm_instr instr) {
+	dm_opcode opcode = dm_instr_op(instr);
+	int a = dm_instr_a(instr);
+	int b = dm_instr_b(instr);
+	switch (opcode) {
+		case DM_OP_IMPORT:				printf("IMPORT\n"); return;
+		case DM_OP_VARSET:				printf("VARSET %d\n", b); return;
+		case DM_OP_VARGETOPSET:			printf("VARGETOPSET %d %d\n", a, b); return;
+		case DM_OP_VARSET_UP:			printf("VARSET_UP %d\n", b); return;
+		case DM_OP_VARGETOPSET_UP:		printf("VARGETOPSET_UP %d %d\n", a, b); return;
+		case DM_OP_VARGET:				printf("VARGET %d\n", b); return;
+		case DM_OP_VARGET_UP:			printf("VARGET_UP %d\n", b); return;
+		case DM_OP_FIELDSET:			printf("FIELDSET\n"); return;
+		case DM_OP_FIELDGETOPSET:		printf("FIELDGETOPSET %d\n", a); return;
+		case DM_OP_FIELDSET_S:			printf("FIELDSET_S\n"); return;
+		case DM_OP_FIELDGETOPSET_S:		printf("FIELDGETOPSET_S %d\n", a); return;
+		case DM_OP_FIELDGET:			printf("FIELDGET\n"); return;
+		case DM_OP_FIELDGET_S:			printf("FIELDGET_S\n"); return;
+		case DM_OP_FIELDGET_PUSHPARENT:	printf("FIELDGET_PUSHPARENT\n"); return;
+		case DM_OP_FIELDGET_S_PUSHPARENT: printf("FIELDGET_S_PUSHPARENT\n"); return;
+
+		case DM_OP_CONSTANT:			printf("CONSTANT %d\n", b); return;
+		case DM_OP_CONSTANT_SMALLINT:	printf("CONSTANT_SMALLINT <%d>\n", b); return;
+		case DM_OP_CLOSURE:				printf("CLOSURE %d\n", b); return;
+
+		case DM_OP_ARRAYLIT:			printf("ARRAYLIT %d\n", b); return;
+		case DM_OP_TABLELIT:			printf("TABLELIT %d\n", b); return;
+		case DM_OP_TRUE:				printf("TRUE\n"); return;
+		case DM_OP_FALSE:				printf("FALSE\n"); return;
+		case DM_OP_NIL:					printf("NIL\n"); return;
+		case DM_OP_SELF:                printf("SELF\n"); return;
+
+		case DM_OP_CALL:				printf("CALL %d\n", a); return;
+		case DM_OP_CALL_WITHPARENT:		printf("CALL_WITHPARENT %d\n", a); return;
+		case DM_OP_TAILCALL:			printf("TAILCALL %d\n", a); return;
+
+		case DM_OP_CHECKTYPE:			printf("CHECKTYPE %d\n", a); return;
+		case DM_OP_NEGATE:				printf("NEGATE\n"); return;
+		case DM_OP_NOT:					printf("NOT\n"); return;
+		case DM_OP_PLUS:				printf("PLUS\n"); return;
+		case DM_OP_MINUS:				printf("MINUS\n"); return;
+		case DM_OP_MUL:					printf("MUL\n"); return;
+		case DM_OP_DIV:					printf("DIV\n"); return;
+		case DM_OP_MOD:					printf("MOD\n"); return;
+		case DM_OP_NOTEQUAL:			printf("NOTEQUAL\n"); return;
+		case DM_OP_EQUAL:				printf("EQUAL\n"); return;
+		case DM_OP_LESS:				printf("LESS\n"); return;
+		case DM_OP_LESSEQUAL:			printf("LESSEQUAL\n"); return;
+		case DM_OP_GREATER:				printf("GREATER\n"); return;
+		case DM_OP_GREATEREQUAL:		printf("GREATEREQUAL\n"); return;
+
+		case DM_OP_JUMP_IF_TRUE_OR_POP:	printf("JUMP_IF_TRUE_OR_POP %d\n", b); return;
+		case DM_OP_JUMP_IF_FALSE_OR_POP:printf("JUMP_IF_FALSE_OR_POP %d\n", b); return;
+		case DM_OP_JUMP_IF_FALSE:		printf("JUMP_IF_FALSE %d\n", b); return;
+		case DM_OP_JUMP:				printf("JUMP %d\n", b); return;
+
+		case DM_OP_POP:					printf("POP\n"); return;
+		case DM_OP_RETURN:				printf("RETURN\n"); return;
+
+		case DM_OP_FORPREP:				printf("FORPREP %d %d\n", a, b); return;
+		case DM_OP_FORLOOP:				printf("FORLOOP %d %d\n", a, b); return;
+
+		case DM_OP_PLUS_INT:		printf("PLUS_INT\n"); return;
+		case DM_OP_PLUS_FLOAT:		printf("PLUS_FLOAT\n"); return;
+		case DM_OP_MINUS_INT:		printf("MINUS_INT\n"); return;
+		case DM_OP_MINUS_FLOAT:		printf("MINUS_FLOAT\n"); return;
+		case DM_OP_MUL_INT:			printf("MUL_INT\n"); return;
+		case DM_OP_MUL_FLOAT:		printf("MUL_FLOAT\n"); return;
+		case DM_OP_DIV_INT:			printf("DIV_INT\n"); return;
+		case DM_OP_DIV_FLOAT:		printf("DIV_FLOAT\n"); return;
+		case DM_OP_LESS_INT:		printf("LESS_INT\n"); return;
+		case DM_OP_LESS_FLOAT:		printf("LESS_FLOAT\n"); return;
+		case DM_OP_LESSEQUAL_INT:	printf("LESSEQUAL_INT\n"); return;
+		case DM_OP_LESSEQUAL_FLOAT:	printf("LESSEQUAL_FLOAT\n"); return;
+		case DM_OP_GREATER_INT:		printf("GREATER_INT\n"); return;
+		case DM_OP_GREATER_FLOAT:	printf("GREATER_FLOAT\n"); return;
+		case DM_OP_GREATEREQUAL_INT:	printf("GREATEREQUAL_INT\n"); return;
+		case DM_OP_GREATEREQUAL_FLOAT:	printf("GREATEREQUAL_FLOAT\n"); return;
+		case DM_OP_FIELDGET_ARRAY_INT:	printf("FIELDGET_ARRAY_INT\n"); return;
+		case DM_OP_FIELDSET_ARRAY_INT:	printf("FIELDSET_ARRAY_INT\n"); return;
+		case DM_OP_PLUS_INT_UNCHECKED:
+		case DM_OP_PLUS_FLOAT_UNCHECKED:
+		case DM_OP_MINUS_INT_UNCHECKED:
+		case DM_OP_MINUS_FLOAT_UNCHECKED:
+		case DM_OP_MUL_INT_UNCHECKED:
+		case DM_OP_MUL_FLOAT_UNCHECKED:
+		case DM_OP_DIV_INT_UNCHECKED:
+		case DM_OP_DIV_FLOAT_UNCHECKED:
+		case DM_OP_LESS_INT_UNCHECKED:
+		case DM_OP_LESS_FLOAT_UNCHECKED:
+		case DM_OP_LESSEQUAL_INT_UNCHECKED:
+		case DM_OP_LESSEQUAL_FLOAT_UNCHECKED:
+		case DM_OP_GREATER_INT_UNCHECKED:
+		case DM_OP_GREATER_FLOAT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_INT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_FLOAT_UNCHECKED:
+		case DM_OP_FIELDGET_ARRAY_INT_UNCHECKED:
+		case DM_OP_FIELDSET_ARRAY_INT_UNCHECKED:	printf("%s\n", dm_opcode_name(opcode)); return;
+		case DM_OP_NUM_OPS:				break;
+#define X(name, first, second) case DM_OP_##name:
+		DM_SUPERINSTRUCTIONS(X)
+#undef X
+			printf("%s %d %d\n", dm_opcode_name(opcode), a, b); return;
+	}
+
+	printf("UNKNOWN_OPCODE\n");
+	return;
+}
+
+// opcodes the vm has written over a generic one, see dm_opcode
+static bool is_specialized(dm_opcode opcode) {
+	return opcode >= DM_OP_PLUS_INT && opcode <= DM_OP_FIELDSET_ARRAY_INT;
+}
+
+void dm_chunk_decompile_code(dm_chunk *chunk) {
+	for (int i = 0; i < chunk->codesize; i++) {
 		printf("%d: ", i);
-		i += decompile_op(chunk->code + i);
+		decompile_op(chunk->code[i]);
 	}
+}
+
+void dm_chunk_decompile(dm_state *dm, dm_chunk *chunk) {
+	int specialized = 0;
+	for (int i = 0; i < chunk->codesize; i++) {
+		if (is_specialized(dm_instr_op(chunk->code[i]))) {
+			specialized++;
+		}
+	}
+	dm_chunk_decompile_code(chunk);
+	printf("Specialized sites: %d\n", specialized);
+	printf("Max stack: %d\n", chunk->maxstack);
 
 	printf("Constants:\n");
 	for (int i = 0; i < chunk->constsize; i++) {
@@ -307,10 +899,32 @@ void dm_chunk_decompile(dm_state *dm, dm_chunk *chunk) {
 		printf("\n");
 	}
 
+	static const char *compare_ops[] = {
+		[DM_OP_LESS] = "<", [DM_OP_LESSEQUAL] = "<=", [DM_OP_GREATER] = ">", [DM_OP_GREATEREQUAL] = ">="
+	};
+	printf("Loops:\n");
+	for (int i = 0; i < chunk->loopsize; i++) {
+		dm_forloop *loop = &chunk->loops[i];
+		printf("%d: var %d %s %s%d, step %d\n", i, loop->var, compare_ops[loop->compare],
+			loop->limit_is_var ? "var " : "", loop->limit, loop->step);
+	}
+
+	printf("Upvalues:\n");
+	for (int i = 0; i < chunk->upvalsize; i++) {
+		printf("%d: %s %d\n", i, chunk->upvals[i].local ? "var" : "up", chunk->upvals[i].index);
+	}
+
 	printf("Variables:\n");
 	for (int i = 0; i < chunk->varsize; i++) {
 		printf("%d: %s -> ", i, chunk->vars[i].name);
 		dm_value_inspect(dm, chunk->vars[i].value);
 		printf("\n");
 	}
+
+	for (int i = 0; i < chunk->constsize; i++) {
+		if (dm_value_type(chunk->consts[i]) == DM_TYPE_FUNCTION) {
+			printf("Function (constant %d):\n", i);
+			dm_chunk_decompile(dm, dm_value_as_function(chunk->consts[i])->chunk);
+		}
+	}
 }
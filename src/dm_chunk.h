@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <dm_value.h>
+#include <dm_superinstr.h>
 
 typedef enum {
 	DM_OPASSIGN_PLUS,
@@ -11,70 +12,226 @@ typedef enum {
 	DM_OPASSIGN_MOD,
 } dm_opassign;
 
+// Every instruction is one 32 bit word, the opcode is in the low byte and the
+// operands are packed into the upper 24 bits as a8 b16. Jump addresses are
+// indices of instructions.
 typedef enum {
-	DM_OP_IMPORT,               // op8 | [string] -> [value]
-	DM_OP_VARSET,               // op8 index16 | [value] -> [value]
-	DM_OP_VARGETOPSET,          // op8 opassign8 index16 | [value] -> [value]
-	DM_OP_VARSET_UP,            // op8 up8 index16 | [value] -> [value]
-	DM_OP_VARGETOPSET_UP,       // op8 opassign8 up8 index16 | [value] -> [value]
-	DM_OP_VARGET,               // op8 index16 | [] -> [value]
-	DM_OP_VARGET_UP,			// op8 up8 index16 | [] -> [value]
-	DM_OP_FIELDSET,             // op8 | [table, field, value] -> [value]
-	DM_OP_FIELDGETOPSET,        // op8 opassign8 | [table, field, value] -> [value]
-	DM_OP_FIELDSET_S,			// op8 | [table, string, value] -> [value]
-	DM_OP_FIELDGETOPSET_S,      // op8 opassign8 | [table, string, value] -> [value]
-	DM_OP_FIELDGET,             // op8 | [table, field] -> [value]
-	DM_OP_FIELDGET_S,			// op8 | [table, string] -> [value]
-	DM_OP_FIELDGET_PUSHPARENT,  // op8 | [table, field] -> [table, value]
-	DM_OP_FIELDGET_S_PUSHPARENT,// op8 | [table, string] -> [table, value]
-
-	DM_OP_CONSTANT,             // op8 index16 | [] -> [value]
-	DM_OP_CONSTANT_SMALLINT,    // op8 imm16 | [] -> [value]
-
-	DM_OP_ARRAYLIT,             // op8 imm16 | [v1, ..., vn] -> [value]
-	DM_OP_TABLELIT,             // op8 imm16 | [k1, v1, ..., kn, vn] -> [value]
-	DM_OP_TRUE,                 // op8 | [] -> [value]
-	DM_OP_FALSE,                // op8 | [] -> [value]
-	DM_OP_NIL,                  // op8 | [] -> [value]
-	DM_OP_SELF,                 // op8 | [] -> [self]
-
-	DM_OP_CALL,                 // op8 nargs8 | [func, arg1, ..., argn] -> [result]
-	DM_OP_CALL_WITHPARENT,      // op8 nargs8 | [parent, func, arg1, ..., argn] -> [result]
-
-	DM_OP_NEGATE,               // op8 | [value] -> [value]
-	DM_OP_NOT,                  // op8 | [value] -> [value]
-	DM_OP_PLUS,                 // op8 | [value1, value2] -> [value]
-	DM_OP_MINUS,                // op8 | [value1, value2] -> [value]
-	DM_OP_MUL,                  // op8 | [value1, value2] -> [value]
-	DM_OP_DIV,                  // op8 | [value1, value2] -> [value]
-	DM_OP_MOD,                  // op8 | [value1, value2] -> [value]
-	DM_OP_NOTEQUAL,             // op8 | [value1, value2] -> [value]
-	DM_OP_EQUAL,                // op8 | [value1, value2] -> [value]
-	DM_OP_LESS,                 // op8 | [value1, value2] -> [value]
-	DM_OP_LESSEQUAL,            // op8 | [value1, value2] -> [value]
-	DM_OP_GREATER,              // op8 | [value1, value2] -> [value]
-	DM_OP_GREATEREQUAL,         // op8 | [value1, value2] -> [value]
-
-	DM_OP_JUMP_IF_TRUE_OR_POP,  // op8 addr16 | cond ? [cond] -> [cond] : [cond] -> []
-	DM_OP_JUMP_IF_FALSE_OR_POP, // op8 addr16 | cond ? [cond] -> [] : [cond] -> [cond]
-	DM_OP_JUMP_IF_FALSE,        // op8 addr16 | [cond] -> []
-	DM_OP_JUMP,                 // op8 addr16 | [] -> []
-
-	DM_OP_POP,                  // op8 | [value] -> []
-	DM_OP_RETURN                // op8 | [value] -> []
+	DM_OP_IMPORT,               // op | [string] -> [value]
+	DM_OP_VARSET,               // op index16 | [value] -> [value]
+	DM_OP_VARGETOPSET,          // op opassign8 index16 | [value] -> [value]
+	DM_OP_VARSET_UP,            // op upval16 | [value] -> [value]
+	DM_OP_VARGETOPSET_UP,       // op opassign8 upval16 | [value] -> [value]
+	DM_OP_VARGET,               // op index16 | [] -> [value]
+	DM_OP_VARGET_UP,			// op upval16 | [] -> [value]
+	DM_OP_FIELDSET,             // op | [table, field, value] -> [value]
+	DM_OP_FIELDGETOPSET,        // op opassign8 | [table, field, value] -> [value]
+	DM_OP_FIELDSET_S,			// op | [table, string, value] -> [value]
+	DM_OP_FIELDGETOPSET_S,      // op opassign8 | [table, string, value] -> [value]
+	DM_OP_FIELDGET,             // op | [table, field] -> [value]
+	DM_OP_FIELDGET_S,			// op | [table, string] -> [value]
+	DM_OP_FIELDGET_PUSHPARENT,  // op | [table, field] -> [table, value]
+	DM_OP_FIELDGET_S_PUSHPARENT,// op | [table, string] -> [table, value]
+
+	DM_OP_CONSTANT,             // op index16 | [] -> [value]
+	DM_OP_CONSTANT_SMALLINT,    // op imm16 | [] -> [value]
+	DM_OP_CLOSURE,              // op index16 | [] -> [function], captures the upvalues of the constant
+
+	DM_OP_ARRAYLIT,             // op imm16 | [v1, ..., vn] -> [value]
+	DM_OP_TABLELIT,             // op imm16 | [k1, v1, ..., kn, vn] -> [value]
+	DM_OP_TRUE,                 // op | [] -> [value]
+	DM_OP_FALSE,                // op | [] -> [value]
+	DM_OP_NIL,                  // op | [] -> [value]
+	DM_OP_SELF,                 // op | [] -> [self]
+
+	DM_OP_CALL,                 // op nargs8 | [func, arg1, ..., argn] -> [result]
+	DM_OP_CALL_WITHPARENT,      // op nargs8 | [parent, func, arg1, ..., argn] -> [result]
+	DM_OP_TAILCALL,             // op nargs8 | [func, arg1, ..., argn] -> [result], the callee takes over the frame
+
+	DM_OP_CHECKTYPE,            // op type8 | [value] -> [value], fails unless the value has the type
+	DM_OP_NEGATE,               // op | [value] -> [value]
+	DM_OP_NOT,                  // op | [value] -> [value]
+	DM_OP_PLUS,                 // op | [value1, value2] -> [value]
+	DM_OP_MINUS,                // op | [value1, value2] -> [value]
+	DM_OP_MUL,                  // op | [value1, value2] -> [value]
+	DM_OP_DIV,                  // op | [value1, value2] -> [value]
+	DM_OP_MOD,                  // op | [value1, value2] -> [value]
+	DM_OP_NOTEQUAL,             // op | [value1, value2] -> [value]
+	DM_OP_EQUAL,                // op | [value1, value2] -> [value]
+	DM_OP_LESS,                 // op | [value1, value2] -> [value]
+	DM_OP_LESSEQUAL,            // op | [value1, value2] -> [value]
+	DM_OP_GREATER,              // op | [value1, value2] -> [value]
+	DM_OP_GREATEREQUAL,         // op | [value1, value2] -> [value]
+
+	DM_OP_JUMP_IF_TRUE_OR_POP,  // op addr16 | cond ? [cond] -> [cond] : [cond] -> []
+	DM_OP_JUMP_IF_FALSE_OR_POP, // op addr16 | cond ? [cond] -> [] : [cond] -> [cond]
+	DM_OP_JUMP_IF_FALSE,        // op addr16 | [cond] -> []
+	DM_OP_JUMP,                 // op addr16 | [] -> []
+
+	DM_OP_POP,                  // op | [value] -> []
+	DM_OP_RETURN,               // op | [value] -> []
+
+	// counting for loops, the operands are in chunk->loops[loop], see dm_forloop
+	DM_OP_FORPREP,              // op loop8 addr16 | [] -> [], jumps to addr if the loop doesn't run
+	DM_OP_FORLOOP,              // op loop8 addr16 | [] -> [], steps and jumps to addr if it goes on
+
+	// pairs of opcodes fused by the peephole pass, see dm_superinstr.h
+#define X(name, first, second) DM_OP_##name,
+	DM_SUPERINSTRUCTIONS(X)
+#undef X
+
+	// Never emitted by the compiler. The vm writes these over the generic
+	// opcode once it has seen the operand types (quickening) and writes the
+	// generic opcode back when a guard fails. FLOAT means at least one float.
+	DM_OP_PLUS_INT,             // op | [int, int] -> [int]
+	DM_OP_PLUS_FLOAT,           // op | [number, number] -> [float]
+	DM_OP_MINUS_INT,            // op | [int, int] -> [int]
+	DM_OP_MINUS_FLOAT,          // op | [number, number] -> [float]
+	DM_OP_MUL_INT,              // op | [int, int] -> [int]
+	DM_OP_MUL_FLOAT,            // op | [number, number] -> [float]
+	DM_OP_DIV_INT,              // op | [int, int] -> [int]
+	DM_OP_DIV_FLOAT,            // op | [number, number] -> [float]
+	DM_OP_LESS_INT,             // op | [int, int] -> [bool]
+	DM_OP_LESS_FLOAT,           // op | [number, number] -> [bool]
+	DM_OP_LESSEQUAL_INT,        // op | [int, int] -> [bool]
+	DM_OP_LESSEQUAL_FLOAT,      // op | [number, number] -> [bool]
+	DM_OP_GREATER_INT,          // op | [int, int] -> [bool]
+	DM_OP_GREATER_FLOAT,        // op | [number, number] -> [bool]
+	DM_OP_GREATEREQUAL_INT,     // op | [int, int] -> [bool]
+	DM_OP_GREATEREQUAL_FLOAT,   // op | [number, number] -> [bool]
+	DM_OP_FIELDGET_ARRAY_INT,   // op | [array, int] -> [value]
+	DM_OP_FIELDSET_ARRAY_INT,   // op | [array, int, value] -> [value]
+
+	// Emitted by the optimizer where its type inference proved the operand
+	// types, they check nothing. FLOAT means at least one float.
+	DM_OP_PLUS_INT_UNCHECKED,           // op | [int, int] -> [int]
+	DM_OP_PLUS_FLOAT_UNCHECKED,         // op | [number, number] -> [float]
+	DM_OP_MINUS_INT_UNCHECKED,          // op | [int, int] -> [int]
+	DM_OP_MINUS_FLOAT_UNCHECKED,        // op | [number, number] -> [float]
+	DM_OP_MUL_INT_UNCHECKED,            // op | [int, int] -> [int]
+	DM_OP_MUL_FLOAT_UNCHECKED,          // op | [number, number] -> [float]
+	DM_OP_DIV_INT_UNCHECKED,            // op | [int, int] -> [int], checks for 0
+	DM_OP_DIV_FLOAT_UNCHECKED,          // op | [number, number] -> [float], checks for 0
+	DM_OP_LESS_INT_UNCHECKED,           // op | [int, int] -> [bool]
+	DM_OP_LESS_FLOAT_UNCHECKED,         // op | [number, number] -> [bool]
+	DM_OP_LESSEQUAL_INT_UNCHECKED,      // op | [int, int] -> [bool]
+	DM_OP_LESSEQUAL_FLOAT_UNCHECKED,    // op | [number, number] -> [bool]
+	DM_OP_GREATER_INT_UNCHECKED,        // op | [int, int] -> [bool]
+	DM_OP_GREATER_FLOAT_UNCHECKED,      // op | [number, number] -> [bool]
+	DM_OP_GREATEREQUAL_INT_UNCHECKED,   // op | [int, int] -> [bool]
+	DM_OP_GREATEREQUAL_FLOAT_UNCHECKED, // op | [number, number] -> [bool]
+	DM_OP_FIELDGET_ARRAY_INT_UNCHECKED, // op | [array, int] -> [value]
+	DM_OP_FIELDSET_ARRAY_INT_UNCHECKED, // op | [array, int, value] -> [value]
+
+	DM_OP_NUM_OPS
 } dm_opcode;
 
+typedef uint32_t dm_instr;
+
+#define dm_instr_op(instr) ((dm_opcode) ((instr) & 0xff))
+#define dm_instr_a(instr)  ((int) (((instr) >> 8) & 0xff))
+#define dm_instr_b(instr)  ((int) ((instr) >> 16))
+#define dm_instr_make(op, a, b) ((dm_instr) (op) | (dm_instr) (a) << 8 | (dm_instr) (b) << 16)
+
+// whether an opcode without operands, one index16 or anything else
+typedef enum {
+	DM_OPERANDS_NONE,
+	DM_OPERANDS_B16,
+	DM_OPERANDS_OTHER
+} dm_operands;
+
+static inline dm_operands dm_opcode_operands(dm_opcode op) {
+	switch (op) {
+		case DM_OP_VARSET:
+		case DM_OP_VARSET_UP:
+		case DM_OP_VARGET:
+		case DM_OP_VARGET_UP:
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_CLOSURE:
+		case DM_OP_ARRAYLIT:
+		case DM_OP_TABLELIT:
+		case DM_OP_JUMP_IF_TRUE_OR_POP:
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+		case DM_OP_JUMP_IF_FALSE:
+		case DM_OP_JUMP:                 return DM_OPERANDS_B16;
+		case DM_OP_VARGETOPSET:
+		case DM_OP_VARGETOPSET_UP:
+		case DM_OP_FIELDGETOPSET:
+		case DM_OP_FIELDGETOPSET_S:
+		case DM_OP_CALL:
+		case DM_OP_CALL_WITHPARENT:
+		case DM_OP_TAILCALL:
+		case DM_OP_CHECKTYPE:
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:              return DM_OPERANDS_OTHER;
+		default:                         return DM_OPERANDS_NONE;
+	}
+}
+
+// the halves of a superinstruction of the given pair, the vm passes constant
+// opcodes so the operand shuffling folds away
+static inline dm_instr dm_superinstr_first(dm_opcode first, dm_opcode second, dm_instr in) {
+	if (dm_opcode_operands(first) == DM_OPERANDS_NONE) {
+		return dm_instr_make(first, 0, 0);
+	} else if (dm_opcode_operands(second) == DM_OPERANDS_NONE) {
+		return dm_instr_make(first, dm_instr_a(in), dm_instr_b(in));
+	}
+	return dm_instr_make(first, 0, dm_instr_a(in));
+}
+
+static inline dm_instr dm_superinstr_second(dm_opcode first, dm_opcode second, dm_instr in) {
+	if (dm_opcode_operands(second) == DM_OPERANDS_NONE) {
+		return dm_instr_make(second, 0, 0);
+	} else if (dm_opcode_operands(first) == DM_OPERANDS_NONE) {
+		return dm_instr_make(second, dm_instr_a(in), dm_instr_b(in));
+	}
+	return dm_instr_make(second, 0, dm_instr_b(in));
+}
+
+// 'for i = a, i < n, i = i + s do' with n a variable or an int and s a small
+// int. compare is one of LESS, LESSEQUAL (step >= 0) or GREATER, GREATEREQUAL
+// (i = i - s, step <= 0).
+typedef struct {
+	int var;
+	bool limit_is_var;
+	int limit;
+	int step;
+	dm_opcode compare;
+} dm_forloop;
+
+// An upvalue of a chunk is either a variable of the parent chunk (local) or
+// one of the upvalues of the parent, captured when the closure is created.
+typedef struct {
+	bool local;
+	int index;
+} dm_upvaldesc;
+
+// value and cell are only used by the top level chunk, whose variables outlive
+// a single run of the vm (repl). cell is the upvalue closures captured the
+// variable in, it is reopened on the next run. Function arguments and locals
+// live on the vm stack.
 struct variable {
 	const char *name;
 	dm_value value;
+	struct dm_upval *cell;
 };
 
+// Code the optimizer inlined from another function keeps the line it had
+// there: its line in the chunk is -(index of the site + 1).
+typedef struct {
+	dm_value func;              // the inlined function, a constant of the chunk
+	int line;                   // in the inlined function
+	int call_line;
+	bool tail;                  // the caller returned what the call returns
+} dm_inline_site;
+
+struct dm_jit_frame;
+
 typedef struct {
 	struct dm_chunk *parent;
 	int codesize;
 	int codecapacity;
-	uint8_t *code;
-	uint32_t ip;
+	dm_instr *code;
 	int constsize;
 	int constcapacity;
 	dm_value *consts;
@@ -83,18 +240,41 @@ typedef struct {
 	struct variable *vars;
 	int *lines;
 	int current_line;
+	int inlinesize;
+	int inlinecapacity;
+	dm_inline_site *inlines;
+	int loopsize;
+	int loopcapacity;
+	dm_forloop *loops;
+	int upvalsize;
+	int upvalcapacity;
+	dm_upvaldesc *upvals;
+	int maxstack;               // values the code keeps on the stack at most, after the variables
+	bool verified;
+	struct dm_regcode *regcode;
+	int hotness;                // calls and loop iterations counted for the jit
+	struct dm_jitcode *jit;
+	struct dm_trace **traces;   // the loops of the tracing jit, by address
+	int tracesize;
+	void (*aot)(struct dm_jit_frame *f); // compiled ahead of time, see dm_aot.h
 } dm_chunk;
 
 void dm_chunk_init(dm_chunk *chunk);
 void dm_chunk_free(dm_chunk *chunk);
 void dm_chunk_set_parent(dm_chunk *chunk, dm_chunk *parent);
 void dm_chunk_reset_code(dm_chunk *chunk);
+void dm_chunk_truncate_code(dm_chunk *chunk, int addr);
 
 int dm_chunk_current_address(dm_chunk *chunk);
-int dm_chunk_current_line(dm_chunk *chunk);
+int dm_chunk_line_at(dm_chunk *chunk, int addr);
+// NULL unless the instruction at addr was inlined
+dm_inline_site *dm_chunk_inline_site_at(dm_chunk *chunk, int addr);
+// returns the line to give the inlined instruction
+int dm_chunk_add_inline_site(dm_chunk *chunk, dm_value func, int line, int call_line, bool tail);
 void dm_chunk_set_line(dm_chunk *chunk, int line);
 
 int  dm_chunk_index_of_string_constant(dm_chunk *chunk, const char *s, size_t len);
+int  dm_chunk_add_constant(dm_state *dm, dm_chunk *chunk, dm_value value);
 void dm_chunk_emit_constant(dm_state *dm, dm_chunk *chunk, dm_value value);
 void dm_chunk_emit_constant_i(dm_chunk *chunk, int index);
 
@@ -102,13 +282,24 @@ void dm_chunk_emit(dm_chunk *chunk, dm_opcode opcode);
 void dm_chunk_emit_arg8(dm_chunk *chunk, dm_opcode opcode, int arg8);
 void dm_chunk_emit_arg16(dm_chunk *chunk, dm_opcode opcode, int arg16);
 void dm_chunk_emit_arg8_arg16(dm_chunk *chunk, dm_opcode opcode, int arg8, int arg16);
-void dm_chunk_emit_arg8_arg8_arg16(dm_chunk *chunk, dm_opcode opcode, int arg8_1, int arg8_2, int arg16);
 int  dm_chunk_emit_jump(dm_chunk *chunk, dm_opcode opcode, int dest);
 void dm_chunk_patch_jump(dm_chunk *chunk, int addr_location);
 
+int  dm_chunk_add_forloop(dm_chunk *chunk, dm_forloop loop);
+int  dm_chunk_add_upval(dm_chunk *chunk, bool local, int index);
+
 int  dm_chunk_add_var(dm_chunk *chunk, const char *name, int size);
 int  dm_chunk_find_var(dm_chunk *chunk, const char *name, int size);
 void dm_chunk_set_var(dm_chunk *chunk, int index, dm_value v);
 dm_value dm_chunk_get_var(dm_chunk *chunk, int index);
 
+dm_opcode dm_opcode_generic(dm_opcode opcode);
+bool dm_opcode_is_jump(dm_opcode opcode);
+void dm_instr_stack_effect(dm_instr instr, int *pops, int *pushes);
+const char *dm_opcode_name(dm_opcode opcode);
+bool dm_superinstr_split(dm_instr in, dm_instr *first, dm_instr *second);
+bool dm_superinstr_fuse(dm_instr first, dm_instr second, dm_instr *fused);
+int dm_chunk_verify(dm_chunk *chunk);
+
+void dm_chunk_decompile_code(dm_chunk *chunk);
 void dm_chunk_decompile(dm_state *dm, dm_chunk *chunk);
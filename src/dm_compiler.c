@@ -2,11 +2,17 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include <dm_compiler.h>
 #include <dm_chunk.h>
 #include <dm_state.h>
 #include <dm_function.h>
+#include <dm_peephole.h>
+#include <dm_optimize.h>
+#include <dm_string.h>
+#include <dm_int.h>
+#include <dm_float.h>
 
 //#############################################################
 
@@ -269,6 +275,8 @@ typedef struct dm_parser {
 	dm_token previous;
 	bool had_error;
 	bool panic_mode;
+	int lhs_addr;               // start of the left operand of an infix rule
+	bool table_key;             // a ':' after an identifier ends the key of a table literal
 } dm_parser;
 
 typedef enum {
@@ -389,11 +397,13 @@ static void pparse_precedence(dm_parser *parser, dm_precedence prec) {
 		return;
 	}
 
+	int start = dm_chunk_current_address(parser->chunk);
 	f(parser);
 
 	while (prec <= pget_rule(parser->current.type)->precedence) {
 		pnext(parser);
 		parsefn f = pget_rule(parser->previous.type)->infix;
+		parser->lhs_addr = start;
 		f(parser);
 	}
 }
@@ -402,11 +412,48 @@ static void pexpression(dm_parser *parser) {
 	pparse_precedence(parser, DM_PREC_ASSIGNEMENT);
 }
 
+// the names of the types in annotations, nil can't be annotated
+static const char *type_names[DM_TYPE_NUM_TYPES] = {
+	[DM_TYPE_BOOL]     = "bool",
+	[DM_TYPE_INT]      = "int",
+	[DM_TYPE_FLOAT]    = "float",
+	[DM_TYPE_STRING]   = "string",
+	[DM_TYPE_ARRAY]    = "array",
+	[DM_TYPE_TABLE]    = "table",
+	[DM_TYPE_FUNCTION] = "function",
+};
+
+// the type of an annotation, after its ':'
+static dm_type ptype(dm_parser *parser) {
+	if (pmatch(parser, DM_TOKEN_FUNCTION)) {
+		return DM_TYPE_FUNCTION;
+	}
+	pconsume(parser, DM_TOKEN_IDENTIFIER, "expect type after ':'");
+	for (int type = 0; type < DM_TYPE_NUM_TYPES; type++) {
+		const char *name = type_names[type];
+		if (name != NULL && (int) strlen(name) == parser->previous.len && memcmp(name, parser->previous.begin, parser->previous.len) == 0) {
+			return type;
+		}
+	}
+	perr_at(parser, &parser->previous, "unknown type");
+	return DM_TYPE_NIL;
+}
+
 static void pident(dm_parser *parser) {
 	const char *var = parser->previous.begin;
 	int len = parser->previous.len;
-	if (pmatch(parser, DM_TOKEN_EQUAL)) {
+	// name: type = value checks the value before it is stored
+	bool annotated = !parser->table_key && pmatch(parser, DM_TOKEN_COLON);
+	dm_type type = DM_TYPE_NIL;
+	if (annotated) {
+		type = ptype(parser);
+		pconsume(parser, DM_TOKEN_EQUAL, "expect '=' after type annotation");
+	}
+	if (annotated || pmatch(parser, DM_TOKEN_EQUAL)) {
 		pexpression(parser);
+		if (annotated) {
+			dm_chunk_emit_arg8(parser->chunk, DM_OP_CHECKTYPE, type);
+		}
 		int ident = dm_chunk_add_var(parser->chunk, var, len);
 		dm_chunk_emit_arg16(parser->chunk, DM_OP_VARSET, ident);
 	} else if (pisopassign(parser)) {
@@ -426,33 +473,43 @@ static void pident(dm_parser *parser) {
 	}
 }
 
+// Returns the upvalue of chunk for the variable of an enclosing chunk, the
+// chunks in between get an upvalue for it as well. -1 if there is none.
+static int presolve_upval(dm_chunk *chunk, const char *var, int len) {
+	dm_chunk *parent = (dm_chunk*) chunk->parent;
+	if (parent == NULL) {
+		return -1;
+	}
+
+	int index = dm_chunk_find_var(parent, var, len);
+	if (index != -1) {
+		return dm_chunk_add_upval(chunk, true, index);
+	}
+
+	index = presolve_upval(parent, var, len);
+	if (index == -1) {
+		return -1;
+	}
+	return dm_chunk_add_upval(chunk, false, index);
+}
+
 static void pglobal(dm_parser *parser) {
 	pconsume(parser, DM_TOKEN_IDENTIFIER, "expect identifier after global keyword");
 	const char *var = parser->previous.begin;
 	int len = parser->previous.len;
-	dm_chunk *chunk = (dm_chunk*) parser->chunk->parent;
-	int ups = 1;
-	int index = -1;
-	while (chunk != NULL) {
-		index = dm_chunk_find_var(chunk, var, len);
-		if (index != -1) {
-			break;
-		}
-		ups++;
-		chunk = (dm_chunk*) chunk->parent;
-	}
+	int index = presolve_upval(parser->chunk, var, len);
 	if (index == -1) {
 		perr_at(parser, &parser->previous, "global variable does not exist!");
 	}
 	if (pmatch(parser, DM_TOKEN_EQUAL)) {
 		pexpression(parser);
-		dm_chunk_emit_arg8_arg16(parser->chunk, DM_OP_VARSET_UP, ups, index);
+		dm_chunk_emit_arg16(parser->chunk, DM_OP_VARSET_UP, index);
 	} else if (pisopassign(parser)) {
 		int opassign = pget_opassign(parser);
 		pexpression(parser);
-		dm_chunk_emit_arg8_arg8_arg16(parser->chunk, DM_OP_VARGETOPSET_UP, opassign, ups, index);
+		dm_chunk_emit_arg8_arg16(parser->chunk, DM_OP_VARGETOPSET_UP, opassign, index);
 	} else {
-		dm_chunk_emit_arg8_arg16(parser->chunk, DM_OP_VARGET_UP, ups, index);
+		dm_chunk_emit_arg16(parser->chunk, DM_OP_VARGET_UP, index);
 	}
 }
 
@@ -487,7 +544,10 @@ static void ptablelit(dm_parser *parser) {
 	int nelems = 0;
 	if (!pcheck(parser, DM_TOKEN_RIGHT_BRACE)) {
 		do {
+			bool table_key = parser->table_key;
+			parser->table_key = true;
 			pexpression(parser);
+			parser->table_key = table_key;
 			pconsume(parser, DM_TOKEN_COLON, "expect ':'");
 			pexpression(parser);
 			nelems++;
@@ -504,7 +564,14 @@ static void pstring(dm_parser *parser) {
 }
 
 static void pinteger(dm_parser *parser) {
-	long value = strtol(parser->previous.begin, NULL, 10);
+	errno = 0;
+	long long value = strtoll(parser->previous.begin, NULL, 10);
+	if (errno == ERANGE || value > DM_INT_MAX) {
+		// would wrap around, NaN-boxed ints only have 47 bits
+		perr_at(parser, &parser->previous, "integer literal out of range");
+		return;
+	}
+
 	if (value <= UINT16_MAX) {
 		dm_chunk_emit_arg16(parser->chunk, DM_OP_CONSTANT_SMALLINT, value);
 	} else {
@@ -597,9 +664,175 @@ static void passign(dm_parser *parser) {
 	perr(parser, "Can't assign to constant");
 }
 
+// Constant folding: an operator whose operands each compiled to a single
+// constant load is evaluated by the compiler, using the same module functions
+// the vm falls back to. Only cases the runtime can't fail on are folded, type
+// errors and division by 0 are left to the vm.
+static bool pconstant(dm_parser *parser, int begin, int end, dm_value *v) {
+	if (end - begin != 1) {
+		return false;
+	}
+
+	dm_instr in = parser->chunk->code[begin];
+	switch (dm_instr_op(in)) {
+		case DM_OP_CONSTANT_SMALLINT: *v = dm_value_int(dm_instr_b(in)); return true;
+		case DM_OP_TRUE:              *v = dm_value_bool(true);          return true;
+		case DM_OP_FALSE:             *v = dm_value_bool(false);         return true;
+		case DM_OP_NIL:               *v = dm_value_nil();               return true;
+		case DM_OP_CONSTANT:
+			*v = parser->chunk->consts[dm_instr_b(in)];
+			return dm_value_type(*v) == DM_TYPE_INT
+				|| dm_value_type(*v) == DM_TYPE_FLOAT
+				|| dm_value_type(*v) == DM_TYPE_STRING;
+		default: return false;
+	}
+}
+
+static void pemit_folded(dm_parser *parser, int addr, dm_value v) {
+	dm_chunk_truncate_code(parser->chunk, addr);
+	if (dm_value_type(v) == DM_TYPE_BOOL) {
+		dm_chunk_emit(parser->chunk, dm_value_as_bool(v) ? DM_OP_TRUE : DM_OP_FALSE);
+	} else if (dm_value_type(v) == DM_TYPE_INT && dm_value_as_int(v) >= 0 && dm_value_as_int(v) <= UINT16_MAX) {
+		dm_chunk_emit_arg16(parser->chunk, DM_OP_CONSTANT_SMALLINT, dm_value_as_int(v));
+	} else {
+		dm_chunk_emit_constant(parser->dm, parser->chunk, v);
+	}
+}
+
+static bool pis_number(dm_value v) {
+	return dm_value_type(v) == DM_TYPE_INT || dm_value_type(v) == DM_TYPE_FLOAT;
+}
+
+static bool pis_zero(dm_value v) {
+	return (dm_value_type(v) == DM_TYPE_INT && dm_value_as_int(v) == 0)
+		|| (dm_value_type(v) == DM_TYPE_FLOAT && dm_value_as_float(v) == 0);
+}
+
+// Whether an int result leaves DM_INT_MIN..DM_INT_MAX and would wrap around.
+// The compiler refuses such a constant like it does an int literal.
+static bool pint_overflows(dm_tokentype optype, dm_int a, dm_int b) {
+	dm_int res;
+	bool overflows;
+	switch (optype) {
+		case DM_TOKEN_PLUS:  overflows = __builtin_add_overflow(a, b, &res); break;
+		case DM_TOKEN_MINUS: overflows = __builtin_sub_overflow(a, b, &res); break;
+		case DM_TOKEN_STAR:  overflows = __builtin_mul_overflow(a, b, &res); break;
+		default:             return false;
+	}
+	return overflows || res < DM_INT_MIN || res > DM_INT_MAX;
+}
+
+static bool pfold_unary(dm_parser *parser, dm_tokentype optype, int operand) {
+	dm_value v;
+	if (!dm_fold_enabled(parser->dm) || !pconstant(parser, operand, dm_chunk_current_address(parser->chunk), &v)) {
+		return false;
+	}
+
+	dm_value res;
+	if (optype == DM_TOKEN_MINUS && dm_value_type(v) == DM_TYPE_INT) {
+		if (pint_overflows(DM_TOKEN_MINUS, 0, dm_value_as_int(v))) {
+			perr_at(parser, &parser->previous, "integer constant out of range");
+			return false;
+		}
+		res = dm_int_negate(parser->dm, v);
+	} else if (optype == DM_TOKEN_MINUS && dm_value_type(v) == DM_TYPE_FLOAT) {
+		res = dm_float_negate(parser->dm, v);
+	} else if ((optype == DM_TOKEN_NOT || optype == DM_TOKEN_BANG) && dm_value_type(v) == DM_TYPE_BOOL) {
+		res = dm_value_bool(!dm_value_as_bool(v));
+	} else {
+		return false;
+	}
+
+	pemit_folded(parser, operand, res);
+	return true;
+}
+
+static dm_value pconcat(dm_parser *parser, dm_value a, dm_value b) {
+	dm_string *s1 = dm_value_as_string(a);
+	dm_string *s2 = dm_value_as_string(b);
+	size_t size = dm_string_size(s1) + dm_string_size(s2);
+	char *data = malloc(size);
+	memcpy(data, dm_string_c_str(s1), dm_string_size(s1));
+	memcpy(data + dm_string_size(s1), dm_string_c_str(s2), dm_string_size(s2));
+	dm_value res = dm_value_string_const(parser->dm, data, size);
+	free(data);
+	return res;
+}
+
+// Whether the runtime evaluates the operator on a and b without an error.
+static bool pcan_fold(dm_tokentype optype, dm_value a, dm_value b) {
+	bool numbers = pis_number(a) && pis_number(b);
+	bool strings = dm_value_type(a) == DM_TYPE_STRING && dm_value_type(b) == DM_TYPE_STRING;
+	bool ints = dm_value_type(a) == DM_TYPE_INT && dm_value_type(b) == DM_TYPE_INT;
+	// the one int division C doesn't define
+	bool overflows = ints && dm_value_as_int(a) == DM_INT_MIN && dm_value_as_int(b) == -1;
+
+	switch (optype) {
+		case DM_TOKEN_PLUS:          return numbers || strings;
+		case DM_TOKEN_MINUS:
+		case DM_TOKEN_STAR:          return numbers;
+		case DM_TOKEN_SLASH:         return numbers && !pis_zero(b) && !overflows;
+		case DM_TOKEN_PERCENT:       return ints && !pis_zero(b) && !overflows;
+		case DM_TOKEN_BANG_EQUAL:
+		case DM_TOKEN_EQUAL_EQUAL:   return true;
+		case DM_TOKEN_LESS:
+		case DM_TOKEN_LESS_EQUAL:
+		case DM_TOKEN_GREATER:
+		case DM_TOKEN_GREATER_EQUAL: return numbers || strings;
+		default:                     return false;
+	}
+}
+
+static bool pfold_binary(dm_parser *parser, dm_tokentype optype, int lhs, int rhs) {
+	dm_value a, b;
+	if (!dm_fold_enabled(parser->dm)
+			|| !pconstant(parser, lhs, rhs, &a)
+			|| !pconstant(parser, rhs, dm_chunk_current_address(parser->chunk), &b)
+			|| !pcan_fold(optype, a, b)) {
+		return false;
+	}
+
+	if (dm_value_type(a) == DM_TYPE_INT && dm_value_type(b) == DM_TYPE_INT
+			&& pint_overflows(optype, dm_value_as_int(a), dm_value_as_int(b))) {
+		perr_at(parser, &parser->previous, "integer constant out of range");
+		return false;
+	}
+
+	dm_state *dm = parser->dm;
+	dm_module *m = dm_state_get_module(dm, dm_value_type(a));
+	dm_value res;
+	switch (optype) {
+		case DM_TOKEN_PLUS:
+			if (dm_value_type(a) == DM_TYPE_STRING) {
+				res = pconcat(parser, a, b);
+			} else {
+				res = m->add(dm, a, b);
+			}
+			break;
+		case DM_TOKEN_MINUS:         res = m->sub(dm, a, b);                          break;
+		case DM_TOKEN_STAR:          res = m->mul(dm, a, b);                          break;
+		case DM_TOKEN_SLASH:         res = m->div(dm, a, b);                          break;
+		case DM_TOKEN_PERCENT:       res = m->mod(dm, a, b);                          break;
+		case DM_TOKEN_BANG_EQUAL:    res = dm_value_bool(!dm_value_equals(dm, a, b)); break;
+		case DM_TOKEN_EQUAL_EQUAL:   res = dm_value_bool(dm_value_equals(dm, a, b));  break;
+		case DM_TOKEN_LESS:          res = dm_value_bool(m->compare(dm, a, b) < 0);   break;
+		case DM_TOKEN_LESS_EQUAL:    res = dm_value_bool(m->compare(dm, a, b) <= 0);  break;
+		case DM_TOKEN_GREATER:       res = dm_value_bool(m->compare(dm, a, b) > 0);   break;
+		case DM_TOKEN_GREATER_EQUAL: res = dm_value_bool(m->compare(dm, a, b) >= 0);  break;
+		default: return false;
+	}
+
+	pemit_folded(parser, lhs, res);
+	return true;
+}
+
 static void punary(dm_parser *parser) {
 	dm_tokentype optype = parser->previous.type;
+	int operand = dm_chunk_current_address(parser->chunk);
 	pparse_precedence(parser, DM_PREC_UNARY);
+	if (pfold_unary(parser, optype, operand)) {
+		return;
+	}
 	switch (optype) {
 		case DM_TOKEN_MINUS: dm_chunk_emit(parser->chunk, DM_OP_NEGATE); break;
 		case DM_TOKEN_BANG:
@@ -623,7 +856,12 @@ static void por(dm_parser *parser) {
 static void pbinary(dm_parser *parser) {
 	dm_tokentype optype = parser->previous.type;
 	dm_parserule *rule = pget_rule(optype);
+	int lhs = parser->lhs_addr;
+	int rhs = dm_chunk_current_address(parser->chunk);
 	pparse_precedence(parser, (dm_precedence)(rule->precedence + 1));
+	if (pfold_binary(parser, optype, lhs, rhs)) {
+		return;
+	}
 
 	switch (optype) {
 		case DM_TOKEN_PLUS:          dm_chunk_emit(parser->chunk, DM_OP_PLUS);         break;
@@ -716,7 +954,7 @@ static void pwhile(dm_parser *parser) {
 			dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP, loop_start_addr);
 		} else if (pmatch(parser, DM_TOKEN_BREAK)) {
 			dm_chunk_emit(parser->chunk, DM_OP_FALSE);
-			dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP_IF_FALSE, jump_if_false_patch);
+			dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP, jump_if_false_patch);
 		} else {
 			dm_chunk_emit(parser->chunk, DM_OP_POP);
 			pexpression(parser);
@@ -729,12 +967,129 @@ static void pwhile(dm_parser *parser) {
 	dm_chunk_patch_jump(parser->chunk, jump_if_false_patch);
 }
 
+// Matches the code the generic for loop emitted for condition and update
+// against 'i < n' and 'i = i + s' (or 'i += s'), see dm_forloop.
+static bool pmatch_forloop(dm_chunk *chunk, int cond_addr, int cond_end, int update_addr, int update_end, dm_forloop *loop) {
+	dm_instr *code = chunk->code;
+	if (cond_end - cond_addr != 3 || dm_instr_op(code[cond_addr]) != DM_OP_VARGET) {
+		return false;
+	}
+
+	loop->var = dm_instr_b(code[cond_addr]);
+	loop->compare = dm_instr_op(code[cond_addr + 2]);
+	dm_instr limit = code[cond_addr + 1];
+	if (dm_instr_op(limit) == DM_OP_VARGET && dm_instr_b(limit) != loop->var) {
+		loop->limit_is_var = true;
+		loop->limit = dm_instr_b(limit);
+	} else if (dm_instr_op(limit) == DM_OP_CONSTANT_SMALLINT) {
+		loop->limit_is_var = false;
+		loop->limit = dm_instr_b(limit);
+	} else if (dm_instr_op(limit) == DM_OP_CONSTANT) {
+		dm_value c = chunk->consts[dm_instr_b(limit)];
+		if (dm_value_type(c) != DM_TYPE_INT || dm_value_as_int(c) != (int) dm_value_as_int(c)) {
+			return false;
+		}
+		loop->limit_is_var = false;
+		loop->limit = dm_value_as_int(c);
+	} else {
+		return false;
+	}
+
+	dm_opcode op;
+	dm_instr step;
+	if (update_end - update_addr == 4) {
+		// i = i + s
+		dm_instr get = code[update_addr];
+		dm_instr set = code[update_addr + 3];
+		if (dm_instr_op(get) != DM_OP_VARGET || dm_instr_b(get) != loop->var
+				|| dm_instr_op(set) != DM_OP_VARSET || dm_instr_b(set) != loop->var) {
+			return false;
+		}
+		step = code[update_addr + 1];
+		op = dm_instr_op(code[update_addr + 2]);
+	} else if (update_end - update_addr == 2) {
+		// i += s
+		dm_instr set = code[update_addr + 1];
+		if (dm_instr_op(set) != DM_OP_VARGETOPSET || dm_instr_b(set) != loop->var) {
+			return false;
+		}
+		step = code[update_addr];
+		switch (dm_instr_a(set)) {
+			case DM_OPASSIGN_PLUS:  op = DM_OP_PLUS; break;
+			case DM_OPASSIGN_MINUS: op = DM_OP_MINUS; break;
+			default: return false;
+		}
+	} else {
+		return false;
+	}
+	if (dm_instr_op(step) != DM_OP_CONSTANT_SMALLINT) {
+		return false;
+	}
+
+	if (op == DM_OP_PLUS && (loop->compare == DM_OP_LESS || loop->compare == DM_OP_LESSEQUAL)) {
+		loop->step = dm_instr_b(step);
+		return true;
+	}
+	if (op == DM_OP_MINUS && (loop->compare == DM_OP_GREATER || loop->compare == DM_OP_GREATEREQUAL)) {
+		loop->step = -dm_instr_b(step);
+		return true;
+	}
+	return false;
+}
+
+// Patches jumps that are chained through their address operands, 0 ends the
+// chain, no jump of a loop body can be at address 0.
+static void ppatch_jump_chain(dm_parser *parser, int chain) {
+	while (chain != 0) {
+		int next = dm_instr_b(parser->chunk->code[chain]);
+		dm_chunk_patch_jump(parser->chunk, chain);
+		chain = next;
+	}
+}
+
+// FORPREP and FORLOOP do the work of the header, errors are reported at its line
+static void pfor_counted(dm_parser *parser, int loop, int line) {
+	int body_line = parser->chunk->current_line;
+	int forprep_patch = dm_chunk_current_address(parser->chunk);
+	dm_chunk_set_line(parser->chunk, line);
+	dm_chunk_emit_arg8_arg16(parser->chunk, DM_OP_FORPREP, loop, 0);
+	dm_chunk_set_line(parser->chunk, body_line);
+	int body_addr = dm_chunk_current_address(parser->chunk);
+
+	int next_chain = 0;
+	int break_chain = 0;
+	while (!pcheck(parser, DM_TOKEN_END) && !pcheck(parser, DM_TOKEN_EOF)) {
+		if (pmatch(parser, DM_TOKEN_SEMICOLON)) {
+			continue;
+		} else if (pmatch(parser, DM_TOKEN_NEXT)) {
+			next_chain = dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP, next_chain);
+		} else if (pmatch(parser, DM_TOKEN_BREAK)) {
+			break_chain = dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP, break_chain);
+		} else {
+			dm_chunk_emit(parser->chunk, DM_OP_POP);
+			pexpression(parser);
+		}
+	}
+
+	pconsume(parser, DM_TOKEN_END, "expect end after for block");
+
+	ppatch_jump_chain(parser, next_chain);
+	int end_line = parser->chunk->current_line;
+	dm_chunk_set_line(parser->chunk, line);
+	dm_chunk_emit_arg8_arg16(parser->chunk, DM_OP_FORLOOP, loop, body_addr);
+	dm_chunk_set_line(parser->chunk, end_line);
+	dm_chunk_patch_jump(parser->chunk, forprep_patch);
+	ppatch_jump_chain(parser, break_chain);
+}
+
 static void pfor(dm_parser *parser) {
+	int line = parser->previous.line;
 	pexpression(parser);
 	pconsume(parser, DM_TOKEN_COMMA, "expect ',' after init expression");
 	int loop_start_addr = dm_chunk_current_address(parser->chunk);
 
 	pexpression(parser);
+	int cond_end = dm_chunk_current_address(parser->chunk);
 	pconsume(parser, DM_TOKEN_COMMA, "expect ',' after condition expression");
 
 	int jump_if_false_patch = dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP_IF_FALSE, 0);
@@ -742,8 +1097,21 @@ static void pfor(dm_parser *parser) {
 
 	int update_addr = dm_chunk_current_address(parser->chunk);
 	pexpression(parser);
+	int update_end = dm_chunk_current_address(parser->chunk);
 	dm_chunk_emit(parser->chunk, DM_OP_POP);
 	pconsume(parser, DM_TOKEN_DO, "expect do in for expression");
+
+	// counting loops replace condition and update with FORPREP and FORLOOP
+	dm_forloop loop;
+	if (pmatch_forloop(parser->chunk, loop_start_addr, cond_end, update_addr, update_end, &loop)) {
+		int index = dm_chunk_add_forloop(parser->chunk, loop);
+		if (index != -1) {
+			dm_chunk_truncate_code(parser->chunk, loop_start_addr);
+			pfor_counted(parser, index, line);
+			return;
+		}
+	}
+
 	dm_chunk_emit_jump(parser->chunk, DM_OP_JUMP, loop_start_addr);
 
 	dm_chunk_patch_jump(parser->chunk, loop_body_patch);
@@ -767,12 +1135,34 @@ static void pfor(dm_parser *parser) {
 	dm_chunk_patch_jump(parser->chunk, jump_if_false_patch);
 }
 
+// A call whose value the function returns is a tail call, the callee takes
+// over the frame. The return after it stays for the jumps that end there.
+// Only in functions: the frame of a script keeps its variables after the call
+// and its line belongs in the backtrace, scripts have no parent chunk.
+static void ptailcall(dm_chunk *chunk) {
+	int last = chunk->codesize - 1;
+	if (chunk->parent != NULL && last >= 0 && dm_instr_op(chunk->code[last]) == DM_OP_CALL) {
+		chunk->code[last] = dm_instr_make(DM_OP_TAILCALL, dm_instr_a(chunk->code[last]), 0);
+	}
+}
+
+// the passes must not separate a tail call from its return
+static void pcheck_tailcalls(dm_chunk *chunk) {
+	for (int i = 0; i < chunk->codesize; i++) {
+		if (dm_instr_op(chunk->code[i]) == DM_OP_TAILCALL
+				&& (i + 1 == chunk->codesize || dm_instr_op(chunk->code[i + 1]) != DM_OP_RETURN)) {
+			chunk->code[i] = dm_instr_make(DM_OP_CALL, dm_instr_a(chunk->code[i]), 0);
+		}
+	}
+}
+
 static void preturn(dm_parser *parser) {
 	if (pcheck(parser, DM_TOKEN_END) || pcheck(parser, DM_TOKEN_ELSIF) || pcheck(parser, DM_TOKEN_ELSE) ||
 		pmatch(parser, DM_TOKEN_SEMICOLON) || pmatch(parser, DM_TOKEN_EOF)) {
 		dm_chunk_emit(parser->chunk, DM_OP_NIL);
 	} else {
 		pexpression(parser);
+		ptailcall(parser->chunk);
 	}
 	dm_chunk_emit(parser->chunk, DM_OP_RETURN);
 }
@@ -785,10 +1175,18 @@ static int parglist(dm_parser *parser, bool *takes_self) {
 		do {
 			if (nargs == 0 && pmatch(parser, DM_TOKEN_SELF)) {
 				*takes_self = true;
+				dm_chunk_add_var(parser->chunk, parser->previous.begin, parser->previous.len);
 			} else {
 				pconsume(parser, DM_TOKEN_IDENTIFIER, "function parameter must be an identifier");
+				int var = dm_chunk_add_var(parser->chunk, parser->previous.begin, parser->previous.len);
+				// the arguments are checked once on entry
+				if (pmatch(parser, DM_TOKEN_COLON)) {
+					dm_type type = ptype(parser);
+					dm_chunk_emit_arg16(parser->chunk, DM_OP_VARGET, var);
+					dm_chunk_emit_arg8(parser->chunk, DM_OP_CHECKTYPE, type);
+					dm_chunk_emit(parser->chunk, DM_OP_POP);
+				}
 			}
-			dm_chunk_add_var(parser->chunk, parser->previous.begin, parser->previous.len);
 			nargs++;
 		} while (pmatch(parser, DM_TOKEN_COMMA));
 	}
@@ -797,13 +1195,21 @@ static int parglist(dm_parser *parser, bool *takes_self) {
 }
 
 static dm_value pcompiler_end(dm_parser *parser, dm_value f, int nargs, bool takes_self) {
+	ptailcall(parser->chunk);
 	dm_chunk_emit(parser->chunk, DM_OP_RETURN);
-	if (f.type == DM_TYPE_NIL) {
+	if (!parser->had_error && dm_opt_level(parser->dm) > 0) {
+		dm_optimize(parser->dm, parser->chunk);
+	}
+	if (!parser->had_error && dm_peephole_enabled(parser->dm)) {
+		dm_peephole(parser->dm, parser->chunk);
+	}
+	pcheck_tailcalls(parser->chunk);
+	if (dm_value_type(f) == DM_TYPE_NIL) {
 		f = dm_value_function(parser->dm, parser->chunk, nargs, takes_self);
 	} else {
-		f.func_val->chunk = parser->chunk;
-		f.func_val->nargs = nargs;
-		f.func_val->takes_self = takes_self;
+		dm_value_as_function(f)->chunk = parser->chunk;
+		dm_value_as_function(f)->nargs = nargs;
+		dm_value_as_function(f)->takes_self = takes_self;
 	}
 	return f;
 }
@@ -819,6 +1225,8 @@ static void pfunction(dm_parser *parser) {
 	dm_chunk_init(parser->chunk);
 	dm_chunk_set_parent(parser->chunk, parent_chunk);
 
+	bool table_key = parser->table_key;
+	parser->table_key = false;
 	bool takes_self;
 	int nargs = parglist(parser, &takes_self);
 
@@ -833,10 +1241,17 @@ static void pfunction(dm_parser *parser) {
 	}
 
 	pconsume(parser, DM_TOKEN_END, "expect 'end' at end of function");
+	parser->table_key = table_key;
 
 	dm_value func = pcompiler_end(parser, dm_value_nil(), nargs, takes_self);
+	bool captures = parser->chunk->upvalsize > 0;
 	parser->chunk = parent_chunk;
-	dm_chunk_emit_constant(parser->dm, parser->chunk, func);
+	if (captures) {
+		int index = dm_chunk_add_constant(parser->dm, parser->chunk, func);
+		dm_chunk_emit_arg16(parser->chunk, DM_OP_CLOSURE, index);
+	} else {
+		dm_chunk_emit_constant(parser->dm, parser->chunk, func);
+	}
 	if (func_name != -1) {
 		dm_chunk_emit_arg16(parser->chunk, DM_OP_VARSET, func_name);
 	}
@@ -852,17 +1267,17 @@ static void pimport(dm_parser *parser) {
 
 int dm_compile(dm_state *dm, dm_value *main, char *prog) {
 	dm_lexer lexer = {prog, prog, 1};
-	dm_parser parser = {dm, &lexer, NULL, {}, {}, false, false};
+	dm_parser parser = {dm, &lexer, NULL, {}, {}, false, false, 0, false};
 
 	if (main == NULL) {
 		return 1;
 	}
 
-	if (main->type == DM_TYPE_NIL) {
+	if (dm_value_type(*main) == DM_TYPE_NIL) {
 		parser.chunk = malloc(sizeof(dm_chunk));
 		dm_chunk_init(parser.chunk);
 	} else {
-		parser.chunk = (dm_chunk*) main->func_val->chunk;
+		parser.chunk = (dm_chunk*) dm_value_as_function(*main)->chunk;
 		dm_chunk_reset_code(parser.chunk);
 		lexer.line = parser.chunk->current_line;
 	}
@@ -887,7 +1302,7 @@ int dm_compile(dm_state *dm, dm_value *main, char *prog) {
 	}
 
 	*main = pcompiler_end(&parser, *main, 0, false);
-	dm_chunk_set_line(main->func_val->chunk, lexer.line + 1);
+	dm_chunk_set_line(dm_value_as_function(*main)->chunk, lexer.line + 1);
 	return 0;
 }
 
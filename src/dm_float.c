@@ -4,18 +4,18 @@
 
 static void dm_float_inspect(dm_state *dm, dm_value self) {
 	(void) dm;
-	printf("%g", self.float_val);
+	printf("%g", dm_value_as_float(self));
 }
 
 static bool dm_float_equals(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
 
-	if (other.type != DM_TYPE_INT && other.type != DM_TYPE_FLOAT) {
+	if (dm_value_type(other) != DM_TYPE_INT && dm_value_type(other) != DM_TYPE_FLOAT) {
 		return false;
 	}
 
-	dm_float a = self.float_val;
-	dm_float b = other.type == DM_TYPE_INT ? other.int_val : other.float_val;
+	dm_float a = dm_value_as_float(self);
+	dm_float b = dm_value_type(other) == DM_TYPE_INT ? dm_value_as_int(other) : dm_value_as_float(other);
 	return a == b;
 }
 
@@ -31,61 +31,61 @@ static bool dm_float_fieldget(dm_state *dm, dm_value self, const char *field, dm
 
 dm_value dm_float_negate(dm_state *dm, dm_value self) {
 	(void) dm;
-	return dm_value_float(-self.float_val);
+	return dm_value_float(-dm_value_as_float(self));
 }
 
 static int dm_float_compare(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_INT && other.type != DM_TYPE_FLOAT) {
+	if (dm_value_type(other) != DM_TYPE_INT && dm_value_type(other) != DM_TYPE_FLOAT) {
 		dm_runtime_compare_mismatch(dm, self, other);
 	}
 
-	dm_float a = self.float_val;
-	dm_float b = other.type == DM_TYPE_INT ? other.int_val : other.float_val;
+	dm_float a = dm_value_as_float(self);
+	dm_float b = dm_value_type(other) == DM_TYPE_INT ? dm_value_as_int(other) : dm_value_as_float(other);
 	return a < b ? -1 : a == b ? 0: 1;
 }
 
 static dm_value dm_float_add(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
-	if (other.type == DM_TYPE_FLOAT) {
-		return dm_value_float(self.float_val + other.float_val);
-	} else if (other.type == DM_TYPE_INT) {
-		return dm_value_float(self.float_val + (dm_float) other.int_val);
+	if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		return dm_value_float(dm_value_as_float(self) + dm_value_as_float(other));
+	} else if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_float(dm_value_as_float(self) + (dm_float) dm_value_as_int(other));
 	}
 
 	dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 }
 
 static dm_value dm_float_sub(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_FLOAT) {
-		return dm_value_float(self.float_val - other.float_val);
-	} else if (other.type == DM_TYPE_INT) {
-		return dm_value_float(self.float_val - (dm_float) other.int_val);
+	if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		return dm_value_float(dm_value_as_float(self) - dm_value_as_float(other));
+	} else if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_float(dm_value_as_float(self) - (dm_float) dm_value_as_int(other));
 	}
 
 	dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 }
 
 static dm_value dm_float_mul(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_FLOAT) {
-		return dm_value_float(self.float_val * other.float_val);
-	} else if (other.type == DM_TYPE_INT) {
-		return dm_value_float(self.float_val * (dm_float) other.int_val);
+	if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		return dm_value_float(dm_value_as_float(self) * dm_value_as_float(other));
+	} else if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_float(dm_value_as_float(self) * (dm_float) dm_value_as_int(other));
 	}
 
 	dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 }
 
 static dm_value dm_float_div(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_INT && other.type != DM_TYPE_FLOAT) {
+	if (dm_value_type(other) != DM_TYPE_INT && dm_value_type(other) != DM_TYPE_FLOAT) {
 		dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 	}
 
-	dm_float f = other.type == DM_TYPE_FLOAT ? other.float_val : (dm_float) other.int_val;
+	dm_float f = dm_value_type(other) == DM_TYPE_FLOAT ? dm_value_as_float(other) : (dm_float) dm_value_as_int(other);
 	if (f == 0.0) {
 		dm_runtime_error(dm, "division by 0");
 	}
 
-	return dm_value_float(self.float_val / f);
+	return dm_value_float(dm_value_as_float(self) / f);
 }
 
 dm_module dm_float_init(dm_state *dm) {
@@ -2,29 +2,74 @@
 #include <dm_function.h>
 #include <dm_chunk.h>
 
+static void function_mark(dm_state *dm, struct dm_gc_obj *obj) {
+	dm_function *func = (dm_function*) obj;
+	if (func->proto != NULL) {
+		dm_gc_mark(dm, (dm_gc_obj*) func->proto);
+	}
+	for (int i = 0; i < func->nupvals; i++) {
+		dm_gc_mark(dm, (dm_gc_obj*) func->upvals[i]);
+	}
+}
+
 static void function_free(dm_state *dm, struct dm_gc_obj *obj) {
 	(void) dm;
 	dm_function *func = (dm_function*) obj;
-	dm_chunk_free(func->chunk);
-	free(func->chunk);
+	free(func->upvals);
+	if (func->proto == NULL) {
+		dm_chunk_free(func->chunk);
+		free(func->chunk);
+	}
 }
 
 dm_value dm_value_function(dm_state *dm, void *chunk, int nargs, bool takes_self) {
-	dm_function *func = (dm_function*) dm_gc_malloc(dm, sizeof(dm_function), NULL, function_free);
+	dm_function *func = (dm_function*) dm_gc_malloc(dm, sizeof(dm_function), function_mark, function_free);
 	func->chunk = chunk;
 	func->nargs = nargs;
 	func->takes_self = takes_self;
-	return (dm_value){DM_TYPE_FUNCTION, {.func_val = func}};
+	func->proto = NULL;
+	func->nupvals = 0;
+	func->upvals = NULL;
+	return dm_value_object(DM_TYPE_FUNCTION, func);
+}
+
+// the upvalues are left for the caller to fill in
+dm_value dm_value_closure(dm_state *dm, dm_function *proto, int nupvals) {
+	dm_function *func = (dm_function*) dm_gc_malloc(dm, sizeof(dm_function), function_mark, function_free);
+	func->chunk = proto->chunk;
+	func->nargs = proto->nargs;
+	func->takes_self = proto->takes_self;
+	func->proto = proto;
+	func->nupvals = nupvals;
+	func->upvals = malloc(nupvals * sizeof(dm_upval*));
+	return dm_value_object(DM_TYPE_FUNCTION, func);
+}
+
+static void upval_mark(dm_state *dm, struct dm_gc_obj *obj) {
+	dm_upval *upval = (dm_upval*) obj;
+	if (dm_value_is_gc_obj(*upval->v)) {
+		dm_gc_mark(dm, dm_value_as_gc_obj(*upval->v));
+	}
+}
+
+// an open upvalue for the stack slot at index
+dm_upval *dm_upval_new(dm_state *dm, dm_value *slot, int index) {
+	dm_upval *upval = (dm_upval*) dm_gc_malloc(dm, sizeof(dm_upval), upval_mark, NULL);
+	upval->v = slot;
+	upval->closed = dm_value_nil();
+	upval->slot = index;
+	upval->next = NULL;
+	return upval;
 }
 
 static void dm_function_inspect(dm_state *dm, dm_value self) {
 	(void) dm;
-	printf("<function %p>", self.func_val);
+	printf("<function %p>", dm_value_as_function(self));
 }
 
 static bool dm_function_equals(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
-	return other.type == DM_TYPE_FUNCTION && self.func_val == other.func_val;
+	return dm_value_type(other) == DM_TYPE_FUNCTION && dm_value_as_function(self) == dm_value_as_function(other);
 }
 
 static bool dm_function_fieldset(dm_state *dm, dm_value self, const char *field, dm_value v) {
@@ -2,11 +2,29 @@
 
 #include <dm_value.h>
 
+// A variable captured by a closure. While the frame of the variable runs, v
+// points to its stack slot, after the frame returned to closed.
+typedef struct dm_upval {
+	dm_gc_obj gc_header;
+	dm_value *v;
+	dm_value closed;
+	int slot;
+	struct dm_upval *next;      // open upvalues of the vm, by descending slot
+} dm_upval;
+
+// A closure is a copy of its prototype, the function constant of the chunk
+// that defines it, together with the upvalues it captured. proto is NULL for
+// the prototype, which owns the chunk.
 struct dm_function {
 	dm_gc_obj gc_header;
 	void *chunk;
 	int nargs;
 	bool takes_self;
+	dm_function *proto;
+	int nupvals;
+	dm_upval **upvals;
 };
 
+dm_value dm_value_closure(dm_state *dm, dm_function *proto, int nupvals);
+dm_upval *dm_upval_new(dm_state *dm, dm_value *slot, int index);
 dm_module dm_function_init(dm_state *dm);
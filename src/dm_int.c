@@ -5,14 +5,14 @@
 
 static void dm_int_inspect(dm_state *dm, dm_value self) {
 	(void) dm;
-	printf("%ld", self.int_val);
+	printf("%ld", dm_value_as_int(self));
 }
 
 static bool dm_int_equals(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_FLOAT) {
+	if (dm_value_type(other) == DM_TYPE_FLOAT) {
 		return dm_value_equals(dm, other, self);
-	} else if (other.type == DM_TYPE_INT) {
-		return self.int_val == other.int_val;
+	} else if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_as_int(self) == dm_value_as_int(other);
 	}
 
 	return false;
@@ -30,16 +30,16 @@ static bool dm_int_fieldget(dm_state *dm, dm_value self, const char *field, dm_v
 
 dm_value dm_int_negate(dm_state *dm, dm_value self) {
 	(void) dm;
-	return dm_value_int(-self.int_val);
+	return dm_value_int(-dm_value_as_int(self));
 }
 
 static int dm_int_compare(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_FLOAT) {
-		dm_module *m = dm_state_get_module(dm, other.type);
+	if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		dm_module *m = dm_state_get_module(dm, dm_value_type(other));
 		return -1 * m->compare(dm, other, self);
-	} else if (other.type == DM_TYPE_INT) {
-		dm_int a = self.int_val;
-		dm_int b = other.int_val;
+	} else if (dm_value_type(other) == DM_TYPE_INT) {
+		dm_int a = dm_value_as_int(self);
+		dm_int b = dm_value_as_int(other);
 		return a < b ? -1 : a == b ? 0 : 1;
 	}
 
@@ -47,65 +47,65 @@ static int dm_int_compare(dm_state *dm, dm_value self, dm_value other) {
 }
 
 static dm_value dm_int_add(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_INT) {
-		return dm_value_int(self.int_val + other.int_val);
-	} else if (other.type == DM_TYPE_FLOAT) {
-		return dm_value_float((dm_float) self.int_val + other.float_val);
+	if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_int(dm_value_as_int(self) + dm_value_as_int(other));
+	} else if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		return dm_value_float((dm_float) dm_value_as_int(self) + dm_value_as_float(other));
 	}
 
 	dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 }
 
 static dm_value dm_int_sub(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_INT) {
-		return dm_value_int(self.int_val - other.int_val);
-	} else if (other.type == DM_TYPE_FLOAT) {
-		return dm_value_float((dm_float) self.int_val - other.float_val);
+	if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_int(dm_value_as_int(self) - dm_value_as_int(other));
+	} else if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		return dm_value_float((dm_float) dm_value_as_int(self) - dm_value_as_float(other));
 	}
 
 	dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 }
 
 static dm_value dm_int_mul(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type == DM_TYPE_INT) {
-		return dm_value_int(self.int_val * other.int_val);
-	} else if (other.type == DM_TYPE_FLOAT) {
-		return dm_value_float((dm_float) self.int_val * other.float_val);
+	if (dm_value_type(other) == DM_TYPE_INT) {
+		return dm_value_int(dm_value_as_int(self) * dm_value_as_int(other));
+	} else if (dm_value_type(other) == DM_TYPE_FLOAT) {
+		return dm_value_float((dm_float) dm_value_as_int(self) * dm_value_as_float(other));
 	}
 
 	dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 }
 
 static dm_value dm_int_div(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_INT && other.type != DM_TYPE_FLOAT) {
+	if (dm_value_type(other) != DM_TYPE_INT && dm_value_type(other) != DM_TYPE_FLOAT) {
 		dm_runtime_type_mismatch2(dm, DM_TYPE_INT, DM_TYPE_FLOAT, other);
 	}
 
-	if (other.type == DM_TYPE_INT) {
-		if (other.int_val == 0) {
+	if (dm_value_type(other) == DM_TYPE_INT) {
+		if (dm_value_as_int(other) == 0) {
 			dm_runtime_error(dm, "division by 0");
 		}
 
-		return dm_value_int(self.int_val / other.int_val);
+		return dm_value_int(dm_value_as_int(self) / dm_value_as_int(other));
 	} else {
-		if (other.float_val == 0) {
+		if (dm_value_as_float(other) == 0) {
 			dm_runtime_error(dm, "division by 0");
 		}
 
-		return dm_value_float((dm_float) self.int_val / other.float_val);
+		return dm_value_float((dm_float) dm_value_as_int(self) / dm_value_as_float(other));
 	}
 }
 
 static dm_value dm_int_mod(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_INT) {
+	if (dm_value_type(other) != DM_TYPE_INT) {
 		dm_runtime_type_mismatch(dm, DM_TYPE_INT, other);
 	}
 
-	if (other.int_val == 0) {
+	if (dm_value_as_int(other) == 0) {
 		dm_runtime_error(dm, "division by 0");
 	}
 
-	return dm_value_int(self.int_val % other.int_val);
+	return dm_value_int(dm_value_as_int(self) % dm_value_as_int(other));
 }
 
 dm_module dm_int_init(dm_state *dm) {
@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dm_ir.h>
+
+// an instruction of the code with the superinstructions split
+typedef struct {
+	dm_instr instr;
+	int addr;
+} flat_instr;
+
+// a value on the symbolic stack of a block, out is the result of the node or
+// -1 for a statement
+typedef struct {
+	dm_ir_node *node;
+	int out;
+} slot;
+
+typedef struct {
+	int size;
+	int capacity;
+	slot *data;
+} slots;
+
+static void slots_push(slots *s, dm_ir_node *node, int out) {
+	if (s->size >= s->capacity) {
+		s->capacity = s->capacity == 0 ? 16 : s->capacity * 2;
+		s->data = realloc(s->data, s->capacity * sizeof(slot));
+	}
+	s->data[s->size++] = (slot){node, out};
+}
+
+// the nodes of the slots from..size-1, the results of one node are next to
+// each other and count once
+static int slots_nodes(slots *s, int from, dm_ir_node **nodes) {
+	int n = 0;
+	for (int i = from; i < s->size; i++) {
+		if (i == from || s->data[i].node != s->data[i - 1].node) {
+			if (nodes != NULL) {
+				nodes[n] = s->data[i].node;
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+static void add_node(dm_ir *ir, dm_ir_node *node) {
+	if (ir->nnodes >= ir->nodecapacity) {
+		ir->nodecapacity = ir->nodecapacity == 0 ? 64 : ir->nodecapacity * 2;
+		ir->nodes = realloc(ir->nodes, ir->nodecapacity * sizeof(dm_ir_node*));
+	}
+	ir->nodes[ir->nnodes++] = node;
+}
+
+dm_ir_node *dm_ir_node_new(dm_ir *ir, dm_instr instr, int line, int nkids) {
+	dm_ir_node *node = malloc(sizeof(dm_ir_node));
+	int pops, pushes;
+	dm_instr_stack_effect(instr, &pops, &pushes);
+	*node = (dm_ir_node){
+		.kind = DM_IR_INSTR,
+		.instr = instr,
+		.line = line,
+		.pushes = pushes,
+		.nkids = nkids,
+		.kids = nkids > 0 ? malloc(nkids * sizeof(dm_ir_node*)) : NULL,
+	};
+	add_node(ir, node);
+	return node;
+}
+
+dm_ir_node *dm_ir_node_copy(dm_ir *ir, dm_ir_node *node) {
+	dm_ir_node *copy = dm_ir_node_new(ir, node->instr, node->line, node->nkids);
+	copy->kind = node->kind;
+	copy->pushes = node->pushes;
+	for (int i = 0; i < node->nkids; i++) {
+		copy->kids[i] = dm_ir_node_copy(ir, node->kids[i]);
+	}
+	return copy;
+}
+
+dm_ir_node *dm_ir_entry_new(dm_ir *ir) {
+	dm_ir_node *node = dm_ir_node_new(ir, dm_instr_make(DM_OP_NIL, 0, 0), 0, 0);
+	node->kind = DM_IR_ENTRY;
+	return node;
+}
+
+void dm_ir_add_root(dm_ir_block *block, dm_ir_node *node) {
+	if (block->nroots >= block->rootcapacity) {
+		block->rootcapacity = block->rootcapacity == 0 ? 8 : block->rootcapacity * 2;
+		block->roots = realloc(block->roots, block->rootcapacity * sizeof(dm_ir_node*));
+	}
+	block->roots[block->nroots++] = node;
+}
+
+void dm_ir_free(dm_ir *ir) {
+	if (ir == NULL) {
+		return;
+	}
+	for (int i = 0; i < ir->nnodes; i++) {
+		free(ir->nodes[i]->kids);
+		free(ir->nodes[i]);
+	}
+	for (int i = 0; i < ir->nblocks; i++) {
+		free(ir->blocks[i].roots);
+	}
+	free(ir->nodes);
+	free(ir->blocks);
+	free(ir);
+}
+
+// Follows the paths through the code like the verifier, sets the stack depth
+// on entry of every reachable block. Returns 1 for code the verifier rejects.
+static int block_depths(flat_instr *code, int size, int *start, int nblocks, int *depth) {
+	int *work = malloc(nblocks * sizeof(int));
+	int nwork = 0;
+	int err = 0;
+	for (int i = 0; i < nblocks; i++) {
+		depth[i] = -1;
+	}
+	depth[0] = 0;
+	work[nwork++] = 0;
+	while (nwork > 0 && !err) {
+		int b = work[--nwork];
+		int d = depth[b];
+		int end = b + 1 < nblocks ? start[b + 1] : size;
+		int succ[2];
+		int succdepth[2];
+		int nsucc = 0;
+		for (int i = start[b]; i < end && !err; i++) {
+			dm_opcode op = dm_opcode_generic(dm_instr_op(code[i].instr));
+			int pops, pushes;
+			dm_instr_stack_effect(code[i].instr, &pops, &pushes);
+			if (d < pops) {
+				err = 1;
+				break;
+			}
+			if (dm_opcode_is_jump(op)) {
+				succ[nsucc] = dm_instr_b(code[i].instr);
+				succdepth[nsucc++] = op == DM_OP_JUMP_IF_TRUE_OR_POP || op == DM_OP_JUMP_IF_FALSE_OR_POP ? d : d - pops + pushes;
+			}
+			d = d - pops + pushes;
+			if (i == end - 1 && op != DM_OP_JUMP && op != DM_OP_RETURN) {
+				if (b + 1 >= nblocks) {
+					err = 1;
+					break;
+				}
+				succ[nsucc] = b + 1;
+				succdepth[nsucc++] = d;
+			}
+		}
+		for (int i = 0; i < nsucc && !err; i++) {
+			if (depth[succ[i]] == -1) {
+				depth[succ[i]] = succdepth[i];
+				work[nwork++] = succ[i];
+			} else if (depth[succ[i]] != succdepth[i]) {
+				err = 1;
+			}
+		}
+	}
+	free(work);
+	return err;
+}
+
+// Builds the trees of one block from its instructions, the operands of an
+// instruction are the values on top of the symbolic stack.
+static int build_block(dm_ir *ir, dm_ir_block *block, flat_instr *code, int from, int to, int *newblock) {
+	slots stack = {0, 0, NULL};
+	for (int i = 0; i < block->nentry; i++) {
+		slots_push(&stack, dm_ir_entry_new(ir), 0);
+	}
+
+	int err = 0;
+	for (int i = from; i < to; i++) {
+		dm_instr instr = code[i].instr;
+		dm_opcode op = dm_opcode_generic(dm_instr_op(instr));
+		int a = dm_instr_a(instr);
+		int b = dm_instr_b(instr);
+		if (dm_opcode_is_jump(op)) {
+			b = newblock[b];
+		}
+
+		int pops, pushes;
+		dm_instr_stack_effect(instr, &pops, &pushes);
+		int first = stack.size;
+		for (int values = 0; values < pops; first--) {
+			if (stack.data[first - 1].out >= 0) {
+				values++;
+			}
+		}
+		// the results of a node are taken all together or not at all
+		if (pops > 0 && stack.data[first].out > 0) {
+			err = 1;
+			break;
+		}
+
+		int nkids = slots_nodes(&stack, first, NULL);
+		dm_ir_node *node = dm_ir_node_new(ir, dm_instr_make(op, a, b), ir->chunk->lines[code[i].addr], nkids);
+		slots_nodes(&stack, first, node->kids);
+		stack.size = first;
+		if (pushes == 0) {
+			slots_push(&stack, node, -1);
+		}
+		for (int out = 0; out < pushes; out++) {
+			slots_push(&stack, node, out);
+		}
+	}
+
+	if (!err) {
+		int nroots = slots_nodes(&stack, 0, NULL);
+		dm_ir_node **roots = malloc((nroots + 1) * sizeof(dm_ir_node*));
+		slots_nodes(&stack, 0, roots);
+		for (int i = 0; i < nroots; i++) {
+			dm_ir_add_root(block, roots[i]);
+		}
+		free(roots);
+	}
+	free(stack.data);
+	return err;
+}
+
+dm_ir *dm_ir_build(dm_state *dm, dm_chunk *chunk) {
+	int n = chunk->codesize;
+	if (n == 0) {
+		return NULL;
+	}
+
+	// index[addr] is the first instruction of addr, jumps land there
+	flat_instr *code = malloc(2 * n * sizeof(flat_instr));
+	int *index = malloc((n + 1) * sizeof(int));
+	int size = 0;
+	int err = 0;
+	for (int addr = 0; addr < n; addr++) {
+		dm_instr instr = chunk->code[addr];
+		dm_instr first;
+		index[addr] = size;
+		if (dm_instr_op(instr) >= DM_OP_NUM_OPS) {
+			err = 1;
+		}
+		if (dm_superinstr_split(instr, &first, &instr)) {
+			code[size++] = (flat_instr){first, addr};
+		}
+		code[size++] = (flat_instr){instr, addr};
+		if (dm_opcode_is_jump(dm_opcode_generic(dm_instr_op(instr))) && dm_instr_b(instr) >= n) {
+			err = 1;
+		}
+	}
+	index[n] = size;
+
+	// the blocks start at the jump targets and after jumps and returns
+	bool *leader = calloc(size + 1, sizeof(bool));
+	leader[0] = true;
+	for (int i = 0; i < size && !err; i++) {
+		dm_opcode op = dm_opcode_generic(dm_instr_op(code[i].instr));
+		if (dm_opcode_is_jump(op)) {
+			int target = index[dm_instr_b(code[i].instr)];
+			code[i].instr = dm_instr_make(op, dm_instr_a(code[i].instr), target);
+			leader[target] = true;
+		}
+		if (dm_opcode_is_jump(op) || op == DM_OP_RETURN) {
+			leader[i + 1] = true;
+		}
+	}
+
+	int nblocks = 0;
+	int *start = malloc((size + 1) * sizeof(int));
+	int *block_of = malloc((size + 1) * sizeof(int));
+	for (int i = 0; i < size; i++) {
+		if (leader[i]) {
+			start[nblocks++] = i;
+		}
+		block_of[i] = nblocks - 1;
+	}
+	// jumps now hold the block they land on
+	for (int i = 0; i < size && !err; i++) {
+		dm_instr in = code[i].instr;
+		if (dm_opcode_is_jump(dm_opcode_generic(dm_instr_op(in)))) {
+			code[i].instr = dm_instr_make(dm_instr_op(in), dm_instr_a(in), block_of[dm_instr_b(in)]);
+		}
+	}
+
+	int *depth = malloc((nblocks + 1) * sizeof(int));
+	int *newblock = malloc((nblocks + 1) * sizeof(int));
+	if (!err) {
+		err = block_depths(code, size, start, nblocks, depth);
+	}
+
+	dm_ir *ir = NULL;
+	if (!err) {
+		// the blocks no path reaches are left out
+		ir = malloc(sizeof(dm_ir));
+		*ir = (dm_ir){dm, chunk, 0, malloc(nblocks * sizeof(dm_ir_block)), 0, 0, NULL};
+		for (int b = 0; b < nblocks; b++) {
+			newblock[b] = depth[b] == -1 ? -1 : ir->nblocks++;
+		}
+		for (int b = 0; b < nblocks && !err; b++) {
+			if (depth[b] == -1) {
+				continue;
+			}
+			dm_ir_block *block = &ir->blocks[newblock[b]];
+			*block = (dm_ir_block){depth[b], 0, 0, NULL};
+			int end = b + 1 < nblocks ? start[b + 1] : size;
+			err = build_block(ir, block, code, start[b], end, newblock);
+		}
+		if (err) {
+			dm_ir_free(ir);
+			ir = NULL;
+		}
+	}
+
+	free(newblock);
+	free(depth);
+	free(block_of);
+	free(start);
+	free(leader);
+	free(index);
+	free(code);
+	return ir;
+}
+
+typedef struct {
+	int size;
+	int capacity;
+	dm_instr *code;
+	int *lines;
+} emitter;
+
+static void emit(emitter *e, dm_ir_node *node) {
+	if (node->kind == DM_IR_NOP) {
+		return;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		emit(e, node->kids[i]);
+	}
+	if (node->kind == DM_IR_ENTRY) {
+		return;
+	}
+
+	if (e->size >= e->capacity) {
+		e->capacity = e->capacity == 0 ? 128 : e->capacity * 2;
+		e->code = realloc(e->code, e->capacity * sizeof(dm_instr));
+		e->lines = realloc(e->lines, e->capacity * sizeof(int));
+	}
+	e->code[e->size] = node->instr;
+	e->lines[e->size++] = node->line;
+}
+
+int dm_ir_lower(dm_ir *ir) {
+	emitter e = {0, 0, NULL, NULL};
+	int *addr = malloc((ir->nblocks + 1) * sizeof(int));
+	for (int b = 0; b < ir->nblocks; b++) {
+		addr[b] = e.size;
+		for (int i = 0; i < ir->blocks[b].nroots; i++) {
+			emit(&e, ir->blocks[b].roots[i]);
+		}
+	}
+
+	int err = e.size == 0 || e.size >= 1 << 16;
+	for (int i = 0; i < e.size && !err; i++) {
+		dm_instr in = e.code[i];
+		if (dm_opcode_is_jump(dm_instr_op(in))) {
+			e.code[i] = dm_instr_make(dm_instr_op(in), dm_instr_a(in), addr[dm_instr_b(in)]);
+		}
+	}
+
+	if (!err) {
+		dm_chunk *chunk = ir->chunk;
+		if (e.size > chunk->codecapacity) {
+			chunk->codecapacity = e.size;
+			chunk->code = realloc(chunk->code, chunk->codecapacity * sizeof(dm_instr));
+			chunk->lines = realloc(chunk->lines, chunk->codecapacity * sizeof(int));
+		}
+		memcpy(chunk->code, e.code, e.size * sizeof(dm_instr));
+		memcpy(chunk->lines, e.lines, e.size * sizeof(int));
+		chunk->codesize = e.size;
+	}
+	free(addr);
+	free(e.code);
+	free(e.lines);
+	return err;
+}
+
+int dm_ir_successors(dm_ir *ir, int b, int succ[2]) {
+	dm_ir_node *last = dm_ir_terminator(&ir->blocks[b]);
+	dm_opcode op = last != NULL ? dm_instr_op(last->instr) : DM_OP_NUM_OPS;
+	int n = 0;
+	if (dm_opcode_is_jump(op)) {
+		succ[n++] = dm_instr_b(last->instr);
+	}
+	if (op != DM_OP_JUMP && op != DM_OP_RETURN && b + 1 < ir->nblocks) {
+		succ[n++] = b + 1;
+	}
+	return n;
+}
+
+dm_ir_node *dm_ir_terminator(dm_ir_block *block) {
+	dm_ir_node *last = block->nroots > 0 ? block->roots[block->nroots - 1] : NULL;
+	if (last != NULL && last->kind == DM_IR_INSTR) {
+		dm_opcode op = dm_instr_op(last->instr);
+		if (dm_opcode_is_jump(op) || op == DM_OP_RETURN) {
+			return last;
+		}
+	}
+	return NULL;
+}
+
+// The blocks from at on move up, so do the jumps to them.
+void dm_ir_insert_block(dm_ir *ir, int at) {
+	ir->blocks = realloc(ir->blocks, (ir->nblocks + 1) * sizeof(dm_ir_block));
+	memmove(&ir->blocks[at + 1], &ir->blocks[at], (ir->nblocks - at) * sizeof(dm_ir_block));
+	ir->blocks[at] = (dm_ir_block){0, 0, 0, NULL};
+	ir->nblocks++;
+	for (int b = 0; b < ir->nblocks; b++) {
+		dm_ir_node *jump = dm_ir_terminator(&ir->blocks[b]);
+		if (jump != NULL && dm_opcode_is_jump(dm_instr_op(jump->instr)) && dm_instr_b(jump->instr) >= at) {
+			jump->instr = dm_instr_make(dm_instr_op(jump->instr), dm_instr_a(jump->instr), dm_instr_b(jump->instr) + 1);
+		}
+	}
+}
+
+static void add_order(dm_ir_node *node, dm_ir_node ***order, int *size, int *capacity) {
+	for (int i = 0; i < node->nkids; i++) {
+		add_order(node->kids[i], order, size, capacity);
+	}
+	if (*size >= *capacity) {
+		*capacity = *capacity == 0 ? 64 : *capacity * 2;
+		*order = realloc(*order, *capacity * sizeof(dm_ir_node*));
+	}
+	(*order)[(*size)++] = node;
+}
+
+int dm_ir_block_order(dm_ir_block *block, dm_ir_node ***order, int *capacity) {
+	int size = 0;
+	for (int i = 0; i < block->nroots; i++) {
+		add_order(block->roots[i], order, &size, capacity);
+	}
+	return size;
+}
+
+// returns -1 if the chunk has no variable index left
+int dm_ir_add_temp(dm_ir *ir) {
+	if (ir->chunk->varsize >= UINT16_MAX) {
+		return -1;
+	}
+	char name[16];
+	// '$' can't start an identifier, the name never clashes
+	snprintf(name, sizeof(name), "$%d", ir->chunk->varsize);
+	return dm_chunk_add_var(ir->chunk, name, strlen(name));
+}
+
+static void print_node(dm_ir_node *node) {
+	switch (node->kind) {
+		case DM_IR_ENTRY: printf("entry"); return;
+		case DM_IR_NOP:   printf("nop"); return;
+		case DM_IR_INSTR: break;
+	}
+
+	dm_opcode op = dm_instr_op(node->instr);
+	printf("(%s", dm_opcode_name(op));
+	if (dm_opcode_is_jump(op)) {
+		printf(" %d ->%d", dm_instr_a(node->instr), dm_instr_b(node->instr));
+	} else if (dm_opcode_operands(op) != DM_OPERANDS_NONE) {
+		printf(" %d %d", dm_instr_a(node->instr), dm_instr_b(node->instr));
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		printf(" ");
+		print_node(node->kids[i]);
+	}
+	printf(")");
+}
+
+void dm_ir_print(dm_ir *ir) {
+	for (int b = 0; b < ir->nblocks; b++) {
+		printf("%d: entry %d\n", b, ir->blocks[b].nentry);
+		for (int i = 0; i < ir->blocks[b].nroots; i++) {
+			if (ir->blocks[b].roots[i]->kind == DM_IR_NOP) {
+				continue;
+			}
+			printf("    ");
+			print_node(ir->blocks[b].roots[i]);
+			printf("\n");
+		}
+	}
+}
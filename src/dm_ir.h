@@ -0,0 +1,69 @@
+#pragma once
+
+#include <dm_state.h>
+#include <dm_chunk.h>
+
+// The IR of a chunk is its stack code taken apart into basic blocks of
+// expression trees. A node is one instruction, its kids are the instructions
+// that pushed its operands, in push order, together with the instructions
+// without a result that ran in between. The roots of a block are the values
+// it leaves on the stack and its statements, in the order they ran. Values
+// that are on the stack when a block is entered are DM_IR_ENTRY leaves.
+//
+// Lowering emits every node after its kids, so the IR as it was built gives
+// back the code it was built from. Passes that rewrite it keep the stack
+// effect of what they replace and leave entry values where they are.
+typedef enum {
+	DM_IR_INSTR,
+	DM_IR_ENTRY,                // a value on the stack on entry, emits nothing
+	DM_IR_NOP                   // a removed statement, emits nothing
+} dm_ir_kind;
+
+typedef struct dm_ir_node {
+	dm_ir_kind kind;
+	dm_instr instr;             // generic opcode, jumps hold the index of the target block
+	int line;
+	int pushes;                 // values left on the stack
+	int nkids;
+	struct dm_ir_node **kids;
+} dm_ir_node;
+
+// A block without a jump or return at its end falls through to the next one.
+typedef struct {
+	int nentry;                 // values on the stack on entry
+	int nroots;
+	int rootcapacity;
+	dm_ir_node **roots;
+} dm_ir_block;
+
+typedef struct {
+	dm_state *dm;
+	dm_chunk *chunk;
+	int nblocks;
+	dm_ir_block *blocks;
+	int nnodes;
+	int nodecapacity;
+	dm_ir_node **nodes;         // every node, for dm_ir_free
+} dm_ir;
+
+// Returns NULL if the code can't be taken apart, the verifier reports it.
+dm_ir *dm_ir_build(dm_state *dm, dm_chunk *chunk);
+// Replaces the code of the chunk, returns 1 if the code would be too large.
+int  dm_ir_lower(dm_ir *ir);
+void dm_ir_free(dm_ir *ir);
+
+dm_ir_node *dm_ir_node_new(dm_ir *ir, dm_instr instr, int line, int nkids);
+dm_ir_node *dm_ir_node_copy(dm_ir *ir, dm_ir_node *node);
+dm_ir_node *dm_ir_entry_new(dm_ir *ir);
+void dm_ir_add_root(dm_ir_block *block, dm_ir_node *node);
+// the jump or return that ends block, NULL if it falls through
+dm_ir_node *dm_ir_terminator(dm_ir_block *block);
+// inserts an empty block before block at
+void dm_ir_insert_block(dm_ir *ir, int at);
+// the blocks that can follow block b, returns how many
+int  dm_ir_successors(dm_ir *ir, int b, int succ[2]);
+// the nodes of block b in the order they run, returns how many
+int  dm_ir_block_order(dm_ir_block *block, dm_ir_node ***order, int *capacity);
+// a new variable of the chunk for values a pass keeps
+int  dm_ir_add_temp(dm_ir *ir);
+void dm_ir_print(dm_ir *ir);
@@ -0,0 +1,1716 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dm_jit.h>
+#include <dm_state.h>
+#include <dm_ops.h>
+#include <dm.h>
+
+// calls and loop iterations of a chunk before it is compiled
+#define DM_JIT_HOT 1000
+
+#if defined(__x86_64__) && !defined(DM_NAN_BOXING)
+
+#include <sys/mman.h>
+
+typedef struct dm_jitcode {
+	void *mem;
+	size_t size;
+	void (*entry)(dm_jit_frame*);
+} dm_jitcode;
+
+static dm_trace *trace_at(dm_chunk *chunk, int addr) {
+	return chunk->traces != NULL && addr < chunk->tracesize ? chunk->traces[addr] : NULL;
+}
+
+// Everything the code doesn't do inline: the instructions without a template
+// and the cases the templates leave out, like values that aren't numbers and
+// the errors. They run like in the stack vm, through dm_ops.h, with the stack
+// of the frame. The jumps return whether they are taken. The trace recorder
+// runs every instruction it records through here.
+
+static inline dm_value pop(dm_jit_frame *f) {
+	return *--f->top;
+}
+
+static inline void push(dm_jit_frame *f, dm_value v) {
+	*f->top++ = v;
+}
+
+static inline dm_value peek(dm_jit_frame *f) {
+	return f->top[-1];
+}
+
+static inline dm_chunk *frame_chunk(dm_jit_frame *f) {
+	return dm_value_as_function(f->func)->chunk;
+}
+
+static inline dm_value for_limit(dm_forloop *loop, dm_value *vars) {
+	return loop->limit_is_var ? vars[loop->limit] : dm_value_int(loop->limit);
+}
+
+static bool run_instr(dm_jit_frame *f, dm_instr in) {
+	dm_state *dm = f->dm;
+	*f->frame_ip = f->ip;
+	dm_opcode op = dm_opcode_generic(dm_instr_op(in));
+	switch (op) {
+		case DM_OP_VARGET:
+			push(f, f->vars[dm_instr_b(in)]);
+			break;
+		case DM_OP_VARSET:
+			f->vars[dm_instr_b(in)] = peek(f);
+			break;
+		case DM_OP_POP:
+			pop(f);
+			break;
+		case DM_OP_CONSTANT:
+			push(f, frame_chunk(f)->consts[dm_instr_b(in)]);
+			break;
+		case DM_OP_CONSTANT_SMALLINT:
+			push(f, dm_value_int(dm_instr_b(in)));
+			break;
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+			push(f, dm_value_bool(op == DM_OP_TRUE));
+			break;
+		case DM_OP_NIL:
+			push(f, dm_value_nil());
+			break;
+		case DM_OP_JUMP:
+			return true;
+		case DM_OP_JUMP_IF_FALSE:
+			return dm_op_falsey(pop(f));
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+		case DM_OP_JUMP_IF_TRUE_OR_POP:
+			if (dm_op_falsey(peek(f)) == (op == DM_OP_JUMP_IF_FALSE_OR_POP)) {
+				return true;
+			}
+			pop(f);
+			break;
+		case DM_OP_VARGETOPSET: {
+			dm_value *var = &f->vars[dm_instr_b(in)];
+			*var = dm_op_opassign(dm, dm_instr_a(in), *var, pop(f));
+			push(f, *var);
+			break;
+		}
+		case DM_OP_VARGETOPSET_UP: {
+			dm_value *var = f->upvals[dm_instr_b(in)]->v;
+			*var = dm_op_opassign(dm, dm_instr_a(in), *var, pop(f));
+			push(f, *var);
+			break;
+		}
+		case DM_OP_FIELDSET: {
+			dm_value v = pop(f);
+			dm_value field = pop(f);
+			dm_op_fieldset(dm, pop(f), field, v);
+			push(f, v);
+			break;
+		}
+		case DM_OP_FIELDGETOPSET: {
+			dm_value v = pop(f);
+			dm_value field = pop(f);
+			push(f, dm_op_fieldgetopset(dm, dm_instr_a(in), pop(f), field, v));
+			break;
+		}
+		case DM_OP_FIELDSET_S: {
+			dm_value v = pop(f);
+			dm_value field = pop(f);
+			dm_op_fieldset_s(dm, pop(f), field, v);
+			push(f, v);
+			break;
+		}
+		case DM_OP_FIELDGETOPSET_S: {
+			dm_value v = pop(f);
+			dm_value field = pop(f);
+			push(f, dm_op_fieldgetopset_s(dm, dm_instr_a(in), pop(f), field, v));
+			break;
+		}
+		case DM_OP_FIELDGET: {
+			dm_value field = pop(f);
+			push(f, dm_op_fieldget(dm, pop(f), field));
+			break;
+		}
+		case DM_OP_FIELDGET_S: {
+			dm_value field = pop(f);
+			push(f, dm_op_fieldget_s(dm, pop(f), field));
+			break;
+		}
+		case DM_OP_FIELDGET_PUSHPARENT: {
+			dm_value field = pop(f);
+			push(f, dm_op_fieldget(dm, peek(f), field));
+			break;
+		}
+		case DM_OP_FIELDGET_S_PUSHPARENT: {
+			dm_value field = pop(f);
+			push(f, dm_op_fieldget_s(dm, peek(f), field));
+			break;
+		}
+		case DM_OP_ARRAYLIT: {
+			int elements = dm_instr_b(in);
+			f->top -= elements;
+			push(f, dm_op_arraylit(dm, elements, f->top));
+			break;
+		}
+		case DM_OP_TABLELIT: {
+			int elements = dm_instr_b(in);
+			f->top -= 2 * elements;
+			push(f, dm_op_tablelit(dm, elements, f->top));
+			break;
+		}
+		case DM_OP_SELF: {
+			dm_function *func = dm_value_as_function(f->func);
+			push(f, func->takes_self && func->nargs > 0 ? f->vars[0] : dm_value_nil());
+			break;
+		}
+		case DM_OP_CHECKTYPE: {
+			if (dm_value_type(peek(f)) != (dm_type) dm_instr_a(in)) {
+				dm_runtime_type_mismatch(dm, dm_instr_a(in), peek(f));
+			}
+			break;
+		}
+		case DM_OP_NEGATE:
+			push(f, dm_op_negate(dm, pop(f)));
+			break;
+		case DM_OP_NOT:
+			push(f, dm_op_not(dm, pop(f)));
+			break;
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:
+		case DM_OP_DIV:
+		case DM_OP_MOD: {
+			dm_value val2 = pop(f);
+			dm_value val1 = pop(f);
+			push(f, dm_op_arith(dm, op, val1, val2));
+			break;
+		}
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL: {
+			dm_value val2 = pop(f);
+			dm_value val1 = pop(f);
+			bool eq = dm_op_equals(dm, val1, val2);
+			push(f, dm_value_bool(op == DM_OP_EQUAL ? eq : !eq));
+			break;
+		}
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL: {
+			dm_value val2 = pop(f);
+			dm_value val1 = pop(f);
+			int cmp = dm_op_compare(dm, val1, val2);
+			bool res = op == DM_OP_LESS ? cmp < 0 : op == DM_OP_LESSEQUAL ? cmp <= 0 : op == DM_OP_GREATER ? cmp > 0 : cmp >= 0;
+			push(f, dm_value_bool(res));
+			break;
+		}
+		case DM_OP_FORPREP: {
+			dm_forloop *loop = &frame_chunk(f)->loops[dm_instr_a(in)];
+			return !dm_op_for_compare(dm, loop->compare, f->vars[loop->var], for_limit(loop, f->vars));
+		}
+		case DM_OP_FORLOOP: {
+			// ints are stepped inline
+			dm_forloop *loop = &frame_chunk(f)->loops[dm_instr_a(in)];
+			return dm_op_for_step(dm, loop->compare, loop->step, &f->vars[loop->var], for_limit(loop, f->vars));
+		}
+		default:
+			break;
+	}
+	return false;
+}
+
+// The code keeps the frame in rbx, the variables in r12 and the top of the
+// stack in r13, all callee saved, so the helpers can be called directly.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1, XMM2 };
+
+// condition codes of jcc and setcc
+enum { CC_B = 0x2, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_P = 0xa, CC_NP, CC_L, CC_GE, CC_LE, CC_G };
+
+#define SLOT     ((int) sizeof(dm_value))
+#define TYPE     ((int) offsetof(dm_value, type))
+#define PAYLOAD  ((int) offsetof(dm_value, int_val))
+// the value n slots below the top of the stack, 0 is the topmost
+#define TOP(n)   (-((n) + 1) * SLOT)
+#define VAR(i)   ((i) * SLOT)
+#define FRAME(field) ((int) offsetof(dm_jit_frame, field))
+
+typedef struct {
+	int at;                     // of the rel32
+	int addr;                   // the instruction it jumps to
+} fixup;
+
+typedef struct {
+	uint8_t *code;
+	int size;
+	int capacity;
+	int *addrs;                 // where the code of every instruction starts
+	int nfixups;
+	int fixupcapacity;
+	fixup *fixups;
+	int epilogue;
+	int dispatch;               // jumps to the code of f->ip
+	int table;                  // where the lea of the address table is
+} jit;
+
+static void emit8(jit *j, int b) {
+	if (j->size >= j->capacity) {
+		j->capacity = j->capacity == 0 ? 4096 : j->capacity * 2;
+		j->code = realloc(j->code, j->capacity);
+	}
+	j->code[j->size++] = (uint8_t) b;
+}
+
+static void emit32(jit *j, int32_t v) {
+	for (int i = 0; i < 4; i++) {
+		emit8(j, (uint32_t) v >> (i * 8));
+	}
+}
+
+static void emit64(jit *j, uint64_t v) {
+	for (int i = 0; i < 8; i++) {
+		emit8(j, v >> (i * 8));
+	}
+}
+
+static void patch32(jit *j, int at, int32_t v) {
+	memcpy(&j->code[at], &v, 4);
+}
+
+static void emit_rex(jit *j, bool w, int reg, int base) {
+	int rex = 0x40 | (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0);
+	if (rex != 0x40) {
+		emit8(j, rex);
+	}
+}
+
+// [base + disp], always with a displacement so rbp and r13 need no special case
+static void emit_modrm_mem(jit *j, int reg, int base, int disp) {
+	bool disp8 = disp >= -128 && disp < 128;
+	emit8(j, (disp8 ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+	if ((base & 7) == RSP) {
+		emit8(j, 0x24);
+	}
+	if (disp8) {
+		emit8(j, disp);
+	} else {
+		emit32(j, disp);
+	}
+}
+
+// [prefix] [rex] op (or 0f op) modrm for reg, [base + disp]
+static void emit_mem(jit *j, int prefix, bool w, bool twobyte, int op, int reg, int base, int disp) {
+	if (prefix != 0) {
+		emit8(j, prefix);
+	}
+	emit_rex(j, w, reg, base);
+	if (twobyte) {
+		emit8(j, 0x0f);
+	}
+	emit8(j, op);
+	emit_modrm_mem(j, reg, base, disp);
+}
+
+static void emit_reg(jit *j, int prefix, bool w, bool twobyte, int op, int reg, int rm) {
+	if (prefix != 0) {
+		emit8(j, prefix);
+	}
+	emit_rex(j, w, reg, rm);
+	if (twobyte) {
+		emit8(j, 0x0f);
+	}
+	emit8(j, op);
+	emit8(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+#define load(j, reg, base, disp)      emit_mem(j, 0, true, false, 0x8b, reg, base, disp)
+#define store(j, reg, base, disp)     emit_mem(j, 0, true, false, 0x89, reg, base, disp)
+#define load32(j, reg, base, disp)    emit_mem(j, 0, false, false, 0x8b, reg, base, disp)
+#define movups_load(j, x, base, disp) emit_mem(j, 0, false, true, 0x10, x, base, disp)
+#define movups_store(j, x, base, disp) emit_mem(j, 0, false, true, 0x11, x, base, disp)
+#define movsd_load(j, x, base, disp)  emit_mem(j, 0xf2, false, true, 0x10, x, base, disp)
+#define movsd_store(j, x, base, disp) emit_mem(j, 0xf2, false, true, 0x11, x, base, disp)
+#define cvtsi2sd(j, x, base, disp)    emit_mem(j, 0xf2, true, true, 0x2a, x, base, disp)
+
+static void set_type(jit *j, int base, int disp, dm_type type) {
+	emit_mem(j, 0, false, false, 0xc7, 0, base, disp + TYPE);
+	emit32(j, type);
+}
+
+// types fit into an imm8
+static void cmp_type(jit *j, int base, int disp, dm_type type) {
+	emit_mem(j, 0, false, false, 0x83, 7, base, disp + TYPE);
+	emit8(j, type);
+}
+
+static void add_top(jit *j, int slots) {
+	emit_reg(j, 0, true, false, 0x83, 0, R13);
+	emit8(j, slots * SLOT);
+}
+
+// a jump within the template, patched with patch_here
+static int jcc_forward(jit *j, int cc) {
+	emit8(j, 0x0f);
+	emit8(j, 0x80 | cc);
+	emit32(j, 0);
+	return j->size - 4;
+}
+
+static int jmp_forward(jit *j) {
+	emit8(j, 0xe9);
+	emit32(j, 0);
+	return j->size - 4;
+}
+
+static void patch_here(jit *j, int at) {
+	if (at >= 0) {
+		patch32(j, at, j->size - (at + 4));
+	}
+}
+
+static void jump_to(jit *j, int cc, int addr) {
+	if (cc < 0) {
+		emit8(j, 0xe9);
+	} else {
+		emit8(j, 0x0f);
+		emit8(j, 0x80 | cc);
+	}
+	emit32(j, 0);
+	if (j->nfixups >= j->fixupcapacity) {
+		j->fixupcapacity = j->fixupcapacity == 0 ? 64 : j->fixupcapacity * 2;
+		j->fixups = realloc(j->fixups, j->fixupcapacity * sizeof(fixup));
+	}
+	j->fixups[j->nfixups++] = (fixup){j->size - 4, addr};
+}
+
+// eax = cc ? 1 : 0 as the bool below the top, which is popped
+static void set_bool(jit *j, int cc) {
+	emit8(j, 0x0f);
+	emit8(j, 0x90 | cc);
+	emit8(j, 0xc0);
+	emit_reg(j, 0, false, true, 0xb6, RAX, RAX);
+	store(j, RAX, R13, TOP(1) + PAYLOAD);
+	set_type(j, R13, TOP(1), DM_TYPE_BOOL);
+	add_top(j, -1);
+}
+
+// Runs the instruction in C, see run_instr. The helper sees the ip after it
+// and the top, the result is in al.
+static void call_helper(jit *j, int addr, dm_instr in) {
+	store(j, R13, RBX, FRAME(top));
+	emit_mem(j, 0, false, false, 0xc7, 0, RBX, FRAME(ip));
+	emit32(j, addr + 1);
+	emit_reg(j, 0, true, false, 0x89, RBX, RDI);
+	emit8(j, 0xbe);
+	emit32(j, in);
+	emit8(j, 0x48);
+	emit8(j, 0xb8);
+	emit64(j, (uint64_t) (uintptr_t) run_instr);
+	emit8(j, 0xff);
+	emit8(j, 0xd0);
+	load(j, R13, RBX, FRAME(top));
+}
+
+// the instruction at addr is run by the vm
+static void exit_to_vm(jit *j, int addr) {
+	emit_mem(j, 0, false, false, 0xc7, 0, RBX, FRAME(ip));
+	emit32(j, addr);
+	emit8(j, 0xe9);
+	emit32(j, j->epilogue - (j->size + 4));
+}
+
+// jumps to label if the value at [r13 + disp] is nil or false
+static void jump_if_falsey(jit *j, int disp, int addr) {
+	load32(j, RAX, R13, disp + TYPE);
+	emit_reg(j, 0, false, false, 0x85, RAX, RAX);
+	jump_to(j, CC_E, addr);
+	emit_reg(j, 0, false, false, 0x83, 7, RAX);
+	emit8(j, DM_TYPE_BOOL);
+	int other = jcc_forward(j, CC_NE);
+	emit_mem(j, 0, false, false, 0x80, 7, R13, disp + PAYLOAD);
+	emit8(j, 0);
+	jump_to(j, CC_E, addr);
+	patch_here(j, other);
+}
+
+// xmm = the number at [r13 + disp], jumps to *slow unless it is one
+static void load_number(jit *j, int x, int disp, int *slow) {
+	cmp_type(j, R13, disp, DM_TYPE_INT);
+	int notint = jcc_forward(j, CC_NE);
+	cvtsi2sd(j, x, R13, disp + PAYLOAD);
+	int done = jmp_forward(j);
+	patch_here(j, notint);
+	if (slow != NULL) {
+		cmp_type(j, R13, disp, DM_TYPE_FLOAT);
+		*slow = jcc_forward(j, CC_NE);
+	}
+	movsd_load(j, x, R13, disp + PAYLOAD);
+	patch_here(j, done);
+}
+
+static void check_ints(jit *j, int *slow1, int *slow2) {
+	cmp_type(j, R13, TOP(1), DM_TYPE_INT);
+	*slow1 = jcc_forward(j, CC_NE);
+	cmp_type(j, R13, TOP(0), DM_TYPE_INT);
+	*slow2 = jcc_forward(j, CC_NE);
+}
+
+// what the unchecked opcodes know about their operands
+typedef enum {
+	CHECKED,
+	INTS,
+	NUMBERS
+} proven;
+
+static proven proven_types(dm_opcode op) {
+	switch (op) {
+		case DM_OP_PLUS_INT_UNCHECKED:
+		case DM_OP_MINUS_INT_UNCHECKED:
+		case DM_OP_MUL_INT_UNCHECKED:
+		case DM_OP_DIV_INT_UNCHECKED:
+		case DM_OP_LESS_INT_UNCHECKED:
+		case DM_OP_LESSEQUAL_INT_UNCHECKED:
+		case DM_OP_GREATER_INT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_INT_UNCHECKED:   return INTS;
+		case DM_OP_PLUS_FLOAT_UNCHECKED:
+		case DM_OP_MINUS_FLOAT_UNCHECKED:
+		case DM_OP_MUL_FLOAT_UNCHECKED:
+		case DM_OP_DIV_FLOAT_UNCHECKED:
+		case DM_OP_LESS_FLOAT_UNCHECKED:
+		case DM_OP_LESSEQUAL_FLOAT_UNCHECKED:
+		case DM_OP_GREATER_FLOAT_UNCHECKED:
+		case DM_OP_GREATEREQUAL_FLOAT_UNCHECKED: return NUMBERS;
+		default:                                 return CHECKED;
+	}
+}
+
+// PLUS, MINUS, MUL and DIV: ints, then numbers, then the module
+static void emit_arith(jit *j, int addr, dm_instr in, dm_opcode op, proven types) {
+	int slow[6] = {-1, -1, -1, -1, -1, -1};
+	int done[3] = {-1, -1, -1};
+	if (types != NUMBERS) {
+		if (types == CHECKED) {
+			check_ints(j, &slow[0], &slow[1]);
+		}
+		if (op == DM_OP_DIV) {
+			// the module reports the division by 0
+			emit_mem(j, 0, true, false, 0x83, 7, R13, TOP(0) + PAYLOAD);
+			emit8(j, 0);
+			slow[2] = jcc_forward(j, CC_E);
+		}
+		load(j, RAX, R13, TOP(1) + PAYLOAD);
+		switch (op) {
+			case DM_OP_PLUS:  emit_mem(j, 0, true, false, 0x03, RAX, R13, TOP(0) + PAYLOAD); break;
+			case DM_OP_MINUS: emit_mem(j, 0, true, false, 0x2b, RAX, R13, TOP(0) + PAYLOAD); break;
+			case DM_OP_MUL:   emit_mem(j, 0, true, true, 0xaf, RAX, R13, TOP(0) + PAYLOAD); break;
+			default:
+				emit8(j, 0x48);
+				emit8(j, 0x99);
+				emit_mem(j, 0, true, false, 0xf7, 7, R13, TOP(0) + PAYLOAD);
+				break;
+		}
+		store(j, RAX, R13, TOP(1) + PAYLOAD);
+		set_type(j, R13, TOP(1), DM_TYPE_INT);
+		add_top(j, -1);
+		done[0] = jmp_forward(j);
+	}
+
+	if (types != INTS) {
+		patch_here(j, slow[0]);
+		patch_here(j, slow[1]);
+		slow[0] = slow[1] = -1;
+		load_number(j, XMM0, TOP(1), types == CHECKED ? &slow[3] : NULL);
+		load_number(j, XMM1, TOP(0), types == CHECKED ? &slow[4] : NULL);
+		if (op == DM_OP_DIV) {
+			emit_reg(j, 0x66, false, true, 0x57, XMM2, XMM2);
+			emit_reg(j, 0x66, false, true, 0x2e, XMM1, XMM2);
+			int nan = jcc_forward(j, CC_P);
+			slow[5] = jcc_forward(j, CC_E);
+			patch_here(j, nan);
+		}
+		int sse = op == DM_OP_PLUS ? 0x58 : op == DM_OP_MINUS ? 0x5c : op == DM_OP_MUL ? 0x59 : 0x5e;
+		emit_reg(j, 0xf2, false, true, sse, XMM0, XMM1);
+		movsd_store(j, XMM0, R13, TOP(1) + PAYLOAD);
+		set_type(j, R13, TOP(1), DM_TYPE_FLOAT);
+		add_top(j, -1);
+		done[1] = jmp_forward(j);
+	}
+
+	bool any = false;
+	for (int i = 0; i < 6; i++) {
+		any |= slow[i] >= 0;
+		patch_here(j, slow[i]);
+	}
+	if (any) {
+		call_helper(j, addr, in);
+	}
+	for (int i = 0; i < 3; i++) {
+		patch_here(j, done[i]);
+	}
+}
+
+// LESS etc: ints, then floats, then the module. The float conditions are those
+// of compare_numbers in the vm, NaN compares greater.
+static void emit_compare(jit *j, int addr, dm_instr in, dm_opcode op, proven types) {
+	int slow[4] = {-1, -1, -1, -1};
+	int done[2] = {-1, -1};
+	if (types != NUMBERS) {
+		if (types == CHECKED) {
+			check_ints(j, &slow[0], &slow[1]);
+		}
+		load(j, RAX, R13, TOP(1) + PAYLOAD);
+		emit_mem(j, 0, true, false, 0x3b, RAX, R13, TOP(0) + PAYLOAD);
+		set_bool(j, op == DM_OP_LESS ? CC_L : op == DM_OP_LESSEQUAL ? CC_LE : op == DM_OP_GREATER ? CC_G : CC_GE);
+		if (types == INTS) {
+			return;
+		}
+		done[0] = jmp_forward(j);
+	}
+
+	patch_here(j, slow[0]);
+	patch_here(j, slow[1]);
+	cmp_type(j, R13, TOP(1), DM_TYPE_FLOAT);
+	slow[2] = jcc_forward(j, CC_NE);
+	cmp_type(j, R13, TOP(0), DM_TYPE_FLOAT);
+	slow[3] = jcc_forward(j, CC_NE);
+	movsd_load(j, XMM0, R13, TOP(1) + PAYLOAD);
+	movsd_load(j, XMM1, R13, TOP(0) + PAYLOAD);
+	// comisd b, a
+	emit_reg(j, 0x66, false, true, 0x2f, XMM1, XMM0);
+	set_bool(j, op == DM_OP_LESS ? CC_A : op == DM_OP_LESSEQUAL ? CC_AE : op == DM_OP_GREATER ? CC_B : CC_BE);
+	done[1] = jmp_forward(j);
+
+	patch_here(j, slow[2]);
+	patch_here(j, slow[3]);
+	call_helper(j, addr, in);
+	patch_here(j, done[0]);
+	patch_here(j, done[1]);
+}
+
+// the int fast path of FORPREP and FORLOOP, everything else in run_instr
+static void emit_for(jit *j, int addr, dm_instr in, dm_forloop *loop, bool step) {
+	int slow[2] = {-1, -1};
+	cmp_type(j, R12, VAR(loop->var), DM_TYPE_INT);
+	slow[0] = jcc_forward(j, CC_NE);
+	if (loop->limit_is_var) {
+		cmp_type(j, R12, VAR(loop->limit), DM_TYPE_INT);
+		slow[1] = jcc_forward(j, CC_NE);
+	}
+	load(j, RAX, R12, VAR(loop->var) + PAYLOAD);
+	if (step) {
+		emit_reg(j, 0, true, false, 0x81, 0, RAX);
+		emit32(j, loop->step);
+		store(j, RAX, R12, VAR(loop->var) + PAYLOAD);
+	}
+	if (loop->limit_is_var) {
+		emit_mem(j, 0, true, false, 0x3b, RAX, R12, VAR(loop->limit) + PAYLOAD);
+	} else {
+		emit_reg(j, 0, true, false, 0x81, 7, RAX);
+		emit32(j, loop->limit);
+	}
+	int cc = loop->compare == DM_OP_LESS ? CC_L : loop->compare == DM_OP_LESSEQUAL ? CC_LE :
+		loop->compare == DM_OP_GREATER ? CC_G : CC_GE;
+	// FORPREP jumps if the loop doesn't run, FORLOOP if it goes on
+	jump_to(j, step ? cc : cc ^ 1, dm_instr_b(in));
+	int done = jmp_forward(j);
+
+	patch_here(j, slow[0]);
+	patch_here(j, slow[1]);
+	call_helper(j, addr, in);
+	emit_reg(j, 0, false, false, 0x84, RAX, RAX);
+	jump_to(j, CC_NE, dm_instr_b(in));
+	patch_here(j, done);
+}
+
+static void push_value(jit *j, dm_type type, uint64_t payload) {
+	set_type(j, R13, 0, type);
+	emit8(j, 0x48);
+	emit8(j, 0xb8);
+	emit64(j, payload);
+	store(j, RAX, R13, PAYLOAD);
+	add_top(j, 1);
+}
+
+// returns false if the instruction has no template
+static bool emit_instr(jit *j, dm_chunk *chunk, int addr, dm_instr in) {
+	dm_instr first, second;
+	if (dm_superinstr_split(in, &first, &second)) {
+		return emit_instr(j, chunk, addr, first) && emit_instr(j, chunk, addr, second);
+	}
+
+	dm_opcode op = dm_opcode_generic(dm_instr_op(in));
+	switch (op) {
+		case DM_OP_VARGET:
+			movups_load(j, XMM0, R12, VAR(dm_instr_b(in)));
+			movups_store(j, XMM0, R13, 0);
+			add_top(j, 1);
+			break;
+		case DM_OP_VARSET:
+			movups_load(j, XMM0, R13, TOP(0));
+			movups_store(j, XMM0, R12, VAR(dm_instr_b(in)));
+			break;
+		case DM_OP_VARGET_UP:
+		case DM_OP_VARSET_UP:
+			load(j, RAX, RBX, FRAME(upvals));
+			load(j, RAX, RAX, dm_instr_b(in) * (int) sizeof(dm_upval*));
+			load(j, RAX, RAX, (int) offsetof(dm_upval, v));
+			if (op == DM_OP_VARGET_UP) {
+				movups_load(j, XMM0, RAX, 0);
+				movups_store(j, XMM0, R13, 0);
+				add_top(j, 1);
+			} else {
+				movups_load(j, XMM0, R13, TOP(0));
+				movups_store(j, XMM0, RAX, 0);
+			}
+			break;
+		case DM_OP_POP:
+			add_top(j, -1);
+			break;
+		case DM_OP_CONSTANT: {
+			dm_value v = chunk->consts[dm_instr_b(in)];
+			// only the bool of a bool is set
+			uint64_t payload = dm_value_type(v) == DM_TYPE_BOOL ? dm_value_as_bool(v) : (uint64_t) dm_value_payload(v);
+			push_value(j, dm_value_type(v), payload);
+			break;
+		}
+		case DM_OP_CONSTANT_SMALLINT:
+			push_value(j, DM_TYPE_INT, dm_instr_b(in));
+			break;
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+			push_value(j, DM_TYPE_BOOL, op == DM_OP_TRUE);
+			break;
+		case DM_OP_NIL:
+			push_value(j, DM_TYPE_NIL, 0);
+			break;
+		case DM_OP_CHECKTYPE: {
+			cmp_type(j, R13, TOP(0), dm_instr_a(in));
+			int ok = jcc_forward(j, CC_E);
+			call_helper(j, addr, in);
+			patch_here(j, ok);
+			break;
+		}
+		case DM_OP_NOT: {
+			cmp_type(j, R13, TOP(0), DM_TYPE_BOOL);
+			int slow = jcc_forward(j, CC_NE);
+			emit_mem(j, 0, false, false, 0x80, 6, R13, TOP(0) + PAYLOAD);
+			emit8(j, 1);
+			int done = jmp_forward(j);
+			patch_here(j, slow);
+			call_helper(j, addr, in);
+			patch_here(j, done);
+			break;
+		}
+		case DM_OP_NEGATE: {
+			cmp_type(j, R13, TOP(0), DM_TYPE_INT);
+			int slow = jcc_forward(j, CC_NE);
+			emit_mem(j, 0, true, false, 0xf7, 3, R13, TOP(0) + PAYLOAD);
+			int done = jmp_forward(j);
+			patch_here(j, slow);
+			call_helper(j, addr, in);
+			patch_here(j, done);
+			break;
+		}
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:
+		case DM_OP_DIV:
+			emit_arith(j, addr, in, op, proven_types(dm_instr_op(in)));
+			break;
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL:
+			emit_compare(j, addr, in, op, proven_types(dm_instr_op(in)));
+			break;
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL: {
+			int slow[2];
+			check_ints(j, &slow[0], &slow[1]);
+			load(j, RAX, R13, TOP(1) + PAYLOAD);
+			emit_mem(j, 0, true, false, 0x3b, RAX, R13, TOP(0) + PAYLOAD);
+			set_bool(j, op == DM_OP_EQUAL ? CC_E : CC_NE);
+			int done = jmp_forward(j);
+			patch_here(j, slow[0]);
+			patch_here(j, slow[1]);
+			call_helper(j, addr, in);
+			patch_here(j, done);
+			break;
+		}
+		case DM_OP_JUMP:
+			jump_to(j, -1, dm_instr_b(in));
+			break;
+		case DM_OP_JUMP_IF_FALSE:
+			add_top(j, -1);
+			jump_if_falsey(j, 0, dm_instr_b(in));
+			break;
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+			jump_if_falsey(j, TOP(0), dm_instr_b(in));
+			add_top(j, -1);
+			break;
+		case DM_OP_JUMP_IF_TRUE_OR_POP: {
+			load32(j, RAX, R13, TOP(0) + TYPE);
+			emit_reg(j, 0, false, false, 0x85, RAX, RAX);
+			int nil = jcc_forward(j, CC_E);
+			emit_reg(j, 0, false, false, 0x83, 7, RAX);
+			emit8(j, DM_TYPE_BOOL);
+			jump_to(j, CC_NE, dm_instr_b(in));
+			emit_mem(j, 0, false, false, 0x80, 7, R13, TOP(0) + PAYLOAD);
+			emit8(j, 0);
+			jump_to(j, CC_NE, dm_instr_b(in));
+			patch_here(j, nil);
+			add_top(j, -1);
+			break;
+		}
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:
+			emit_for(j, addr, in, &chunk->loops[dm_instr_a(in)], op == DM_OP_FORLOOP);
+			break;
+		case DM_OP_VARGETOPSET:
+		case DM_OP_VARGETOPSET_UP:
+		case DM_OP_FIELDSET:
+		case DM_OP_FIELDGETOPSET:
+		case DM_OP_FIELDSET_S:
+		case DM_OP_FIELDGETOPSET_S:
+		case DM_OP_FIELDGET:
+		case DM_OP_FIELDGET_S:
+		case DM_OP_FIELDGET_PUSHPARENT:
+		case DM_OP_FIELDGET_S_PUSHPARENT:
+		case DM_OP_ARRAYLIT:
+		case DM_OP_TABLELIT:
+		case DM_OP_SELF:
+		case DM_OP_MOD:
+			call_helper(j, addr, in);
+			break;
+		case DM_OP_CALL:
+		case DM_OP_CALL_WITHPARENT:
+		case DM_OP_TAILCALL:
+		case DM_OP_RETURN:
+		case DM_OP_CLOSURE:
+		case DM_OP_IMPORT:
+			exit_to_vm(j, addr);
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+// A loop that was traced before the chunk got compiled runs its trace
+// wherever it starts, the code goes on where the trace left. If that is the
+// start of the loop, the trace can't run it.
+static void enter_trace(jit *j, int addr, dm_jitcode *trace) {
+	store(j, R13, RBX, FRAME(top));
+	emit_mem(j, 0, false, false, 0xc7, 0, RBX, FRAME(ip));
+	emit32(j, addr);
+	emit_reg(j, 0, true, false, 0x89, RBX, RDI);
+	emit8(j, 0x48);
+	emit8(j, 0xb8);
+	emit64(j, (uint64_t) (uintptr_t) trace->entry);
+	emit8(j, 0xff);
+	emit8(j, 0xd0);
+	load(j, R13, RBX, FRAME(top));
+	emit_mem(j, 0, false, false, 0x81, 7, RBX, FRAME(ip));
+	emit32(j, addr);
+	int here = jcc_forward(j, CC_E);
+	emit8(j, 0xe9);
+	emit32(j, j->dispatch - (j->size + 4));
+	patch_here(j, here);
+}
+
+// The entry jumps to the code of f->ip through a table of offsets behind the
+// code, the exits store their address in f->ip and leave through the epilogue.
+static bool emit_chunk(jit *j, dm_chunk *chunk) {
+	emit8(j, 0x53);
+	emit8(j, 0x41);
+	emit8(j, 0x54);
+	emit8(j, 0x41);
+	emit8(j, 0x55);
+	emit_reg(j, 0, true, false, 0x89, RDI, RBX);
+	load(j, R12, RBX, FRAME(vars));
+	load(j, R13, RBX, FRAME(top));
+	j->dispatch = j->size;
+	emit_mem(j, 0, true, false, 0x63, RAX, RBX, FRAME(ip));
+	// lea rcx, [rip + table]
+	emit8(j, 0x48);
+	emit8(j, 0x8d);
+	emit8(j, 0x0d);
+	emit32(j, 0);
+	j->table = j->size - 4;
+	// movsxd rax, [rcx + rax * 4]; add rax, rcx; jmp rax
+	emit8(j, 0x48);
+	emit8(j, 0x63);
+	emit8(j, 0x04);
+	emit8(j, 0x81);
+	emit_reg(j, 0, true, false, 0x01, RCX, RAX);
+	emit8(j, 0xff);
+	emit8(j, 0xe0);
+
+	j->epilogue = j->size;
+	store(j, R13, RBX, FRAME(top));
+	emit8(j, 0x41);
+	emit8(j, 0x5d);
+	emit8(j, 0x41);
+	emit8(j, 0x5c);
+	emit8(j, 0x5b);
+	emit8(j, 0xc3);
+
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		j->addrs[addr] = j->size;
+		dm_trace *trace = trace_at(chunk, addr);
+		if (trace != NULL && trace->code != NULL) {
+			enter_trace(j, addr, trace->code);
+		}
+		if (!emit_instr(j, chunk, addr, chunk->code[addr])) {
+			return false;
+		}
+	}
+	for (int i = 0; i < j->nfixups; i++) {
+		fixup *fix = &j->fixups[i];
+		patch32(j, fix->at, j->addrs[fix->addr] - (fix->at + 4));
+	}
+
+	while (j->size % 4 != 0) {
+		emit8(j, 0xcc);
+	}
+	int table = j->size;
+	patch32(j, j->table, table - (j->table + 4));
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		emit32(j, j->addrs[addr] - table);
+	}
+	return true;
+}
+
+// perf picks up the symbols of jitted code from /tmp/perf-<pid>.map
+static void perf_map(dm_jitcode *code, const char *kind, int line) {
+	static FILE *map;
+	if (map == NULL) {
+		char path[64];
+		snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+		map = fopen(path, "w");
+		if (map == NULL) {
+			return;
+		}
+	}
+	fprintf(map, "%lx %zx %s:line_%d\n", (unsigned long) (uintptr_t) code->mem, code->size, kind, line);
+	fflush(map);
+}
+
+// Copies the code into memory that is made executable after it was written.
+static dm_jitcode *install(jit *j, const char *kind, int line) {
+	long page = sysconf(_SC_PAGESIZE);
+	size_t size = (j->size + page - 1) / page * page;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+	memcpy(mem, j->code, j->size);
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, size);
+		return NULL;
+	}
+
+	dm_jitcode *code = malloc(sizeof(dm_jitcode));
+	code->mem = mem;
+	code->size = size;
+	code->entry = (void (*)(dm_jit_frame*)) mem;
+	perf_map(code, kind, line);
+	return code;
+}
+
+static dm_jitcode *compile(dm_chunk *chunk) {
+	jit j = {0};
+	j.addrs = malloc(chunk->codesize * sizeof(int));
+	dm_jitcode *code = NULL;
+	if (emit_chunk(&j, chunk)) {
+		code = install(&j, "dm_jit", dm_chunk_line_at(chunk, 0));
+	}
+	free(j.addrs);
+	free(j.fixups);
+	free(j.code);
+	return code;
+}
+
+// With --trace a loop that jumped back to its start often enough has one
+// iteration recorded: the recorder runs the instructions through run_instr
+// and notes the types of their operands and which way the jumps went. The
+// recording is compiled into code that only knows these types and that path,
+// values on the stack are kept unboxed in registers, variables are guarded for
+// the type they had the first time they are read and the jumps that go the
+// other way leave the trace. A trace leaves in front of the instruction the vm
+// goes on with, with the stack it has there. Only numbers, bools and nil are
+// traced, a loop with anything else, a call or an inner loop stays with the vm.
+//
+// The code has the iteration twice: the first one checks the types of the
+// variables, the second one knows them without the checks and loops back to
+// itself.
+
+#define DM_TRACE_HOT      100   // back jumps to a loop before it is recorded
+#define DM_TRACE_MAX      256   // instructions in a trace
+#define DM_TRACE_DEPTH    8     // values on the stack of a trace
+
+typedef struct {
+	int addr;                   // of the instruction, both halves of a superinstruction share it
+	dm_instr in;
+	dm_type types[2];           // of the operands, the variable and limit of FORPREP and FORLOOP
+	dm_type result;             // of the topmost value after it ran
+	bool jumped;
+} step;
+
+static bool traceable(dm_instr in) {
+	switch (dm_opcode_generic(dm_instr_op(in))) {
+		case DM_OP_VARGET:
+		case DM_OP_VARSET:
+		case DM_OP_POP:
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL:
+		case DM_OP_CHECKTYPE:
+		case DM_OP_NEGATE:
+		case DM_OP_NOT:
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:
+		case DM_OP_DIV:
+		case DM_OP_MOD:
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL:
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL:
+		case DM_OP_JUMP:
+		case DM_OP_JUMP_IF_FALSE:
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+		case DM_OP_JUMP_IF_TRUE_OR_POP:
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static int stack_depth(dm_chunk *chunk, dm_jit_frame *f) {
+	return f->top - (f->vars + chunk->varsize);
+}
+
+static dm_type top_type(dm_chunk *chunk, dm_jit_frame *f, int n) {
+	return stack_depth(chunk, f) > n ? dm_value_type(f->top[-(n + 1)]) : DM_TYPE_NIL;
+}
+
+// Runs one iteration of the loop at f->ip and returns the number of steps, or
+// 0 if it ran into something that can't be traced. f->ip is in front of that.
+static int record(dm_chunk *chunk, dm_jit_frame *f, step *steps) {
+	int header = f->ip;
+	int n = 0;
+	do {
+		int addr = f->ip;
+		dm_instr halves[2] = {chunk->code[addr], 0};
+		int nhalves = dm_superinstr_split(halves[0], &halves[0], &halves[1]) ? 2 : 1;
+		bool ok = n + nhalves <= DM_TRACE_MAX;
+		for (int i = 0; i < nhalves; i++) {
+			ok = ok && traceable(halves[i]);
+		}
+		// an inner loop
+		for (int i = 0; i < n && ok; i++) {
+			ok = steps[i].addr != addr;
+		}
+		if (!ok) {
+			return 0;
+		}
+
+		f->ip = addr + 1;
+		bool jumped = false;
+		for (int i = 0; i < nhalves; i++) {
+			step *s = &steps[n++];
+			dm_opcode op = dm_opcode_generic(dm_instr_op(halves[i]));
+			s->addr = addr;
+			s->in = halves[i];
+			if (op == DM_OP_FORPREP || op == DM_OP_FORLOOP) {
+				dm_forloop *loop = &chunk->loops[dm_instr_a(halves[i])];
+				s->types[0] = dm_value_type(f->vars[loop->var]);
+				s->types[1] = dm_value_type(for_limit(loop, f->vars));
+			} else {
+				s->types[0] = top_type(chunk, f, 0);
+				s->types[1] = top_type(chunk, f, 1);
+			}
+			jumped = run_instr(f, halves[i]);
+			s->result = top_type(chunk, f, 0);
+			s->jumped = jumped;
+		}
+		if (jumped) {
+			f->ip = dm_instr_b(halves[nhalves - 1]);
+		}
+	} while (f->ip != header);
+	return n;
+}
+
+// where a value on the stack of a trace is
+typedef enum {
+	IN_MEMORY,                  // boxed on the stack, it was there when the trace started
+	IN_GPR,                     // ints and bools, as 0 and 1
+	IN_XMM,                     // floats
+	IN_CODE                     // a constant
+} location;
+
+typedef struct {
+	location loc;
+	dm_type type;               // unless IN_MEMORY
+	uint64_t payload;           // IN_CODE
+} tvalue;
+
+// the stack at an exit of the trace
+typedef struct {
+	int at;                     // of the rel32 of the jump
+	int addr;
+	int depth;
+	tvalue stack[DM_TRACE_DEPTH];
+} texit;
+
+typedef struct {
+	jit *j;
+	dm_chunk *chunk;
+	int entry;                  // values on the stack when the trace starts, below are the variables
+	int depth;
+	tvalue stack[DM_TRACE_DEPTH];
+	int *vartypes;              // the type a variable is known to have, -1 if it isn't
+	// the stack in front of the instruction of the step, the guards leave with it
+	int addr;
+	int predepth;
+	tvalue prestack[DM_TRACE_DEPTH];
+	int nexits;
+	int exitcapacity;
+	texit *exits;
+	bool failed;
+} tracer;
+
+// the registers of the values on the stack, by position
+static const int gprs[DM_TRACE_DEPTH] = {RCX, RSI, RDI, R8, R9, R10, R11, R14};
+static const int xmms[DM_TRACE_DEPTH] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+// the slot of position p, r13 is the top of the stack when the trace started
+#define STACK(t, p) (((p) - (t)->entry) * SLOT)
+
+static void add_exit(tracer *t, int cc, int addr, int depth, tvalue *stack) {
+	if (t->nexits >= t->exitcapacity) {
+		t->exitcapacity = t->exitcapacity == 0 ? 32 : t->exitcapacity * 2;
+		t->exits = realloc(t->exits, t->exitcapacity * sizeof(texit));
+	}
+	texit *e = &t->exits[t->nexits++];
+	e->at = jcc_forward(t->j, cc);
+	e->addr = addr;
+	e->depth = depth;
+	memcpy(e->stack, stack, depth * sizeof(tvalue));
+}
+
+// leaves in front of the instruction, which the vm runs again
+static void guard(tracer *t, int cc) {
+	add_exit(t, cc, t->addr, t->predepth, t->prestack);
+}
+
+// leaves with the stack as it is for the jump the recording didn't take
+static void side_exit(tracer *t, int cc, int addr, int depth) {
+	add_exit(t, cc, addr, depth, t->stack);
+}
+
+static void mov_imm64(jit *j, int reg, uint64_t imm) {
+	emit_rex(j, true, 0, reg);
+	emit8(j, 0xb8 + (reg & 7));
+	emit64(j, imm);
+}
+
+// the payload of a value that isn't IN_MEMORY into [base + disp]
+static void store_payload(jit *j, tvalue *v, int p, int base, int disp) {
+	switch (v->loc) {
+		case IN_GPR:
+			store(j, gprs[p], base, disp + PAYLOAD);
+			break;
+		case IN_XMM:
+			movsd_store(j, xmms[p], base, disp + PAYLOAD);
+			break;
+		default:
+			if (v->type != DM_TYPE_NIL) {
+				mov_imm64(j, RAX, v->payload);
+				store(j, RAX, base, disp + PAYLOAD);
+			}
+			break;
+	}
+}
+
+// boxes the value at position p back onto the stack
+static void flush_value(tracer *t, tvalue *v, int p) {
+	if (v->loc != IN_MEMORY) {
+		store_payload(t->j, v, p, R13, STACK(t, p));
+		set_type(t->j, R13, STACK(t, p), v->type);
+	}
+}
+
+static bool is_number_type(dm_type type) {
+	return type == DM_TYPE_INT || type == DM_TYPE_FLOAT;
+}
+
+// the position of a new value on the stack
+static int push_position(tracer *t) {
+	if (t->depth >= DM_TRACE_DEPTH) {
+		t->failed = true;
+		return DM_TRACE_DEPTH - 1;
+	}
+	return t->depth++;
+}
+
+static void push_constant(tracer *t, dm_type type, uint64_t payload) {
+	t->stack[push_position(t)] = (tvalue){IN_CODE, type, payload};
+}
+
+// unboxes the value at [base + disp] of the type into the register of position p
+static void unbox(tracer *t, int p, dm_type type, int base, int disp) {
+	tvalue *v = &t->stack[p];
+	*v = (tvalue){IN_GPR, type, 0};
+	switch (type) {
+		case DM_TYPE_INT:
+			load(t->j, gprs[p], base, disp + PAYLOAD);
+			break;
+		case DM_TYPE_BOOL:
+			emit_mem(t->j, 0, false, true, 0xb6, gprs[p], base, disp + PAYLOAD);
+			break;
+		case DM_TYPE_FLOAT:
+			movsd_load(t->j, xmms[p], base, disp + PAYLOAD);
+			v->loc = IN_XMM;
+			break;
+		case DM_TYPE_NIL:
+			v->loc = IN_CODE;
+			break;
+		default:
+			t->failed = true;
+			break;
+	}
+}
+
+// the type of the value at position p, a value from before the trace gets the
+// type it had in the recording
+static dm_type known(tracer *t, int p, dm_type recorded) {
+	if (t->stack[p].loc == IN_MEMORY) {
+		cmp_type(t->j, R13, STACK(t, p), recorded);
+		guard(t, CC_NE);
+		unbox(t, p, recorded, R13, STACK(t, p));
+	}
+	return t->stack[p].type;
+}
+
+static void guard_var(tracer *t, int var, dm_type type) {
+	if (t->vartypes[var] != (int) type) {
+		cmp_type(t->j, R12, VAR(var), type);
+		guard(t, CC_NE);
+		t->vartypes[var] = type;
+	}
+}
+
+// an int or bool at position p in its gpr
+static void to_gpr(tracer *t, int p) {
+	if (t->stack[p].loc == IN_CODE) {
+		mov_imm64(t->j, gprs[p], t->stack[p].payload);
+		t->stack[p].loc = IN_GPR;
+	}
+}
+
+// a number at position p as a float in its xmm
+static void to_xmm(tracer *t, int p) {
+	tvalue *v = &t->stack[p];
+	if (v->loc == IN_CODE) {
+		if (v->type == DM_TYPE_INT) {
+			dm_float d = (dm_float) (dm_int) v->payload;
+			memcpy(&v->payload, &d, sizeof(d));
+		}
+		mov_imm64(t->j, RAX, v->payload);
+		// movq xmm, rax
+		emit_reg(t->j, 0x66, true, true, 0x6e, xmms[p], RAX);
+	} else if (v->loc == IN_GPR) {
+		emit_reg(t->j, 0xf2, true, true, 0x2a, xmms[p], gprs[p]);
+	}
+	v->loc = IN_XMM;
+	v->type = DM_TYPE_FLOAT;
+}
+
+// op a, b for the ints at positions a and b = a + 1, rr is the opcode of the
+// register form, ext the extension of 81 /ext imm32
+static void int_op(tracer *t, int a, int rr, int ext) {
+	tvalue *b = &t->stack[a + 1];
+	to_gpr(t, a);
+	if (b->loc == IN_CODE && (int64_t) b->payload == (int32_t) b->payload) {
+		emit_reg(t->j, 0, true, false, 0x81, ext, gprs[a]);
+		emit32(t->j, (int32_t) b->payload);
+	} else {
+		to_gpr(t, a + 1);
+		emit_reg(t->j, 0, true, false, rr, gprs[a + 1], gprs[a]);
+	}
+}
+
+// the bool of the condition at position p
+static void set_gpr_bool(tracer *t, int p, int cc) {
+	emit8(t->j, 0x0f);
+	emit8(t->j, 0x90 | cc);
+	emit8(t->j, 0xc0);
+	emit_reg(t->j, 0, false, true, 0xb6, gprs[p], RAX);
+	t->stack[p] = (tvalue){IN_GPR, DM_TYPE_BOOL, 0};
+}
+
+static void trace_arith(tracer *t, step *s, dm_opcode op) {
+	int a = t->depth - 2;
+	dm_type ta = known(t, a, s->types[1]);
+	dm_type tb = known(t, a + 1, s->types[0]);
+	t->depth--;
+	if (!is_number_type(ta) || !is_number_type(tb)) {
+		t->failed = true;
+		return;
+	}
+
+	if (ta == DM_TYPE_INT && tb == DM_TYPE_INT) {
+		switch (op) {
+			case DM_OP_PLUS:
+				int_op(t, a, 0x01, 0);
+				break;
+			case DM_OP_MINUS:
+				int_op(t, a, 0x29, 5);
+				break;
+			case DM_OP_MUL:
+				to_gpr(t, a);
+				to_gpr(t, a + 1);
+				emit_reg(t->j, 0, true, true, 0xaf, gprs[a], gprs[a + 1]);
+				break;
+			default:
+				// the module reports the division by 0
+				to_gpr(t, a);
+				to_gpr(t, a + 1);
+				emit_reg(t->j, 0, true, false, 0x85, gprs[a + 1], gprs[a + 1]);
+				guard(t, CC_E);
+				emit_reg(t->j, 0, true, false, 0x89, gprs[a], RAX);
+				emit8(t->j, 0x48);
+				emit8(t->j, 0x99);
+				emit_reg(t->j, 0, true, false, 0xf7, 7, gprs[a + 1]);
+				emit_reg(t->j, 0, true, false, 0x89, op == DM_OP_DIV ? RAX : RDX, gprs[a]);
+				break;
+		}
+		t->stack[a].loc = IN_GPR;
+		return;
+	}
+
+	// the float module reports a mod
+	if (op == DM_OP_MOD) {
+		t->failed = true;
+		return;
+	}
+	to_xmm(t, a);
+	to_xmm(t, a + 1);
+	if (op == DM_OP_DIV) {
+		emit_reg(t->j, 0x66, false, true, 0x57, XMM0, XMM0);
+		emit_reg(t->j, 0x66, false, true, 0x2e, xmms[a + 1], XMM0);
+		int nan = jcc_forward(t->j, CC_P);
+		guard(t, CC_E);
+		patch_here(t->j, nan);
+	}
+	int sse = op == DM_OP_PLUS ? 0x58 : op == DM_OP_MINUS ? 0x5c : op == DM_OP_MUL ? 0x59 : 0x5e;
+	emit_reg(t->j, 0xf2, false, true, sse, xmms[a], xmms[a + 1]);
+}
+
+static void trace_compare(tracer *t, step *s, dm_opcode op) {
+	int a = t->depth - 2;
+	dm_type ta = known(t, a, s->types[1]);
+	dm_type tb = known(t, a + 1, s->types[0]);
+	bool eq = op == DM_OP_EQUAL || op == DM_OP_NOTEQUAL;
+	t->depth--;
+
+	if ((ta == DM_TYPE_INT && tb == DM_TYPE_INT) || (eq && ta == DM_TYPE_BOOL && tb == DM_TYPE_BOOL)) {
+		int_op(t, a, 0x39, 7);
+		set_gpr_bool(t, a, op == DM_OP_EQUAL ? CC_E : op == DM_OP_NOTEQUAL ? CC_NE : op == DM_OP_LESS ? CC_L :
+			op == DM_OP_LESSEQUAL ? CC_LE : op == DM_OP_GREATER ? CC_G : CC_GE);
+		return;
+	}
+
+	// the int module compares an int with a float the other way round, which
+	// differs for NaN
+	if (!is_number_type(ta) || !is_number_type(tb) || (!eq && ta != DM_TYPE_FLOAT)) {
+		t->failed = true;
+		return;
+	}
+	to_xmm(t, a);
+	to_xmm(t, a + 1);
+	if (eq) {
+		// ucomisd a, b, unordered is not equal
+		emit_reg(t->j, 0x66, false, true, 0x2e, xmms[a], xmms[a + 1]);
+		emit8(t->j, 0x0f);
+		emit8(t->j, 0x90 | (op == DM_OP_EQUAL ? CC_NP : CC_P));
+		emit8(t->j, 0xc0);
+		emit8(t->j, 0x0f);
+		emit8(t->j, 0x90 | (op == DM_OP_EQUAL ? CC_E : CC_NE));
+		emit8(t->j, 0xc2);
+		// and al, dl or or al, dl
+		emit8(t->j, op == DM_OP_EQUAL ? 0x20 : 0x08);
+		emit8(t->j, 0xd0);
+		emit_reg(t->j, 0, false, true, 0xb6, gprs[a], RAX);
+		t->stack[a] = (tvalue){IN_GPR, DM_TYPE_BOOL, 0};
+		return;
+	}
+	// comisd b, a like emit_compare
+	emit_reg(t->j, 0x66, false, true, 0x2f, xmms[a + 1], xmms[a]);
+	set_gpr_bool(t, a, op == DM_OP_LESS ? CC_A : op == DM_OP_LESSEQUAL ? CC_AE : op == DM_OP_GREATER ? CC_B : CC_BE);
+}
+
+// The conditional jumps stay on the recorded path and leave where the value at
+// the top is the other way, pops is whether that way pops it.
+static void trace_branch(tracer *t, step *s, bool truthy, bool pops, int addr) {
+	int p = t->depth - 1;
+	dm_type type = known(t, p, s->types[0]);
+	if (type == DM_TYPE_BOOL && t->stack[p].loc == IN_GPR) {
+		emit_reg(t->j, 0, false, false, 0x85, gprs[p], gprs[p]);
+		side_exit(t, truthy ? CC_E : CC_NE, addr, pops ? p : p + 1);
+	}
+}
+
+static void trace_for(tracer *t, step *s, dm_opcode op) {
+	jit *j = t->j;
+	dm_forloop *loop = &t->chunk->loops[dm_instr_a(s->in)];
+	if (s->types[0] != DM_TYPE_INT || (loop->limit_is_var && s->types[1] != DM_TYPE_INT)) {
+		t->failed = true;
+		return;
+	}
+	guard_var(t, loop->var, DM_TYPE_INT);
+	if (loop->limit_is_var) {
+		guard_var(t, loop->limit, DM_TYPE_INT);
+	}
+	load(j, RAX, R12, VAR(loop->var) + PAYLOAD);
+	if (op == DM_OP_FORLOOP) {
+		emit_reg(j, 0, true, false, 0x81, 0, RAX);
+		emit32(j, loop->step);
+		store(j, RAX, R12, VAR(loop->var) + PAYLOAD);
+	}
+	if (loop->limit_is_var) {
+		emit_mem(j, 0, true, false, 0x3b, RAX, R12, VAR(loop->limit) + PAYLOAD);
+	} else {
+		emit_reg(j, 0, true, false, 0x81, 7, RAX);
+		emit32(j, loop->limit);
+	}
+	int cc = loop->compare == DM_OP_LESS ? CC_L : loop->compare == DM_OP_LESSEQUAL ? CC_LE :
+		loop->compare == DM_OP_GREATER ? CC_G : CC_GE;
+	// FORPREP jumps if the loop doesn't run, FORLOOP if it goes on
+	int jumps = op == DM_OP_FORLOOP ? cc : cc ^ 1;
+	if (s->jumped) {
+		side_exit(t, jumps ^ 1, s->addr + 1, t->depth);
+	} else {
+		side_exit(t, jumps, dm_instr_b(s->in), t->depth);
+	}
+}
+
+static void trace_step(tracer *t, step *s) {
+	jit *j = t->j;
+	dm_opcode op = dm_opcode_generic(dm_instr_op(s->in));
+	int top = t->depth - 1;
+	switch (op) {
+		case DM_OP_VARGET: {
+			int var = dm_instr_b(s->in);
+			guard_var(t, var, s->result);
+			unbox(t, push_position(t), s->result, R12, VAR(var));
+			break;
+		}
+		case DM_OP_VARSET: {
+			int var = dm_instr_b(s->in);
+			dm_type type = known(t, top, s->types[0]);
+			store_payload(j, &t->stack[top], top, R12, VAR(var));
+			// the tag only changes with the type
+			if (t->vartypes[var] != (int) type) {
+				set_type(j, R12, VAR(var), type);
+			}
+			t->vartypes[var] = type;
+			break;
+		}
+		case DM_OP_POP:
+			t->depth--;
+			break;
+		case DM_OP_CONSTANT: {
+			dm_value v = t->chunk->consts[dm_instr_b(s->in)];
+			if (dm_value_type(v) == DM_TYPE_BOOL) {
+				push_constant(t, DM_TYPE_BOOL, dm_value_as_bool(v));
+			} else if (is_number_type(dm_value_type(v)) || dm_value_type(v) == DM_TYPE_NIL) {
+				push_constant(t, dm_value_type(v), (uint64_t) dm_value_payload(v));
+			} else {
+				t->failed = true;
+			}
+			break;
+		}
+		case DM_OP_CONSTANT_SMALLINT:
+			push_constant(t, DM_TYPE_INT, dm_instr_b(s->in));
+			break;
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+			push_constant(t, DM_TYPE_BOOL, op == DM_OP_TRUE);
+			break;
+		case DM_OP_NIL:
+			push_constant(t, DM_TYPE_NIL, 0);
+			break;
+		case DM_OP_CHECKTYPE:
+			// the recording would have failed
+			t->failed |= known(t, top, s->types[0]) != (dm_type) dm_instr_a(s->in);
+			break;
+		case DM_OP_NOT: {
+			tvalue *v = &t->stack[top];
+			if (known(t, top, s->types[0]) != DM_TYPE_BOOL) {
+				t->failed = true;
+			} else if (v->loc == IN_CODE) {
+				v->payload = !v->payload;
+			} else {
+				emit_reg(j, 0, false, false, 0x83, 6, gprs[top]);
+				emit8(j, 1);
+			}
+			break;
+		}
+		case DM_OP_NEGATE: {
+			tvalue *v = &t->stack[top];
+			dm_type type = known(t, top, s->types[0]);
+			if (!is_number_type(type)) {
+				t->failed = true;
+			} else if (v->loc == IN_CODE) {
+				v->payload = type == DM_TYPE_INT ? -v->payload : v->payload ^ (1ull << 63);
+			} else if (type == DM_TYPE_INT) {
+				emit_reg(j, 0, true, false, 0xf7, 3, gprs[top]);
+			} else {
+				mov_imm64(j, RAX, 1ull << 63);
+				emit_reg(j, 0x66, true, true, 0x6e, XMM0, RAX);
+				emit_reg(j, 0x66, false, true, 0x57, xmms[top], XMM0);
+			}
+			break;
+		}
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:
+		case DM_OP_DIV:
+		case DM_OP_MOD:
+			trace_arith(t, s, op);
+			break;
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL:
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL:
+			trace_compare(t, s, op);
+			break;
+		case DM_OP_JUMP:
+			break;
+		case DM_OP_JUMP_IF_FALSE:
+			// pops either way
+			trace_branch(t, s, !s->jumped, true, s->jumped ? s->addr + 1 : dm_instr_b(s->in));
+			t->depth--;
+			break;
+		case DM_OP_JUMP_IF_FALSE_OR_POP:
+		case DM_OP_JUMP_IF_TRUE_OR_POP: {
+			// jumps with the value, goes on without it
+			bool falsey_jumps = op == DM_OP_JUMP_IF_FALSE_OR_POP;
+			bool truthy = s->jumped != falsey_jumps;
+			trace_branch(t, s, truthy, s->jumped, s->jumped ? s->addr + 1 : dm_instr_b(s->in));
+			if (!s->jumped) {
+				t->depth--;
+			}
+			break;
+		}
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:
+			trace_for(t, s, op);
+			break;
+		default:
+			t->failed = true;
+			break;
+	}
+
+	// the code computes the types the recording saw
+	if (t->depth > 0 && t->stack[t->depth - 1].loc != IN_MEMORY && t->stack[t->depth - 1].type != s->result) {
+		t->failed = true;
+	}
+}
+
+// one iteration of the recording, the values from before the trace go back
+// onto the stack at its end
+static void trace_pass(tracer *t, step *steps, int n) {
+	for (int i = 0; i < n && !t->failed; i++) {
+		if (i == 0 || steps[i - 1].addr != steps[i].addr) {
+			t->addr = steps[i].addr;
+			t->predepth = t->depth;
+			memcpy(t->prestack, t->stack, sizeof(t->stack));
+		}
+		trace_step(t, &steps[i]);
+	}
+	t->failed |= t->depth != t->entry;
+	for (int p = 0; p < t->entry; p++) {
+		flush_value(t, &t->stack[p], p);
+		t->stack[p].loc = IN_MEMORY;
+	}
+}
+
+static dm_jitcode *compile_trace(dm_chunk *chunk, int entry, step *steps, int n) {
+	if (entry > DM_TRACE_DEPTH) {
+		return NULL;
+	}
+	jit j = {0};
+	tracer t = {.j = &j, .chunk = chunk, .entry = entry, .depth = entry};
+	size_t varsize = (chunk->varsize + 1) * sizeof(int);
+	t.vartypes = malloc(varsize);
+	int *looptypes = malloc(varsize);
+	memset(t.vartypes, -1, varsize);
+
+	// push rbx, r12, r13, r14
+	emit8(&j, 0x53);
+	emit8(&j, 0x41);
+	emit8(&j, 0x54);
+	emit8(&j, 0x41);
+	emit8(&j, 0x55);
+	emit8(&j, 0x41);
+	emit8(&j, 0x56);
+	emit_reg(&j, 0, true, false, 0x89, RDI, RBX);
+	load(&j, R12, RBX, FRAME(vars));
+	load(&j, R13, RBX, FRAME(top));
+
+	trace_pass(&t, steps, n);
+	memcpy(looptypes, t.vartypes, varsize);
+	int loop = j.size;
+	trace_pass(&t, steps, n);
+	t.failed |= memcmp(looptypes, t.vartypes, varsize) != 0;
+	emit8(&j, 0xe9);
+	emit32(&j, loop - (j.size + 4));
+
+	j.epilogue = j.size;
+	emit8(&j, 0x41);
+	emit8(&j, 0x5e);
+	emit8(&j, 0x41);
+	emit8(&j, 0x5d);
+	emit8(&j, 0x41);
+	emit8(&j, 0x5c);
+	emit8(&j, 0x5b);
+	emit8(&j, 0xc3);
+
+	for (int i = 0; i < t.nexits; i++) {
+		texit *e = &t.exits[i];
+		patch_here(&j, e->at);
+		for (int p = 0; p < e->depth; p++) {
+			flush_value(&t, &e->stack[p], p);
+		}
+		emit_mem(&j, 0, true, false, 0x8d, RAX, R13, STACK(&t, e->depth));
+		store(&j, RAX, RBX, FRAME(top));
+		emit_mem(&j, 0, false, false, 0xc7, 0, RBX, FRAME(ip));
+		emit32(&j, e->addr);
+		emit8(&j, 0xe9);
+		emit32(&j, j.epilogue - (j.size + 4));
+	}
+
+	dm_jitcode *code = NULL;
+	if (!t.failed) {
+		code = install(&j, "dm_trace", dm_chunk_line_at(chunk, steps[0].addr));
+	}
+	free(t.vartypes);
+	free(looptypes);
+	free(t.exits);
+	free(j.code);
+	return code;
+}
+
+void dm_trace_enter(dm_chunk *chunk, dm_jit_frame *f) {
+	if (chunk->traces == NULL) {
+		chunk->tracesize = chunk->codesize;
+		chunk->traces = calloc(chunk->tracesize, sizeof(dm_trace*));
+	}
+	int header = f->ip;
+	if (header >= chunk->tracesize) {
+		return;
+	}
+	dm_trace *trace = chunk->traces[header];
+	if (trace == NULL) {
+		trace = chunk->traces[header] = calloc(1, sizeof(dm_trace));
+	}
+	if (trace->code == NULL) {
+		if (trace->attempts == DM_TRACE_ATTEMPTS || ++trace->count < DM_TRACE_HOT) {
+			return;
+		}
+		trace->count = 0;
+		trace->attempts++;
+		step steps[DM_TRACE_MAX];
+		int n = record(chunk, f, steps);
+		if (n > 0) {
+			trace->code = compile_trace(chunk, stack_depth(chunk, f), steps, n);
+		}
+		if (trace->code == NULL) {
+			if (dm_debug_enabled(f->dm)) {
+				fprintf(stderr, "trace: can't trace the loop at line %d\n", dm_chunk_line_at(chunk, header));
+			}
+			return;
+		}
+	}
+	trace->code->entry(f);
+}
+
+void dm_trace_free(dm_chunk *chunk) {
+	for (int addr = 0; chunk->traces != NULL && addr < chunk->tracesize; addr++) {
+		if (chunk->traces[addr] != NULL) {
+			dm_jit_free(chunk->traces[addr]->code);
+			free(chunk->traces[addr]);
+		}
+	}
+	free(chunk->traces);
+	chunk->traces = NULL;
+	chunk->tracesize = 0;
+}
+
+bool dm_jit_hot(dm_state *dm, dm_chunk *chunk) {
+	if (chunk->jit != NULL) {
+		return true;
+	}
+	// a chunk that can't be compiled stays at the threshold
+	if (chunk->hotness < DM_JIT_HOT && ++chunk->hotness == DM_JIT_HOT) {
+		chunk->jit = compile(chunk);
+		if (chunk->jit == NULL && dm_debug_enabled(dm)) {
+			fprintf(stderr, "jit: can't compile the chunk at line %d\n", dm_chunk_line_at(chunk, 0));
+		}
+	}
+	return chunk->jit != NULL;
+}
+
+void dm_jit_run(dm_chunk *chunk, dm_jit_frame *f) {
+	chunk->jit->entry(f);
+}
+
+void dm_jit_free(dm_jitcode *code) {
+	if (code == NULL) {
+		return;
+	}
+	munmap(code->mem, code->size);
+	free(code);
+}
+
+#else
+
+bool dm_jit_hot(dm_state *dm, dm_chunk *chunk) {
+	(void) dm;
+	(void) chunk;
+	return false;
+}
+
+void dm_jit_run(dm_chunk *chunk, dm_jit_frame *f) {
+	(void) chunk;
+	(void) f;
+}
+
+void dm_jit_free(struct dm_jitcode *code) {
+	(void) code;
+}
+
+void dm_trace_enter(dm_chunk *chunk, dm_jit_frame *f) {
+	(void) chunk;
+	(void) f;
+}
+
+void dm_trace_free(dm_chunk *chunk) {
+	(void) chunk;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <dm_value.h>
+#include <dm_chunk.h>
+
+// The baseline jit translates the stack code of a hot chunk into x86-64 code,
+// one template per instruction, that works on the stack and the variables of
+// the frame like the stack vm does. Calls, returns, closures and imports are
+// left to the vm: the code stops in front of them and the vm enters it again
+// after them, at any address. Everything that isn't a number goes through the
+// modules, a chunk with an instruction the jit doesn't know stays interpreted.
+// Every compiled chunk is added to /tmp/perf-<pid>.map for perf.
+//
+// With --trace a loop that ran often is recorded for one iteration and
+// compiled for the types and the path it took there, see dm_trace_enter in
+// dm_jit.c. With --jit as well, the code of a chunk runs the traces its loops
+// had when it was compiled.
+//
+// Only built on x86-64 without NaN-boxing, elsewhere no chunk ever gets hot.
+
+// the frame the code runs on, the vm fills it in and reads ip and top back
+typedef struct dm_jit_frame {
+	dm_state *dm;
+	dm_value func;
+	dm_value *vars;             // the slots of the frame
+	dm_value *top;              // the next free slot of the stack
+	struct dm_upval **upvals;
+	int ip;                     // where the code starts and where it stopped
+	int *frame_ip;              // the ip of the frame, errors print backtraces from it
+} dm_jit_frame;
+
+// Counts one more call or loop iteration of the chunk and compiles it once it
+// got hot, returns whether the chunk has code.
+bool dm_jit_hot(dm_state *dm, dm_chunk *chunk);
+// Runs the code of the chunk from f->ip to the next instruction the vm has to
+// execute, f->ip is its address.
+void dm_jit_run(dm_chunk *chunk, dm_jit_frame *f);
+void dm_jit_free(struct dm_jitcode *code);
+
+// A loop of the tracing jit, by the address it starts at in chunk->traces.
+typedef struct dm_trace {
+	int count;                  // back jumps since the last recording
+	int attempts;               // recordings that couldn't be compiled
+	struct dm_jitcode *code;
+} dm_trace;
+
+#define DM_TRACE_ATTEMPTS 3
+
+// Whether dm_trace_enter has something to do for the loop at addr, the vm
+// doesn't call it for the loops it gave up on.
+static inline bool dm_trace_live(dm_chunk *chunk, int addr) {
+	dm_trace *trace = chunk->traces != NULL && addr < chunk->tracesize ? chunk->traces[addr] : NULL;
+	return trace == NULL || trace->code != NULL || trace->attempts < DM_TRACE_ATTEMPTS;
+}
+
+// Counts one more iteration of the loop starting at f->ip and runs its trace
+// once it has one, f->ip and f->top are where the vm goes on.
+void dm_trace_enter(dm_chunk *chunk, dm_jit_frame *f);
+void dm_trace_free(dm_chunk *chunk);
@@ -6,6 +6,7 @@
 #include <dm_vm.h>
 #include <dm_state.h>
 #include <dm_lsp.h>
+#include <dm_aot.h>
 
 #define DM_REPL_PROMPT "> "
 
@@ -14,9 +15,17 @@ static void usage(char **argv) {
 	fprintf(stderr, "  run repl:       %s\n", argv[0]);
 	fprintf(stderr, "  run script:     %s <path>\n", argv[0]);
 	fprintf(stderr, "  run lsp:        %s --lsp\n", argv[0]);
+	fprintf(stderr, "  compile to C:   %s --emit-c <path>\n", argv[0]);
 	fprintf(stderr, "  print help:     %s --help\n", argv[0]);
 	fprintf(stderr, "Additional options:\n");
 	fprintf(stderr, "  enable debug:   --debug\n");
+	fprintf(stderr, "  register vm:    --regvm\n");
+	fprintf(stderr, "  no const fold:  --no-fold\n");
+	fprintf(stderr, "  no peephole:    --no-peephole\n");
+	fprintf(stderr, "  no inlining:    --no-inline\n");
+	fprintf(stderr, "  jit (x86-64):   --jit\n");
+	fprintf(stderr, "  tracing jit:    --trace\n");
+	fprintf(stderr, "  optimize:       -O0 | -O1 (default for scripts, the repl runs -O0)\n");
 }
 
 static void run(dm_state *dm, char *prog, bool repl) {
@@ -55,6 +64,12 @@ static void run_file(dm_state *dm, const char *path) {
 	char *source = dm_read_file(path);
 	run(dm, source, false);
 	free(source);
+#ifdef DM_VM_STATS
+	fprintf(stderr, "instructions executed: %llu\n", dm_vm_instructions_executed());
+	if (!dm_regvm_enabled(dm)) {
+		dm_vm_print_opcode_pairs(50);
+	}
+#endif
 }
 
 int main(int argc, char **argv) {
@@ -64,19 +79,37 @@ int main(int argc, char **argv) {
 	}
 
 	const char *script = NULL;
+	int optlevel = -1;
+	bool emit_c = false;
 
 	for (int i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--help") == 0) {
 			usage(argv);
 			return 0;
 		} else if (strcmp(argv[i], "--argument-list") == 0) {
-			printf("--help --lsp --debug\n");
+			printf("--help --lsp --debug --regvm --no-fold --no-peephole --no-inline --jit --trace --emit-c -O0 -O1\n");
 			return 0;
 		} else if (strcmp(argv[i], "--lsp") == 0) {
 			dm_lsp_run(dm);
 			return 0;
 		} else if (strcmp(argv[i], "--debug") == 0) {
 			dm_enable_debug(dm);
+		} else if (strcmp(argv[i], "--regvm") == 0) {
+			dm_enable_regvm(dm);
+		} else if (strcmp(argv[i], "--no-fold") == 0) {
+			dm_disable_fold(dm);
+		} else if (strcmp(argv[i], "--no-peephole") == 0) {
+			dm_disable_peephole(dm);
+		} else if (strcmp(argv[i], "--no-inline") == 0) {
+			dm_disable_inline(dm);
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			dm_enable_jit(dm);
+		} else if (strcmp(argv[i], "--trace") == 0) {
+			dm_enable_trace(dm);
+		} else if (strcmp(argv[i], "--emit-c") == 0) {
+			emit_c = true;
+		} else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0) {
+			optlevel = argv[i][2] - '0';
 		} else {
 			if (script == NULL) {
 				script = argv[i];
@@ -84,7 +117,19 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (script == NULL) {
+	// code typed into the repl runs once, optimizing it doesn't pay off
+	dm_set_opt_level(dm, optlevel != -1 ? optlevel : script == NULL ? 0 : 1);
+	if (emit_c) {
+		if (script == NULL) {
+			usage(argv);
+			return 1;
+		}
+		char *source = dm_read_file(script);
+		int error = dm_aot_emit(dm, source, stdout);
+		free(source);
+		dm_close(dm);
+		return error;
+	} else if (script == NULL) {
 		repl(dm);
 	} else {
 		run_file(dm, script);
@@ -8,7 +8,7 @@ static void dm_nil_inspect(dm_state *dm, dm_value self) {
 
 static bool dm_nil_equals(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm, (void) self;
-	return other.type == DM_TYPE_NIL;
+	return dm_value_type(other) == DM_TYPE_NIL;
 }
 
 static bool dm_nil_fieldset(dm_state *dm, dm_value self, const char *field, dm_value v) {
@@ -0,0 +1,146 @@
+#include <dm_ops.h>
+
+dm_value dm_op_arith(dm_state *dm, dm_opcode op, dm_value a, dm_value b) {
+	dm_module *m = dm_state_get_module(dm, dm_value_type(a));
+	switch (op) {
+		case DM_OP_PLUS:  return m->add(dm, a, b);
+		case DM_OP_MINUS: return m->sub(dm, a, b);
+		case DM_OP_MUL:   return m->mul(dm, a, b);
+		case DM_OP_DIV:   return m->div(dm, a, b);
+		case DM_OP_MOD:   return m->mod(dm, a, b);
+		default:          break;
+	}
+
+	dm_runtime_error(dm, "Can't execute arithmetic op %d", op);
+}
+
+dm_value dm_op_opassign(dm_state *dm, dm_opassign op, dm_value old, dm_value v) {
+	dm_module *m = dm_state_get_module(dm, dm_value_type(old));
+	switch (op) {
+		case DM_OPASSIGN_PLUS:  return m->add(dm, old, v);
+		case DM_OPASSIGN_MINUS: return m->sub(dm, old, v);
+		case DM_OPASSIGN_MUL:   return m->mul(dm, old, v);
+		case DM_OPASSIGN_DIV:   return m->div(dm, old, v);
+		case DM_OPASSIGN_MOD:   return m->mod(dm, old, v);
+	}
+
+	dm_runtime_error(dm, "Can't execute op-assign %d", op);
+}
+
+int dm_op_compare(dm_state *dm, dm_value a, dm_value b) {
+	if (dm_op_is_number(a) && dm_op_is_number(b)) {
+		return dm_op_compare_numbers(a, b);
+	}
+	return dm_state_get_module(dm, dm_value_type(a))->compare(dm, a, b);
+}
+
+bool dm_op_equals(dm_state *dm, dm_value a, dm_value b) {
+	if (dm_op_is_number(a) && dm_op_is_number(b)) {
+		return dm_op_numbers_equal(a, b);
+	}
+	return dm_value_equals(dm, a, b);
+}
+
+dm_value dm_op_negate(dm_state *dm, dm_value v) {
+	if (dm_value_type(v) == DM_TYPE_INT) {
+		return dm_int_negate(dm, v);
+	} else if (dm_value_type(v) == DM_TYPE_FLOAT) {
+		return dm_float_negate(dm, v);
+	}
+	dm_runtime_error(dm, "Can't negate <%s>", dm_value_type_str(dm, v));
+}
+
+dm_value dm_op_not(dm_state *dm, dm_value v) {
+	if (dm_value_type(v) != DM_TYPE_BOOL) {
+		dm_runtime_error(dm, "Can't apply logical not to <%s>", dm_value_type_str(dm, v));
+	}
+	return dm_value_bool(!dm_value_as_bool(v));
+}
+
+dm_value dm_op_fieldget(dm_state *dm, dm_value table, dm_value field) {
+	if (dm_value_type(table) == DM_TYPE_ARRAY) {
+		return dm_value_array_get(dm, table, field);
+	} else if (dm_value_type(table) == DM_TYPE_TABLE) {
+		return dm_value_table_get(dm, table, field);
+	}
+	const char *msg = "Can't get field of <%s>, expected <array> or <table>";
+	dm_runtime_error(dm, msg, dm_value_type_str(dm, table));
+}
+
+dm_value dm_op_fieldget_s(dm_state *dm, dm_value table, dm_value field) {
+	dm_value v;
+	dm_module *m = dm_state_get_module(dm, dm_value_type(table));
+	const char *field_s = dm_string_c_str(dm_value_as_string(field));
+	if (!m->fieldget_s(dm, table, field_s, &v)) {
+		const char *ty = dm_value_type_str(dm, table);
+		dm_runtime_error(dm, "Can't get field '%s' of <%s>", field_s, ty);
+	}
+	return v;
+}
+
+void dm_op_fieldset(dm_state *dm, dm_value table, dm_value field, dm_value v) {
+	if (dm_value_type(table) == DM_TYPE_ARRAY) {
+		dm_value_array_set(dm, table, field, v);
+	} else if (dm_value_type(table) == DM_TYPE_TABLE) {
+		dm_value_table_set(dm, table, field, v);
+	} else {
+		dm_runtime_type_mismatch2(dm, DM_TYPE_ARRAY, DM_TYPE_TABLE, field);
+	}
+}
+
+void dm_op_fieldset_s(dm_state *dm, dm_value table, dm_value field, dm_value v) {
+	dm_module *m = dm_state_get_module(dm, dm_value_type(table));
+	const char *field_s = dm_string_c_str(dm_value_as_string(field));
+	if (!m->fieldset_s(dm, table, field_s, v)) {
+		const char *ty = dm_value_type_str(dm, table);
+		dm_runtime_error(dm, "Can't set field '%s' of <%s>", field_s, ty);
+	}
+}
+
+dm_value dm_op_fieldgetopset(dm_state *dm, dm_opassign op, dm_value table, dm_value field, dm_value v) {
+	if (dm_value_type(table) != DM_TYPE_ARRAY && dm_value_type(table) != DM_TYPE_TABLE) {
+		dm_runtime_type_mismatch2(dm, DM_TYPE_ARRAY, DM_TYPE_TABLE, field);
+	}
+	v = dm_op_opassign(dm, op, dm_op_fieldget(dm, table, field), v);
+	dm_op_fieldset(dm, table, field, v);
+	return v;
+}
+
+dm_value dm_op_fieldgetopset_s(dm_state *dm, dm_opassign op, dm_value table, dm_value field, dm_value v) {
+	v = dm_op_opassign(dm, op, dm_op_fieldget_s(dm, table, field), v);
+	dm_op_fieldset_s(dm, table, field, v);
+	return v;
+}
+
+dm_value dm_op_arraylit(dm_state *dm, int n, const dm_value *elements) {
+	dm_value arr = dm_value_array(dm, n);
+	while (n--) {
+		dm_value_array_set(dm, arr, dm_value_int(n), elements[n]);
+	}
+	return arr;
+}
+
+dm_value dm_op_tablelit(dm_state *dm, int n, const dm_value *elements) {
+	dm_value tab = dm_value_table(dm, n);
+	while (n--) {
+		dm_value_table_set(dm, tab, elements[2 * n], elements[2 * n + 1]);
+	}
+	return tab;
+}
+
+bool dm_op_for_compare(dm_state *dm, dm_opcode compare, dm_value i, dm_value limit) {
+	int cmp = dm_op_compare(dm, i, limit);
+	switch (compare) {
+		case DM_OP_LESS:      return cmp < 0;
+		case DM_OP_LESSEQUAL: return cmp <= 0;
+		case DM_OP_GREATER:   return cmp > 0;
+		default:              return cmp >= 0;
+	}
+}
+
+bool dm_op_for_step(dm_state *dm, dm_opcode compare, int step, dm_value *i, dm_value limit) {
+	bool up = compare == DM_OP_LESS || compare == DM_OP_LESSEQUAL;
+	dm_opassign op = up ? DM_OPASSIGN_PLUS : DM_OPASSIGN_MINUS;
+	*i = dm_op_opassign(dm, op, *i, dm_value_int(up ? step : -step));
+	return dm_op_for_compare(dm, compare, *i, limit);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <dm.h>
+#include <dm_value.h>
+#include <dm_state.h>
+#include <dm_chunk.h>
+
+// What the instructions do, shared by both vms, the jit and the code compiled
+// ahead of time. They all handle numbers inline, the helpers below give the
+// same results as the int and float modules. Everything else (and the error
+// cases) is in dm_ops.c and goes through the module of the left operand.
+
+static inline bool dm_op_falsey(dm_value val) {
+	return dm_value_type(val) == DM_TYPE_NIL || (dm_value_type(val) == DM_TYPE_BOOL && dm_value_as_bool(val) == false);
+}
+
+static inline bool dm_op_is_number(dm_value val) {
+	return dm_value_type(val) == DM_TYPE_INT || dm_value_type(val) == DM_TYPE_FLOAT;
+}
+
+static inline bool dm_op_is_int_pair(dm_value a, dm_value b) {
+	return dm_value_type(a) == DM_TYPE_INT && dm_value_type(b) == DM_TYPE_INT;
+}
+
+static inline bool dm_op_is_float_pair(dm_value a, dm_value b) {
+	return dm_op_is_number(a) && dm_op_is_number(b) && (dm_value_type(a) == DM_TYPE_FLOAT || dm_value_type(b) == DM_TYPE_FLOAT);
+}
+
+static inline dm_float dm_op_as_float(dm_value val) {
+	return dm_value_type(val) == DM_TYPE_INT ? (dm_float) dm_value_as_int(val) : dm_value_as_float(val);
+}
+
+static inline int dm_op_compare_floats(dm_float a, dm_float b) {
+	return a < b ? -1 : a == b ? 0 : 1;
+}
+
+static inline int dm_op_compare_numbers(dm_value a, dm_value b) {
+	if (dm_op_is_int_pair(a, b)) {
+		return dm_value_as_int(a) < dm_value_as_int(b) ? -1 : dm_value_as_int(a) == dm_value_as_int(b) ? 0 : 1;
+	} else if (dm_value_type(a) == DM_TYPE_INT) {
+		return -dm_op_compare_floats(dm_value_as_float(b), (dm_float) dm_value_as_int(a));
+	}
+
+	return dm_op_compare_floats(dm_value_as_float(a), dm_op_as_float(b));
+}
+
+static inline bool dm_op_numbers_equal(dm_value a, dm_value b) {
+	if (dm_op_is_int_pair(a, b)) {
+		return dm_value_as_int(a) == dm_value_as_int(b);
+	}
+
+	return dm_op_as_float(a) == dm_op_as_float(b);
+}
+
+// PLUS, MINUS, MUL, DIV and MOD by the module
+dm_value dm_op_arith(dm_state *dm, dm_opcode op, dm_value a, dm_value b);
+dm_value dm_op_opassign(dm_state *dm, dm_opassign op, dm_value old, dm_value v);
+int dm_op_compare(dm_state *dm, dm_value a, dm_value b);
+bool dm_op_equals(dm_state *dm, dm_value a, dm_value b);
+dm_value dm_op_negate(dm_state *dm, dm_value v);
+dm_value dm_op_not(dm_state *dm, dm_value v);
+
+// FIELDGET etc., the _s variants take a string constant as field
+dm_value dm_op_fieldget(dm_state *dm, dm_value table, dm_value field);
+dm_value dm_op_fieldget_s(dm_state *dm, dm_value table, dm_value field);
+void dm_op_fieldset(dm_state *dm, dm_value table, dm_value field, dm_value v);
+void dm_op_fieldset_s(dm_state *dm, dm_value table, dm_value field, dm_value v);
+dm_value dm_op_fieldgetopset(dm_state *dm, dm_opassign op, dm_value table, dm_value field, dm_value v);
+dm_value dm_op_fieldgetopset_s(dm_state *dm, dm_opassign op, dm_value table, dm_value field, dm_value v);
+
+// the literals of n elements, key and value after each other for tables
+dm_value dm_op_arraylit(dm_state *dm, int n, const dm_value *elements);
+dm_value dm_op_tablelit(dm_state *dm, int n, const dm_value *elements);
+
+// The condition of a counting loop, and the step of one that isn't counting
+// ints, like 'i = i + s' and the condition. compare is the one of dm_forloop.
+bool dm_op_for_compare(dm_state *dm, dm_opcode compare, dm_value i, dm_value limit);
+bool dm_op_for_step(dm_state *dm, dm_opcode compare, int step, dm_value *i, dm_value limit);
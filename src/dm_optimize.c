@@ -0,0 +1,1598 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dm_optimize.h>
+#include <dm_ir.h>
+#include <dm_function.h>
+
+// What the passes know about the chunk besides its IR. The variables of the
+// top level chunk are globals that closures and later runs of the repl see,
+// all of them count as captured. A call can only change the captured
+// variables some closure assigns.
+typedef struct {
+	dm_ir *ir;
+	int nvars;
+	bool *captured;             // variables closures can read and write
+	bool *clobbered;            // variables closures assign
+	int first_temp;             // variables from here on were added by the passes
+	dm_ir_node **order;         // scratch for dm_ir_block_order
+	int ordercapacity;
+	int *predstart;             // the predecessors of block b are preds[predstart[b]..predstart[b + 1]-1]
+	int *preds;
+	int *rpo;                   // index of a block in reverse postorder
+	int *idom;                  // immediate dominator of a block
+} optimizer;
+
+static dm_opcode node_op(dm_ir_node *node) {
+	return node->kind == DM_IR_INSTR ? dm_instr_op(node->instr) : DM_OP_NUM_OPS;
+}
+
+static int node_b(dm_ir_node *node) {
+	return dm_instr_b(node->instr);
+}
+
+static dm_forloop *node_loop(optimizer *o, dm_ir_node *node) {
+	return &o->ir->chunk->loops[dm_instr_a(node->instr)];
+}
+
+// the variable a node writes, -1 if none
+static int writes_var(optimizer *o, dm_ir_node *node) {
+	switch (node_op(node)) {
+		case DM_OP_VARSET:
+		case DM_OP_VARGETOPSET: return node_b(node);
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:     return node_loop(o, node)->var;
+		default:                return -1;
+	}
+}
+
+// runs code the compiler doesn't see, which may change captured variables,
+// upvalues and fields
+static bool calls(dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	return op == DM_OP_CALL || op == DM_OP_CALL_WITHPARENT || op == DM_OP_TAILCALL || op == DM_OP_IMPORT;
+}
+
+static bool writes_fields(dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	return op == DM_OP_FIELDSET || op == DM_OP_FIELDSET_S || op == DM_OP_FIELDGETOPSET
+		|| op == DM_OP_FIELDGETOPSET_S || calls(node);
+}
+
+static bool writes_upvals(dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	return op == DM_OP_VARSET_UP || op == DM_OP_VARGETOPSET_UP || calls(node);
+}
+
+// neither fails nor changes anything
+static bool is_pure(dm_opcode op) {
+	switch (op) {
+		case DM_OP_VARGET:
+		case DM_OP_VARGET_UP:
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_CLOSURE:
+		case DM_OP_ARRAYLIT:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL:
+		case DM_OP_SELF:
+		case DM_OP_EQUAL:
+		case DM_OP_NOTEQUAL: return true;
+		default:             return false;
+	}
+}
+
+// entry values have to stay on the stack
+static bool is_removable(dm_ir_node *node) {
+	if (node->kind == DM_IR_NOP) {
+		return true;
+	}
+	if (node->kind != DM_IR_INSTR || !is_pure(node_op(node))) {
+		return false;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		if (!is_removable(node->kids[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int intersect(optimizer *o, int a, int b) {
+	while (a != b) {
+		while (o->rpo[a] > o->rpo[b]) {
+			a = o->idom[a];
+		}
+		while (o->rpo[b] > o->rpo[a]) {
+			b = o->idom[b];
+		}
+	}
+	return a;
+}
+
+static bool dominates(optimizer *o, int a, int b) {
+	while (b != a && b != 0) {
+		b = o->idom[b];
+	}
+	return b == a;
+}
+
+// Finds the predecessors and dominators of the blocks, again after blocks
+// were inserted. The dominators are computed like in Cooper, Harvey and
+// Kennedy, "A Simple, Fast Dominance Algorithm".
+static void update_cfg(optimizer *o) {
+	dm_ir *ir = o->ir;
+	int n = ir->nblocks;
+	int succ[2];
+	free(o->predstart);
+	free(o->preds);
+	free(o->rpo);
+	free(o->idom);
+
+	o->predstart = calloc(n + 1, sizeof(int));
+	for (int b = 0; b < n; b++) {
+		int nsucc = dm_ir_successors(ir, b, succ);
+		for (int i = 0; i < nsucc; i++) {
+			o->predstart[succ[i] + 1]++;
+		}
+	}
+	for (int b = 0; b < n; b++) {
+		o->predstart[b + 1] += o->predstart[b];
+	}
+	o->preds = malloc(o->predstart[n] * sizeof(int) + 1);
+	int *fill = malloc(n * sizeof(int));
+	memcpy(fill, o->predstart, n * sizeof(int));
+	for (int b = 0; b < n; b++) {
+		int nsucc = dm_ir_successors(ir, b, succ);
+		for (int i = 0; i < nsucc; i++) {
+			o->preds[fill[succ[i]]++] = b;
+		}
+	}
+
+	// depth first from the entry, blocks are added to the order when all
+	// their successors are done
+	o->rpo = malloc(n * sizeof(int));
+	int *order = malloc(n * sizeof(int));
+	int *stack = malloc(n * sizeof(int));
+	int *next = fill;
+	int size = n;
+	int sp = 0;
+	for (int b = 0; b < n; b++) {
+		o->rpo[b] = -1;
+		next[b] = 0;
+	}
+	o->rpo[0] = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		int b = stack[sp - 1];
+		int nsucc = dm_ir_successors(ir, b, succ);
+		if (next[b] < nsucc) {
+			int s = succ[next[b]++];
+			if (o->rpo[s] == -1) {
+				o->rpo[s] = 0;
+				stack[sp++] = s;
+			}
+		} else {
+			order[--size] = stack[--sp];
+		}
+	}
+	for (int i = size; i < n; i++) {
+		o->rpo[order[i]] = i - size;
+	}
+
+	o->idom = malloc(n * sizeof(int));
+	for (int b = 0; b < n; b++) {
+		o->idom[b] = -1;
+	}
+	o->idom[0] = 0;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i = size + 1; i < n; i++) {
+			int b = order[i];
+			int idom = -1;
+			for (int p = o->predstart[b]; p < o->predstart[b + 1]; p++) {
+				int pred = o->preds[p];
+				if (o->idom[pred] != -1) {
+					idom = idom == -1 ? pred : intersect(o, pred, idom);
+				}
+			}
+			if (idom != o->idom[b]) {
+				o->idom[b] = idom;
+				changed = true;
+			}
+		}
+	}
+	free(stack);
+	free(order);
+	free(fill);
+}
+
+static int order(optimizer *o, int b) {
+	return dm_ir_block_order(&o->ir->blocks[b], &o->order, &o->ordercapacity);
+}
+
+static int new_temp(optimizer *o) {
+	int temp = dm_ir_add_temp(o->ir);
+	if (temp != -1 && temp >= o->nvars) {
+		o->nvars = temp + 1;
+		o->captured = realloc(o->captured, o->nvars * sizeof(bool));
+		o->clobbered = realloc(o->clobbered, o->nvars * sizeof(bool));
+		o->captured[temp] = false;
+		o->clobbered[temp] = false;
+	}
+	return temp;
+}
+
+// Copy propagation: after 'x = y' or 'x = constant' reads of x read y or the
+// constant, as long as neither x nor y change. The copies that hold at the
+// start of a block are the ones that hold at the end of all its predecessors.
+#define COPY_NONE    dm_instr_make(DM_OP_NUM_OPS, 0, 0)
+#define COPY_UNKNOWN dm_instr_make(DM_OP_NUM_OPS, 1, 0)
+
+static bool is_copy_source(dm_ir_node *node) {
+	switch (node_op(node)) {
+		case DM_OP_VARGET:
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL: return true;
+		default:        return false;
+	}
+}
+
+static void kill_copies(optimizer *o, dm_instr *copies, int var) {
+	copies[var] = COPY_NONE;
+	for (int v = 0; v < o->nvars; v++) {
+		if (dm_instr_op(copies[v]) == DM_OP_VARGET && dm_instr_b(copies[v]) == var) {
+			copies[v] = COPY_NONE;
+		}
+	}
+}
+
+static int copy_node(optimizer *o, dm_ir_node *node, dm_instr *copies, bool rewrite) {
+	int changes = 0;
+	for (int i = 0; i < node->nkids; i++) {
+		changes += copy_node(o, node->kids[i], copies, rewrite);
+	}
+
+	dm_opcode op = node_op(node);
+	if (rewrite && op == DM_OP_VARGET) {
+		dm_instr copy = copies[node_b(node)];
+		if (copy != COPY_NONE && copy != COPY_UNKNOWN) {
+			node->instr = copy;
+			changes++;
+		}
+	}
+
+	int var = writes_var(o, node);
+	if (var != -1) {
+		kill_copies(o, copies, var);
+	}
+	for (int v = 0; v < o->nvars && calls(node); v++) {
+		if (o->clobbered[v]) {
+			kill_copies(o, copies, v);
+		}
+	}
+	if (op == DM_OP_VARSET && node->nkids == 1 && is_copy_source(node->kids[0])) {
+		dm_instr source = node->kids[0]->instr;
+		if (dm_instr_op(source) != DM_OP_VARGET || dm_instr_b(source) != var) {
+			copies[var] = source;
+		}
+	}
+	return changes;
+}
+
+static int copy_block(optimizer *o, int b, dm_instr *copies, bool rewrite) {
+	int changes = 0;
+	dm_ir_block *block = &o->ir->blocks[b];
+	for (int i = 0; i < block->nroots; i++) {
+		changes += copy_node(o, block->roots[i], copies, rewrite);
+	}
+	return changes;
+}
+
+static int copy_propagation(optimizer *o) {
+	int nblocks = o->ir->nblocks;
+	int nvars = o->nvars;
+	dm_instr *out = malloc(nblocks * nvars * sizeof(dm_instr) + 1);
+	dm_instr *in = malloc(nblocks * nvars * sizeof(dm_instr) + 1);
+	dm_instr *copies = malloc(nvars * sizeof(dm_instr) + 1);
+	for (int i = 0; i < nblocks * nvars; i++) {
+		out[i] = COPY_UNKNOWN;
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int b = 0; b < nblocks; b++) {
+			dm_instr *blockin = &in[b * nvars];
+			for (int v = 0; v < nvars; v++) {
+				dm_instr copy = b == 0 ? COPY_NONE : COPY_UNKNOWN;
+				for (int i = o->predstart[b]; i < o->predstart[b + 1]; i++) {
+					dm_instr pred = out[o->preds[i] * nvars + v];
+					if (pred == COPY_UNKNOWN) {
+						continue;
+					}
+					copy = copy == COPY_UNKNOWN || copy == pred ? pred : COPY_NONE;
+				}
+				blockin[v] = copy;
+			}
+
+			memcpy(copies, blockin, nvars * sizeof(dm_instr));
+			copy_block(o, b, copies, false);
+			if (memcmp(copies, &out[b * nvars], nvars * sizeof(dm_instr)) != 0) {
+				memcpy(&out[b * nvars], copies, nvars * sizeof(dm_instr));
+				changed = true;
+			}
+		}
+	}
+
+	int changes = 0;
+	for (int b = 0; b < nblocks; b++) {
+		memcpy(copies, &in[b * nvars], nvars * sizeof(dm_instr));
+		changes += copy_block(o, b, copies, true);
+	}
+	free(copies);
+	free(in);
+	free(out);
+	return changes;
+}
+
+// Inlining: a call of a function constant whose body is a few instructions
+// without calls, jumps and upvalues runs the body in place of the call. The
+// arguments and variables of the function become temporaries, the calls of a
+// function share them unless one is inside the arguments of another. The
+// inlined instructions keep their lines through the inline sites of the chunk.
+#define INLINE_MAX_SIZE 24
+
+typedef struct {
+	int constant;
+	int depth;                  // calls inside the arguments of a call are one deeper
+	int *temps;                 // by variable of the function
+} inline_temps;
+
+typedef struct {
+	optimizer *o;
+	bool *checked;              // by constant
+	dm_ir **bodies;             // the IR of the function, NULL if it isn't inlined
+	int **constmaps;            // its constants among those of the chunk
+	int ntemps;
+	int tempcapacity;
+	inline_temps *temps;
+} inliner;
+
+// the body reads no variable of the function before it was assigned, it would
+// be nil on a call but holds what the last call left in the temporary
+static bool can_inline(dm_ir_node *node, bool *assigned, int *size) {
+	if (node->kind != DM_IR_INSTR) {
+		return node->kind == DM_IR_NOP;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		if (!can_inline(node->kids[i], assigned, size)) {
+			return false;
+		}
+	}
+	if (node->line < 0 || ++*size > INLINE_MAX_SIZE) {
+		return false;
+	}
+	dm_opcode op = node_op(node);
+	switch (op) {
+		case DM_OP_VARGET:
+		case DM_OP_VARGETOPSET:
+			return assigned[node_b(node)];
+		case DM_OP_VARSET:
+			assigned[node_b(node)] = true;
+			return true;
+		case DM_OP_CALL:
+		case DM_OP_CALL_WITHPARENT:
+		case DM_OP_TAILCALL:
+		case DM_OP_IMPORT:
+		case DM_OP_CLOSURE:
+		case DM_OP_SELF:
+		case DM_OP_VARGET_UP:
+		case DM_OP_VARSET_UP:
+		case DM_OP_VARGETOPSET_UP:
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:
+		case DM_OP_RETURN:
+			return false;
+		default:
+			return !dm_opcode_is_jump(op);
+	}
+}
+
+static bool map_constants(inliner *in, int k, dm_ir *body) {
+	dm_chunk *chunk = in->o->ir->chunk;
+	dm_chunk *fchunk = body->chunk;
+	in->constmaps[k] = malloc(fchunk->constsize * sizeof(int) + 1);
+	for (int i = 0; i < body->nnodes; i++) {
+		dm_ir_node *node = body->nodes[i];
+		if (node_op(node) == DM_OP_CONSTANT) {
+			int index = dm_chunk_add_constant(body->dm, chunk, fchunk->consts[node_b(node)]);
+			if (index > UINT16_MAX) {
+				return false;
+			}
+			in->constmaps[k][node_b(node)] = index;
+		}
+	}
+	return true;
+}
+
+// The body of the function in constant k: a single block that returns the
+// value of its last expression.
+static dm_ir *inline_body(inliner *in, int k) {
+	if (in->checked[k]) {
+		return in->bodies[k];
+	}
+	in->checked[k] = true;
+	dm_ir *ir = in->o->ir;
+	dm_value c = ir->chunk->consts[k];
+	if (dm_value_type(c) != DM_TYPE_FUNCTION) {
+		return NULL;
+	}
+	dm_function *fn = dm_value_as_function(c);
+	dm_chunk *fchunk = (dm_chunk*) fn->chunk;
+	if (fn->takes_self || fchunk->upvalsize > 0) {
+		return NULL;
+	}
+	dm_ir *body = dm_ir_build(ir->dm, fchunk);
+	if (body == NULL) {
+		return NULL;
+	}
+
+	dm_ir_block *block = &body->blocks[0];
+	bool *assigned = calloc(fchunk->varsize + 1, sizeof(bool));
+	for (int v = 0; v < fn->nargs; v++) {
+		assigned[v] = true;
+	}
+	int size = 0;
+	bool ok = block->nentry == 0 && block->nroots > 0;
+	for (int i = 0; ok && i < block->nroots - 1; i++) {
+		ok = block->roots[i]->pushes == 0 && can_inline(block->roots[i], assigned, &size);
+	}
+	dm_ir_node *ret = ok ? block->roots[block->nroots - 1] : NULL;
+	ok = ok && node_op(ret) == DM_OP_RETURN && ret->nkids == 1 && ret->kids[0]->pushes == 1
+		&& can_inline(ret->kids[0], assigned, &size);
+	free(assigned);
+	if (!ok || !map_constants(in, k, body)) {
+		dm_ir_free(body);
+		return NULL;
+	}
+	in->bodies[k] = body;
+	return body;
+}
+
+static int *inline_temps_of(inliner *in, int k, int depth) {
+	for (int i = 0; i < in->ntemps; i++) {
+		if (in->temps[i].constant == k && in->temps[i].depth == depth) {
+			return in->temps[i].temps;
+		}
+	}
+	int nvars = in->bodies[k]->chunk->varsize;
+	int *temps = malloc(nvars * sizeof(int) + 1);
+	for (int v = 0; v < nvars; v++) {
+		temps[v] = new_temp(in->o);
+		if (temps[v] == -1) {
+			free(temps);
+			return NULL;
+		}
+	}
+	if (in->ntemps >= in->tempcapacity) {
+		in->tempcapacity = in->tempcapacity == 0 ? 8 : in->tempcapacity * 2;
+		in->temps = realloc(in->temps, in->tempcapacity * sizeof(inline_temps));
+	}
+	in->temps[in->ntemps++] = (inline_temps){k, depth, temps};
+	return temps;
+}
+
+// the constant of the function a call node calls if it can be inlined, else -1
+static int inline_site(inliner *in, dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	if ((op != DM_OP_CALL && op != DM_OP_TAILCALL) || node->line < 0 || node->nkids != dm_instr_a(node->instr) + 1
+			|| node_op(node->kids[0]) != DM_OP_CONSTANT) {
+		return -1;
+	}
+	for (int i = 1; i < node->nkids; i++) {
+		if (node->kids[i]->pushes != 1) {
+			return -1;
+		}
+	}
+	int k = node_b(node->kids[0]);
+	dm_ir *body = inline_body(in, k);
+	if (body == NULL || dm_value_as_function(in->o->ir->chunk->consts[k])->nargs != node->nkids - 1) {
+		return -1;
+	}
+	return k;
+}
+
+static void remap_inlined(inliner *in, dm_ir_node *node, int k, int *temps, int call_line, bool tail) {
+	dm_ir_node **kids = node->kids;
+	for (int i = 0; i < node->nkids; i++) {
+		remap_inlined(in, kids[i], k, temps, call_line, tail);
+	}
+	dm_opcode op = node_op(node);
+	if (op == DM_OP_VARGET || op == DM_OP_VARSET || op == DM_OP_VARGETOPSET) {
+		node->instr = dm_instr_make(op, dm_instr_a(node->instr), temps[node_b(node)]);
+	} else if (op == DM_OP_CONSTANT) {
+		node->instr = dm_instr_make(op, 0, in->constmaps[k][node_b(node)]);
+	}
+	dm_chunk *chunk = in->o->ir->chunk;
+	node->line = dm_chunk_add_inline_site(chunk, chunk->consts[k], node->line, call_line, tail);
+}
+
+// The arguments are stored to the temporaries of the parameters, then the
+// statements of the body run and the call node becomes its last expression.
+static void inline_call(inliner *in, dm_ir_node *node, int k, int *temps) {
+	dm_ir *ir = in->o->ir;
+	dm_ir_block *block = &in->bodies[k]->blocks[0];
+	int nargs = node->nkids - 1;
+	int nstmts = nargs + block->nroots - 1;
+
+	// an inlined tail call leaves no frame of the caller behind either
+	bool tail = node_op(node) == DM_OP_TAILCALL;
+	dm_ir_node *value = dm_ir_node_copy(ir, block->roots[block->nroots - 1]->kids[0]);
+	remap_inlined(in, value, k, temps, node->line, tail);
+	dm_ir_node **kids = malloc((nstmts + value->nkids) * sizeof(dm_ir_node*) + 1);
+	for (int i = 0; i < nargs; i++) {
+		dm_ir_node *pop = dm_ir_node_new(ir, dm_instr_make(DM_OP_POP, 0, 0), node->line, 1);
+		pop->kids[0] = dm_ir_node_new(ir, dm_instr_make(DM_OP_VARSET, 0, temps[i]), node->line, 1);
+		pop->kids[0]->kids[0] = node->kids[i + 1];
+		kids[i] = pop;
+	}
+	for (int i = 0; i < block->nroots - 1; i++) {
+		kids[nargs + i] = dm_ir_node_copy(ir, block->roots[i]);
+		remap_inlined(in, kids[nargs + i], k, temps, node->line, tail);
+	}
+	for (int i = 0; i < value->nkids; i++) {
+		kids[nstmts + i] = value->kids[i];
+	}
+
+	free(node->kids);
+	node->kind = value->kind;
+	node->instr = value->instr;
+	node->line = value->line;
+	node->pushes = value->pushes;
+	node->kids = kids;
+	node->nkids = nstmts + value->nkids;
+	free(value->kids);
+	value->kids = NULL;
+	value->nkids = 0;
+}
+
+static int inline_node(inliner *in, dm_ir_node *node, int depth) {
+	int k = inline_site(in, node);
+	int changes = 0;
+	for (int i = 0; i < node->nkids; i++) {
+		changes += inline_node(in, node->kids[i], k != -1 ? depth + 1 : depth);
+	}
+	int *temps = k != -1 ? inline_temps_of(in, k, depth) : NULL;
+	if (temps != NULL) {
+		inline_call(in, node, k, temps);
+		changes++;
+	}
+	return changes;
+}
+
+static int inlining(optimizer *o) {
+	if (!dm_inline_enabled(o->ir->dm)) {
+		return 0;
+	}
+	int nconsts = o->ir->chunk->constsize;
+	inliner in = {
+		.o = o,
+		.checked = calloc(nconsts + 1, sizeof(bool)),
+		.bodies = calloc(nconsts + 1, sizeof(dm_ir*)),
+		.constmaps = calloc(nconsts + 1, sizeof(int*)),
+	};
+	int changes = 0;
+	for (int b = 0; b < o->ir->nblocks; b++) {
+		dm_ir_block *block = &o->ir->blocks[b];
+		for (int i = 0; i < block->nroots; i++) {
+			changes += inline_node(&in, block->roots[i], 0);
+		}
+	}
+
+	for (int k = 0; k < nconsts; k++) {
+		if (in.bodies[k] != NULL) {
+			dm_ir_free(in.bodies[k]);
+		}
+		free(in.constmaps[k]);
+	}
+	for (int i = 0; i < in.ntemps; i++) {
+		free(in.temps[i].temps);
+	}
+	free(in.temps);
+	free(in.constmaps);
+	free(in.bodies);
+	free(in.checked);
+	return changes;
+}
+
+// Common subexpressions: an expression that is computed again in the same
+// block while nothing it reads changed is read from a temporary the first
+// computation stores to. Only expressions that give the same value again and
+// whose value is no new object a program could change count, + - * of arrays
+// make new arrays.
+typedef struct {
+	dm_ir_node *expr;
+	int temp;                   // -1 until the expression is found again
+} available;
+
+typedef struct {
+	int size;
+	int capacity;
+	available *data;
+} availables;
+
+// the expression a temporary of the pass stores
+static dm_ir_node *unwrap(optimizer *o, dm_ir_node *node) {
+	if (node_op(node) == DM_OP_VARSET && node_b(node) >= o->first_temp && node->nkids == 1) {
+		return node->kids[0];
+	}
+	return node;
+}
+
+static bool never_array(dm_ir_node *node) {
+	switch (node_op(node)) {
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL:
+		case DM_OP_NEGATE:
+		case DM_OP_NOT:
+		case DM_OP_DIV:
+		case DM_OP_MOD:
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL:
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL: return true;
+		// the module of the left operand makes the result
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:          return node->nkids == 2 && never_array(node->kids[0]);
+		default:                 return false;
+	}
+}
+
+static bool is_repeatable(dm_ir_node *node) {
+	if (node->kind != DM_IR_INSTR || node->pushes != 1) {
+		return false;
+	}
+	switch (node_op(node)) {
+		case DM_OP_VARGET:
+		case DM_OP_VARGET_UP:
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL:
+		case DM_OP_SELF:         return true;
+		case DM_OP_FIELDGET:
+		case DM_OP_FIELDGET_S:
+		case DM_OP_NEGATE:
+		case DM_OP_NOT:
+		case DM_OP_DIV:
+		case DM_OP_MOD:
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL:
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL:
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:          break;
+		default:                 return false;
+	}
+
+	// only operands, no statements that ran in between
+	int pops, pushes;
+	dm_instr_stack_effect(node->instr, &pops, &pushes);
+	if (node->nkids != pops) {
+		return false;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		if (!is_repeatable(node->kids[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int expr_size(dm_ir_node *node) {
+	int size = 1;
+	for (int i = 0; i < node->nkids; i++) {
+		size += expr_size(node->kids[i]);
+	}
+	return size;
+}
+
+// worth a temporary: the second computation saves more than the store costs.
+// A new array inside is only seen by the operator that takes it.
+static bool is_candidate(dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	bool new_array = (op == DM_OP_PLUS || op == DM_OP_MINUS || op == DM_OP_MUL) && !never_array(node);
+	return !new_array && is_repeatable(node) && expr_size(node) >= 3;
+}
+
+static bool same_expr(optimizer *o, dm_ir_node *x, dm_ir_node *y) {
+	x = unwrap(o, x);
+	y = unwrap(o, y);
+	if (x->kind != DM_IR_INSTR || y->kind != DM_IR_INSTR || x->instr != y->instr || x->nkids != y->nkids) {
+		return false;
+	}
+	for (int i = 0; i < x->nkids; i++) {
+		if (!same_expr(o, x->kids[i], y->kids[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// whether an expression reads something the node changes
+static bool is_killed_by(optimizer *o, dm_ir_node *expr, dm_ir_node *node) {
+	expr = unwrap(o, expr);
+	dm_opcode op = node_op(expr);
+	int var = writes_var(o, node);
+	if (op == DM_OP_VARGET && (node_b(expr) == var || (calls(node) && o->clobbered[node_b(expr)]))) {
+		return true;
+	}
+	if ((op == DM_OP_FIELDGET || op == DM_OP_FIELDGET_S) && writes_fields(node)) {
+		return true;
+	}
+	if (op == DM_OP_VARGET_UP && writes_upvals(node)) {
+		return true;
+	}
+	for (int i = 0; i < expr->nkids; i++) {
+		if (is_killed_by(o, expr->kids[i], node)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int cse_node(optimizer *o, dm_ir_node *node, availables *avail) {
+	if (is_candidate(node)) {
+		for (int i = 0; i < avail->size; i++) {
+			available *a = &avail->data[i];
+			if (!same_expr(o, a->expr, node)) {
+				continue;
+			}
+			if (a->temp == -1) {
+				a->temp = new_temp(o);
+				if (a->temp == -1) {
+					return 0;
+				}
+				// the first computation stores its value
+				dm_ir_node *expr = a->expr;
+				dm_ir_node *inner = dm_ir_node_new(o->ir, expr->instr, expr->line, 0);
+				inner->nkids = expr->nkids;
+				inner->kids = expr->kids;
+				expr->instr = dm_instr_make(DM_OP_VARSET, 0, a->temp);
+				expr->nkids = 1;
+				expr->kids = malloc(sizeof(dm_ir_node*));
+				expr->kids[0] = inner;
+				a->expr = inner;
+			}
+			free(node->kids);
+			node->kids = NULL;
+			node->nkids = 0;
+			node->instr = dm_instr_make(DM_OP_VARGET, 0, a->temp);
+			return 1;
+		}
+	}
+
+	int changes = 0;
+	for (int i = 0; i < node->nkids; i++) {
+		changes += cse_node(o, node->kids[i], avail);
+	}
+
+	for (int i = 0; i < avail->size;) {
+		if (is_killed_by(o, avail->data[i].expr, node)) {
+			avail->data[i] = avail->data[--avail->size];
+		} else {
+			i++;
+		}
+	}
+	if (is_candidate(node)) {
+		if (avail->size >= avail->capacity) {
+			avail->capacity = avail->capacity == 0 ? 16 : avail->capacity * 2;
+			avail->data = realloc(avail->data, avail->capacity * sizeof(available));
+		}
+		avail->data[avail->size++] = (available){node, -1};
+	}
+	return changes;
+}
+
+static int common_subexpressions(optimizer *o) {
+	int changes = 0;
+	availables avail = {0, 0, NULL};
+	for (int b = 0; b < o->ir->nblocks; b++) {
+		avail.size = 0;
+		dm_ir_block *block = &o->ir->blocks[b];
+		for (int i = 0; i < block->nroots; i++) {
+			changes += cse_node(o, block->roots[i], &avail);
+		}
+	}
+	free(avail.data);
+	return changes;
+}
+
+// Loop invariants: an expression in a loop whose operands the loop never
+// changes is computed once in a pre-header block in front of the loop and
+// read from a temporary inside. An expression that can fail only moves if
+// every entry of the loop runs it before anything else that can fail or be
+// seen from outside, so the error stays the same. When the loop checks its
+// condition first, a copy of the condition guards the pre-header.
+typedef struct {
+	int header;
+	bool *body;                 // the blocks of the loop
+	bool *written;              // the variables the loop writes
+	bool calls;
+	bool writes_fields;
+	bool writes_upvals;
+	int nhoisted;
+	int hoistcapacity;
+	dm_ir_node **hoisted;
+	bool may_fail;              // one of the hoisted expressions may fail
+} loop;
+
+// changes nothing, running it twice is the same as running it once
+static bool is_effect_free(optimizer *o, dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	if (node->kind == DM_IR_INSTR && (writes_var(o, node) != -1 || writes_fields(node) || writes_upvals(node)
+			|| op == DM_OP_CLOSURE || op == DM_OP_RETURN || dm_opcode_is_jump(op))) {
+		return false;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		if (!is_effect_free(o, node->kids[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// neither fails nor does anything that is seen after an error
+static bool is_quiet(optimizer *o, dm_ir_node *node) {
+	dm_opcode op = node_op(node);
+	return node->kind != DM_IR_INSTR || is_pure(op) || op == DM_OP_POP || op == DM_OP_JUMP
+		|| (op == DM_OP_VARSET && !o->captured[node_b(node)]);
+}
+
+static bool may_fail(dm_ir_node *node) {
+	if (node->kind == DM_IR_INSTR && !is_pure(node_op(node))) {
+		return true;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		if (may_fail(node->kids[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool reads_invariant(optimizer *o, loop *l, dm_ir_node *node) {
+	switch (node_op(node)) {
+		case DM_OP_VARGET: {
+			int var = node_b(node);
+			if (l->written[var] || (l->calls && o->clobbered[var])) {
+				return false;
+			}
+			break;
+		}
+		case DM_OP_VARGET_UP:
+			if (l->writes_upvals) {
+				return false;
+			}
+			break;
+		case DM_OP_FIELDGET:
+		case DM_OP_FIELDGET_S:
+			if (l->writes_fields) {
+				return false;
+			}
+			break;
+		default:
+			break;
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		if (!reads_invariant(o, l, node->kids[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// clean is whether everything since the loop was entered is quiet, then the
+// expression runs on every entry before anything that could fail
+static void find_invariants(optimizer *o, loop *l, dm_ir_node *node, bool *clean) {
+	if (is_candidate(node) && reads_invariant(o, l, node)) {
+		bool fails = may_fail(node);
+		if (*clean || !fails) {
+			if (l->nhoisted >= l->hoistcapacity) {
+				l->hoistcapacity = l->hoistcapacity == 0 ? 8 : l->hoistcapacity * 2;
+				l->hoisted = realloc(l->hoisted, l->hoistcapacity * sizeof(dm_ir_node*));
+			}
+			l->hoisted[l->nhoisted++] = node;
+			l->may_fail |= fails;
+			return;
+		}
+	}
+	for (int i = 0; i < node->nkids; i++) {
+		find_invariants(o, l, node->kids[i], clean);
+	}
+	if (!is_quiet(o, node)) {
+		*clean = false;
+	}
+}
+
+// The natural loop of the back edges to block h, false if there is none.
+static bool find_loop(optimizer *o, int h, loop *l) {
+	int n = o->ir->nblocks;
+	int *work = malloc(n * sizeof(int));
+	int nwork = 0;
+	memset(l->body, 0, n * sizeof(bool));
+	l->body[h] = true;
+	bool found = false;
+	for (int i = o->predstart[h]; i < o->predstart[h + 1]; i++) {
+		int pred = o->preds[i];
+		if (o->rpo[pred] >= 0 && dominates(o, h, pred)) {
+			found = true;
+			if (!l->body[pred]) {
+				l->body[pred] = true;
+				work[nwork++] = pred;
+			}
+		}
+	}
+	while (nwork > 0) {
+		int b = work[--nwork];
+		for (int i = o->predstart[b]; i < o->predstart[b + 1]; i++) {
+			int pred = o->preds[i];
+			if (!l->body[pred] && o->rpo[pred] >= 0) {
+				l->body[pred] = true;
+				work[nwork++] = pred;
+			}
+		}
+	}
+	free(work);
+	return found;
+}
+
+static bool falls_through(dm_ir_block *block) {
+	dm_ir_node *jump = dm_ir_terminator(block);
+	return jump == NULL || (dm_instr_op(jump->instr) != DM_OP_JUMP && dm_instr_op(jump->instr) != DM_OP_RETURN);
+}
+
+// The last block of the condition of the loop that the guard copies: the
+// blocks from the header on that fall through into each other, change
+// nothing and leave the loop by their jumps. -1 if there is none.
+static int guard_end(optimizer *o, loop *l) {
+	int end = -1;
+	for (int b = l->header; b < o->ir->nblocks && l->body[b]; b++) {
+		dm_ir_block *block = &o->ir->blocks[b];
+		dm_ir_node *jump = dm_ir_terminator(block);
+		for (int i = 0; i < block->nroots; i++) {
+			dm_ir_node *root = block->roots[i];
+			if (root == jump) {
+				for (int k = 0; k < root->nkids; k++) {
+					if (!is_effect_free(o, root->kids[k])) {
+						return end;
+					}
+				}
+			} else if (!is_effect_free(o, root)) {
+				return end;
+			}
+		}
+		if (jump != NULL) {
+			dm_opcode op = dm_instr_op(jump->instr);
+			if (!falls_through(block) || op == DM_OP_FORPREP || op == DM_OP_FORLOOP || l->body[dm_instr_b(jump->instr)]) {
+				return end;
+			}
+			end = b;
+		}
+	}
+	return end;
+}
+
+// Moves the hoisted expressions of the loop into a new pre-header, behind the
+// guard blocks if there are any. Returns how many moved.
+static int hoist(optimizer *o, loop *l, int guard) {
+	dm_ir *ir = o->ir;
+	int *temps = malloc(l->nhoisted * sizeof(int));
+	for (int i = 0; i < l->nhoisted; i++) {
+		temps[i] = new_temp(o);
+		if (temps[i] == -1) {
+			free(temps);
+			return 0;
+		}
+	}
+
+	int h = l->header;
+	int nguard = guard == -1 ? 0 : guard - h + 1;
+	int nold = ir->nblocks;
+	for (int i = 0; i <= nguard; i++) {
+		dm_ir_insert_block(ir, h);
+	}
+	int header = h + nguard + 1;
+
+	// the loop is entered through the new blocks, its own jumps go on to the header
+	for (int b = 0; b < nold; b++) {
+		int moved = b < h ? b : b + nguard + 1;
+		dm_ir_node *jump = dm_ir_terminator(&ir->blocks[moved]);
+		if (!l->body[b] && jump != NULL && dm_opcode_is_jump(dm_instr_op(jump->instr)) && dm_instr_b(jump->instr) == header) {
+			jump->instr = dm_instr_make(dm_instr_op(jump->instr), dm_instr_a(jump->instr), h);
+		}
+	}
+
+	for (int i = 0; i < nguard; i++) {
+		dm_ir_block *from = &ir->blocks[header + i];
+		dm_ir_block *to = &ir->blocks[h + i];
+		to->nentry = from->nentry;
+		for (int r = 0; r < from->nroots; r++) {
+			dm_ir_add_root(to, dm_ir_node_copy(ir, from->roots[r]));
+		}
+	}
+
+	dm_ir_block *pre = &ir->blocks[h + nguard];
+	pre->nentry = ir->blocks[header].nentry;
+	for (int i = 0; i < pre->nentry; i++) {
+		dm_ir_add_root(pre, dm_ir_entry_new(ir));
+	}
+	for (int i = 0; i < l->nhoisted; i++) {
+		dm_ir_node *expr = l->hoisted[i];
+		dm_ir_node *value = dm_ir_node_new(ir, expr->instr, expr->line, 0);
+		value->nkids = expr->nkids;
+		value->kids = expr->kids;
+		dm_ir_node *set = dm_ir_node_new(ir, dm_instr_make(DM_OP_VARSET, 0, temps[i]), expr->line, 1);
+		set->kids[0] = value;
+		dm_ir_node *pop = dm_ir_node_new(ir, dm_instr_make(DM_OP_POP, 0, 0), expr->line, 1);
+		pop->kids[0] = set;
+		dm_ir_add_root(pre, pop);
+
+		expr->instr = dm_instr_make(DM_OP_VARGET, 0, temps[i]);
+		expr->nkids = 0;
+		expr->kids = NULL;
+	}
+	free(temps);
+	return l->nhoisted;
+}
+
+static int hoist_loop(optimizer *o, int h) {
+	dm_ir *ir = o->ir;
+	int n = ir->nblocks;
+	loop l = {
+		.header = h,
+		.body = malloc(n * sizeof(bool)),
+		.written = calloc(o->nvars + 1, sizeof(bool)),
+	};
+	int moved = 0;
+	// the pre-header goes in front of the header, the loop can't fall into it
+	if (!find_loop(o, h, &l) || (h > 0 && l.body[h - 1] && falls_through(&ir->blocks[h - 1]))) {
+		goto done;
+	}
+
+	for (int b = 0; b < n; b++) {
+		int size = l.body[b] ? order(o, b) : 0;
+		for (int i = 0; i < size; i++) {
+			dm_ir_node *node = o->order[i];
+			int var = writes_var(o, node);
+			if (var != -1) {
+				l.written[var] = true;
+			}
+			l.calls |= calls(node);
+			l.writes_fields |= writes_fields(node);
+			l.writes_upvals |= writes_upvals(node);
+		}
+	}
+
+	// the guard runs the condition before the pre-header, after it everything
+	// up to the first branch runs on every entry
+	bool *seen = calloc(n, sizeof(bool));
+	int guard = guard_end(o, &l);
+	for (int b = h; b <= guard; b++) {
+		seen[b] = true;
+		for (int i = 0; i < ir->blocks[b].nroots; i++) {
+			bool clean = true;
+			find_invariants(o, &l, ir->blocks[b].roots[i], &clean);
+		}
+	}
+	bool clean = true;
+	for (int b = guard == -1 ? h : guard + 1; b < n && l.body[b] && !seen[b] && clean;) {
+		seen[b] = true;
+		for (int i = 0; i < ir->blocks[b].nroots; i++) {
+			find_invariants(o, &l, ir->blocks[b].roots[i], &clean);
+		}
+		dm_ir_node *jump = dm_ir_terminator(&ir->blocks[b]);
+		if (jump == NULL) {
+			b++;
+		} else if (dm_instr_op(jump->instr) == DM_OP_JUMP) {
+			b = dm_instr_b(jump->instr);
+		} else {
+			break;
+		}
+	}
+	for (int b = 0; b < n; b++) {
+		for (int i = 0; l.body[b] && !seen[b] && i < ir->blocks[b].nroots; i++) {
+			clean = false;
+			find_invariants(o, &l, ir->blocks[b].roots[i], &clean);
+		}
+	}
+	free(seen);
+
+	if (l.nhoisted > 0) {
+		moved = hoist(o, &l, l.may_fail ? guard : -1);
+	}
+
+done:
+	free(l.hoisted);
+	free(l.written);
+	free(l.body);
+	return moved;
+}
+
+// inner loops come after the loops around them, their invariants move first
+static int loop_invariants(optimizer *o) {
+	int changes = 0;
+	for (int h = o->ir->nblocks - 1; h >= 0; h--) {
+		int moved = hoist_loop(o, h);
+		if (moved > 0) {
+			changes += moved;
+			update_cfg(o);
+			h = o->ir->nblocks;
+		}
+	}
+	return changes;
+}
+
+// Dead code: stores to local variables that are not read afterwards and
+// values that are dropped right away without having any effect. The
+// variables of the top level chunk outlive it, their stores stay.
+static void live_node(optimizer *o, dm_ir_node *node, bool *live) {
+	int var = writes_var(o, node);
+	if (var != -1) {
+		live[var] = false;
+	}
+	dm_opcode op = node_op(node);
+	if (op == DM_OP_VARGET || op == DM_OP_VARGETOPSET) {
+		live[node_b(node)] = true;
+	} else if (op == DM_OP_FORPREP || op == DM_OP_FORLOOP) {
+		dm_forloop *loop = node_loop(o, node);
+		live[loop->var] = true;
+		if (loop->limit_is_var) {
+			live[loop->limit] = true;
+		}
+	}
+}
+
+static void live_out(optimizer *o, int b, bool *livein, bool *live) {
+	int succ[2];
+	int nsucc = dm_ir_successors(o->ir, b, succ);
+	memset(live, 0, o->nvars * sizeof(bool));
+	for (int i = 0; i < nsucc; i++) {
+		for (int v = 0; v < o->nvars; v++) {
+			live[v] |= livein[succ[i] * o->nvars + v];
+		}
+	}
+}
+
+static int dead_stores(optimizer *o) {
+	int nblocks = o->ir->nblocks;
+	int nvars = o->nvars;
+	bool *livein = calloc(nblocks * nvars + 1, sizeof(bool));
+	bool *live = malloc(nvars * sizeof(bool) + 1);
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int b = nblocks - 1; b >= 0; b--) {
+			live_out(o, b, livein, live);
+			for (int i = order(o, b) - 1; i >= 0; i--) {
+				live_node(o, o->order[i], live);
+			}
+			if (memcmp(live, &livein[b * nvars], nvars * sizeof(bool)) != 0) {
+				memcpy(&livein[b * nvars], live, nvars * sizeof(bool));
+				changed = true;
+			}
+		}
+	}
+
+	// the store goes, the value it leaves on the stack stays
+	int changes = 0;
+	for (int b = 0; b < nblocks; b++) {
+		live_out(o, b, livein, live);
+		for (int i = order(o, b) - 1; i >= 0; i--) {
+			dm_ir_node *node = o->order[i];
+			int var = node_b(node);
+			if (node_op(node) == DM_OP_VARSET && node->nkids == 1 && !live[var] && !o->captured[var]) {
+				dm_ir_node *kid = node->kids[0];
+				free(node->kids);
+				*node = *kid;
+				kid->kids = NULL;
+				kid->nkids = 0;
+				changes++;
+				continue;
+			}
+			live_node(o, node, live);
+		}
+	}
+	free(live);
+	free(livein);
+	return changes;
+}
+
+static int dead_code(optimizer *o) {
+	int changes = dead_stores(o);
+
+	for (int b = 0; b < o->ir->nblocks; b++) {
+		int size = order(o, b);
+		for (int i = 0; i < size; i++) {
+			dm_ir_node *node = o->order[i];
+			if (node_op(node) == DM_OP_POP && node->nkids == 1 && is_removable(node->kids[0])) {
+				node->kind = DM_IR_NOP;
+				changes++;
+			}
+		}
+	}
+	return changes;
+}
+
+// Types: every value gets the set of types it can have, from the constants,
+// the operators and the variables, whose types flow along the code like the
+// copies of copy propagation. Arguments, fields, upvalues and the results of
+// calls can be anything until an annotation checked them, and a call forgets
+// the types of the variables closures assign. Operators whose operands are proven ints, numbers with a
+// float or an array with an int index become their unchecked opcodes. This
+// runs after the other passes, which only know the generic opcodes.
+#define TYPE_INT    1
+#define TYPE_FLOAT  2
+#define TYPE_ARRAY  4
+#define TYPE_OTHER  8
+#define TYPE_NUMBER (TYPE_INT | TYPE_FLOAT)
+#define TYPE_ANY    (TYPE_NUMBER | TYPE_ARRAY | TYPE_OTHER)
+
+typedef unsigned char types;
+
+static types type_types(dm_type type) {
+	switch (type) {
+		case DM_TYPE_INT:   return TYPE_INT;
+		case DM_TYPE_FLOAT: return TYPE_FLOAT;
+		case DM_TYPE_ARRAY: return TYPE_ARRAY;
+		default:            return TYPE_OTHER;
+	}
+}
+
+static types value_types(dm_value v) {
+	return type_types(dm_value_type(v));
+}
+
+// Numbers are computed inline like in the vm, anything else runs a method of
+// its module that may return anything. No types are code that wasn't reached
+// yet, the result grows with the operand types so the types of the variables
+// settle.
+static types arith_types(dm_opcode op, types x, types y) {
+	if (x == 0 || y == 0) {
+		return 0;
+	}
+	if ((x | y) & ~TYPE_NUMBER) {
+		return TYPE_ANY;
+	}
+	if (x == TYPE_INT && y == TYPE_INT) {
+		return TYPE_INT;
+	}
+	if (op == DM_OP_MOD) {
+		return TYPE_ANY;
+	}
+	return x == TYPE_FLOAT || y == TYPE_FLOAT ? TYPE_FLOAT : TYPE_NUMBER;
+}
+
+static dm_opcode opassign_op(int opassign) {
+	switch (opassign) {
+		case DM_OPASSIGN_PLUS:  return DM_OP_PLUS;
+		case DM_OPASSIGN_MINUS: return DM_OP_MINUS;
+		case DM_OPASSIGN_MUL:   return DM_OP_MUL;
+		case DM_OPASSIGN_DIV:   return DM_OP_DIV;
+		default:                return DM_OP_MOD;
+	}
+}
+
+// the unchecked opcode for operands of types x and y, DM_OP_NUM_OPS if none
+static dm_opcode unchecked_op(dm_opcode op, types x, types y) {
+	bool ints = x == TYPE_INT && y == TYPE_INT;
+	bool floats = !ints && x != 0 && y != 0 && ((x | y) & ~TYPE_NUMBER) == 0 && (x == TYPE_FLOAT || y == TYPE_FLOAT);
+	if (!ints && !floats) {
+		return DM_OP_NUM_OPS;
+	}
+	switch (op) {
+		case DM_OP_PLUS:         return ints ? DM_OP_PLUS_INT_UNCHECKED : DM_OP_PLUS_FLOAT_UNCHECKED;
+		case DM_OP_MINUS:        return ints ? DM_OP_MINUS_INT_UNCHECKED : DM_OP_MINUS_FLOAT_UNCHECKED;
+		case DM_OP_MUL:          return ints ? DM_OP_MUL_INT_UNCHECKED : DM_OP_MUL_FLOAT_UNCHECKED;
+		case DM_OP_DIV:          return ints ? DM_OP_DIV_INT_UNCHECKED : DM_OP_DIV_FLOAT_UNCHECKED;
+		case DM_OP_LESS:         return ints ? DM_OP_LESS_INT_UNCHECKED : DM_OP_LESS_FLOAT_UNCHECKED;
+		case DM_OP_LESSEQUAL:    return ints ? DM_OP_LESSEQUAL_INT_UNCHECKED : DM_OP_LESSEQUAL_FLOAT_UNCHECKED;
+		case DM_OP_GREATER:      return ints ? DM_OP_GREATER_INT_UNCHECKED : DM_OP_GREATER_FLOAT_UNCHECKED;
+		case DM_OP_GREATEREQUAL: return ints ? DM_OP_GREATEREQUAL_INT_UNCHECKED : DM_OP_GREATEREQUAL_FLOAT_UNCHECKED;
+		default:                 return DM_OP_NUM_OPS;
+	}
+}
+
+// Returns the types of the value of a node and updates the types of the
+// variables it changes, rewrite makes its operators unchecked where it can.
+static types type_node(optimizer *o, dm_ir_node *node, types *vars, int *rewritten) {
+	if (node->kind != DM_IR_INSTR) {
+		return TYPE_ANY;
+	}
+	// the values of the kids in push order, without the statements
+	types kids[3] = {TYPE_ANY, TYPE_ANY, TYPE_ANY};
+	int nvalues = 0;
+	for (int i = 0; i < node->nkids; i++) {
+		types t = type_node(o, node->kids[i], vars, rewritten);
+		if (node->kids[i]->pushes > 0 && nvalues < 3) {
+			kids[nvalues++] = node->kids[i]->pushes == 1 ? t : TYPE_ANY;
+		}
+	}
+
+	dm_opcode op = node_op(node);
+	dm_opcode unchecked = DM_OP_NUM_OPS;
+	types result = TYPE_ANY;
+	switch (op) {
+		case DM_OP_VARGET:
+			result = vars[node_b(node)];
+			break;
+		case DM_OP_VARSET:
+			result = vars[node_b(node)] = kids[0];
+			break;
+		case DM_OP_VARGETOPSET: {
+			int var = node_b(node);
+			result = vars[var] = arith_types(opassign_op(dm_instr_a(node->instr)), vars[var], kids[0]);
+			break;
+		}
+		case DM_OP_FORLOOP: {
+			int var = node_loop(o, node)->var;
+			vars[var] = arith_types(DM_OP_PLUS, vars[var], TYPE_INT);
+			break;
+		}
+		case DM_OP_CONSTANT:
+			result = value_types(o->ir->chunk->consts[node_b(node)]);
+			break;
+		case DM_OP_CONSTANT_SMALLINT:
+			result = TYPE_INT;
+			break;
+		case DM_OP_ARRAYLIT:
+			result = TYPE_ARRAY;
+			break;
+		case DM_OP_TABLELIT:
+		case DM_OP_CLOSURE:
+		case DM_OP_TRUE:
+		case DM_OP_FALSE:
+		case DM_OP_NIL:
+		case DM_OP_NOT:
+		case DM_OP_EQUAL:
+		case DM_OP_NOTEQUAL:
+			result = TYPE_OTHER;
+			break;
+		case DM_OP_NEGATE:
+			result = kids[0] & TYPE_NUMBER;
+			break;
+		// past an annotation the variable it checked has the type
+		case DM_OP_CHECKTYPE:
+			result = kids[0] & type_types(dm_instr_a(node->instr));
+			if (node->nkids == 1 && node->kids[0]->kind == DM_IR_INSTR && node_op(node->kids[0]) == DM_OP_VARGET) {
+				vars[node_b(node->kids[0])] &= result;
+			}
+			break;
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:
+		case DM_OP_DIV:
+		case DM_OP_MOD:
+			result = arith_types(op, kids[0], kids[1]);
+			unchecked = unchecked_op(op, kids[0], kids[1]);
+			break;
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL:
+			result = TYPE_OTHER;
+			unchecked = unchecked_op(op, kids[0], kids[1]);
+			break;
+		case DM_OP_FIELDGET:
+			if (kids[0] == TYPE_ARRAY && kids[1] == TYPE_INT) {
+				unchecked = DM_OP_FIELDGET_ARRAY_INT_UNCHECKED;
+			}
+			break;
+		case DM_OP_FIELDSET:
+			result = kids[2];
+			if (kids[0] == TYPE_ARRAY && kids[1] == TYPE_INT) {
+				unchecked = DM_OP_FIELDSET_ARRAY_INT_UNCHECKED;
+			}
+			break;
+		default:
+			break;
+	}
+
+	for (int v = 0; v < o->nvars && calls(node); v++) {
+		if (o->clobbered[v]) {
+			vars[v] = TYPE_ANY;
+		}
+	}
+	if (rewritten != NULL && unchecked != DM_OP_NUM_OPS) {
+		node->instr = dm_instr_make(unchecked, 0, 0);
+		(*rewritten)++;
+	}
+	return result;
+}
+
+static void type_block(optimizer *o, int b, types *vars, int *rewritten) {
+	dm_ir_block *block = &o->ir->blocks[b];
+	for (int i = 0; i < block->nroots; i++) {
+		type_node(o, block->roots[i], vars, rewritten);
+	}
+}
+
+static int specialize_types(optimizer *o) {
+	int nblocks = o->ir->nblocks;
+	int nvars = o->nvars;
+	types *out = calloc(nblocks * nvars + 1, sizeof(types));
+	types *in = calloc(nblocks * nvars + 1, sizeof(types));
+	types *vars = malloc(nvars * sizeof(types) + 1);
+
+	// what a variable holds on entry isn't known
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int b = 0; b < nblocks; b++) {
+			types *blockin = &in[b * nvars];
+			for (int v = 0; v < nvars; v++) {
+				types t = b == 0 ? TYPE_ANY : 0;
+				for (int i = o->predstart[b]; i < o->predstart[b + 1]; i++) {
+					t |= out[o->preds[i] * nvars + v];
+				}
+				blockin[v] = t;
+			}
+
+			memcpy(vars, blockin, nvars * sizeof(types));
+			type_block(o, b, vars, NULL);
+			if (memcmp(vars, &out[b * nvars], nvars * sizeof(types)) != 0) {
+				memcpy(&out[b * nvars], vars, nvars * sizeof(types));
+				changed = true;
+			}
+		}
+	}
+
+	int rewritten = 0;
+	for (int b = 0; b < nblocks; b++) {
+		memcpy(vars, &in[b * nvars], nvars * sizeof(types));
+		type_block(o, b, vars, &rewritten);
+	}
+	free(vars);
+	free(in);
+	free(out);
+	return rewritten;
+}
+
+typedef struct {
+	const char *name;
+	int (*run)(optimizer*);
+} pass;
+
+static const pass passes[] = {
+	{"copy propagation",      copy_propagation},
+	{"inlining",              inlining},
+	{"common subexpressions", common_subexpressions},
+	{"loop invariants",       loop_invariants},
+	{"dead code",             dead_code},
+};
+
+#define NUM_PASSES (int) (sizeof(passes) / sizeof(passes[0]))
+#define MAX_ROUNDS 4
+
+// Marks the variables a function and the closures in it assign, vars maps
+// the upvalues of the function to variables of the chunk, -1 for the others.
+static void find_clobbered(optimizer *o, dm_chunk *fchunk, int *vars) {
+	for (int addr = 0; addr < fchunk->codesize; addr++) {
+		dm_instr parts[2] = {fchunk->code[addr], fchunk->code[addr]};
+		dm_superinstr_split(fchunk->code[addr], &parts[0], &parts[1]);
+		for (int i = 0; i < 2; i++) {
+			dm_opcode op = dm_opcode_generic(dm_instr_op(parts[i]));
+			int b = dm_instr_b(parts[i]);
+			if ((op == DM_OP_VARSET_UP || op == DM_OP_VARGETOPSET_UP) && b < fchunk->upvalsize && vars[b] != -1) {
+				o->clobbered[vars[b]] = true;
+			}
+		}
+	}
+	for (int i = 0; i < fchunk->constsize; i++) {
+		if (dm_value_type(fchunk->consts[i]) != DM_TYPE_FUNCTION) {
+			continue;
+		}
+		dm_chunk *inner = (dm_chunk*) dm_value_as_function(fchunk->consts[i])->chunk;
+		int *innervars = malloc(inner->upvalsize * sizeof(int) + 1);
+		for (int j = 0; j < inner->upvalsize; j++) {
+			dm_upvaldesc desc = inner->upvals[j];
+			innervars[j] = !desc.local && desc.index < fchunk->upvalsize ? vars[desc.index] : -1;
+		}
+		find_clobbered(o, inner, innervars);
+		free(innervars);
+	}
+}
+
+static void find_captured(optimizer *o) {
+	dm_chunk *chunk = o->ir->chunk;
+	o->captured = malloc(o->nvars * sizeof(bool) + 1);
+	o->clobbered = calloc(o->nvars + 1, sizeof(bool));
+	for (int v = 0; v < o->nvars; v++) {
+		o->captured[v] = chunk->parent == NULL;
+	}
+	for (int i = 0; i < chunk->constsize; i++) {
+		if (dm_value_type(chunk->consts[i]) != DM_TYPE_FUNCTION) {
+			continue;
+		}
+		dm_chunk *fchunk = (dm_chunk*) dm_value_as_function(chunk->consts[i])->chunk;
+		int *vars = malloc(fchunk->upvalsize * sizeof(int) + 1);
+		for (int j = 0; j < fchunk->upvalsize; j++) {
+			dm_upvaldesc desc = fchunk->upvals[j];
+			vars[j] = desc.local ? desc.index : -1;
+			if (desc.local) {
+				o->captured[desc.index] = true;
+			}
+		}
+		find_clobbered(o, fchunk, vars);
+		free(vars);
+	}
+}
+
+void dm_optimize(dm_state *dm, dm_chunk *chunk) {
+	// broken code is left to the verifier
+	dm_ir *ir = dm_ir_build(dm, chunk);
+	if (ir == NULL) {
+		return;
+	}
+
+	optimizer o = {
+		.ir = ir,
+		.nvars = chunk->varsize,
+		.first_temp = chunk->varsize,
+	};
+	find_captured(&o);
+	update_cfg(&o);
+
+	int changes[NUM_PASSES] = {0};
+	int total = 0;
+	for (int round = 0; round < MAX_ROUNDS; round++) {
+		int n = 0;
+		for (int i = 0; i < NUM_PASSES; i++) {
+			int c = passes[i].run(&o);
+			changes[i] += c;
+			n += c;
+		}
+		total += n;
+		if (n == 0) {
+			break;
+		}
+	}
+
+	int specialized = specialize_types(&o);
+	total += specialized;
+
+	if (total > 0 && dm_ir_lower(ir) == 0 && dm_debug_enabled(dm)) {
+		printf("Optimized IR:");
+		for (int i = 0; i < NUM_PASSES; i++) {
+			printf(" %s %d,", passes[i].name, changes[i]);
+		}
+		printf(" specialized %d\n", specialized);
+		dm_ir_print(ir);
+	}
+
+	free(o.predstart);
+	free(o.preds);
+	free(o.rpo);
+	free(o.idom);
+	free(o.captured);
+	free(o.clobbered);
+	free(o.order);
+	dm_ir_free(ir);
+}
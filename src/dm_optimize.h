@@ -0,0 +1,9 @@
+#pragma once
+
+#include <dm_state.h>
+#include <dm_chunk.h>
+
+// Runs the optimization passes over the IR of a finished chunk (see dm_ir.h)
+// and replaces its code, -O0 skips it. With --debug the IR is printed after
+// the passes if they changed anything.
+void dm_optimize(dm_state *dm, dm_chunk *chunk);
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dm_peephole.h>
+#include <dm_chunk.h>
+
+// The pass works on a finished chunk: the rewrites replace instructions in
+// place or mark them dead, compact() then removes the dead ones and moves the
+// jump targets and lines along. Rewrites that remove an instruction other than
+// the first of a pattern only apply if no jump lands on it.
+typedef struct {
+	dm_chunk *chunk;
+	bool *dead;
+	bool *target;
+} peephole;
+
+static bool is_jump(dm_opcode op) {
+	return op == DM_OP_JUMP || op == DM_OP_JUMP_IF_FALSE || op == DM_OP_JUMP_IF_TRUE_OR_POP
+		|| op == DM_OP_JUMP_IF_FALSE_OR_POP || op == DM_OP_FORPREP || op == DM_OP_FORLOOP;
+}
+
+// pushes a value without any other effect
+static bool is_pure_push(dm_opcode op) {
+	return op == DM_OP_VARGET || op == DM_OP_VARGET_UP || op == DM_OP_CONSTANT || op == DM_OP_CONSTANT_SMALLINT
+		|| op == DM_OP_TRUE || op == DM_OP_FALSE || op == DM_OP_NIL || op == DM_OP_SELF;
+}
+
+// whether the value pushed by a pure push is known to be truthy (1), falsey
+// (0) or only known at runtime (-1), constants are never nil or false
+static int truthiness(dm_opcode op) {
+	switch (op) {
+		case DM_OP_CONSTANT:
+		case DM_OP_CONSTANT_SMALLINT:
+		case DM_OP_TRUE:  return 1;
+		case DM_OP_FALSE:
+		case DM_OP_NIL:   return 0;
+		default:          return -1;
+	}
+}
+
+static void set_op(dm_chunk *chunk, int addr, dm_opcode op) {
+	dm_instr in = chunk->code[addr];
+	chunk->code[addr] = dm_instr_make(op, dm_instr_a(in), dm_instr_b(in));
+}
+
+// removes an instruction, jumps to it land on the next one
+static void kill(peephole *p, int addr) {
+	p->dead[addr] = true;
+	if (p->target[addr] && addr + 1 < p->chunk->codesize) {
+		p->target[addr + 1] = true;
+	}
+}
+
+// the end of a chain of unconditional jumps, the chain may be a loop
+static int final_target(dm_chunk *chunk, int addr) {
+	for (int hops = 0; hops < chunk->codesize; hops++) {
+		dm_instr in = chunk->code[addr];
+		if (dm_instr_op(in) != DM_OP_JUMP || dm_instr_b(in) == addr) {
+			break;
+		}
+		addr = dm_instr_b(in);
+	}
+	return addr;
+}
+
+// Retargets jumps to jumps. A *_OR_POP jump that lands on an *_OR_POP jump of
+// the same kind tests the same value, one that lands on a JUMP_IF_FALSE does
+// the same as that JUMP_IF_FALSE on both paths. A JUMP to a RETURN returns.
+static bool thread_jumps(dm_chunk *chunk) {
+	bool changed = false;
+	for (int i = 0; i < chunk->codesize; i++) {
+		dm_instr in = chunk->code[i];
+		dm_opcode op = dm_instr_op(in);
+		if (!is_jump(op) || op == DM_OP_FORLOOP) {
+			continue;
+		}
+
+		int dest = final_target(chunk, dm_instr_b(in));
+		dm_opcode destop = dm_instr_op(chunk->code[dest]);
+		if ((op == DM_OP_JUMP_IF_FALSE_OR_POP || op == DM_OP_JUMP_IF_TRUE_OR_POP) && dest != i) {
+			if (destop == op) {
+				dest = final_target(chunk, dm_instr_b(chunk->code[dest]));
+			} else if (op == DM_OP_JUMP_IF_FALSE_OR_POP && destop == DM_OP_JUMP_IF_FALSE) {
+				op = DM_OP_JUMP_IF_FALSE;
+				dest = final_target(chunk, dm_instr_b(chunk->code[dest]));
+			}
+		}
+
+		dm_instr new = dm_instr_make(op, dm_instr_a(in), dest);
+		if (op == DM_OP_JUMP && destop == DM_OP_RETURN) {
+			new = chunk->code[dest];
+		}
+		if (new != in) {
+			chunk->code[i] = new;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// marks what can't be reached from the entry as dead and the jump targets
+static void mark_reachable(peephole *p) {
+	dm_chunk *chunk = p->chunk;
+	int *work = malloc(chunk->codesize * sizeof(int));
+	int worksize = 0;
+	for (int i = 0; i < chunk->codesize; i++) {
+		p->dead[i] = true;
+		p->target[i] = false;
+	}
+
+	work[worksize++] = 0;
+	p->dead[0] = false;
+	while (worksize > 0) {
+		int addr = work[--worksize];
+		dm_instr in = chunk->code[addr];
+		dm_opcode op = dm_instr_op(in);
+		int next[2];
+		int nnext = 0;
+		if (is_jump(op)) {
+			next[nnext++] = dm_instr_b(in);
+			p->target[dm_instr_b(in)] = true;
+		}
+		if (op != DM_OP_JUMP && op != DM_OP_RETURN && addr + 1 < chunk->codesize) {
+			next[nnext++] = addr + 1;
+		}
+		for (int i = 0; i < nnext; i++) {
+			if (p->dead[next[i]]) {
+				p->dead[next[i]] = false;
+				work[worksize++] = next[i];
+			}
+		}
+	}
+	free(work);
+}
+
+// rewrites the patterns starting at addr, returns the number of instructions
+// it looked at or 0 if nothing matched
+static int rewrite(peephole *p, int addr) {
+	dm_chunk *chunk = p->chunk;
+	int left = chunk->codesize - addr;
+	dm_instr in = chunk->code[addr];
+	dm_opcode op = dm_instr_op(in);
+	// patterns of more than one instruction need the next one, a RETURN
+	// matches none of them
+	dm_opcode next = DM_OP_RETURN;
+	if (left > 1 && !p->target[addr + 1]) {
+		next = dm_instr_op(chunk->code[addr + 1]);
+	}
+
+	// a jump to the next instruction
+	if (op == DM_OP_JUMP && dm_instr_b(in) == addr + 1) {
+		kill(p, addr);
+		return 1;
+	}
+	if (op == DM_OP_JUMP_IF_FALSE && dm_instr_b(in) == addr + 1) {
+		set_op(chunk, addr, DM_OP_POP);
+		return 1;
+	}
+
+	// VARSET x; POP; VARGET x leaves x on the stack, as VARSET x does
+	if (left > 2 && next == DM_OP_POP && !p->target[addr + 2] && dm_instr_b(chunk->code[addr + 2]) == dm_instr_b(in)) {
+		dm_opcode get = dm_instr_op(chunk->code[addr + 2]);
+		if (((op == DM_OP_VARSET || op == DM_OP_VARGETOPSET) && get == DM_OP_VARGET)
+				|| ((op == DM_OP_VARSET_UP || op == DM_OP_VARGETOPSET_UP) && get == DM_OP_VARGET_UP)) {
+			kill(p, addr + 1);
+			kill(p, addr + 2);
+			return 3;
+		}
+	}
+
+	if (!is_pure_push(op)) {
+		return 0;
+	}
+
+	// a value that is dropped right away
+	if (next == DM_OP_POP) {
+		kill(p, addr);
+		kill(p, addr + 1);
+		return 2;
+	}
+
+	// conditional jumps on a constant
+	int truthy = truthiness(op);
+	if (truthy == -1) {
+		return 0;
+	}
+	if (next == DM_OP_JUMP_IF_FALSE) {
+		kill(p, addr);
+		if (truthy) {
+			kill(p, addr + 1);
+		} else {
+			set_op(chunk, addr + 1, DM_OP_JUMP);
+		}
+		return 2;
+	}
+	if (next == DM_OP_JUMP_IF_FALSE_OR_POP || next == DM_OP_JUMP_IF_TRUE_OR_POP) {
+		if (truthy == (next == DM_OP_JUMP_IF_TRUE_OR_POP)) {
+			set_op(chunk, addr + 1, DM_OP_JUMP);
+		} else {
+			kill(p, addr);
+			kill(p, addr + 1);
+		}
+		return 2;
+	}
+	// a constant that is taken to a JUMP_IF_FALSE, as break does
+	if (next == DM_OP_JUMP) {
+		int dest = dm_instr_b(chunk->code[addr + 1]);
+		if (dm_instr_op(chunk->code[dest]) == DM_OP_JUMP_IF_FALSE) {
+			kill(p, addr);
+			int to = truthy ? dest + 1 : dm_instr_b(chunk->code[dest]);
+			chunk->code[addr + 1] = dm_instr_make(DM_OP_JUMP, 0, to);
+			return 2;
+		}
+	}
+	return 0;
+}
+
+// removes the dead instructions, a jump to a dead one lands on the next live one
+static void compact(peephole *p) {
+	dm_chunk *chunk = p->chunk;
+	int *addrs = malloc((chunk->codesize + 1) * sizeof(int));
+	int size = 0;
+	for (int i = 0; i < chunk->codesize; i++) {
+		addrs[i] = size;
+		if (!p->dead[i]) {
+			chunk->code[size] = chunk->code[i];
+			chunk->lines[size] = chunk->lines[i];
+			size++;
+		}
+	}
+	addrs[chunk->codesize] = size;
+
+	for (int i = 0; i < size; i++) {
+		dm_instr in = chunk->code[i];
+		if (is_jump(dm_instr_op(in))) {
+			chunk->code[i] = dm_instr_make(dm_instr_op(in), dm_instr_a(in), addrs[dm_instr_b(in)]);
+		}
+	}
+	chunk->codesize = size;
+	free(addrs);
+}
+
+// fuses the pairs of dm_superinstr.h from the left, the second instruction of
+// a pair can't be a jump target. The pair gets the line of the second, the
+// first halves can't fail.
+static void fuse(peephole *p) {
+	dm_chunk *chunk = p->chunk;
+	mark_reachable(p);
+	for (int i = 0; i + 1 < chunk->codesize; i++) {
+		dm_instr fused;
+		if (!p->target[i + 1] && dm_superinstr_fuse(chunk->code[i], chunk->code[i + 1], &fused)) {
+			chunk->code[i] = fused;
+			chunk->lines[i] = chunk->lines[i + 1];
+			kill(p, i + 1);
+			i++;
+		}
+	}
+	compact(p);
+}
+
+static bool targets_valid(dm_chunk *chunk) {
+	for (int i = 0; i < chunk->codesize; i++) {
+		dm_instr in = chunk->code[i];
+		if (is_jump(dm_instr_op(in)) && dm_instr_b(in) >= chunk->codesize) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void print_code(dm_instr *code, int size) {
+	dm_chunk listing = {.codesize = size, .code = code};
+	dm_chunk_decompile_code(&listing);
+}
+
+void dm_peephole(dm_state *dm, dm_chunk *chunk) {
+	// broken code is left to the verifier
+	if (chunk->codesize == 0 || !targets_valid(chunk)) {
+		return;
+	}
+
+	int oldsize = chunk->codesize;
+	dm_instr *old = NULL;
+	if (dm_debug_enabled(dm)) {
+		old = malloc(oldsize * sizeof(dm_instr));
+		memcpy(old, chunk->code, oldsize * sizeof(dm_instr));
+	}
+
+	peephole p = {
+		.chunk = chunk,
+		.dead = malloc(chunk->codesize * sizeof(bool)),
+		.target = malloc(chunk->codesize * sizeof(bool)),
+	};
+
+	bool changed = true;
+	while (changed) {
+		changed = thread_jumps(chunk);
+		mark_reachable(&p);
+		for (int i = 0; i < chunk->codesize; i++) {
+			changed |= p.dead[i];
+		}
+
+		for (int i = 0; i < chunk->codesize;) {
+			int n = p.dead[i] ? 0 : rewrite(&p, i);
+			changed |= n > 0;
+			i += n > 0 ? n : 1;
+		}
+		compact(&p);
+	}
+	fuse(&p);
+
+	free(p.dead);
+	free(p.target);
+
+	if (old != NULL && (oldsize != chunk->codesize || memcmp(old, chunk->code, oldsize * sizeof(dm_instr)) != 0)) {
+		printf("Before peephole:\n");
+		print_code(old, oldsize);
+		printf("After peephole:\n");
+		print_code(chunk->code, chunk->codesize);
+	}
+	free(old);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <dm_state.h>
+#include <dm_chunk.h>
+
+// Removes redundant instructions from the code of a finished chunk and
+// retargets jumps that land on jumps. With --debug the code is printed before
+// and after.
+void dm_peephole(dm_state *dm, dm_chunk *chunk);
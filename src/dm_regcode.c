@@ -0,0 +1,677 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <dm_regcode.h>
+#include <dm.h>
+
+// The translation runs over the stack code once and keeps a symbolic stack of
+// operands instead of values. Variables and constants are pushed as operands
+// without emitting anything, an instruction only reads them when the value is
+// used. Everything else the stack code leaves on the stack is in the register
+// for that stack slot (varsize + slot). At jumps and their targets every slot
+// is in its own register, so all paths agree on where the values are.
+typedef struct {
+	dm_chunk *chunk;
+	dm_regcode *rc;
+	int addr;
+	uint16_t *stack;
+	int depth;
+	int maxdepth;
+	int *label_depth;
+	int *map;
+	int retarget;
+	int nfixups;
+	int *fixups;
+	bool failed;
+} translator;
+
+static int add_instr(translator *t, dm_reginstr instr) {
+	dm_regcode *rc = t->rc;
+	if (rc->size >= rc->capacity) {
+		rc->capacity *= 2;
+		rc->code = realloc(rc->code, rc->capacity * sizeof(dm_reginstr));
+		rc->addrs = realloc(rc->addrs, rc->capacity * sizeof(int));
+	}
+	rc->code[rc->size] = instr;
+	rc->addrs[rc->size] = t->addr;
+	t->retarget = -1;
+	return rc->size++;
+}
+
+static void emit(translator *t, dm_regop op, int x, int a, int b, int c) {
+	add_instr(t, (dm_reginstr){op, x, a, b, c});
+}
+
+// instructions that only write a, so the result can go to a variable directly
+static void emit_dst(translator *t, dm_regop op, int a, int b, int c) {
+	t->retarget = add_instr(t, (dm_reginstr){op, 0, a, b, c});
+}
+
+static void emit_jump(translator *t, dm_regop op, int a, int target) {
+	if (t->label_depth[target] != -1 && t->label_depth[target] != t->depth) {
+		t->failed = true;
+	}
+	t->label_depth[target] = t->depth;
+
+	int index = add_instr(t, (dm_reginstr){op, 0, a, 0, 0});
+	dm_reginstr *in = &t->rc->code[index];
+	if (op == DM_ROP_JUMP) {
+		in->a = target;
+	} else {
+		in->b = target;
+	}
+	t->fixups[t->nfixups++] = index;
+}
+
+static int add_const(translator *t, dm_value v) {
+	dm_regcode *rc = t->rc;
+	for (int i = t->chunk->constsize; i < rc->constsize; i++) {
+		dm_value c = rc->consts[i];
+		if (dm_value_type(c) == dm_value_type(v) && (dm_value_type(v) == DM_TYPE_NIL
+				|| (dm_value_type(v) == DM_TYPE_BOOL && dm_value_as_bool(c) == dm_value_as_bool(v))
+				|| (dm_value_type(v) == DM_TYPE_INT && dm_value_as_int(c) == dm_value_as_int(v)))) {
+			return i | DM_RK_CONST;
+		}
+	}
+
+	if (rc->constsize >= rc->constcapacity) {
+		rc->constcapacity *= 2;
+		rc->consts = realloc(rc->consts, rc->constcapacity * sizeof(dm_value));
+	}
+	rc->consts[rc->constsize] = v;
+	return rc->constsize++ | DM_RK_CONST;
+}
+
+static int slot_reg(translator *t, int slot) {
+	return t->chunk->varsize + slot;
+}
+
+static bool is_var(translator *t, int operand) {
+	return !(operand & DM_RK_CONST) && operand < t->chunk->varsize;
+}
+
+static void push(translator *t, int operand) {
+	if (t->depth >= t->maxdepth) {
+		t->maxdepth = t->depth + 1;
+		t->stack = realloc(t->stack, t->maxdepth * sizeof(uint16_t));
+	}
+	t->stack[t->depth++] = operand;
+}
+
+static int pop(translator *t) {
+	if (t->depth == 0) {
+		t->failed = true;
+		return slot_reg(t, 0);
+	}
+	return t->stack[--t->depth];
+}
+
+// pushes the result of an instruction, a register of another slot is moved
+static void push_result(translator *t, int operand) {
+	if (!is_var(t, operand) && !(operand & DM_RK_CONST) && operand != slot_reg(t, t->depth)) {
+		emit_dst(t, DM_ROP_MOVE, slot_reg(t, t->depth), operand, 0);
+		operand = slot_reg(t, t->depth);
+	}
+	push(t, operand);
+}
+
+static void materialize(translator *t, int slot) {
+	int reg = slot_reg(t, slot);
+	if (t->stack[slot] != reg) {
+		emit(t, DM_ROP_MOVE, 0, reg, t->stack[slot], 0);
+		t->stack[slot] = reg;
+	}
+}
+
+static void materialize_from(translator *t, int slot) {
+	for (int i = slot; i < t->depth; i++) {
+		materialize(t, i);
+	}
+}
+
+// a variable is about to change, the slots still need the old value
+static void materialize_var(translator *t, int index) {
+	for (int i = 0; i < t->depth; i++) {
+		if (t->stack[i] == index) {
+			materialize(t, i);
+		}
+	}
+}
+
+static bool is_jump(dm_opcode op) {
+	return op == DM_OP_JUMP_IF_TRUE_OR_POP || op == DM_OP_JUMP_IF_FALSE_OR_POP
+		|| op == DM_OP_JUMP_IF_FALSE || op == DM_OP_JUMP
+		|| op == DM_OP_FORPREP || op == DM_OP_FORLOOP;
+}
+
+static dm_regop binary_regop(dm_opcode op) {
+	switch (op) {
+		case DM_OP_PLUS:         return DM_ROP_PLUS;
+		case DM_OP_MINUS:        return DM_ROP_MINUS;
+		case DM_OP_MUL:          return DM_ROP_MUL;
+		case DM_OP_DIV:          return DM_ROP_DIV;
+		case DM_OP_MOD:          return DM_ROP_MOD;
+		case DM_OP_NOTEQUAL:     return DM_ROP_NOTEQUAL;
+		case DM_OP_EQUAL:        return DM_ROP_EQUAL;
+		case DM_OP_LESS:         return DM_ROP_LESS;
+		case DM_OP_LESSEQUAL:    return DM_ROP_LESSEQUAL;
+		case DM_OP_GREATER:      return DM_ROP_GREATER;
+		default:                 return DM_ROP_GREATEREQUAL;
+	}
+}
+
+static void translate_op(translator *t, dm_instr instr) {
+	dm_opcode op = dm_opcode_generic(dm_instr_op(instr));
+	int a = dm_instr_a(instr);
+	int b = dm_instr_b(instr);
+	switch (op) {
+		case DM_OP_IMPORT: {
+			int module = pop(t);
+			emit_dst(t, DM_ROP_IMPORT, slot_reg(t, t->depth), module, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_VARSET: {
+			int index = b;
+			int v = pop(t);
+			materialize_var(t, index);
+			int last = t->rc->size - 1;
+			if (t->retarget == last && v == slot_reg(t, t->depth) && t->rc->code[last].a == v) {
+				t->rc->code[t->retarget].a = index;
+			} else if (v != index) {
+				emit(t, DM_ROP_MOVE, 0, index, v, 0);
+			}
+			push(t, index);
+			break;
+		}
+		case DM_OP_VARGETOPSET: {
+			int index = b;
+			int v = pop(t);
+			materialize_var(t, index);
+			emit(t, DM_ROP_VARGETOPSET, a, index, v, 0);
+			push(t, index);
+			break;
+		}
+		case DM_OP_VARSET_UP: {
+			int v = pop(t);
+			emit(t, DM_ROP_VARSET_UP, 0, v, b, 0);
+			push_result(t, v);
+			break;
+		}
+		case DM_OP_VARGETOPSET_UP: {
+			if (t->depth == 0) {
+				t->failed = true;
+				break;
+			}
+			materialize(t, t->depth - 1);
+			emit(t, DM_ROP_VARGETOPSET_UP, a, slot_reg(t, t->depth - 1), b, 0);
+			break;
+		}
+		case DM_OP_VARGET:
+			push(t, b);
+			break;
+		case DM_OP_VARGET_UP:
+			emit(t, DM_ROP_VARGET_UP, 0, slot_reg(t, t->depth), b, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		case DM_OP_FIELDSET:
+		case DM_OP_FIELDSET_S: {
+			int v = pop(t);
+			int field = pop(t);
+			int table = pop(t);
+			dm_regop rop = op == DM_OP_FIELDSET ? DM_ROP_FIELDSET : DM_ROP_FIELDSET_S;
+			emit(t, rop, 0, table, field, v);
+			push_result(t, v);
+			break;
+		}
+		case DM_OP_FIELDGETOPSET:
+		case DM_OP_FIELDGETOPSET_S: {
+			int v = pop(t);
+			int field = pop(t);
+			(void) pop(t);
+			materialize(t, t->depth);
+			dm_regop rop = op == DM_OP_FIELDGETOPSET ? DM_ROP_FIELDGETOPSET : DM_ROP_FIELDGETOPSET_S;
+			emit(t, rop, a, slot_reg(t, t->depth), field, v);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_FIELDGET:
+		case DM_OP_FIELDGET_S: {
+			int field = pop(t);
+			int table = pop(t);
+			dm_regop rop = op == DM_OP_FIELDGET ? DM_ROP_FIELDGET : DM_ROP_FIELDGET_S;
+			emit_dst(t, rop, slot_reg(t, t->depth), table, field);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_FIELDGET_PUSHPARENT:
+		case DM_OP_FIELDGET_S_PUSHPARENT: {
+			int field = pop(t);
+			int table = t->depth > 0 ? t->stack[t->depth - 1] : slot_reg(t, 0);
+			dm_regop rop = op == DM_OP_FIELDGET_PUSHPARENT ? DM_ROP_FIELDGET : DM_ROP_FIELDGET_S;
+			emit(t, rop, 0, slot_reg(t, t->depth), table, field);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_CONSTANT:
+			push(t, b | DM_RK_CONST);
+			break;
+		case DM_OP_CONSTANT_SMALLINT:
+			push(t, add_const(t, dm_value_int(b)));
+			break;
+		case DM_OP_CLOSURE:
+			emit_dst(t, DM_ROP_CLOSURE, slot_reg(t, t->depth), b, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		case DM_OP_TRUE:
+			push(t, add_const(t, dm_value_bool(true)));
+			break;
+		case DM_OP_FALSE:
+			push(t, add_const(t, dm_value_bool(false)));
+			break;
+		case DM_OP_NIL:
+			push(t, add_const(t, dm_value_nil()));
+			break;
+		case DM_OP_ARRAYLIT:
+		case DM_OP_TABLELIT: {
+			int n = b;
+			int slots = op == DM_OP_ARRAYLIT ? n : 2 * n;
+			if (slots > t->depth) {
+				t->failed = true;
+				break;
+			}
+			materialize_from(t, t->depth - slots);
+			t->depth -= slots;
+			dm_regop rop = op == DM_OP_ARRAYLIT ? DM_ROP_ARRAYLIT : DM_ROP_TABLELIT;
+			emit(t, rop, 0, slot_reg(t, t->depth), n, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_SELF:
+			emit_dst(t, DM_ROP_SELF, slot_reg(t, t->depth), 0, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		case DM_OP_CALL:
+		case DM_OP_CALL_WITHPARENT:
+		case DM_OP_TAILCALL: {
+			// the callee may change variables of this chunk through global
+			int n = a;
+			int slots = op == DM_OP_CALL_WITHPARENT ? n + 2 : n + 1;
+			if (slots > t->depth) {
+				t->failed = true;
+				break;
+			}
+			materialize_from(t, 0);
+			t->depth -= slots;
+			dm_regop rop = op == DM_OP_CALL ? DM_ROP_CALL : op == DM_OP_TAILCALL ? DM_ROP_TAILCALL : DM_ROP_CALL_WITHPARENT;
+			emit(t, rop, 0, slot_reg(t, t->depth), n, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_CHECKTYPE: {
+			int v = pop(t);
+			emit_dst(t, DM_ROP_CHECKTYPE, slot_reg(t, t->depth), v, dm_instr_a(instr));
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_NEGATE:
+		case DM_OP_NOT: {
+			int v = pop(t);
+			emit_dst(t, op == DM_OP_NEGATE ? DM_ROP_NEGATE : DM_ROP_NOT, slot_reg(t, t->depth), v, 0);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_PLUS:
+		case DM_OP_MINUS:
+		case DM_OP_MUL:
+		case DM_OP_DIV:
+		case DM_OP_MOD:
+		case DM_OP_NOTEQUAL:
+		case DM_OP_EQUAL:
+		case DM_OP_LESS:
+		case DM_OP_LESSEQUAL:
+		case DM_OP_GREATER:
+		case DM_OP_GREATEREQUAL: {
+			int v2 = pop(t);
+			int v1 = pop(t);
+			emit_dst(t, binary_regop(op), slot_reg(t, t->depth), v1, v2);
+			push(t, slot_reg(t, t->depth));
+			break;
+		}
+		case DM_OP_JUMP_IF_TRUE_OR_POP:
+		case DM_OP_JUMP_IF_FALSE_OR_POP: {
+			if (t->depth == 0) {
+				t->failed = true;
+				break;
+			}
+			materialize_from(t, 0);
+			dm_regop rop = op == DM_OP_JUMP_IF_TRUE_OR_POP ? DM_ROP_JUMP_IF_TRUE : DM_ROP_JUMP_IF_FALSE;
+			emit_jump(t, rop, slot_reg(t, t->depth - 1), b);
+			t->depth--;
+			break;
+		}
+		case DM_OP_JUMP_IF_FALSE: {
+			int cond = pop(t);
+			materialize_from(t, 0);
+			emit_jump(t, DM_ROP_JUMP_IF_FALSE, cond, b);
+			break;
+		}
+		case DM_OP_JUMP:
+			materialize_from(t, 0);
+			emit_jump(t, DM_ROP_JUMP, 0, b);
+			break;
+		case DM_OP_FORPREP:
+		case DM_OP_FORLOOP:
+			// the loop writes its variable
+			materialize_from(t, 0);
+			emit_jump(t, op == DM_OP_FORPREP ? DM_ROP_FORPREP : DM_ROP_FORLOOP, 0, b);
+			t->rc->code[t->rc->size - 1].x = a;
+			break;
+		case DM_OP_POP:
+			(void) pop(t);
+			break;
+		case DM_OP_RETURN:
+			emit(t, DM_ROP_RETURN, 0, pop(t), 0, 0);
+			break;
+		default:
+			t->failed = true;
+			break;
+	}
+}
+
+static dm_regcode *translate(dm_chunk *chunk) {
+	dm_regcode *rc = malloc(sizeof(dm_regcode));
+	rc->size = 0;
+	rc->capacity = 64;
+	rc->code = malloc(rc->capacity * sizeof(dm_reginstr));
+	rc->addrs = malloc(rc->capacity * sizeof(int));
+	rc->constsize = chunk->constsize;
+	rc->constcapacity = chunk->constsize + 8;
+	rc->consts = malloc(rc->constcapacity * sizeof(dm_value));
+	for (int i = 0; i < chunk->constsize; i++) {
+		rc->consts[i] = chunk->consts[i];
+	}
+
+	translator t = {chunk, rc, 0, NULL, 0, 0, NULL, NULL, -1, 0, NULL, false};
+	t.label_depth = malloc((chunk->codesize + 1) * sizeof(int));
+	t.map = malloc((chunk->codesize + 1) * sizeof(int));
+	t.fixups = malloc((chunk->codesize + 1) * sizeof(int));
+	bool *is_target = calloc(chunk->codesize + 1, sizeof(bool));
+	for (int i = 0; i <= chunk->codesize; i++) {
+		t.label_depth[i] = -1;
+		t.map[i] = -1;
+	}
+
+	for (int addr = 0; addr < chunk->codesize; addr++) {
+		dm_instr instr = chunk->code[addr];
+		dm_instr first;
+		dm_superinstr_split(instr, &first, &instr);
+		if (is_jump(dm_instr_op(instr))) {
+			int target = dm_instr_b(instr);
+			if (target >= chunk->codesize) {
+				t.failed = true;
+				break;
+			}
+			is_target[target] = true;
+		}
+	}
+
+	bool reachable = true;
+	for (int addr = 0; addr < chunk->codesize && !t.failed; addr++) {
+		t.addr = addr;
+		if (is_target[addr]) {
+			t.retarget = -1;
+			if (reachable) {
+				materialize_from(&t, 0);
+				if (t.label_depth[addr] != -1 && t.label_depth[addr] != t.depth) {
+					t.failed = true;
+					break;
+				}
+				t.label_depth[addr] = t.depth;
+			} else {
+				// labels only reached by later jumps (the step of a for loop)
+				// keep the depth of the jump before them, the jumps check it
+				if (t.label_depth[addr] == -1) {
+					t.label_depth[addr] = t.depth;
+				}
+				reachable = true;
+				t.depth = 0;
+				for (int i = 0; i < t.label_depth[addr]; i++) {
+					push(&t, slot_reg(&t, i));
+				}
+			}
+		}
+		if (!reachable) {
+			continue;
+		}
+
+		t.map[addr] = rc->size;
+		// both halves of a superinstruction belong to its address
+		dm_instr instr = chunk->code[addr];
+		dm_instr first;
+		if (dm_superinstr_split(instr, &first, &instr)) {
+			translate_op(&t, first);
+		}
+		dm_opcode op = dm_opcode_generic(dm_instr_op(instr));
+		translate_op(&t, instr);
+		if (op == DM_OP_JUMP || op == DM_OP_RETURN) {
+			reachable = false;
+		}
+	}
+
+	for (int i = 0; i < t.nfixups && !t.failed; i++) {
+		dm_reginstr *in = &rc->code[t.fixups[i]];
+		uint16_t *target = in->op == DM_ROP_JUMP ? &in->a : &in->b;
+		if (t.map[*target] == -1) {
+			t.failed = true;
+			break;
+		}
+		*target = t.map[*target];
+	}
+
+	rc->nregs = chunk->varsize + t.maxdepth;
+	if (rc->nregs >= DM_RK_CONST || rc->constsize >= DM_RK_CONST || rc->size > UINT16_MAX) {
+		t.failed = true;
+	}
+
+	free(is_target);
+	free(t.fixups);
+	free(t.map);
+	free(t.label_depth);
+	free(t.stack);
+	if (t.failed) {
+		dm_regcode_free(rc);
+		return NULL;
+	}
+	return rc;
+}
+
+int dm_regcode_compile(dm_state *dm, dm_chunk *chunk) {
+	if (chunk->regcode == NULL) {
+		chunk->regcode = translate(chunk);
+		if (chunk->regcode == NULL) {
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < chunk->constsize; i++) {
+		if (dm_value_type(chunk->consts[i]) == DM_TYPE_FUNCTION) {
+			if (dm_regcode_compile(dm, dm_value_as_function(chunk->consts[i])->chunk) != 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+void dm_regcode_free(dm_regcode *rc) {
+	if (rc == NULL) {
+		return;
+	}
+	free(rc->code);
+	free(rc->addrs);
+	free(rc->consts);
+	free(rc);
+}
+
+int dm_regcode_addr_at(dm_chunk *chunk, int index) {
+	dm_regcode *rc = chunk->regcode;
+	if (rc == NULL || index < 0 || index >= rc->size) {
+		return -1;
+	}
+	return rc->addrs[index];
+}
+
+int dm_regcode_line_at(dm_chunk *chunk, int index) {
+	int addr = dm_regcode_addr_at(chunk, index);
+	return addr == -1 ? chunk->current_line : dm_chunk_line_at(chunk, addr);
+}
+
+static const char *regop_names[] = {
+	[DM_ROP_MOVE]            = "MOVE",
+	[DM_ROP_IMPORT]          = "IMPORT",
+	[DM_ROP_VARGETOPSET]     = "VARGETOPSET",
+	[DM_ROP_VARSET_UP]       = "VARSET_UP",
+	[DM_ROP_VARGETOPSET_UP]  = "VARGETOPSET_UP",
+	[DM_ROP_VARGET_UP]       = "VARGET_UP",
+	[DM_ROP_CLOSURE]         = "CLOSURE",
+	[DM_ROP_FIELDSET]        = "FIELDSET",
+	[DM_ROP_FIELDGETOPSET]   = "FIELDGETOPSET",
+	[DM_ROP_FIELDSET_S]      = "FIELDSET_S",
+	[DM_ROP_FIELDGETOPSET_S] = "FIELDGETOPSET_S",
+	[DM_ROP_FIELDGET]        = "FIELDGET",
+	[DM_ROP_FIELDGET_S]      = "FIELDGET_S",
+	[DM_ROP_ARRAYLIT]        = "ARRAYLIT",
+	[DM_ROP_TABLELIT]        = "TABLELIT",
+	[DM_ROP_SELF]            = "SELF",
+	[DM_ROP_CALL]            = "CALL",
+	[DM_ROP_CALL_WITHPARENT] = "CALL_WITHPARENT",
+	[DM_ROP_TAILCALL]        = "TAILCALL",
+	[DM_ROP_CHECKTYPE]       = "CHECKTYPE",
+	[DM_ROP_NEGATE]          = "NEGATE",
+	[DM_ROP_NOT]             = "NOT",
+	[DM_ROP_PLUS]            = "PLUS",
+	[DM_ROP_MINUS]           = "MINUS",
+	[DM_ROP_MUL]             = "MUL",
+	[DM_ROP_DIV]             = "DIV",
+	[DM_ROP_MOD]             = "MOD",
+	[DM_ROP_NOTEQUAL]        = "NOTEQUAL",
+	[DM_ROP_EQUAL]           = "EQUAL",
+	[DM_ROP_LESS]            = "LESS",
+	[DM_ROP_LESSEQUAL]       = "LESSEQUAL",
+	[DM_ROP_GREATER]         = "GREATER",
+	[DM_ROP_GREATEREQUAL]    = "GREATEREQUAL",
+	[DM_ROP_JUMP_IF_TRUE]    = "JUMP_IF_TRUE",
+	[DM_ROP_JUMP_IF_FALSE]   = "JUMP_IF_FALSE",
+	[DM_ROP_JUMP]            = "JUMP",
+	[DM_ROP_RETURN]          = "RETURN",
+	[DM_ROP_FORPREP]         = "FORPREP",
+	[DM_ROP_FORLOOP]         = "FORLOOP",
+};
+
+static void print_rk(int operand) {
+	if (operand & DM_RK_CONST) {
+		printf(" k%d", operand & ~DM_RK_CONST);
+	} else {
+		printf(" r%d", operand);
+	}
+}
+
+void dm_regcode_decompile(dm_state *dm, dm_chunk *chunk) {
+	dm_regcode *rc = chunk->regcode;
+	if (rc == NULL) {
+		printf("No register code\n");
+		return;
+	}
+
+	for (int i = 0; i < rc->size; i++) {
+		dm_reginstr in = rc->code[i];
+		printf("%d: %s", i, regop_names[in.op]);
+		switch (in.op) {
+			case DM_ROP_SELF:
+				print_rk(in.a);
+				break;
+			case DM_ROP_JUMP:
+				printf(" %d", in.a);
+				break;
+			case DM_ROP_RETURN:
+				print_rk(in.a);
+				break;
+			case DM_ROP_JUMP_IF_TRUE:
+			case DM_ROP_JUMP_IF_FALSE:
+				print_rk(in.a);
+				printf(" %d", in.b);
+				break;
+			case DM_ROP_FORPREP:
+			case DM_ROP_FORLOOP:
+				printf(" %d %d", in.x, in.b);
+				break;
+			case DM_ROP_ARRAYLIT:
+			case DM_ROP_TABLELIT:
+			case DM_ROP_CALL:
+			case DM_ROP_CALL_WITHPARENT:
+			case DM_ROP_TAILCALL:
+				print_rk(in.a);
+				printf(" %d", in.b);
+				break;
+			case DM_ROP_VARGETOPSET:
+				printf(" %d", in.x);
+				print_rk(in.a);
+				print_rk(in.b);
+				break;
+			case DM_ROP_VARSET_UP:
+			case DM_ROP_VARGET_UP:
+				print_rk(in.a);
+				printf(" u%d", in.b);
+				break;
+			case DM_ROP_VARGETOPSET_UP:
+				printf(" %d", in.x);
+				print_rk(in.a);
+				printf(" u%d", in.b);
+				break;
+			case DM_ROP_CLOSURE:
+				print_rk(in.a);
+				printf(" k%d", in.b);
+				break;
+			case DM_ROP_FIELDGETOPSET:
+			case DM_ROP_FIELDGETOPSET_S:
+				printf(" %d", in.x);
+				print_rk(in.a);
+				print_rk(in.b);
+				print_rk(in.c);
+				break;
+			case DM_ROP_MOVE:
+			case DM_ROP_IMPORT:
+			case DM_ROP_NEGATE:
+			case DM_ROP_NOT:
+				print_rk(in.a);
+				print_rk(in.b);
+				break;
+			case DM_ROP_CHECKTYPE:
+				print_rk(in.a);
+				print_rk(in.b);
+				printf(" %d", in.c);
+				break;
+			default:
+				print_rk(in.a);
+				print_rk(in.b);
+				print_rk(in.c);
+				break;
+		}
+		printf("\n");
+	}
+
+	printf("Registers: %d\n", rc->nregs);
+	printf("Constants:\n");
+	for (int i = 0; i < rc->constsize; i++) {
+		printf("%d: ", i);
+		dm_value_inspect(dm, rc->consts[i]);
+		printf("\n");
+	}
+
+	for (int i = 0; i < chunk->constsize; i++) {
+		if (dm_value_type(chunk->consts[i]) == DM_TYPE_FUNCTION) {
+			printf("Function (constant %d):\n", i);
+			dm_regcode_decompile(dm, dm_value_as_function(chunk->consts[i])->chunk);
+		}
+	}
+}
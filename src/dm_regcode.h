@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <dm_value.h>
+#include <dm_chunk.h>
+
+// Register code is translated from the stack code of a chunk. The variables
+// of the chunk are the registers 0..varsize-1, the values the stack code keeps
+// on the stack live in the registers after them. Operands marked rk are either
+// a register or, with DM_RK_CONST set, an index into the constants.
+typedef enum {
+	DM_ROP_MOVE,                // dst rk          | dst = rk
+	DM_ROP_IMPORT,              // dst rk          | dst = import(rk)
+	DM_ROP_VARGETOPSET,         // reg rk op       | reg = reg op rk
+	DM_ROP_VARSET_UP,           // rk upval        | upvals[upval] = rk
+	DM_ROP_VARGETOPSET_UP,      // reg upval op    | reg = upvals[upval] = upvals[upval] op reg
+	DM_ROP_VARGET_UP,           // dst upval       | dst = upvals[upval]
+	DM_ROP_CLOSURE,             // dst index       | dst = closure of consts[index]
+	DM_ROP_FIELDSET,            // rk rk rk        | rk1[rk2] = rk3
+	DM_ROP_FIELDGETOPSET,       // reg rk rk op    | reg = reg[rk1] = reg[rk1] op rk2
+	DM_ROP_FIELDSET_S,          // rk rk rk        | rk1.rk2 = rk3
+	DM_ROP_FIELDGETOPSET_S,     // reg rk rk op    | reg = reg.rk1 = reg.rk1 op rk2
+	DM_ROP_FIELDGET,            // dst rk rk       | dst = rk1[rk2]
+	DM_ROP_FIELDGET_S,          // dst rk rk       | dst = rk1.rk2
+
+	DM_ROP_ARRAYLIT,            // reg n           | reg = [reg, ..., reg+n-1]
+	DM_ROP_TABLELIT,            // reg n           | reg = {reg: reg+1, ..., reg+2n-2: reg+2n-1}
+	DM_ROP_SELF,                // dst             | dst = self
+
+	DM_ROP_CALL,                // reg n           | reg = reg(reg+1, ..., reg+n)
+	DM_ROP_CALL_WITHPARENT,     // reg n           | reg = reg.(reg+1)(reg+2, ..., reg+n+1)
+	DM_ROP_TAILCALL,            // reg n           | return reg(reg+1, ..., reg+n) in the frame of the caller
+
+	DM_ROP_CHECKTYPE,           // dst rk type     | dst = rk, fails unless rk has the type
+	DM_ROP_NEGATE,              // dst rk          | dst = -rk
+	DM_ROP_NOT,                 // dst rk          | dst = not rk
+	DM_ROP_PLUS,                // dst rk rk       | dst = rk1 + rk2
+	DM_ROP_MINUS,               // dst rk rk
+	DM_ROP_MUL,                 // dst rk rk
+	DM_ROP_DIV,                 // dst rk rk
+	DM_ROP_MOD,                 // dst rk rk
+	DM_ROP_NOTEQUAL,            // dst rk rk
+	DM_ROP_EQUAL,               // dst rk rk
+	DM_ROP_LESS,                // dst rk rk
+	DM_ROP_LESSEQUAL,           // dst rk rk
+	DM_ROP_GREATER,             // dst rk rk
+	DM_ROP_GREATEREQUAL,        // dst rk rk
+
+	DM_ROP_JUMP_IF_TRUE,        // rk addr
+	DM_ROP_JUMP_IF_FALSE,       // rk addr
+	DM_ROP_JUMP,                // addr
+
+	DM_ROP_RETURN,              // rk
+
+	DM_ROP_FORPREP,             // loop addr       | x = loop, see DM_OP_FORPREP
+	DM_ROP_FORLOOP              // loop addr       | x = loop, see DM_OP_FORLOOP
+} dm_regop;
+
+#define DM_RK_CONST 0x8000
+
+typedef struct {
+	uint8_t op;
+	uint8_t x;
+	uint16_t a;
+	uint16_t b;
+	uint16_t c;
+} dm_reginstr;
+
+typedef struct dm_regcode {
+	int size;
+	int capacity;
+	dm_reginstr *code;
+	int *addrs;                 // address of the stack instruction, for lines
+	int constsize;
+	int constcapacity;
+	dm_value *consts;
+	int nregs;
+} dm_regcode;
+
+// Translates the chunk and the chunks of its function constants, functions that
+// were translated before are kept. Returns 0 if everything could be translated.
+int  dm_regcode_compile(dm_state *dm, dm_chunk *chunk);
+void dm_regcode_free(dm_regcode *rc);
+// the stack code address register instruction index came from, -1 if none
+int  dm_regcode_addr_at(dm_chunk *chunk, int index);
+int  dm_regcode_line_at(dm_chunk *chunk, int index);
+void dm_regcode_decompile(dm_state *dm, dm_chunk *chunk);
@@ -22,6 +22,15 @@ struct dm_state {
 	struct string_constant *strings;
 
 	bool debug;
+	bool regvm;
+	bool nofold;
+	bool nopeephole;
+	bool noinline;
+	bool jit;
+	bool trace;
+	bool aot;
+	const struct dm_aot_program *aot_program;
+	int optlevel;
 	bool runtime_error;
 };
 
@@ -98,6 +107,7 @@ dm_state *dm_open(void) {
 	}
 
 	dm->main = dm_value_nil();
+	dm->optlevel = 1;
 	return dm;
 }
 
@@ -157,6 +167,77 @@ bool dm_debug_enabled(dm_state *dm) {
 	return dm->debug;
 }
 
+void dm_enable_regvm(dm_state *dm) {
+	dm->regvm = true;
+}
+
+bool dm_regvm_enabled(dm_state *dm) {
+	return dm->regvm;
+}
+
+void dm_disable_fold(dm_state *dm) {
+	dm->nofold = true;
+}
+
+bool dm_fold_enabled(dm_state *dm) {
+	return !dm->nofold;
+}
+
+void dm_disable_peephole(dm_state *dm) {
+	dm->nopeephole = true;
+}
+
+bool dm_peephole_enabled(dm_state *dm) {
+	return !dm->nopeephole;
+}
+
+void dm_disable_inline(dm_state *dm) {
+	dm->noinline = true;
+}
+
+bool dm_inline_enabled(dm_state *dm) {
+	return !dm->noinline;
+}
+
+void dm_enable_jit(dm_state *dm) {
+	dm->jit = true;
+}
+
+bool dm_jit_enabled(dm_state *dm) {
+	return dm->jit;
+}
+
+void dm_enable_trace(dm_state *dm) {
+	dm->trace = true;
+}
+
+bool dm_trace_enabled(dm_state *dm) {
+	return dm->trace;
+}
+
+void dm_enable_aot(dm_state *dm, const struct dm_aot_program *program) {
+	dm->aot = true;
+	dm->aot_program = program;
+}
+
+bool dm_aot_enabled(dm_state *dm) {
+	return dm->aot;
+}
+
+const struct dm_aot_program *dm_state_take_aot_program(dm_state *dm) {
+	const struct dm_aot_program *program = dm->aot_program;
+	dm->aot_program = NULL;
+	return program;
+}
+
+void dm_set_opt_level(dm_state *dm, int level) {
+	dm->optlevel = level;
+}
+
+int dm_opt_level(dm_state *dm) {
+	return dm->optlevel;
+}
+
 dm_value *dm_state_get_main(dm_state *dm) {
 	return &dm->main;
 }
@@ -5,6 +5,8 @@
 #include <setjmp.h>
 #include <stdarg.h>
 
+struct dm_aot_program;
+
 char *dm_read_file(const char *path);
 
 dm_state *dm_open(void);
@@ -12,6 +14,23 @@ void dm_close(dm_state *dm);
 
 void dm_enable_debug(dm_state *dm);
 bool dm_debug_enabled(dm_state *dm);
+void dm_enable_regvm(dm_state *dm);
+bool dm_regvm_enabled(dm_state *dm);
+void dm_disable_fold(dm_state *dm);
+bool dm_fold_enabled(dm_state *dm);
+void dm_disable_peephole(dm_state *dm);
+bool dm_peephole_enabled(dm_state *dm);
+void dm_disable_inline(dm_state *dm);
+bool dm_inline_enabled(dm_state *dm);
+void dm_enable_jit(dm_state *dm);
+bool dm_jit_enabled(dm_state *dm);
+void dm_enable_trace(dm_state *dm);
+bool dm_trace_enabled(dm_state *dm);
+// the chunks of the first script that runs get the code of the program, see dm_aot.h
+void dm_enable_aot(dm_state *dm, const struct dm_aot_program *program);
+bool dm_aot_enabled(dm_state *dm);
+void dm_set_opt_level(dm_state *dm, int level);
+int  dm_opt_level(dm_state *dm);
 
 const char *dm_state_string_dedup(dm_state *dm, const char *str, int str_len);
 
@@ -19,6 +38,8 @@ dm_value *dm_state_get_main(dm_state *dm);
 void *dm_state_get_gc(dm_state *dm);
 dm_module *dm_state_get_module(dm_state *dm, dm_type t);
 jmp_buf *dm_state_get_jmpbuf(dm_state *dm);
+// the program of dm_enable_aot the first time, NULL afterwards
+const struct dm_aot_program *dm_state_take_aot_program(dm_state *dm);
 
 dm_exception void dm_state_set_error(dm_state *dm, const char *message, va_list args);
 void dm_state_reset_error(dm_state *dm);
@@ -26,7 +26,7 @@ dm_value dm_value_string_const(dm_state *dm, const char *s, int size) {
 	dm_string *str = string_alloc(dm, true);
 	str->data = ds;
 	str->size = size;
-	return (dm_value){DM_TYPE_STRING, {.str_val = str}};
+	return dm_value_object(DM_TYPE_STRING, str);
 }
 
 size_t dm_string_size(dm_string *s) {
@@ -40,31 +40,31 @@ const char *dm_string_c_str(dm_string *s) {
 static bool dm_string_equals(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
 
-	if (other.type != DM_TYPE_STRING) {
+	if (dm_value_type(other) != DM_TYPE_STRING) {
 		return false;
 	}
 
-	dm_string *s1 = self.str_val;
-	dm_string *s2 = other.str_val;
+	dm_string *s1 = dm_value_as_string(self);
+	dm_string *s2 = dm_value_as_string(other);
 	return s1->data == s2->data
 		|| (s1->size == s2->size && memcmp(s1->data, s2->data, s1->size) == 0);
 }
 
 static void dm_string_inspect(dm_state *dm, dm_value self) {
 	(void) dm;
-	dm_string *s = self.str_val;
+	dm_string *s = dm_value_as_string(self);
 	printf("\"%.*s\"", (int) s->size, s->data);
 }
 
 static int dm_string_compare(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
 
-	if (other.type != DM_TYPE_STRING) {
+	if (dm_value_type(other) != DM_TYPE_STRING) {
 		dm_runtime_compare_mismatch(dm, self, other);
 	}
 
-	const char *s1 = self.str_val->data;
-	const char *s2 = other.str_val->data;
+	const char *s1 = dm_value_as_string(self)->data;
+	const char *s2 = dm_value_as_string(other)->data;
 	int res = s1 == s2 ? 0 : strcmp(s1, s2);
 	return res < 0 ? -1 : res > 0 ? 1: 0;
 }
@@ -80,12 +80,12 @@ static bool dm_string_fieldget(dm_state *dm, dm_value self, const char *field, d
 }
 
 static dm_value dm_string_add(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_STRING) {
+	if (dm_value_type(other) != DM_TYPE_STRING) {
 		return dm_value_nil();
 	}
 
-	dm_string *a = self.str_val;
-	dm_string *b = other.str_val;
+	dm_string *a = dm_value_as_string(self);
+	dm_string *b = dm_value_as_string(other);
 	dm_string *new = string_alloc(dm, false);
 	new->size = a->size + b->size;
 	char *data = malloc(new->size + 1);
@@ -93,24 +93,24 @@ static dm_value dm_string_add(dm_state *dm, dm_value self, dm_value other) {
 	memcpy(data + a->size, b->data, b->size);
 	data[new->size] = '\0';
 	new->data = data;
-	return (dm_value){DM_TYPE_STRING, {.str_val = new}};
+	return dm_value_object(DM_TYPE_STRING, new);
 }
 
 static dm_value dm_string_mul(dm_state *dm, dm_value self, dm_value other) {
-	if (other.type != DM_TYPE_INT) {
+	if (dm_value_type(other) != DM_TYPE_INT) {
 		return dm_value_nil();
 	}
 
-	dm_string *a = self.str_val;
+	dm_string *a = dm_value_as_string(self);
 	dm_string *new = string_alloc(dm, false);
-	new->size = a->size * other.int_val;
+	new->size = a->size * dm_value_as_int(other);
 	char *data = malloc(new->size + 1);
-	for (int i = 0; i < other.int_val; i++) {
+	for (int i = 0; i < dm_value_as_int(other); i++) {
 		memcpy(data + i * a->size, a->data, a->size);
 	}
 	data[new->size] = '\0';
 	new->data = data;
-	return (dm_value){DM_TYPE_STRING, {.str_val = new}};
+	return dm_value_object(DM_TYPE_STRING, new);
 }
 
 dm_module dm_string_init(dm_state *dm) {
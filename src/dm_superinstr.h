@@ -0,0 +1,27 @@
+#pragma once
+
+// Superinstructions are pairs of opcodes the stack vm runs with one dispatch.
+// The pairs are the ones the stack vm executed most often over the tests, see
+// tests/opcode_pairs.sh, ordered by their share of all executed pairs.
+// Everything else is derived from this table: the opcodes, the fusing in the
+// peephole pass, the vm handlers, the verifier, the register translation and
+// the decompiler.
+//
+// The first opcode of a pair needs a vm_do_* macro in dm_vm.c. The operands of
+// the pair are those of the opcode that has any, if both take an index16 the
+// first one goes into a8 and the pair is only fused if it is below 256, see
+// dm_superinstr_first.
+//
+//   X(superinstruction, first, second)
+#define DM_SUPERINSTRUCTIONS(X)                                              \
+	X(POP_VARGET,                POP,                VARGET)                  \
+	X(VARGET_VARGET,             VARGET,             VARGET)                  \
+	X(VARGET_CONSTANT_SMALLINT,  VARGET,             CONSTANT_SMALLINT)       \
+	X(CONSTANT_SMALLINT_VARGET,  CONSTANT_SMALLINT,  VARGET)                  \
+	X(VARGET_CONSTANT,           VARGET,             CONSTANT)                \
+	X(VARGET_NOTEQUAL,           VARGET,             NOTEQUAL)                \
+	X(VARGET_EQUAL,              VARGET,             EQUAL)                   \
+	X(CONSTANT_SMALLINT_MINUS,   CONSTANT_SMALLINT,  MINUS)                   \
+	X(VARGET_MUL,                VARGET,             MUL)                     \
+	X(VARSET_POP,                VARSET,             POP)                     \
+	X(CONSTANT_MUL,              CONSTANT,           MUL)
@@ -2,8 +2,9 @@
 #include <string.h>
 #include <dm_table.h>
 
-#define TABLE_INVALID_VAL ((dm_value){DM_TYPE_NIL, {.int_val = 0xDEAD}})
+// a nil with a payload marks unused entries
 #define TABLE_INVALID_CODE (0xDEAD)
+#define TABLE_INVALID_VAL dm_value_make(DM_TYPE_NIL, TABLE_INVALID_CODE)
 
 struct dm_table {
 	dm_gc_obj gc_header;
@@ -14,7 +15,7 @@ struct dm_table {
 };
 
 static bool table_is_invalid_entry(dm_value v) {
-	return v.type == DM_TYPE_NIL && v.int_val == TABLE_INVALID_CODE;
+	return dm_value_type(v) == DM_TYPE_NIL && dm_value_payload(v) == TABLE_INVALID_CODE;
 }
 
 static void table_mark(dm_state *dm, struct dm_gc_obj *obj) {
@@ -26,10 +27,10 @@ static void table_mark(dm_state *dm, struct dm_gc_obj *obj) {
 			continue;
 		}
 		if (dm_value_is_gc_obj(keys[i])) {
-			dm_gc_mark(dm, keys[i].gc_obj);
+			dm_gc_mark(dm, dm_value_as_gc_obj(keys[i]));
 		}
 		if (dm_value_is_gc_obj(values[i])) {
-			dm_gc_mark(dm, values[i].gc_obj);
+			dm_gc_mark(dm, dm_value_as_gc_obj(values[i]));
 		}
 	}
 }
@@ -43,10 +44,10 @@ static void table_free(dm_state *dm, struct dm_gc_obj *obj) {
 			continue;
 		}
 		if (dm_value_is_gc_obj(keys[i])) {
-			dm_gc_free(dm, keys[i].gc_obj);
+			dm_gc_free(dm, dm_value_as_gc_obj(keys[i]));
 		}
 		if (dm_value_is_gc_obj(values[i])) {
-			dm_gc_free(dm, values[i].gc_obj);
+			dm_gc_free(dm, dm_value_as_gc_obj(values[i]));
 		}
 	}
 	free(t->keys);
@@ -67,7 +68,7 @@ dm_value dm_value_table(dm_state *dm, int size) {
 		keys[i] = TABLE_INVALID_VAL;
 		values[i] = TABLE_INVALID_VAL;
 	}
-	return (dm_value){DM_TYPE_TABLE, {.table_val = table}};
+	return dm_value_object(DM_TYPE_TABLE, table);
 }
 
 bool dm_table_equal(dm_table *t1, dm_table *t2) {
@@ -75,7 +76,7 @@ bool dm_table_equal(dm_table *t1, dm_table *t2) {
 }
 
 static void dm_table_inspect(dm_state *dm, dm_value self) {
-	dm_table *t = self.table_val;
+	dm_table *t = dm_value_as_table(self);
 	dm_value *keys = t->keys;
 	dm_value *values = t->values;
 
@@ -85,7 +86,7 @@ static void dm_table_inspect(dm_state *dm, dm_value self) {
 	for (int i = 0; i < t->size; i++) {
 		dm_value key = keys[i];
 		dm_value value = values[i];
-		if (key.int_val == TABLE_INVALID_CODE || value.int_val == TABLE_INVALID_CODE) {
+		if (table_is_invalid_entry(key) || table_is_invalid_entry(value)) {
 			continue;
 		}
 
@@ -104,11 +105,11 @@ static void dm_table_inspect(dm_state *dm, dm_value self) {
 }
 
 void dm_value_table_set(dm_state *dm, dm_value t, dm_value field, dm_value v) {
-	if (t.type != DM_TYPE_TABLE) {
+	if (dm_value_type(t) != DM_TYPE_TABLE) {
 		return;
 	}
 
-	dm_table *table = t.table_val;
+	dm_table *table = dm_value_as_table(t);
 	dm_value *keys = (dm_value*) table->keys;
 	dm_value *values = (dm_value*) table->values;
 	for (int i = 0; i < table->size; i++) {
@@ -116,7 +117,7 @@ void dm_value_table_set(dm_state *dm, dm_value t, dm_value field, dm_value v) {
 			values[i] = v;
 			break;
 		}
-		if (keys[i].int_val != TABLE_INVALID_CODE && values[i].int_val != TABLE_INVALID_CODE) {
+		if (!table_is_invalid_entry(keys[i]) && !table_is_invalid_entry(values[i])) {
 			continue;
 		}
 		keys[i] = field;
@@ -126,16 +127,16 @@ void dm_value_table_set(dm_state *dm, dm_value t, dm_value field, dm_value v) {
 }
 
 dm_value dm_value_table_get(dm_state *dm, dm_value t, dm_value field) {
-	if (t.type != DM_TYPE_TABLE) {
+	if (dm_value_type(t) != DM_TYPE_TABLE) {
 		// error
 		return dm_value_nil();
 	}
 
-	dm_table *table = t.table_val;
+	dm_table *table = dm_value_as_table(t);
 	dm_value *keys = (dm_value*) table->keys;
 	dm_value *values = (dm_value*) table->values;
 	for (int i = 0; i < table->size; i++) {
-		if (keys[i].int_val == TABLE_INVALID_CODE || values[i].int_val == TABLE_INVALID_CODE) {
+		if (table_is_invalid_entry(keys[i]) || table_is_invalid_entry(values[i])) {
 			continue;
 		}
 		if (dm_value_equals(dm, keys[i], field)) {
@@ -148,7 +149,7 @@ dm_value dm_value_table_get(dm_state *dm, dm_value t, dm_value field) {
 
 static bool dm_table_equals(dm_state *dm, dm_value self, dm_value other) {
 	(void) dm;
-	return self.table_val == other.table_val ? true : false;
+	return dm_value_as_table(self) == dm_value_as_table(other) ? true : false;
 }
 
 static bool dm_table_fieldset(dm_state *dm, dm_value self, const char *field, dm_value v) {
@@ -2,40 +2,53 @@
 #include <dm_state.h>
 
 dm_value dm_value_nil(void) {
-	return (dm_value){DM_TYPE_NIL, {0}};
+	return dm_value_make(DM_TYPE_NIL, 0);
 }
 
 dm_value dm_value_bool(dm_bool bool_val) {
+#ifdef DM_NAN_BOXING
+	return dm_value_make(DM_TYPE_BOOL, bool_val);
+#else
 	return (dm_value){DM_TYPE_BOOL, {.bool_val = bool_val}};
+#endif
 }
 
 dm_value dm_value_int(dm_int int_val) {
-	return (dm_value){DM_TYPE_INT, {.int_val = int_val}};
+	return dm_value_make(DM_TYPE_INT, int_val);
 }
 
 dm_value dm_value_float(dm_float float_val) {
+#ifdef DM_NAN_BOXING
+	union { dm_float f; uint64_t bits; } u = {float_val};
+	// any NaN would be read as a boxed value
+	if (float_val != float_val) {
+		u.bits = DM_NANBOX_QNAN;
+	}
+	return (dm_value){u.bits};
+#else
 	return (dm_value){DM_TYPE_FLOAT, {.float_val = float_val}};
+#endif
 }
 
 bool dm_value_equals(dm_state *dm, dm_value v1, dm_value v2) {
-	dm_module *m = dm_state_get_module(dm, v1.type);
+	dm_module *m = dm_state_get_module(dm, dm_value_type(v1));
 	return m->equals(dm, v1, v2);
 }
 
 void dm_value_inspect(dm_state *dm, dm_value v) {
-	dm_module *m = dm_state_get_module(dm, v.type);
+	dm_module *m = dm_state_get_module(dm, dm_value_type(v));
 	return m->inspect(dm, v);
 }
 
 bool dm_value_is_gc_obj(dm_value v) {
-	return v.type == DM_TYPE_STRING
-		|| v.type == DM_TYPE_ARRAY
-		|| v.type == DM_TYPE_TABLE
-		|| v.type == DM_TYPE_FUNCTION;
+	return dm_value_type(v) == DM_TYPE_STRING
+		|| dm_value_type(v) == DM_TYPE_ARRAY
+		|| dm_value_type(v) == DM_TYPE_TABLE
+		|| dm_value_type(v) == DM_TYPE_FUNCTION;
 }
 
 const char *dm_value_type_str(dm_state *dm, dm_value v) {
-	dm_module *m = dm_state_get_module(dm, v.type);
+	dm_module *m = dm_state_get_module(dm, dm_value_type(v));
 	return m->typename;
 }
 
@@ -27,6 +27,57 @@ typedef struct dm_array dm_array;
 typedef struct dm_table dm_table;
 typedef struct dm_function dm_function;
 
+#ifdef DM_NAN_BOXING
+
+// NaN-boxing: a value is the bits of a double. All other types are stored as
+// NaNs with the sign bit and the two high mantissa bits set, the type in bits
+// 47-49 and a 47 bit payload. Float NaNs are all stored as the positive quiet
+// NaN, so they never look like a boxed value. Ints are limited to
+// DM_INT_MIN..DM_INT_MAX and wrap around outside, the compiler refuses int
+// constants outside. Pointers must fit into 47 bits (user space on x86-64
+// and aarch64).
+typedef struct {
+	uint64_t bits;
+} dm_value;
+
+#define DM_NANBOX_MASK    UINT64_C(0xfffc000000000000)
+#define DM_NANBOX_PAYLOAD UINT64_C(0x00007fffffffffff)
+#define DM_NANBOX_QNAN    UINT64_C(0x7ff8000000000000)
+#define DM_INT_MIN        (-(INT64_C(1) << 46))
+#define DM_INT_MAX        ((INT64_C(1) << 46) - 1)
+
+static inline dm_type dm_value_type(dm_value v) {
+	if ((v.bits & DM_NANBOX_MASK) != DM_NANBOX_MASK) {
+		return DM_TYPE_FLOAT;
+	}
+	return (dm_type) ((v.bits >> 47) & 0x7);
+}
+
+static inline dm_value dm_value_make(dm_type type, uint64_t payload) {
+	return (dm_value){DM_NANBOX_MASK | (uint64_t) type << 47 | (payload & DM_NANBOX_PAYLOAD)};
+}
+
+static inline dm_int dm_value_as_int(dm_value v) {
+	// sign extend the 47 bit payload
+	return (dm_int) (v.bits << 17) >> 17;
+}
+
+static inline dm_float dm_value_as_float(dm_value v) {
+	union { uint64_t bits; dm_float f; } u = {v.bits};
+	return u.f;
+}
+
+#define dm_value_payload(v)          ((v).bits & DM_NANBOX_PAYLOAD)
+#define dm_value_as_bool(v)          ((dm_bool) dm_value_payload(v))
+#define dm_value_as_string(v)        ((dm_string*) (uintptr_t) dm_value_payload(v))
+#define dm_value_as_array(v)         ((dm_array*) (uintptr_t) dm_value_payload(v))
+#define dm_value_as_table(v)         ((dm_table*) (uintptr_t) dm_value_payload(v))
+#define dm_value_as_function(v)      ((dm_function*) (uintptr_t) dm_value_payload(v))
+#define dm_value_as_gc_obj(v)        ((dm_gc_obj*) (uintptr_t) dm_value_payload(v))
+#define dm_value_object(type, ptr)   dm_value_make((type), (uintptr_t) (ptr))
+
+#else
+
 typedef struct {
 	dm_type type;
 	union {
@@ -41,6 +92,24 @@ typedef struct {
 	};
 } dm_value;
 
+#define DM_INT_MIN                   INT64_MIN
+#define DM_INT_MAX                   INT64_MAX
+
+#define dm_value_type(v)             ((v).type)
+#define dm_value_make(type, payload) ((dm_value){(type), {.int_val = (payload)}})
+#define dm_value_payload(v)          ((v).int_val)
+#define dm_value_as_bool(v)          ((v).bool_val)
+#define dm_value_as_int(v)           ((v).int_val)
+#define dm_value_as_float(v)         ((v).float_val)
+#define dm_value_as_string(v)        ((v).str_val)
+#define dm_value_as_array(v)         ((v).arr_val)
+#define dm_value_as_table(v)         ((v).table_val)
+#define dm_value_as_function(v)      ((v).func_val)
+#define dm_value_as_gc_obj(v)        ((v).gc_obj)
+#define dm_value_object(type, ptr)   ((dm_value){(type), {.gc_obj = (dm_gc_obj*) (ptr)}})
+
+#endif
+
 typedef struct {
 	// required
 	const char *typename;
@@ -1,23 +1,55 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
+#include <assert.h>
 
 #include <dm_vm.h>
 #include <dm_compiler.h>
 #include <dm_chunk.h>
+#include <dm_regcode.h>
+#include <dm_ops.h>
+#include <dm_jit.h>
+#include <dm_aot.h>
 #include <dm.h>
 
+// open holds the upvalues that still point into data
 typedef struct {
 	int size;
 	int capacity;
 	dm_value *data;
+	dm_upval *open;
 } dm_stack;
 
+// One activation of a function. Arguments come first in the slot window at
+// base, followed by the remaining variables of the chunk, so every call has
+// its own set of variables and recursion works. On return the result is
+// stored at ret and the stack is cut off after it.
+typedef struct {
+	dm_value func;
+	dm_chunk *chunk;
+	dm_upval **upvals;
+	int ip;
+	int base;
+	int ret;
+} dm_frame;
+
+// Calls and returns only push and pop frames here, exec_func is never entered
+// recursively for a diamond function call.
+typedef struct {
+	int size;
+	int capacity;
+	dm_frame *data;
+} dm_frames;
+
+#define DM_FRAMES_MAX (1 << 20)
+
 static void stack_init(dm_stack *stack) {
 	stack->size = 0;
 	stack->capacity = 64;
 	stack->data = malloc(sizeof(dm_value) * stack->capacity);
+	stack->open = NULL;
 }
 
 static void stack_free(dm_stack *stack) {
@@ -27,55 +59,207 @@ static void stack_free(dm_stack *stack) {
 	stack->data = NULL;
 }
 
-static void stack_push(dm_stack *stack, dm_value val) {
-	if (stack->size >= stack->capacity) {
-		stack->capacity *= 2;
-		stack->data = realloc(stack->data, stack->capacity * sizeof(dm_value));
+// the open upvalues have to follow the slots when the stack moves, kept out of
+// line because stack_push is inlined into every handler
+__attribute__((noinline, cold)) static void stack_realloc(dm_stack *stack) {
+	stack->data = realloc(stack->data, stack->capacity * sizeof(dm_value));
+	for (dm_upval *u = stack->open; u != NULL; u = u->next) {
+		u->v = &stack->data[u->slot];
 	}
-	stack->data[stack->size++] = val;
 }
 
-static dm_value stack_pop(dm_stack *stack) {
-	if (stack->size == 0) {
-		//dm_runtime_error(dm, "can't pop from empty stack");
-		return dm_value_nil();
+// Makes room for size values. Every frame reserves the variables and the
+// maxstack of its chunk when it is pushed, so the handlers push and pop
+// without checks.
+static void stack_reserve(dm_stack *stack, int size) {
+	if (size > stack->capacity) {
+		while (size > stack->capacity) {
+			stack->capacity *= 2;
+		}
+		stack_realloc(stack);
 	}
+}
 
-	stack->size--;
-	return stack->data[stack->size];
+static inline void stack_push(dm_stack *stack, dm_value val) {
+	stack->data[stack->size++] = val;
 }
 
-static dm_value stack_peek(dm_stack *stack) {
-	if (stack->size == 0) {
-		//dm_runtime_error(dm, "can't peek empty stack");
-		return dm_value_nil();
-	}
+// The register vm uses the stack as register file, every frame gets the
+// registers of its chunk on top of the registers of the caller.
+static void stack_resize(dm_stack *stack, int size) {
+	stack_reserve(stack, size);
+	stack->size = size;
+}
+
+static inline dm_value stack_pop(dm_stack *stack) {
+	return stack->data[--stack->size];
+}
 
+static inline dm_value stack_peek(dm_stack *stack) {
 	return stack->data[stack->size - 1];
 }
 
-static dm_value stack_peekn(dm_stack *stack, int n) {
-	if (stack->size <= n) {
-		//dm_runtime_error(dm, "can't peek %d items in stack of size %d", n, stack->size);
-		return dm_value_nil();
+static inline dm_value stack_peekn(dm_stack *stack, int n) {
+	return stack->data[stack->size - 1 - n];
+}
+
+static void frames_init(dm_frames *frames) {
+	frames->size = 0;
+	frames->capacity = 16;
+	frames->data = malloc(sizeof(dm_frame) * frames->capacity);
+}
+
+static void frames_free(dm_frames *frames) {
+	free(frames->data);
+	frames->size = 0;
+	frames->capacity = 0;
+	frames->data = NULL;
+}
+
+static dm_frame *frames_push(dm_state *dm, dm_frames *frames, dm_value func, int base, int ret) {
+	if (frames->size >= frames->capacity) {
+		if (frames->capacity >= DM_FRAMES_MAX) {
+			dm_runtime_error(dm, "stack overflow, more than %d nested calls", DM_FRAMES_MAX);
+		}
+		frames->capacity *= 2;
+		frames->data = realloc(frames->data, frames->capacity * sizeof(dm_frame));
 	}
+	dm_frame *frame = &frames->data[frames->size++];
+	dm_function *f = dm_value_as_function(func);
+	*frame = (dm_frame){func, f->chunk, f->upvals, 0, base, ret};
+	return frame;
+}
 
-	return stack->data[stack->size - 1 - n];
+// With gcc/clang every handler jumps directly to the handler of the next opcode
+// through a table of label addresses (labels as values), so each handler gets its
+// own indirect branch. The Makefile builds the portable switch loop unless it is
+// given DISPATCH=threaded.
+#if defined(__GNUC__) && !defined(DM_SWITCH_DISPATCH)
+#define DM_THREADED_DISPATCH
+#endif
+
+// Build with STATS=1 to count the executed instructions of both vms and the
+// pairs of consecutive opcodes, see dm_vm_print_opcode_pairs.
+#ifdef DM_VM_STATS
+static unsigned long long instructions_executed;
+static unsigned long long pairs_executed[256][256];
+static int last_opcode;
+
+static inline int count_instr(int op) {
+	instructions_executed++;
+	pairs_executed[last_opcode][op]++;
+	last_opcode = op;
+	return op;
 }
 
-static uint8_t read8(dm_chunk *chunk) {
-	return chunk->code[chunk->ip++];
+#define vm_counted(fetch) count_instr(fetch)
+#else
+#define vm_counted(fetch) (fetch)
+#endif
+
+// vm_fetch() reads the next opcode, it is defined by each interpreter loop
+#ifdef DM_THREADED_DISPATCH
+#define vm_dispatch() goto *dispatch_table[vm_counted(vm_fetch())];
+#define vm_case(op)   op_##op
+#define vm_next()     goto *dispatch_table[vm_counted(vm_fetch())]
+#else
+#define vm_dispatch() switch (vm_counted(vm_fetch()))
+#define vm_case(op)   case op: op_##op
+#define vm_next()     break
+// the labels are there for the superinstructions, most are never used
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-label"
+#endif
+#endif
+
+// Quickening: a generic opcode that saw int or float operands rewrites itself
+// into the specialized opcode, which only checks its guard. If the guard fails
+// the generic opcode is written back and executed instead.
+// The second half of a superinstruction runs the generic handler without
+// quickening, in is not the instruction at ip - 1 there.
+#define vm_quicken(op) do {                                                    \
+	if (frame->chunk->code[frame->ip - 1] == in) {                             \
+		frame->chunk->code[frame->ip - 1] = dm_instr_make(op, dm_instr_a(in), dm_instr_b(in)); \
+	}                                                                          \
+} while (0)
+#define vm_deopt(op)   { frame->chunk->code[--frame->ip] = dm_instr_make(op, dm_instr_a(in), dm_instr_b(in)); vm_next(); }
+
+#define vm_arith(name, op) {                                                   \
+	dm_value val2 = stack_pop(stack);                                          \
+	dm_value val1 = stack_pop(stack);                                          \
+	if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT) {                \
+		stack_push(stack, dm_value_int(dm_value_as_int(val1) op dm_value_as_int(val2)));         \
+		vm_quicken(DM_OP_##name##_INT);                                        \
+	} else if (dm_op_is_number(val1) && dm_op_is_number(val2)) {               \
+		stack_push(stack, dm_value_float(dm_op_as_float(val1) op dm_op_as_float(val2))); \
+		vm_quicken(DM_OP_##name##_FLOAT);                                      \
+	} else {                                                                   \
+		stack_push(stack, dm_op_arith(dm, DM_OP_##name, val1, val2));          \
+	}                                                                          \
 }
 
-static uint16_t read16(dm_chunk *chunk) {
-	uint16_t s = chunk->code[chunk->ip++];
-	s <<= 8;
-	s |= chunk->code[chunk->ip++];
-	return s;
+#define vm_arith_int(name, op) {                                               \
+	dm_value val2 = stack_peek(stack);                                         \
+	dm_value val1 = stack_peekn(stack, 1);                                     \
+	if (dm_value_type(val1) != DM_TYPE_INT || dm_value_type(val2) != DM_TYPE_INT) {                \
+		vm_deopt(DM_OP_##name);                                                \
+	}                                                                          \
+	stack->size -= 2;                                                          \
+	stack_push(stack, dm_value_int(dm_value_as_int(val1) op dm_value_as_int(val2)));             \
 }
 
-static bool is_falsey(dm_value val) {
-	return val.type == DM_TYPE_NIL || (val.type == DM_TYPE_BOOL && val.bool_val == false);
+#define vm_arith_float(name, op) {                                             \
+	dm_value val2 = stack_peek(stack);                                         \
+	dm_value val1 = stack_peekn(stack, 1);                                     \
+	if (!dm_op_is_float_pair(val1, val2)) {                                    \
+		vm_deopt(DM_OP_##name);                                                \
+	}                                                                          \
+	stack->size -= 2;                                                          \
+	stack_push(stack, dm_value_float(dm_op_as_float(val1) op dm_op_as_float(val2))); \
+}
+
+#define vm_compare(name, op) {                                                 \
+	dm_value val2 = stack_pop(stack);                                          \
+	dm_value val1 = stack_pop(stack);                                          \
+	int cmp;                                                                   \
+	if (dm_op_is_number(val1) && dm_op_is_number(val2)) {                      \
+		cmp = dm_op_compare_numbers(val1, val2);                               \
+		if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT) {            \
+			vm_quicken(DM_OP_##name##_INT);                                    \
+		} else {                                                               \
+			vm_quicken(DM_OP_##name##_FLOAT);                                  \
+		}                                                                      \
+	} else {                                                                   \
+		cmp = dm_op_compare(dm, val1, val2);                                   \
+	}                                                                          \
+	stack_push(stack, dm_value_bool(cmp op 0));                                \
+}
+
+#define vm_compare_int(name, op) {                                             \
+	dm_value val2 = stack_peek(stack);                                         \
+	dm_value val1 = stack_peekn(stack, 1);                                     \
+	if (dm_value_type(val1) != DM_TYPE_INT || dm_value_type(val2) != DM_TYPE_INT) {                \
+		vm_deopt(DM_OP_##name);                                                \
+	}                                                                          \
+	stack->size -= 2;                                                          \
+	stack_push(stack, dm_value_bool(dm_value_as_int(val1) op dm_value_as_int(val2)));            \
+}
+
+#define vm_compare_float(name, op) {                                           \
+	dm_value val2 = stack_peek(stack);                                         \
+	dm_value val1 = stack_peekn(stack, 1);                                     \
+	if (!dm_op_is_float_pair(val1, val2)) {                                    \
+		vm_deopt(DM_OP_##name);                                                \
+	}                                                                          \
+	stack->size -= 2;                                                          \
+	stack_push(stack, dm_value_bool(dm_op_compare_numbers(val1, val2) op 0));  \
+}
+
+// The optimizer proved the operand types, see dm_optimize.c.
+#define vm_arith_unchecked(type, expr) {                                      \
+	dm_value val2 = stack_pop(stack);                                          \
+	dm_value val1 = stack_pop(stack);                                          \
+	stack_push(stack, dm_value_##type(expr));                                  \
 }
 
 dm_exception void dm_runtime_error(dm_state *dm, const char *message, ...) {
@@ -109,12 +293,119 @@ dm_exception void dm_runtime_type_mismatch2(dm_state *dm, dm_type expected1, dm_
 	dm_runtime_error(dm, "Expected value of type <%s> or <%s>, got <%s>", ty_exp1, ty_exp2, ty_got);
 }
 
-static dm_value print_backtrace(dm_state *dm, dm_value f) {
-	dm_chunk *chunk = f.func_val->chunk;
+#define DM_BACKTRACE_MAX 32
+
+// Code the optimizer inlined shows up as a frame of the inlined function.
+static void print_frame(dm_state *dm, dm_frame *frame, bool regs) {
+	int addr = regs ? dm_regcode_addr_at(frame->chunk, frame->ip - 1) : frame->ip - 1;
+	dm_inline_site *site = dm_chunk_inline_site_at(frame->chunk, addr);
+	if (site != NULL) {
+		printf("    in ");
+		dm_value_inspect(dm, site->func);
+		printf("(%d)\n", site->line);
+		if (site->tail) {
+			return;
+		}
+	}
 	printf("    in ");
-	dm_value_inspect(dm, f);
-	printf("(%d)\n", dm_chunk_current_line(chunk));
-	return dm_value_nil();
+	dm_value_inspect(dm, frame->func);
+	printf("(%d)\n", dm_chunk_line_at(frame->chunk, addr));
+}
+
+// Prints the frames that were active when the error was raised, innermost
+// first. Deep recursion is cut short, the outermost frame is always shown.
+static void print_backtrace(dm_state *dm, dm_frames *frames, bool regs) {
+	int shown = frames->size < DM_BACKTRACE_MAX ? frames->size : DM_BACKTRACE_MAX - 1;
+	for (int i = frames->size - 1; i >= frames->size - shown; i--) {
+		print_frame(dm, &frames->data[i], regs);
+	}
+	if (shown < frames->size) {
+		printf("    ... %d more\n", frames->size - shown - 1);
+		print_frame(dm, &frames->data[0], regs);
+	}
+}
+
+static dm_value *frame_slot(dm_stack *stack, dm_frame *frame, int index) {
+	return &stack->data[frame->base + index];
+}
+
+// Upvalues share the open upvalue of a slot, so all closures of a frame see
+// the same variable.
+static dm_upval *capture_upval(dm_state *dm, dm_stack *stack, int slot) {
+	dm_upval **link = &stack->open;
+	while (*link != NULL && (*link)->slot > slot) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL && (*link)->slot == slot) {
+		return *link;
+	}
+
+	dm_upval *upval = dm_upval_new(dm, &stack->data[slot], slot);
+	upval->next = *link;
+	*link = upval;
+	return upval;
+}
+
+// the slots from base on go away, their upvalues keep the last values
+static void close_upvals(dm_stack *stack, int base) {
+	while (stack->open != NULL && stack->open->slot >= base) {
+		dm_upval *upval = stack->open;
+		upval->closed = *upval->v;
+		upval->v = &upval->closed;
+		stack->open = upval->next;
+	}
+}
+
+// Variables of the top level chunk are captured into the cells of the chunk,
+// the next run of the chunk (repl) opens them again on its own stack.
+static dm_value make_closure(dm_state *dm, dm_stack *stack, dm_frames *frames, dm_frame *frame, dm_value proto) {
+	dm_function *p = dm_value_as_function(proto);
+	dm_chunk *chunk = p->chunk;
+	dm_value closure = dm_value_closure(dm, p, chunk->upvalsize);
+	dm_upval **upvals = dm_value_as_function(closure)->upvals;
+	for (int i = 0; i < chunk->upvalsize; i++) {
+		dm_upvaldesc desc = chunk->upvals[i];
+		if (!desc.local) {
+			upvals[i] = frame->upvals[desc.index];
+			continue;
+		}
+		upvals[i] = capture_upval(dm, stack, frame->base + desc.index);
+		if (frame == frames->data) {
+			frame->chunk->vars[desc.index].cell = upvals[i];
+		}
+	}
+	return closure;
+}
+
+static void reopen_cells(dm_stack *stack, dm_chunk *chunk) {
+	for (int i = 0; i < chunk->varsize; i++) {
+		dm_upval *cell = chunk->vars[i].cell;
+		if (cell != NULL) {
+			cell->v = &stack->data[i];
+			cell->slot = i;
+			cell->next = stack->open;
+			stack->open = cell;
+		}
+	}
+}
+
+static void check_call(dm_state *dm, dm_value func, int arguments) {
+	if (dm_value_type(func) != DM_TYPE_FUNCTION) {
+		dm_runtime_error(dm, "Can't call <%s>", dm_value_type_str(dm, func));
+	}
+
+	if (arguments != dm_value_as_function(func)->nargs) {
+		int nargs = dm_value_as_function(func)->nargs;
+		dm_runtime_error(dm, "expected %d args, but %d args given", nargs, arguments);
+	}
+}
+
+static void push_locals(dm_stack *stack, dm_frame *frame) {
+	int nlocals = frame->chunk->varsize - dm_value_as_function(frame->func)->nargs;
+	stack_reserve(stack, frame->base + frame->chunk->varsize + frame->chunk->maxstack);
+	while (nlocals-- > 0) {
+		stack_push(stack, dm_value_nil());
+	}
 }
 
 static dm_value do_import(dm_state *dm, dm_value module) {
@@ -125,482 +416,1187 @@ static dm_value do_import(dm_state *dm, dm_value module) {
 	}
 
 	char *file;
-	asprintf(&file, "%s/%s.dm", cwd, dm_string_c_str(module.str_val));
+	asprintf(&file, "%s/%s.dm", cwd, dm_string_c_str(dm_value_as_string(module)));
 	char *prog = dm_read_file(file);
 
 	free(file);
 	free(cwd);
 	dm_value ret;
 	if (dm_vm_exec(dm, prog, &ret, false) != 0) {
-		return dm_value_nil();
+		dm_runtime_error(dm, "failed to import '%s'", dm_string_c_str(dm_value_as_string(module)));
 	}
 
 	return ret;
 }
 
-static dm_value do_opassign(dm_state *dm, dm_opassign op, dm_value old, dm_value v) {
-	dm_module *m = dm_state_get_module(dm, old.type);
-	switch (op) {
-		case DM_OPASSIGN_PLUS:  return m->add(dm, old, v);
-		case DM_OPASSIGN_MINUS: return m->sub(dm, old, v);
-		case DM_OPASSIGN_MUL:   return m->mul(dm, old, v);
-		case DM_OPASSIGN_DIV:   return m->div(dm, old, v);
-		case DM_OPASSIGN_MOD:   return m->mod(dm, old, v);
+static inline dm_value for_limit(dm_forloop *loop, dm_value *vars) {
+	return loop->limit_is_var ? vars[loop->limit] : dm_value_int(loop->limit);
+}
+
+// Steps the loop variable of vars and returns whether the loop goes on. Ints
+// are handled inline, everything else like 'i = i + s' and the condition.
+static inline bool for_loop(dm_state *dm, dm_forloop *loop, dm_value *vars) {
+	dm_value *i = &vars[loop->var];
+	dm_value limit = for_limit(loop, vars);
+	if (dm_value_type(*i) == DM_TYPE_INT && dm_value_type(limit) == DM_TYPE_INT) {
+		dm_int v = dm_value_as_int(*i) + loop->step;
+		*i = dm_value_int(v);
+		switch (loop->compare) {
+			case DM_OP_LESS:      return v < dm_value_as_int(limit);
+			case DM_OP_LESSEQUAL: return v <= dm_value_as_int(limit);
+			case DM_OP_GREATER:   return v > dm_value_as_int(limit);
+			default:              return v >= dm_value_as_int(limit);
+		}
 	}
 
-	dm_runtime_error(dm, "Can't execute op-assign %d", op);
+	return dm_op_for_step(dm, loop->compare, loop->step, i, limit);
+}
+
+// the whole instruction is read at once, the handlers decode the operands from in
+#ifdef DM_VM_CHECK
+// the stack of a frame stays between its variables and the maxstack the
+// compiler computed for the chunk
+static void check_depth(dm_stack *stack, dm_frame *frame) {
+	int depth = stack->size - frame->base - frame->chunk->varsize;
+	assert(depth >= 0 && depth <= frame->chunk->maxstack);
+	assert(stack->size <= stack->capacity);
 }
+#define vm_fetch() (check_depth(stack, frame), dm_instr_op(in = frame->chunk->code[frame->ip++]))
+#else
+#define vm_fetch() dm_instr_op(in = frame->chunk->code[frame->ip++])
+#endif
 
-static dm_value exec_func(dm_state *dm, dm_value f, dm_stack *stack) {
-	dm_chunk *chunk = (dm_chunk*) f.func_val->chunk;
-	chunk->ip = 0;
+// The opcodes that start a superinstruction, the handler of the pair runs the
+// first half with these and goes on in the handler of the second half.
+#define vm_do_POP(in)               stack_pop(stack)
+#define vm_do_VARSET(in)            (*frame_slot(stack, frame, dm_instr_b(in)) = stack_peek(stack))
+#define vm_do_VARGET(in)            stack_push(stack, *frame_slot(stack, frame, dm_instr_b(in)))
+#define vm_do_CONSTANT(in)          stack_push(stack, frame->chunk->consts[dm_instr_b(in)])
+#define vm_do_CONSTANT_SMALLINT(in) stack_push(stack, dm_value_int(dm_instr_b(in)))
 
-	dm_value self = dm_value_nil();
-	if (f.func_val->takes_self && f.func_val->nargs > 0) {
-		self = dm_chunk_get_var(chunk, 0);
-	}
+// With --jit the code of a hot chunk takes over where a frame is entered or
+// loops back and gives the frame back in front of the next instruction the vm
+// has to run itself, see dm_jit.h. Code compiled ahead of time does the same
+// from the first time on, see dm_aot.h.
+#define vm_jit() do {                                                          \
+	if ((aot && frame->chunk->aot != NULL) || (jit && dm_jit_hot(dm, frame->chunk))) { \
+		dm_jit_frame f = {dm, frame->func, frame_slot(stack, frame, 0),        \
+			&stack->data[stack->size], frame->upvals, frame->ip, &frame->ip};  \
+		if (frame->chunk->aot != NULL) {                                       \
+			frame->chunk->aot(&f);                                             \
+		} else {                                                               \
+			dm_jit_run(frame->chunk, &f);                                      \
+		}                                                                      \
+		stack->size = f.top - stack->data;                                     \
+		frame->ip = f.ip;                                                      \
+	}                                                                          \
+} while (0)
 
-	if (setjmp(*dm_state_get_jmpbuf(dm)) != 0) {
-		return dm_value_nil();
+// With --trace a loop that jumped back often enough runs its trace from there,
+// see dm_jit.h. Out of line, the loop handlers stay small without it.
+static void enter_trace(dm_state *dm, dm_stack *stack, dm_frame *frame) {
+	dm_jit_frame f = {dm, frame->func, frame_slot(stack, frame, 0),
+		&stack->data[stack->size], frame->upvals, frame->ip, &frame->ip};
+	dm_trace_enter(frame->chunk, &f);
+	stack->size = f.top - stack->data;
+	frame->ip = f.ip;
+}
+
+#define vm_trace() do {                                                        \
+	if (trace && dm_trace_live(frame->chunk, frame->ip)) {                     \
+		enter_trace(dm, stack, frame);                                         \
+	}                                                                          \
+} while (0)
+
+// Runs the topmost frame until it returns, including all the calls it makes.
+static dm_value exec_func(dm_state *dm, dm_stack *stack, dm_frames *frames) {
+	int entry = frames->size - 1;
+	dm_frame *frame = &frames->data[entry];
+	dm_instr in;
+	bool jit = dm_jit_enabled(dm);
+	bool trace = dm_trace_enabled(dm);
+	bool aot = dm_aot_enabled(dm);
+
+#ifdef DM_THREADED_DISPATCH
+	static void *dispatch_table[] = {
+		[DM_OP_IMPORT]                = &&op_DM_OP_IMPORT,
+		[DM_OP_VARSET]                = &&op_DM_OP_VARSET,
+		[DM_OP_VARGETOPSET]           = &&op_DM_OP_VARGETOPSET,
+		[DM_OP_VARSET_UP]             = &&op_DM_OP_VARSET_UP,
+		[DM_OP_VARGETOPSET_UP]        = &&op_DM_OP_VARGETOPSET_UP,
+		[DM_OP_VARGET]                = &&op_DM_OP_VARGET,
+		[DM_OP_VARGET_UP]             = &&op_DM_OP_VARGET_UP,
+		[DM_OP_FIELDSET]              = &&op_DM_OP_FIELDSET,
+		[DM_OP_FIELDGETOPSET]         = &&op_DM_OP_FIELDGETOPSET,
+		[DM_OP_FIELDSET_S]            = &&op_DM_OP_FIELDSET_S,
+		[DM_OP_FIELDGETOPSET_S]       = &&op_DM_OP_FIELDGETOPSET_S,
+		[DM_OP_FIELDGET]              = &&op_DM_OP_FIELDGET,
+		[DM_OP_FIELDGET_S]            = &&op_DM_OP_FIELDGET_S,
+		[DM_OP_FIELDGET_PUSHPARENT]   = &&op_DM_OP_FIELDGET_PUSHPARENT,
+		[DM_OP_FIELDGET_S_PUSHPARENT] = &&op_DM_OP_FIELDGET_S_PUSHPARENT,
+		[DM_OP_CONSTANT]              = &&op_DM_OP_CONSTANT,
+		[DM_OP_CONSTANT_SMALLINT]     = &&op_DM_OP_CONSTANT_SMALLINT,
+		[DM_OP_CLOSURE]               = &&op_DM_OP_CLOSURE,
+		[DM_OP_ARRAYLIT]              = &&op_DM_OP_ARRAYLIT,
+		[DM_OP_TABLELIT]              = &&op_DM_OP_TABLELIT,
+		[DM_OP_TRUE]                  = &&op_DM_OP_TRUE,
+		[DM_OP_FALSE]                 = &&op_DM_OP_FALSE,
+		[DM_OP_NIL]                   = &&op_DM_OP_NIL,
+		[DM_OP_SELF]                  = &&op_DM_OP_SELF,
+		[DM_OP_CALL]                  = &&op_DM_OP_CALL,
+		[DM_OP_CALL_WITHPARENT]       = &&op_DM_OP_CALL_WITHPARENT,
+		[DM_OP_TAILCALL]              = &&op_DM_OP_TAILCALL,
+		[DM_OP_CHECKTYPE]             = &&op_DM_OP_CHECKTYPE,
+		[DM_OP_NEGATE]                = &&op_DM_OP_NEGATE,
+		[DM_OP_NOT]                   = &&op_DM_OP_NOT,
+		[DM_OP_PLUS]                  = &&op_DM_OP_PLUS,
+		[DM_OP_MINUS]                 = &&op_DM_OP_MINUS,
+		[DM_OP_MUL]                   = &&op_DM_OP_MUL,
+		[DM_OP_DIV]                   = &&op_DM_OP_DIV,
+		[DM_OP_MOD]                   = &&op_DM_OP_MOD,
+		[DM_OP_NOTEQUAL]              = &&op_DM_OP_NOTEQUAL,
+		[DM_OP_EQUAL]                 = &&op_DM_OP_EQUAL,
+		[DM_OP_LESS]                  = &&op_DM_OP_LESS,
+		[DM_OP_LESSEQUAL]             = &&op_DM_OP_LESSEQUAL,
+		[DM_OP_GREATER]               = &&op_DM_OP_GREATER,
+		[DM_OP_GREATEREQUAL]          = &&op_DM_OP_GREATEREQUAL,
+		[DM_OP_JUMP_IF_TRUE_OR_POP]   = &&op_DM_OP_JUMP_IF_TRUE_OR_POP,
+		[DM_OP_JUMP_IF_FALSE_OR_POP]  = &&op_DM_OP_JUMP_IF_FALSE_OR_POP,
+		[DM_OP_JUMP_IF_FALSE]         = &&op_DM_OP_JUMP_IF_FALSE,
+		[DM_OP_JUMP]                  = &&op_DM_OP_JUMP,
+		[DM_OP_POP]                   = &&op_DM_OP_POP,
+		[DM_OP_RETURN]                = &&op_DM_OP_RETURN,
+		[DM_OP_FORPREP]               = &&op_DM_OP_FORPREP,
+		[DM_OP_FORLOOP]               = &&op_DM_OP_FORLOOP,
+#define X(name, first, second) [DM_OP_##name] = &&op_DM_OP_##name,
+		DM_SUPERINSTRUCTIONS(X)
+#undef X
+		[DM_OP_PLUS_INT]              = &&op_DM_OP_PLUS_INT,
+		[DM_OP_PLUS_FLOAT]            = &&op_DM_OP_PLUS_FLOAT,
+		[DM_OP_MINUS_INT]             = &&op_DM_OP_MINUS_INT,
+		[DM_OP_MINUS_FLOAT]           = &&op_DM_OP_MINUS_FLOAT,
+		[DM_OP_MUL_INT]               = &&op_DM_OP_MUL_INT,
+		[DM_OP_MUL_FLOAT]             = &&op_DM_OP_MUL_FLOAT,
+		[DM_OP_DIV_INT]               = &&op_DM_OP_DIV_INT,
+		[DM_OP_DIV_FLOAT]             = &&op_DM_OP_DIV_FLOAT,
+		[DM_OP_LESS_INT]              = &&op_DM_OP_LESS_INT,
+		[DM_OP_LESS_FLOAT]            = &&op_DM_OP_LESS_FLOAT,
+		[DM_OP_LESSEQUAL_INT]         = &&op_DM_OP_LESSEQUAL_INT,
+		[DM_OP_LESSEQUAL_FLOAT]       = &&op_DM_OP_LESSEQUAL_FLOAT,
+		[DM_OP_GREATER_INT]           = &&op_DM_OP_GREATER_INT,
+		[DM_OP_GREATER_FLOAT]         = &&op_DM_OP_GREATER_FLOAT,
+		[DM_OP_GREATEREQUAL_INT]      = &&op_DM_OP_GREATEREQUAL_INT,
+		[DM_OP_GREATEREQUAL_FLOAT]    = &&op_DM_OP_GREATEREQUAL_FLOAT,
+		[DM_OP_FIELDGET_ARRAY_INT]    = &&op_DM_OP_FIELDGET_ARRAY_INT,
+		[DM_OP_FIELDSET_ARRAY_INT]    = &&op_DM_OP_FIELDSET_ARRAY_INT,
+		[DM_OP_PLUS_INT_UNCHECKED]            = &&op_DM_OP_PLUS_INT_UNCHECKED,
+		[DM_OP_PLUS_FLOAT_UNCHECKED]          = &&op_DM_OP_PLUS_FLOAT_UNCHECKED,
+		[DM_OP_MINUS_INT_UNCHECKED]           = &&op_DM_OP_MINUS_INT_UNCHECKED,
+		[DM_OP_MINUS_FLOAT_UNCHECKED]         = &&op_DM_OP_MINUS_FLOAT_UNCHECKED,
+		[DM_OP_MUL_INT_UNCHECKED]             = &&op_DM_OP_MUL_INT_UNCHECKED,
+		[DM_OP_MUL_FLOAT_UNCHECKED]           = &&op_DM_OP_MUL_FLOAT_UNCHECKED,
+		[DM_OP_DIV_INT_UNCHECKED]             = &&op_DM_OP_DIV_INT_UNCHECKED,
+		[DM_OP_DIV_FLOAT_UNCHECKED]           = &&op_DM_OP_DIV_FLOAT_UNCHECKED,
+		[DM_OP_LESS_INT_UNCHECKED]            = &&op_DM_OP_LESS_INT_UNCHECKED,
+		[DM_OP_LESS_FLOAT_UNCHECKED]          = &&op_DM_OP_LESS_FLOAT_UNCHECKED,
+		[DM_OP_LESSEQUAL_INT_UNCHECKED]       = &&op_DM_OP_LESSEQUAL_INT_UNCHECKED,
+		[DM_OP_LESSEQUAL_FLOAT_UNCHECKED]     = &&op_DM_OP_LESSEQUAL_FLOAT_UNCHECKED,
+		[DM_OP_GREATER_INT_UNCHECKED]         = &&op_DM_OP_GREATER_INT_UNCHECKED,
+		[DM_OP_GREATER_FLOAT_UNCHECKED]       = &&op_DM_OP_GREATER_FLOAT_UNCHECKED,
+		[DM_OP_GREATEREQUAL_INT_UNCHECKED]    = &&op_DM_OP_GREATEREQUAL_INT_UNCHECKED,
+		[DM_OP_GREATEREQUAL_FLOAT_UNCHECKED]  = &&op_DM_OP_GREATEREQUAL_FLOAT_UNCHECKED,
+		[DM_OP_FIELDGET_ARRAY_INT_UNCHECKED]  = &&op_DM_OP_FIELDGET_ARRAY_INT_UNCHECKED,
+		[DM_OP_FIELDSET_ARRAY_INT_UNCHECKED]  = &&op_DM_OP_FIELDSET_ARRAY_INT_UNCHECKED,
+	};
+#endif
+
+	// code compiled ahead of time runs from the start
+	if (aot) {
+		vm_jit();
 	}
 
 	for (;;) {
-		dm_opcode opcode = (dm_opcode) read8(chunk);
-
-		switch (opcode) {
-			case DM_OP_IMPORT:              {
+		vm_dispatch() {
+			vm_case(DM_OP_IMPORT):          {
 				dm_value module = stack_pop(stack);
-				if (module.type != DM_TYPE_STRING) {
+				if (dm_value_type(module) != DM_TYPE_STRING) {
 					dm_runtime_error(dm, "Expected string for import");
 				}
 
 				dm_value v = do_import(dm, module);
 				stack_push(stack, v);
-				break;
+				vm_jit();
+				vm_next();
 			}
-			case DM_OP_VARSET:              {
-				int index = read16(chunk);
-				dm_value v = stack_peek(stack);
-				dm_chunk_set_var(chunk, index, v);
-				break;
+			vm_case(DM_OP_VARSET):          {
+				vm_do_VARSET(in);
+				vm_next();
 			}
-			case DM_OP_VARGETOPSET:         {
-				int opassign = read8(chunk);
-				int index = read16(chunk);
-				dm_value old = dm_chunk_get_var(chunk, index);
+			vm_case(DM_OP_VARGETOPSET):     {
+				int opassign = dm_instr_a(in);
+				int index = dm_instr_b(in);
+				dm_value old = *frame_slot(stack, frame, index);
 				dm_value v = stack_pop(stack);
-				v = do_opassign(dm, opassign, old, v);
+				v = dm_op_opassign(dm, opassign, old, v);
 				stack_push(stack, v);
-				dm_chunk_set_var(chunk, index, v);
-				break;
-			}
-			case DM_OP_VARSET_UP:           {
-				int ups = read8(chunk);
-				int index = read16(chunk);
-				dm_chunk *upchunk = chunk;
-				for (int i = 0; i < ups; i++) {
-					upchunk = (dm_chunk*) upchunk->parent;
-					if (upchunk == NULL) {
-						dm_runtime_error(dm, "Can't set upvalue from up chunk %d", ups);
-					}
-				}
-				dm_value v = stack_peek(stack);
-				dm_chunk_set_var(upchunk, index, v);
-				break;
-			}
-			case DM_OP_VARGETOPSET_UP:      {
-				int opassign = read8(chunk);
-				int ups = read8(chunk);
-				int index = read16(chunk);
-				dm_chunk *upchunk = chunk;
-				for (int i = 0; i < ups; i++) {
-					upchunk = (dm_chunk*) upchunk->parent;
-					if (upchunk == NULL) {
-						dm_runtime_error(dm, "Can't set upvalue from up chunk %d", ups);
-					}
-				}
-				dm_value old = dm_chunk_get_var(upchunk, index);
+				*frame_slot(stack, frame, index) = v;
+				vm_next();
+			}
+			vm_case(DM_OP_VARSET_UP):       {
+				int index = dm_instr_b(in);
+				*frame->upvals[index]->v = stack_peek(stack);
+				vm_next();
+			}
+			vm_case(DM_OP_VARGETOPSET_UP):  {
+				int opassign = dm_instr_a(in);
+				int index = dm_instr_b(in);
+				dm_value old = *frame->upvals[index]->v;
 				dm_value v = stack_pop(stack);
-				v = do_opassign(dm, opassign, old, v);
+				v = dm_op_opassign(dm, opassign, old, v);
 				stack_push(stack, v);
-				dm_chunk_set_var(upchunk, index, v);
-				break;
+				*frame->upvals[index]->v = v;
+				vm_next();
 			}
-			case DM_OP_VARGET:              {
-				int index = read16(chunk);
-				dm_value v = dm_chunk_get_var(chunk, index);
-				stack_push(stack, v);
-				break;
-			}
-			case DM_OP_VARGET_UP:           {
-				int ups = read8(chunk);
-				int index = read16(chunk);
-				dm_chunk *upchunk = chunk;
-				for (int i = 0; i < ups; i++) {
-					upchunk = (dm_chunk*) upchunk->parent;
-					if (upchunk == NULL) {
-						dm_runtime_error(dm, "Can't get upvalue from up chunk %d", ups);
-					}
-				}
-				dm_value v = dm_chunk_get_var(upchunk, index);
-				stack_push(stack, v);
-				break;
+			vm_case(DM_OP_VARGET):          {
+				vm_do_VARGET(in);
+				vm_next();
 			}
-			case DM_OP_FIELDSET:            {
+			vm_case(DM_OP_VARGET_UP):       {
+				int index = dm_instr_b(in);
+				stack_push(stack, *frame->upvals[index]->v);
+				vm_next();
+			}
+			vm_case(DM_OP_FIELDSET):        {
 				dm_value v = stack_pop(stack);
 				dm_value field = stack_pop(stack);
 				dm_value table = stack_pop(stack);
-				if (table.type == DM_TYPE_ARRAY) {
-					dm_value_array_set(dm, table, field, v);
-				} else if (table.type == DM_TYPE_TABLE) {
-					dm_value_table_set(dm, table, field, v);
-				} else {
-					dm_runtime_type_mismatch2(dm, DM_TYPE_ARRAY, DM_TYPE_TABLE, field);
+				dm_op_fieldset(dm, table, field, v);
+				if (dm_value_type(table) == DM_TYPE_ARRAY && dm_value_type(field) == DM_TYPE_INT) {
+					vm_quicken(DM_OP_FIELDSET_ARRAY_INT);
 				}
 				stack_push(stack, v);
-				break;
+				vm_next();
 			}
-			case DM_OP_FIELDGETOPSET:       {
-				int opassign = read8(chunk);
+			vm_case(DM_OP_FIELDGETOPSET):   {
+				int opassign = dm_instr_a(in);
 				dm_value v = stack_pop(stack);
 				dm_value field = stack_pop(stack);
 				dm_value table = stack_pop(stack);
-				if (table.type == DM_TYPE_ARRAY) {
-					dm_value old = dm_value_array_get(dm, table, field);
-					v = do_opassign(dm, opassign, old, v);
-					dm_value_array_set(dm, table, field, v);
-				} else if (table.type == DM_TYPE_TABLE) {
-					dm_value old = dm_value_table_get(dm, table, field);
-					v = do_opassign(dm, opassign, old, v);
-					dm_value_table_set(dm, table, field, v);
-				} else {
-					dm_runtime_type_mismatch2(dm, DM_TYPE_ARRAY, DM_TYPE_TABLE, field);
-				}
-				stack_push(stack, v);
-				break;
+				stack_push(stack, dm_op_fieldgetopset(dm, opassign, table, field, v));
+				vm_next();
 			}
-			case DM_OP_FIELDSET_S:			{
+			vm_case(DM_OP_FIELDSET_S): {
 				dm_value v = stack_pop(stack);
 				dm_value field = stack_pop(stack);
 				dm_value table = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, table.type);
-				const char *field_s = dm_string_c_str(field.str_val);
-				if (!m->fieldset_s(dm, table, field_s, v)) {
-					const char *ty = dm_value_type_str(dm, table);
-					dm_runtime_error(dm, "Can't set field '%s' of <%s>", field_s, ty);
-				}
+				dm_op_fieldset_s(dm, table, field, v);
 				stack_push(stack, v);
-				break;
+				vm_next();
 			}
-			case DM_OP_FIELDGETOPSET_S:       {
-				int opassign = read8(chunk);
-				dm_value old;
+			vm_case(DM_OP_FIELDGETOPSET_S):   {
+				int opassign = dm_instr_a(in);
 				dm_value v = stack_pop(stack);
 				dm_value field = stack_pop(stack);
 				dm_value table = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, table.type);
-				const char *field_s = dm_string_c_str(field.str_val);
-				if (!m->fieldget_s(dm, table, field_s, &old)) {
-					const char *ty = dm_value_type_str(dm, table);
-					dm_runtime_error(dm, "Can't get field '%s' of <%s>", field_s, ty);
-				}
-				v = do_opassign(dm, opassign, old, v);
-				if (!m->fieldset_s(dm, table, field_s, v)) {
-					const char *ty = dm_value_type_str(dm, table);
-					dm_runtime_error(dm, "Can't set field '%s' of <%s>", field_s, ty);
-				}
-				stack_push(stack, v);
-				break;
+				stack_push(stack, dm_op_fieldgetopset_s(dm, opassign, table, field, v));
+				vm_next();
 			}
-			case DM_OP_FIELDGET:            {
+			vm_case(DM_OP_FIELDGET):        {
 				dm_value field = stack_pop(stack);
 				dm_value table = stack_pop(stack);
-				dm_value v;
-				if (table.type == DM_TYPE_ARRAY) {
-					v = dm_value_array_get(dm, table, field);
-				} else if (table.type == DM_TYPE_TABLE) {
-					v = dm_value_table_get(dm, table, field);
-				} else {
-					const char *msg = "Can't get field of <%s>, expected <array> or <table>";
-					dm_runtime_error(dm, msg, dm_value_type_str(dm, table));
+				stack_push(stack, dm_op_fieldget(dm, table, field));
+				if (dm_value_type(table) == DM_TYPE_ARRAY && dm_value_type(field) == DM_TYPE_INT) {
+					vm_quicken(DM_OP_FIELDGET_ARRAY_INT);
 				}
-				stack_push(stack, v);
-				break;
+				vm_next();
 			}
-			case DM_OP_FIELDGET_S:			{
+			vm_case(DM_OP_FIELDGET_S): {
 				dm_value field = stack_pop(stack);
 				dm_value table = stack_pop(stack);
-				dm_value v;
-				dm_module *m = dm_state_get_module(dm, table.type);
-				const char *field_s = dm_string_c_str(field.str_val);
-				if (!m->fieldget_s(dm, table, field_s, &v)) {
-					const char *ty = dm_value_type_str(dm, table);
-					dm_runtime_error(dm, "Can't get field '%s' of <%s>", field_s, ty);
-				}
-				stack_push(stack, v);
-				break;
+				stack_push(stack, dm_op_fieldget_s(dm, table, field));
+				vm_next();
 			}
-			case DM_OP_FIELDGET_PUSHPARENT: {
+			vm_case(DM_OP_FIELDGET_PUSHPARENT): {
 				dm_value field = stack_pop(stack);
-				dm_value table = stack_peek(stack);
-				dm_value v;
-				if (table.type == DM_TYPE_ARRAY) {
-					v = dm_value_array_get(dm, table, field);
-				} else if (table.type == DM_TYPE_TABLE) {
-					v = dm_value_table_get(dm, table, field);
-				} else {
-					const char *msg = "Can't get field of <%s>, expected <array> or <table>";
-					dm_runtime_error(dm, msg, dm_value_type_str(dm, table));
-				}
-				stack_push(stack, v);
-				break;
+				stack_push(stack, dm_op_fieldget(dm, stack_peek(stack), field));
+				vm_next();
 			}
-			case DM_OP_FIELDGET_S_PUSHPARENT: {
+			vm_case(DM_OP_FIELDGET_S_PUSHPARENT): {
 				dm_value field = stack_pop(stack);
-				dm_value table = stack_peek(stack);
-				dm_value v;
-				dm_module *m = dm_state_get_module(dm, table.type);
-				const char *field_s = dm_string_c_str(field.str_val);
-				if (!m->fieldget_s(dm, table, field_s, &v)) {
-					const char *ty = dm_value_type_str(dm, table);
-					dm_runtime_error(dm, "Can't get field '%s' of <%s>", field_s, ty);
-				}
-				stack_push(stack, v);
-				break;
-			}
-			case DM_OP_CONSTANT:            {
-				uint16_t index = read16(chunk);
-				stack_push(stack, chunk->consts[index]);
-				break;
-			}
-			case DM_OP_CONSTANT_SMALLINT:	{
-				uint16_t val = read16(chunk);
-				stack_push(stack, dm_value_int(val));
-				break;
-			}
-			case DM_OP_ARRAYLIT:            {
-				int elements = read16(chunk);
-				dm_value arr = dm_value_array(dm, elements);
-				while (elements--) {
-					dm_value_array_set(dm, arr, dm_value_int(elements), stack_pop(stack));
-				}
-				stack_push(stack, arr);
-				break;
-			}
-			case DM_OP_TABLELIT:            {
-				int elements = read16(chunk);
-				dm_value tab = dm_value_table(dm, elements);
-				while (elements--) {
-					dm_value value = stack_pop(stack);
-					dm_value key = stack_pop(stack);
-					dm_value_table_set(dm, tab, key, value);
-				}
-				stack_push(stack, tab);
-				break;
-			}
-			case DM_OP_TRUE:                {
+				stack_push(stack, dm_op_fieldget_s(dm, stack_peek(stack), field));
+				vm_next();
+			}
+			vm_case(DM_OP_CONSTANT):        {
+				vm_do_CONSTANT(in);
+				vm_next();
+			}
+			vm_case(DM_OP_CONSTANT_SMALLINT): {
+				vm_do_CONSTANT_SMALLINT(in);
+				vm_next();
+			}
+			vm_case(DM_OP_CLOSURE):         {
+				dm_value proto = frame->chunk->consts[dm_instr_b(in)];
+				stack_push(stack, make_closure(dm, stack, frames, frame, proto));
+				vm_jit();
+				vm_next();
+			}
+			vm_case(DM_OP_ARRAYLIT):        {
+				int elements = dm_instr_b(in);
+				stack->size -= elements;
+				stack_push(stack, dm_op_arraylit(dm, elements, &stack->data[stack->size]));
+				vm_next();
+			}
+			vm_case(DM_OP_TABLELIT):        {
+				int elements = dm_instr_b(in);
+				stack->size -= 2 * elements;
+				stack_push(stack, dm_op_tablelit(dm, elements, &stack->data[stack->size]));
+				vm_next();
+			}
+			vm_case(DM_OP_TRUE):            {
 				stack_push(stack, dm_value_bool(true));
-				break;
+				vm_next();
 			}
-			case DM_OP_FALSE:               {
+			vm_case(DM_OP_FALSE):           {
 				stack_push(stack, dm_value_bool(false));
-				break;
+				vm_next();
 			}
-			case DM_OP_NIL:                 {
+			vm_case(DM_OP_NIL):             {
 				stack_push(stack, dm_value_nil());
-				break;
+				vm_next();
 			}
-			case DM_OP_SELF:                {
-				stack_push(stack, self);
-				break;
+			vm_case(DM_OP_SELF):            {
+				dm_function *f = dm_value_as_function(frame->func);
+				if (f->takes_self && f->nargs > 0) {
+					stack_push(stack, *frame_slot(stack, frame, 0));
+				} else {
+					stack_push(stack, dm_value_nil());
+				}
+				vm_next();
 			}
-			case DM_OP_CALL:                {
-				int arguments = read8(chunk);
+			vm_case(DM_OP_CALL):            {
+				int arguments = dm_instr_a(in);
 				dm_value func = stack_peekn(stack, arguments);
-				if (arguments != func.func_val->nargs) {
-					int nargs = func.func_val->nargs;
-					dm_runtime_error(dm, "expected %d args, but %d args given", nargs, arguments);
-				}
+				check_call(dm, func, arguments);
 
-				while (arguments--) {
-					dm_chunk_set_var(func.func_val->chunk, arguments, stack_pop(stack));
-				}
-				stack_pop(stack);
-
-				dm_value ret = exec_func(dm, func, stack);
-				if (dm_state_has_error(dm)) {
-					return print_backtrace(dm, f);
-				}
-				stack_push(stack, ret);
-				break;
+				int base = stack->size - arguments;
+				frame = frames_push(dm, frames, func, base, base - 1);
+				push_locals(stack, frame);
+				vm_jit();
+				vm_next();
 			}
-			case DM_OP_CALL_WITHPARENT:     {
-				int arguments = read8(chunk);
+			vm_case(DM_OP_CALL_WITHPARENT): {
+				int arguments = dm_instr_a(in);
 				dm_value func = stack_peekn(stack, arguments);
-				int normal_args_start = func.func_val->takes_self ? 1 : 0;
-				arguments += normal_args_start;
-				if (arguments != func.func_val->nargs) {
-					int nargs = func.func_val->nargs;
-					dm_runtime_error(dm, "expected %d args, but %d args given", nargs, arguments);
+				int ret_slot = stack->size - arguments - 2;
+				int base = stack->size - arguments;
+				if (dm_value_type(func) == DM_TYPE_FUNCTION && dm_value_as_function(func)->takes_self) {
+					// the parent takes the place of the function as first argument
+					base--;
+					arguments++;
+					stack->data[base] = stack->data[ret_slot];
 				}
+				check_call(dm, func, arguments);
 
-				while (arguments-- > normal_args_start) {
-					dm_chunk_set_var(func.func_val->chunk, arguments, stack_pop(stack));
-				}
-				stack_pop(stack);
-
-				dm_value parent = stack_pop(stack);
-				if (func.func_val->takes_self) {
-					dm_chunk_set_var(func.func_val->chunk, 0, parent);
-				}
+				frame = frames_push(dm, frames, func, base, ret_slot);
+				push_locals(stack, frame);
+				vm_jit();
+				vm_next();
+			}
+			vm_case(DM_OP_TAILCALL):        {
+				int arguments = dm_instr_a(in);
+				dm_value func = stack_peekn(stack, arguments);
+				check_call(dm, func, arguments);
 
-				dm_value ret = exec_func(dm, func, stack);
-				if (dm_state_has_error(dm)) {
-					return print_backtrace(dm, f);
-				}
-				stack_push(stack, ret);
-				break;
+				// the arguments take the place of the variables, the callee
+				// returns to the caller of this frame
+				close_upvals(stack, frame->base);
+				dm_value *args = &stack->data[stack->size - arguments];
+				memmove(frame_slot(stack, frame, 0), args, arguments * sizeof(dm_value));
+				stack->size = frame->base + arguments;
+				dm_function *f = dm_value_as_function(func);
+				*frame = (dm_frame){func, f->chunk, f->upvals, 0, frame->base, frame->ret};
+				push_locals(stack, frame);
+				vm_jit();
+				vm_next();
 			}
-			case DM_OP_NEGATE:              {
-				dm_value val = stack_pop(stack);
-				if (val.type == DM_TYPE_INT) {
-					stack_push(stack, dm_int_negate(dm, val));
-				} else if (val.type == DM_TYPE_FLOAT) {
-					stack_push(stack, dm_float_negate(dm, val));
-				} else {
-					dm_runtime_error(dm, "Can't negate <%s>", dm_value_type_str(dm, val));
+			vm_case(DM_OP_CHECKTYPE):       {
+				dm_value val = stack_peek(stack);
+				if (dm_value_type(val) != (dm_type) dm_instr_a(in)) {
+					dm_runtime_type_mismatch(dm, dm_instr_a(in), val);
 				}
-				break;
+				vm_next();
 			}
-			case DM_OP_NOT:                 {
-				dm_value val = stack_pop(stack);
-				if (val.type != DM_TYPE_BOOL) {
-					dm_runtime_error(dm, "Can't apply logical not to <%s>", dm_value_type_str(dm, val));
-				}
-				stack_push(stack, dm_value_bool(!val.bool_val));
-				break;
+			vm_case(DM_OP_NEGATE):          {
+				stack_push(stack, dm_op_negate(dm, stack_pop(stack)));
+				vm_next();
 			}
-			case DM_OP_PLUS:                {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, m->add(dm, val1, val2));
-				break;
+			vm_case(DM_OP_NOT):             {
+				stack_push(stack, dm_op_not(dm, stack_pop(stack)));
+				vm_next();
 			}
-			case DM_OP_MINUS:               {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, m->sub(dm, val1, val2));
-				break;
+			vm_case(DM_OP_PLUS):            {
+				vm_arith(PLUS, +);
+				vm_next();
 			}
-			case DM_OP_MUL:                 {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, m->mul(dm, val1, val2));
-				break;
+			vm_case(DM_OP_MINUS):           {
+				vm_arith(MINUS, -);
+				vm_next();
 			}
-			case DM_OP_DIV:                 {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, m->div(dm, val1, val2));
-				break;
+			vm_case(DM_OP_MUL):             {
+				vm_arith(MUL, *);
+				vm_next();
 			}
-			case DM_OP_MOD:                 {
+			vm_case(DM_OP_DIV):             {
 				dm_value val2 = stack_pop(stack);
 				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, m->mod(dm, val1, val2));
-				break;
+				// division by 0 is reported by the module
+				if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT && dm_value_as_int(val2) != 0) {
+					stack_push(stack, dm_value_int(dm_value_as_int(val1) / dm_value_as_int(val2)));
+					vm_quicken(DM_OP_DIV_INT);
+				} else if (dm_op_is_number(val1) && dm_op_is_number(val2) && dm_op_as_float(val2) != 0) {
+					stack_push(stack, dm_value_float(dm_op_as_float(val1) / dm_op_as_float(val2)));
+					vm_quicken(DM_OP_DIV_FLOAT);
+				} else {
+					stack_push(stack, dm_op_arith(dm, DM_OP_DIV, val1, val2));
+				}
+				vm_next();
 			}
-			case DM_OP_NOTEQUAL:            {
+			vm_case(DM_OP_MOD):             {
 				dm_value val2 = stack_pop(stack);
 				dm_value val1 = stack_pop(stack);
-				stack_push(stack, dm_value_bool(!dm_value_equals(dm, val1, val2)));
-				break;
+				if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT && dm_value_as_int(val2) != 0) {
+					stack_push(stack, dm_value_int(dm_value_as_int(val1) % dm_value_as_int(val2)));
+				} else {
+					stack_push(stack, dm_op_arith(dm, DM_OP_MOD, val1, val2));
+				}
+				vm_next();
 			}
-			case DM_OP_EQUAL:               {
+			vm_case(DM_OP_NOTEQUAL):        {
 				dm_value val2 = stack_pop(stack);
 				dm_value val1 = stack_pop(stack);
-				stack_push(stack, dm_value_bool(dm_value_equals(dm, val1, val2)));
-				break;
+				bool eq;
+				if (dm_op_is_number(val1) && dm_op_is_number(val2)) {
+					eq = dm_op_numbers_equal(val1, val2);
+				} else {
+					eq = dm_value_equals(dm, val1, val2);
+				}
+				stack_push(stack, dm_value_bool(!eq));
+				vm_next();
 			}
-			case DM_OP_LESS:                {
+			vm_case(DM_OP_EQUAL):           {
 				dm_value val2 = stack_pop(stack);
 				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, dm_value_bool(m->compare(dm, val1, val2) < 0));
-				break;
+				bool eq;
+				if (dm_op_is_number(val1) && dm_op_is_number(val2)) {
+					eq = dm_op_numbers_equal(val1, val2);
+				} else {
+					eq = dm_value_equals(dm, val1, val2);
+				}
+				stack_push(stack, dm_value_bool(eq));
+				vm_next();
 			}
-			case DM_OP_LESSEQUAL:           {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, dm_value_bool(m->compare(dm, val1, val2) <= 0));
-				break;
+			vm_case(DM_OP_LESS):            {
+				vm_compare(LESS, <);
+				vm_next();
 			}
-			case DM_OP_GREATER:             {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, dm_value_bool(m->compare(dm, val1, val2) > 0));
-				break;
+			vm_case(DM_OP_LESSEQUAL):       {
+				vm_compare(LESSEQUAL, <=);
+				vm_next();
 			}
-			case DM_OP_GREATEREQUAL:        {
-				dm_value val2 = stack_pop(stack);
-				dm_value val1 = stack_pop(stack);
-				dm_module *m = dm_state_get_module(dm, val1.type);
-				stack_push(stack, dm_value_bool(m->compare(dm, val1, val2) >= 0));
-				break;
+			vm_case(DM_OP_GREATER):         {
+				vm_compare(GREATER, >);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATEREQUAL):    {
+				vm_compare(GREATEREQUAL, >=);
+				vm_next();
 			}
-			case DM_OP_JUMP_IF_TRUE_OR_POP: {
+			vm_case(DM_OP_JUMP_IF_TRUE_OR_POP): {
 				dm_value val = stack_peek(stack);
-				uint16_t addr = read16(chunk);
-				if (!is_falsey(val)) {
-					chunk->ip = addr;
+				int addr = dm_instr_b(in);
+				if (!dm_op_falsey(val)) {
+					frame->ip = addr;
 				} else {
 					stack_pop(stack);
 				}
-				break;
+				vm_next();
 			}
-			case DM_OP_JUMP_IF_FALSE_OR_POP:{
+			vm_case(DM_OP_JUMP_IF_FALSE_OR_POP): {
 				dm_value val = stack_peek(stack);
-				uint16_t addr = read16(chunk);
-				if (is_falsey(val)) {
-					chunk->ip = addr;
+				int addr = dm_instr_b(in);
+				if (dm_op_falsey(val)) {
+					frame->ip = addr;
 				} else {
 					stack_pop(stack);
 				}
-				break;
+				vm_next();
 			}
-			case DM_OP_JUMP_IF_FALSE:       {
+			vm_case(DM_OP_JUMP_IF_FALSE):   {
 				dm_value val = stack_pop(stack);
-				uint16_t addr = read16(chunk);
-				if (is_falsey(val)) {
-					chunk->ip = addr;
+				int addr = dm_instr_b(in);
+				if (dm_op_falsey(val)) {
+					frame->ip = addr;
+				}
+				vm_next();
+			}
+			vm_case(DM_OP_JUMP):            {
+				int addr = dm_instr_b(in);
+				bool back = addr < frame->ip;
+				frame->ip = addr;
+				if (back) {
+					vm_trace();
+					vm_jit();
+				}
+				vm_next();
+			}
+			vm_case(DM_OP_POP):             {
+				vm_do_POP(in);
+				vm_next();
+			}
+			vm_case(DM_OP_RETURN):          {
+				dm_value ret = stack_pop(stack);
+				close_upvals(stack, frame->base);
+				if (frames->size - 1 == entry) {
+					frames->size--;
+					return ret;
+				}
+
+				stack->size = frame->ret;
+				stack_push(stack, ret);
+				frames->size--;
+				frame = &frames->data[frames->size - 1];
+				vm_jit();
+				vm_next();
+			}
+			vm_case(DM_OP_FORPREP):         {
+				dm_forloop *loop = &frame->chunk->loops[dm_instr_a(in)];
+				dm_value *vars = frame_slot(stack, frame, 0);
+				if (!dm_op_for_compare(dm, loop->compare, vars[loop->var], for_limit(loop, vars))) {
+					frame->ip = dm_instr_b(in);
+				}
+				vm_next();
+			}
+			vm_case(DM_OP_FORLOOP):         {
+				dm_forloop *loop = &frame->chunk->loops[dm_instr_a(in)];
+				if (for_loop(dm, loop, frame_slot(stack, frame, 0))) {
+					frame->ip = dm_instr_b(in);
+					vm_trace();
+					vm_jit();
+				}
+				vm_next();
+			}
+#define X(name, first, second)                                                 \
+			vm_case(DM_OP_##name): {                                           \
+				vm_do_##first(dm_superinstr_first(DM_OP_##first, DM_OP_##second, in)); \
+				in = dm_superinstr_second(DM_OP_##first, DM_OP_##second, in);  \
+				goto op_DM_OP_##second;                                        \
+			}
+			DM_SUPERINSTRUCTIONS(X)
+#undef X
+#ifndef DM_THREADED_DISPATCH
+			case DM_OP_NUM_OPS:             {
+				// not an opcode, the verifier rejects it
+				vm_next();
+			}
+#endif
+			vm_case(DM_OP_PLUS_INT):        {
+				vm_arith_int(PLUS, +);
+				vm_next();
+			}
+			vm_case(DM_OP_PLUS_FLOAT):      {
+				vm_arith_float(PLUS, +);
+				vm_next();
+			}
+			vm_case(DM_OP_MINUS_INT):       {
+				vm_arith_int(MINUS, -);
+				vm_next();
+			}
+			vm_case(DM_OP_MINUS_FLOAT):     {
+				vm_arith_float(MINUS, -);
+				vm_next();
+			}
+			vm_case(DM_OP_MUL_INT):         {
+				vm_arith_int(MUL, *);
+				vm_next();
+			}
+			vm_case(DM_OP_MUL_FLOAT):       {
+				vm_arith_float(MUL, *);
+				vm_next();
+			}
+			vm_case(DM_OP_DIV_INT):         {
+				dm_value val2 = stack_peek(stack);
+				dm_value val1 = stack_peekn(stack, 1);
+				if (dm_value_type(val1) != DM_TYPE_INT || dm_value_type(val2) != DM_TYPE_INT || dm_value_as_int(val2) == 0) {
+					vm_deopt(DM_OP_DIV);
+				}
+				stack->size -= 2;
+				stack_push(stack, dm_value_int(dm_value_as_int(val1) / dm_value_as_int(val2)));
+				vm_next();
+			}
+			vm_case(DM_OP_DIV_FLOAT):       {
+				dm_value val2 = stack_peek(stack);
+				dm_value val1 = stack_peekn(stack, 1);
+				if (!dm_op_is_float_pair(val1, val2) || dm_op_as_float(val2) == 0) {
+					vm_deopt(DM_OP_DIV);
+				}
+				stack->size -= 2;
+				stack_push(stack, dm_value_float(dm_op_as_float(val1) / dm_op_as_float(val2)));
+				vm_next();
+			}
+			vm_case(DM_OP_LESS_INT):        {
+				vm_compare_int(LESS, <);
+				vm_next();
+			}
+			vm_case(DM_OP_LESS_FLOAT):      {
+				vm_compare_float(LESS, <);
+				vm_next();
+			}
+			vm_case(DM_OP_LESSEQUAL_INT):   {
+				vm_compare_int(LESSEQUAL, <=);
+				vm_next();
+			}
+			vm_case(DM_OP_LESSEQUAL_FLOAT): {
+				vm_compare_float(LESSEQUAL, <=);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATER_INT):     {
+				vm_compare_int(GREATER, >);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATER_FLOAT):   {
+				vm_compare_float(GREATER, >);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATEREQUAL_INT): {
+				vm_compare_int(GREATEREQUAL, >=);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATEREQUAL_FLOAT): {
+				vm_compare_float(GREATEREQUAL, >=);
+				vm_next();
+			}
+			vm_case(DM_OP_FIELDGET_ARRAY_INT): {
+				dm_value field = stack_peek(stack);
+				dm_value table = stack_peekn(stack, 1);
+				if (dm_value_type(table) != DM_TYPE_ARRAY || dm_value_type(field) != DM_TYPE_INT) {
+					vm_deopt(DM_OP_FIELDGET);
+				}
+				stack->size -= 2;
+				stack_push(stack, dm_value_array_get(dm, table, field));
+				vm_next();
+			}
+			vm_case(DM_OP_FIELDSET_ARRAY_INT): {
+				dm_value v = stack_peek(stack);
+				dm_value field = stack_peekn(stack, 1);
+				dm_value table = stack_peekn(stack, 2);
+				if (dm_value_type(table) != DM_TYPE_ARRAY || dm_value_type(field) != DM_TYPE_INT) {
+					vm_deopt(DM_OP_FIELDSET);
+				}
+				stack->size -= 3;
+				dm_value_array_set(dm, table, field, v);
+				stack_push(stack, v);
+				vm_next();
+			}
+			vm_case(DM_OP_PLUS_INT_UNCHECKED): {
+				vm_arith_unchecked(int, dm_value_as_int(val1) + dm_value_as_int(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_PLUS_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(float, dm_op_as_float(val1) + dm_op_as_float(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_MINUS_INT_UNCHECKED): {
+				vm_arith_unchecked(int, dm_value_as_int(val1) - dm_value_as_int(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_MINUS_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(float, dm_op_as_float(val1) - dm_op_as_float(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_MUL_INT_UNCHECKED): {
+				vm_arith_unchecked(int, dm_value_as_int(val1) * dm_value_as_int(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_MUL_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(float, dm_op_as_float(val1) * dm_op_as_float(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_DIV_INT_UNCHECKED): {
+				dm_value val2 = stack_pop(stack);
+				dm_value val1 = stack_pop(stack);
+				// the module reports the division by 0
+				stack_push(stack, dm_value_as_int(val2) != 0 ? dm_value_int(dm_value_as_int(val1) / dm_value_as_int(val2)) : dm_op_arith(dm, DM_OP_DIV, val1, val2));
+				vm_next();
+			}
+			vm_case(DM_OP_DIV_FLOAT_UNCHECKED): {
+				dm_value val2 = stack_pop(stack);
+				dm_value val1 = stack_pop(stack);
+				if (dm_op_as_float(val2) == 0) {
+					stack_push(stack, dm_op_arith(dm, DM_OP_DIV, val1, val2));
+				} else {
+					stack_push(stack, dm_value_float(dm_op_as_float(val1) / dm_op_as_float(val2)));
 				}
-				break;
+				vm_next();
 			}
-			case DM_OP_JUMP:                {
-				uint16_t addr = read16(chunk);
-				chunk->ip = addr;
-				break;
+			vm_case(DM_OP_LESS_INT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_value_as_int(val1) < dm_value_as_int(val2));
+				vm_next();
 			}
-			case DM_OP_POP:                 {
-				stack_pop(stack);
-				break;
+			vm_case(DM_OP_LESS_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_op_compare_numbers(val1, val2) < 0);
+				vm_next();
 			}
-			case DM_OP_RETURN:              {
-				return stack_pop(stack);
-				break;
+			vm_case(DM_OP_LESSEQUAL_INT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_value_as_int(val1) <= dm_value_as_int(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_LESSEQUAL_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_op_compare_numbers(val1, val2) <= 0);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATER_INT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_value_as_int(val1) > dm_value_as_int(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_GREATER_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_op_compare_numbers(val1, val2) > 0);
+				vm_next();
+			}
+			vm_case(DM_OP_GREATEREQUAL_INT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_value_as_int(val1) >= dm_value_as_int(val2));
+				vm_next();
+			}
+			vm_case(DM_OP_GREATEREQUAL_FLOAT_UNCHECKED): {
+				vm_arith_unchecked(bool, dm_op_compare_numbers(val1, val2) >= 0);
+				vm_next();
+			}
+			vm_case(DM_OP_FIELDGET_ARRAY_INT_UNCHECKED): {
+				dm_value field = stack_pop(stack);
+				dm_value table = stack_pop(stack);
+				stack_push(stack, dm_value_array_get(dm, table, field));
+				vm_next();
+			}
+			vm_case(DM_OP_FIELDSET_ARRAY_INT_UNCHECKED): {
+				dm_value v = stack_pop(stack);
+				dm_value field = stack_pop(stack);
+				dm_value table = stack_pop(stack);
+				dm_value_array_set(dm, table, field, v);
+				stack_push(stack, v);
+				vm_next();
 			}
 		}
 	}
 	return dm_value_nil();
 }
 
+#undef vm_fetch
+#define vm_fetch() (in = code[frame->ip++]).op
+
+#define rk(operand) ((operand) & DM_RK_CONST ? consts[(operand) & ~DM_RK_CONST] : regs[operand])
+
+#define vm_load_frame() {                                                      \
+	dm_regcode *rc = frame->chunk->regcode;                                    \
+	code = rc->code;                                                           \
+	consts = rc->consts;                                                       \
+	regs = &stack->data[frame->base];                                          \
+}
+
+#define rvm_arith(name, op) {                                                  \
+	dm_value val1 = rk(in.b);                                                  \
+	dm_value val2 = rk(in.c);                                                  \
+	if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT) {                \
+		regs[in.a] = dm_value_int(dm_value_as_int(val1) op dm_value_as_int(val2));               \
+	} else if (dm_op_is_number(val1) && dm_op_is_number(val2)) {               \
+		regs[in.a] = dm_value_float(dm_op_as_float(val1) op dm_op_as_float(val2)); \
+	} else {                                                                   \
+		regs[in.a] = dm_op_arith(dm, DM_OP_##name, val1, val2);                \
+	}                                                                          \
+}
+
+#define rvm_compare(op) {                                                      \
+	dm_value val1 = rk(in.b);                                                  \
+	dm_value val2 = rk(in.c);                                                  \
+	int cmp;                                                                   \
+	if (dm_op_is_number(val1) && dm_op_is_number(val2)) {                      \
+		cmp = dm_op_compare_numbers(val1, val2);                               \
+	} else {                                                                   \
+		cmp = dm_op_compare(dm, val1, val2);                                   \
+	}                                                                          \
+	regs[in.a] = dm_value_bool(cmp op 0);                                      \
+}
+
+static dm_frame *push_reg_frame(dm_state *dm, dm_stack *stack, dm_frames *frames, dm_value func, int base, int ret) {
+	dm_chunk *chunk = dm_value_as_function(func)->chunk;
+	if (chunk->regcode == NULL) {
+		dm_runtime_error(dm, "Can't run <%s> on the register vm", dm_value_type_str(dm, func));
+	}
+
+	dm_frame *frame = frames_push(dm, frames, func, base, ret);
+	stack_resize(stack, base + chunk->regcode->nregs);
+	for (int i = dm_value_as_function(func)->nargs; i < chunk->varsize; i++) {
+		stack->data[base + i] = dm_value_nil();
+	}
+	return frame;
+}
+
+// Same as exec_func, but runs the register code of the chunks. Registers
+// are slots of the stack relative to the base of the frame.
+static dm_value exec_func_reg(dm_state *dm, dm_stack *stack, dm_frames *frames) {
+	int entry = frames->size - 1;
+	dm_frame *frame = &frames->data[entry];
+	dm_reginstr in;
+	dm_reginstr *code;
+	dm_value *consts;
+	dm_value *regs;
+	vm_load_frame();
+
+#ifdef DM_THREADED_DISPATCH
+	static void *dispatch_table[] = {
+		[DM_ROP_MOVE]            = &&op_DM_ROP_MOVE,
+		[DM_ROP_IMPORT]          = &&op_DM_ROP_IMPORT,
+		[DM_ROP_VARGETOPSET]     = &&op_DM_ROP_VARGETOPSET,
+		[DM_ROP_VARSET_UP]       = &&op_DM_ROP_VARSET_UP,
+		[DM_ROP_VARGETOPSET_UP]  = &&op_DM_ROP_VARGETOPSET_UP,
+		[DM_ROP_VARGET_UP]       = &&op_DM_ROP_VARGET_UP,
+		[DM_ROP_CLOSURE]         = &&op_DM_ROP_CLOSURE,
+		[DM_ROP_FIELDSET]        = &&op_DM_ROP_FIELDSET,
+		[DM_ROP_FIELDGETOPSET]   = &&op_DM_ROP_FIELDGETOPSET,
+		[DM_ROP_FIELDSET_S]      = &&op_DM_ROP_FIELDSET_S,
+		[DM_ROP_FIELDGETOPSET_S] = &&op_DM_ROP_FIELDGETOPSET_S,
+		[DM_ROP_FIELDGET]        = &&op_DM_ROP_FIELDGET,
+		[DM_ROP_FIELDGET_S]      = &&op_DM_ROP_FIELDGET_S,
+		[DM_ROP_ARRAYLIT]        = &&op_DM_ROP_ARRAYLIT,
+		[DM_ROP_TABLELIT]        = &&op_DM_ROP_TABLELIT,
+		[DM_ROP_SELF]            = &&op_DM_ROP_SELF,
+		[DM_ROP_CALL]            = &&op_DM_ROP_CALL,
+		[DM_ROP_CALL_WITHPARENT] = &&op_DM_ROP_CALL_WITHPARENT,
+		[DM_ROP_TAILCALL]        = &&op_DM_ROP_TAILCALL,
+		[DM_ROP_CHECKTYPE]       = &&op_DM_ROP_CHECKTYPE,
+		[DM_ROP_NEGATE]          = &&op_DM_ROP_NEGATE,
+		[DM_ROP_NOT]             = &&op_DM_ROP_NOT,
+		[DM_ROP_PLUS]            = &&op_DM_ROP_PLUS,
+		[DM_ROP_MINUS]           = &&op_DM_ROP_MINUS,
+		[DM_ROP_MUL]             = &&op_DM_ROP_MUL,
+		[DM_ROP_DIV]             = &&op_DM_ROP_DIV,
+		[DM_ROP_MOD]             = &&op_DM_ROP_MOD,
+		[DM_ROP_NOTEQUAL]        = &&op_DM_ROP_NOTEQUAL,
+		[DM_ROP_EQUAL]           = &&op_DM_ROP_EQUAL,
+		[DM_ROP_LESS]            = &&op_DM_ROP_LESS,
+		[DM_ROP_LESSEQUAL]       = &&op_DM_ROP_LESSEQUAL,
+		[DM_ROP_GREATER]         = &&op_DM_ROP_GREATER,
+		[DM_ROP_GREATEREQUAL]    = &&op_DM_ROP_GREATEREQUAL,
+		[DM_ROP_JUMP_IF_TRUE]    = &&op_DM_ROP_JUMP_IF_TRUE,
+		[DM_ROP_JUMP_IF_FALSE]   = &&op_DM_ROP_JUMP_IF_FALSE,
+		[DM_ROP_JUMP]            = &&op_DM_ROP_JUMP,
+		[DM_ROP_RETURN]          = &&op_DM_ROP_RETURN,
+		[DM_ROP_FORPREP]         = &&op_DM_ROP_FORPREP,
+		[DM_ROP_FORLOOP]         = &&op_DM_ROP_FORLOOP,
+	};
+#endif
+
+	for (;;) {
+		vm_dispatch() {
+			vm_case(DM_ROP_MOVE):           {
+				regs[in.a] = rk(in.b);
+				vm_next();
+			}
+			vm_case(DM_ROP_IMPORT):         {
+				dm_value module = rk(in.b);
+				if (dm_value_type(module) != DM_TYPE_STRING) {
+					dm_runtime_error(dm, "Expected string for import");
+				}
+
+				regs[in.a] = do_import(dm, module);
+				vm_next();
+			}
+			vm_case(DM_ROP_VARGETOPSET):    {
+				regs[in.a] = dm_op_opassign(dm, in.x, regs[in.a], rk(in.b));
+				vm_next();
+			}
+			vm_case(DM_ROP_VARSET_UP):      {
+				*frame->upvals[in.b]->v = rk(in.a);
+				vm_next();
+			}
+			vm_case(DM_ROP_VARGETOPSET_UP): {
+				dm_value *up = frame->upvals[in.b]->v;
+				dm_value v = dm_op_opassign(dm, in.x, *up, regs[in.a]);
+				*up = v;
+				regs[in.a] = v;
+				vm_next();
+			}
+			vm_case(DM_ROP_VARGET_UP):      {
+				regs[in.a] = *frame->upvals[in.b]->v;
+				vm_next();
+			}
+			vm_case(DM_ROP_CLOSURE):        {
+				regs[in.a] = make_closure(dm, stack, frames, frame, consts[in.b]);
+				vm_next();
+			}
+			vm_case(DM_ROP_FIELDSET):       {
+				dm_value table = rk(in.a);
+				dm_value field = rk(in.b);
+				dm_op_fieldset(dm, table, field, rk(in.c));
+				vm_next();
+			}
+			vm_case(DM_ROP_FIELDGETOPSET):  {
+				regs[in.a] = dm_op_fieldgetopset(dm, in.x, regs[in.a], rk(in.b), rk(in.c));
+				vm_next();
+			}
+			vm_case(DM_ROP_FIELDSET_S):     {
+				dm_op_fieldset_s(dm, rk(in.a), rk(in.b), rk(in.c));
+				vm_next();
+			}
+			vm_case(DM_ROP_FIELDGETOPSET_S): {
+				regs[in.a] = dm_op_fieldgetopset_s(dm, in.x, regs[in.a], rk(in.b), rk(in.c));
+				vm_next();
+			}
+			vm_case(DM_ROP_FIELDGET):       {
+				regs[in.a] = dm_op_fieldget(dm, rk(in.b), rk(in.c));
+				vm_next();
+			}
+			vm_case(DM_ROP_FIELDGET_S):     {
+				regs[in.a] = dm_op_fieldget_s(dm, rk(in.b), rk(in.c));
+				vm_next();
+			}
+			vm_case(DM_ROP_ARRAYLIT):       {
+				regs[in.a] = dm_op_arraylit(dm, in.b, &regs[in.a]);
+				vm_next();
+			}
+			vm_case(DM_ROP_TABLELIT):       {
+				regs[in.a] = dm_op_tablelit(dm, in.b, &regs[in.a]);
+				vm_next();
+			}
+			vm_case(DM_ROP_SELF):           {
+				dm_function *f = dm_value_as_function(frame->func);
+				if (f->takes_self && f->nargs > 0) {
+					regs[in.a] = regs[0];
+				} else {
+					regs[in.a] = dm_value_nil();
+				}
+				vm_next();
+			}
+			vm_case(DM_ROP_CALL):           {
+				int arguments = in.b;
+				dm_value func = regs[in.a];
+				check_call(dm, func, arguments);
+
+				int ret_slot = frame->base + in.a;
+				frame = push_reg_frame(dm, stack, frames, func, ret_slot + 1, ret_slot);
+				vm_load_frame();
+				vm_next();
+			}
+			vm_case(DM_ROP_CALL_WITHPARENT): {
+				int arguments = in.b;
+				dm_value func = regs[in.a + 1];
+				int ret_slot = frame->base + in.a;
+				int base = ret_slot + 2;
+				if (dm_value_type(func) == DM_TYPE_FUNCTION && dm_value_as_function(func)->takes_self) {
+					// the parent takes the place of the function as first argument
+					base--;
+					arguments++;
+					stack->data[base] = stack->data[ret_slot];
+				}
+				check_call(dm, func, arguments);
+
+				frame = push_reg_frame(dm, stack, frames, func, base, ret_slot);
+				vm_load_frame();
+				vm_next();
+			}
+			vm_case(DM_ROP_TAILCALL):       {
+				int arguments = in.b;
+				dm_value func = regs[in.a];
+				check_call(dm, func, arguments);
+
+				// the callee gets the registers of this frame and returns to
+				// the caller of this frame
+				close_upvals(stack, frame->base);
+				memmove(regs, &regs[in.a + 1], arguments * sizeof(dm_value));
+				int base = frame->base;
+				int ret_slot = frame->ret;
+				frames->size--;
+				frame = push_reg_frame(dm, stack, frames, func, base, ret_slot);
+				vm_load_frame();
+				vm_next();
+			}
+			vm_case(DM_ROP_CHECKTYPE):      {
+				dm_value val = rk(in.b);
+				if (dm_value_type(val) != (dm_type) in.c) {
+					dm_runtime_type_mismatch(dm, in.c, val);
+				}
+				regs[in.a] = val;
+				vm_next();
+			}
+			vm_case(DM_ROP_NEGATE):         {
+				regs[in.a] = dm_op_negate(dm, rk(in.b));
+				vm_next();
+			}
+			vm_case(DM_ROP_NOT):            {
+				regs[in.a] = dm_op_not(dm, rk(in.b));
+				vm_next();
+			}
+			vm_case(DM_ROP_PLUS):           {
+				rvm_arith(PLUS, +);
+				vm_next();
+			}
+			vm_case(DM_ROP_MINUS):          {
+				rvm_arith(MINUS, -);
+				vm_next();
+			}
+			vm_case(DM_ROP_MUL):            {
+				rvm_arith(MUL, *);
+				vm_next();
+			}
+			vm_case(DM_ROP_DIV):            {
+				dm_value val1 = rk(in.b);
+				dm_value val2 = rk(in.c);
+				// division by 0 is reported by the module
+				if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT && dm_value_as_int(val2) != 0) {
+					regs[in.a] = dm_value_int(dm_value_as_int(val1) / dm_value_as_int(val2));
+				} else if (dm_op_is_number(val1) && dm_op_is_number(val2) && dm_op_as_float(val2) != 0) {
+					regs[in.a] = dm_value_float(dm_op_as_float(val1) / dm_op_as_float(val2));
+				} else {
+					regs[in.a] = dm_op_arith(dm, DM_OP_DIV, val1, val2);
+				}
+				vm_next();
+			}
+			vm_case(DM_ROP_MOD):            {
+				dm_value val1 = rk(in.b);
+				dm_value val2 = rk(in.c);
+				if (dm_value_type(val1) == DM_TYPE_INT && dm_value_type(val2) == DM_TYPE_INT && dm_value_as_int(val2) != 0) {
+					regs[in.a] = dm_value_int(dm_value_as_int(val1) % dm_value_as_int(val2));
+				} else {
+					regs[in.a] = dm_op_arith(dm, DM_OP_MOD, val1, val2);
+				}
+				vm_next();
+			}
+			vm_case(DM_ROP_NOTEQUAL):       {
+				regs[in.a] = dm_value_bool(!dm_op_equals(dm, rk(in.b), rk(in.c)));
+				vm_next();
+			}
+			vm_case(DM_ROP_EQUAL):          {
+				regs[in.a] = dm_value_bool(dm_op_equals(dm, rk(in.b), rk(in.c)));
+				vm_next();
+			}
+			vm_case(DM_ROP_LESS):           {
+				rvm_compare(<);
+				vm_next();
+			}
+			vm_case(DM_ROP_LESSEQUAL):      {
+				rvm_compare(<=);
+				vm_next();
+			}
+			vm_case(DM_ROP_GREATER):        {
+				rvm_compare(>);
+				vm_next();
+			}
+			vm_case(DM_ROP_GREATEREQUAL):   {
+				rvm_compare(>=);
+				vm_next();
+			}
+			vm_case(DM_ROP_JUMP_IF_TRUE):   {
+				if (!dm_op_falsey(rk(in.a))) {
+					frame->ip = in.b;
+				}
+				vm_next();
+			}
+			vm_case(DM_ROP_JUMP_IF_FALSE):  {
+				if (dm_op_falsey(rk(in.a))) {
+					frame->ip = in.b;
+				}
+				vm_next();
+			}
+			vm_case(DM_ROP_JUMP):           {
+				frame->ip = in.a;
+				vm_next();
+			}
+			vm_case(DM_ROP_RETURN):         {
+				dm_value ret = rk(in.a);
+				close_upvals(stack, frame->base);
+				if (frames->size - 1 == entry) {
+					frames->size--;
+					return ret;
+				}
+
+				stack->data[frame->ret] = ret;
+				frames->size--;
+				frame = &frames->data[frames->size - 1];
+				vm_load_frame();
+				vm_next();
+			}
+			vm_case(DM_ROP_FORPREP):        {
+				dm_forloop *loop = &frame->chunk->loops[in.x];
+				if (!dm_op_for_compare(dm, loop->compare, regs[loop->var], for_limit(loop, regs))) {
+					frame->ip = in.b;
+				}
+				vm_next();
+			}
+			vm_case(DM_ROP_FORLOOP):        {
+				dm_forloop *loop = &frame->chunk->loops[in.x];
+				if (for_loop(dm, loop, regs)) {
+					frame->ip = in.b;
+				}
+				vm_next();
+			}
+		}
+	}
+	return dm_value_nil();
+}
+
+// Translates the program for the register vm. If anything can't be
+// translated the whole program runs on the stack vm.
+static bool use_regcode(dm_state *dm, dm_chunk *chunk) {
+	if (!dm_regvm_enabled(dm)) {
+		return false;
+	}
+
+	bool ok = dm_regcode_compile(dm, chunk) == 0;
+	// functions of earlier repl lines
+	for (int i = 0; i < chunk->varsize && ok; i++) {
+		dm_value v = chunk->vars[i].value;
+		if (dm_value_type(v) == DM_TYPE_FUNCTION) {
+			ok = dm_regcode_compile(dm, dm_value_as_function(v)->chunk) == 0;
+		}
+	}
+
+	if (!ok && dm_debug_enabled(dm)) {
+		fprintf(stderr, "register vm: can't translate the program, using the stack vm\n");
+	}
+	return ok;
+}
+
+#ifdef DM_VM_STATS
+unsigned long long dm_vm_instructions_executed(void) {
+	return instructions_executed;
+}
+
+// the pairs are counted by generic opcode, the quickened forms fold into it
+void dm_vm_print_opcode_pairs(int n) {
+	static unsigned long long pairs[DM_OP_NUM_OPS][DM_OP_NUM_OPS];
+	for (int i = 0; i < DM_OP_NUM_OPS; i++) {
+		for (int j = 0; j < DM_OP_NUM_OPS; j++) {
+			pairs[dm_opcode_generic(i)][dm_opcode_generic(j)] += pairs_executed[i][j];
+		}
+	}
+
+	for (int k = 0; k < n; k++) {
+		int first = 0, second = 0;
+		for (int i = 0; i < DM_OP_NUM_OPS; i++) {
+			for (int j = 0; j < DM_OP_NUM_OPS; j++) {
+				if (pairs[i][j] > pairs[first][second]) {
+					first = i;
+					second = j;
+				}
+			}
+		}
+		if (pairs[first][second] == 0) {
+			break;
+		}
+		fprintf(stderr, "opcode pair: %s %s %llu\n", dm_opcode_name(first), dm_opcode_name(second), pairs[first][second]);
+		pairs[first][second] = 0;
+	}
+}
+#endif
+
 int dm_vm_exec(dm_state *dm, char *prog, dm_value *result, bool repl) {
 	dm_state_reset_error(dm);
 	dm_value _nil = dm_value_nil();
@@ -609,17 +1605,62 @@ int dm_vm_exec(dm_state *dm, char *prog, dm_value *result, bool repl) {
 	if (dm_compile(dm, main, prog) != 0) {
 		return 1;
 	}
+	if (dm_chunk_verify(dm_value_as_function(*main)->chunk) != 0) {
+		return 1;
+	}
+	const struct dm_aot_program *aot = dm_state_take_aot_program(dm);
+	if (aot != NULL && dm_aot_bind(dm_value_as_function(*main), aot) != 0) {
+		return 1;
+	}
 
 	dm_stack stack;
 	stack_init(&stack);
 
-	dm_value v = exec_func(dm, *main, &stack);
-	if (dm_state_has_error(dm)) {
-		print_backtrace(dm, *main);
-	} else if (dm_debug_enabled(dm)) {
-		dm_chunk_decompile(dm, main->func_val->chunk);
+	dm_frames frames;
+	frames_init(&frames);
+
+	// the variables of the top level chunk are kept in the chunk between runs
+	dm_chunk *chunk = dm_value_as_function(*main)->chunk;
+	frames_push(dm, &frames, *main, 0, 0);
+	stack_reserve(&stack, chunk->varsize + chunk->maxstack);
+	for (int i = 0; i < chunk->varsize; i++) {
+		stack_push(&stack, chunk->vars[i].value);
+	}
+	reopen_cells(&stack, chunk);
+
+	bool regs = use_regcode(dm, chunk);
+	if (regs) {
+		stack_resize(&stack, chunk->regcode->nregs);
+	}
+
+	// the only recovery point for runtime errors, the frames are left as they
+	// were when the error was raised. imports run dm_vm_exec recursively, so
+	// the recovery point of the caller is restored afterwards.
+	jmp_buf outer;
+	memcpy(outer, *dm_state_get_jmpbuf(dm), sizeof(jmp_buf));
+
+	dm_value v = dm_value_nil();
+	if (setjmp(*dm_state_get_jmpbuf(dm)) == 0) {
+		v = regs ? exec_func_reg(dm, &stack, &frames) : exec_func(dm, &stack, &frames);
+	} else {
+		print_backtrace(dm, &frames, regs);
+	}
+	memcpy(*dm_state_get_jmpbuf(dm), outer, sizeof(jmp_buf));
+
+	close_upvals(&stack, 0);
+	for (int i = 0; i < chunk->varsize; i++) {
+		chunk->vars[i].value = stack.data[i];
+	}
+
+	if (!dm_state_has_error(dm) && dm_debug_enabled(dm)) {
+		if (regs) {
+			dm_regcode_decompile(dm, chunk);
+		} else {
+			dm_chunk_decompile(dm, chunk);
+		}
 	}
 
+	frames_free(&frames);
 	stack_free(&stack);
 	if (result) {
 		*result = v;
@@ -4,3 +4,8 @@
 #include <dm_state.h>
 
 int dm_vm_exec(dm_state *dm, char *prog, dm_value *result, bool repl);
+
+#ifdef DM_VM_STATS
+unsigned long long dm_vm_instructions_executed(void);
+void dm_vm_print_opcode_pairs(int n);
+#endif
@@ -0,0 +1,25 @@
+#!/usr/bin/bash
+
+# Runs the optimizer corpus and the tests with and without the compiler
+# optimizations (-O0 --no-fold --no-peephole) on both vms and with the jits,
+# the output has to be the same. A script with a .out file next to it has to
+# print exactly that, with the function addresses as 0x.
+
+status=0
+for script in tests/opt/*.dm tests/*.dm; do
+	for vm in "" --regvm --jit --trace; do
+		# function addresses differ between runs
+		optimized=$(./bin/diamond $vm $script 2>&1 | sed 's/0x[0-9a-f]*/0x/')
+		unoptimized=$(./bin/diamond $vm -O0 --no-fold --no-peephole $script 2>&1 | sed 's/0x[0-9a-f]*/0x/')
+		if [ "$optimized" != "$unoptimized" ]; then
+			echo "$script $vm: optimized and unoptimized results differ"
+			status=1
+		fi
+		expected=${script%.dm}.out
+		if [ -f $expected ] && [ "$optimized" != "$(cat $expected)" ]; then
+			echo "$script $vm: result differs from $expected"
+			status=1
+		fi
+	done
+done
+exit $status
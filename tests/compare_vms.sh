@@ -0,0 +1,22 @@
+#!/usr/bin/bash
+
+# Runs every test on the stack vm and on the register vm (--regvm).
+# Build with 'make STATS=1' to also get the number of executed instructions.
+
+TIMEFORMAT='%R'
+
+run() {
+	local script=$1
+	shift
+	# the time builtin and the interpreter both report on stderr
+	{ time ./bin/diamond "$@" $script > /dev/null 2> /tmp/compare_vms.$$; } 2>&1
+	grep "instructions executed" /tmp/compare_vms.$$ | sed 's/.*: //'
+}
+
+printf "%-55s %16s %8s %16s %8s\n" "script" "stack instrs" "time" "reg instrs" "time"
+for script in tests/*.dm; do
+	stack=($(run $script))
+	regs=($(run $script --regvm))
+	printf "%-55s %16s %8s %16s %8s\n" $script "${stack[1]:--}" ${stack[0]} "${regs[1]:--}" ${regs[0]}
+done
+rm -f /tmp/compare_vms.$$
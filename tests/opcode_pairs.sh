@@ -0,0 +1,12 @@
+#!/usr/bin/bash
+
+# Prints the pairs of consecutive opcodes the stack vm executes most often over
+# all tests, as candidates for src/dm_superinstr.h. Needs a 'make STATS=1'
+# build, see make opcode-pairs.
+
+N=${1:-20}
+
+for script in tests/*.dm; do
+	./bin/diamond $script 2>&1 > /dev/null | grep "^opcode pair:"
+done | awk '{ count[$3 " " $4] += $5; total += $5 }
+	END { for (p in count) printf "%6.2f%%  %s\n", 100 * count[p] / total, p }' | sort -rn | head -n $N
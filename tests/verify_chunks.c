@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dm_chunk.h>
+
+// Builds malformed chunks by hand and checks that dm_chunk_verify refuses
+// each of them with "Invalid bytecode at ADDR", run by make tests-verify.
+
+typedef struct {
+	dm_opcode op;
+	int a;
+	int b;
+} instr;
+
+typedef struct {
+	const char *name;
+	int addr;                   // where the error is reported, -1 if the code is fine
+	int nvars;
+	int ninstrs;
+	instr instrs[4];
+} verify_case;
+
+static const verify_case cases[] = {
+	{"well formed", -1, 1, 3, {
+		{DM_OP_CONSTANT_SMALLINT, 0, 1}, {DM_OP_VARSET, 0, 0}, {DM_OP_RETURN, 0, 0}}},
+	{"constant out of range", 1, 0, 3, {
+		{DM_OP_NIL, 0, 0}, {DM_OP_CONSTANT, 0, 3}, {DM_OP_RETURN, 0, 0}}},
+	{"jump out of the code", 0, 0, 3, {
+		{DM_OP_JUMP, 0, 40}, {DM_OP_NIL, 0, 0}, {DM_OP_RETURN, 0, 0}}},
+	{"stack underflow", 1, 0, 3, {
+		{DM_OP_NIL, 0, 0}, {DM_OP_PLUS, 0, 0}, {DM_OP_RETURN, 0, 0}}},
+	{"unknown opcode", 1, 0, 3, {
+		{DM_OP_NIL, 0, 0}, {DM_OP_NUM_OPS, 0, 0}, {DM_OP_RETURN, 0, 0}}},
+	{"local slot out of range", 2, 2, 4, {
+		{DM_OP_VARGET, 0, 1}, {DM_OP_POP, 0, 0}, {DM_OP_VARGET, 0, 2}, {DM_OP_RETURN, 0, 0}}},
+};
+
+// runs the verifier with stderr going into out
+static int verify(dm_chunk *chunk, char *out, size_t size) {
+	FILE *tmp = tmpfile();
+	int saved = dup(STDERR_FILENO);
+	fflush(stderr);
+	dup2(fileno(tmp), STDERR_FILENO);
+	int result = dm_chunk_verify(chunk);
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	rewind(tmp);
+	size_t n = fread(out, 1, size - 1, tmp);
+	out[n] = '\0';
+	fclose(tmp);
+	return result;
+}
+
+static int run_case(const verify_case *c) {
+	dm_chunk chunk;
+	dm_chunk_init(&chunk);
+	for (int i = 0; i < c->nvars; i++) {
+		char name[2] = {'a' + i, '\0'};
+		dm_chunk_add_var(&chunk, name, 1);
+	}
+	for (int i = 0; i < c->ninstrs; i++) {
+		dm_chunk_emit_arg8_arg16(&chunk, c->instrs[i].op, c->instrs[i].a, c->instrs[i].b);
+	}
+
+	char out[256];
+	int result = verify(&chunk, out, sizeof(out));
+	dm_chunk_free(&chunk);
+
+	if (c->addr == -1) {
+		if (result != 0) {
+			printf("%s: refused: %s", c->name, out);
+			return 1;
+		}
+		return 0;
+	}
+
+	char expected[64];
+	snprintf(expected, sizeof(expected), "Invalid bytecode at %d:", c->addr);
+	if (result == 0) {
+		printf("%s: accepted\n", c->name);
+		return 1;
+	} else if (strstr(out, expected) == NULL) {
+		printf("%s: expected '%s', got: %s", c->name, expected, out);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void) {
+	int failed = 0;
+	int n = sizeof(cases) / sizeof(cases[0]);
+	for (int i = 0; i < n; i++) {
+		failed += run_case(&cases[i]);
+	}
+	printf("%d of %d chunks verified as expected\n", n - failed, n);
+	return failed != 0;
+}